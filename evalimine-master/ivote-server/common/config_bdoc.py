@@ -15,6 +15,7 @@ http://creativecommons.org/licenses/by-nc-nd/3.0/.
 import sys
 from election import Election
 import evcommon
+import bdocpython
 import bdocpythonutils
 import subprocess
 
@@ -24,6 +25,15 @@ def set_bdoc_conf(conf_dir):
     conf.save(Election().get_bdoc_conf())
     subprocess.check_call(['c_rehash', Election().get_bdoc_ca()])
 
+    # Verifiers start from the snapshot of what was just installed
+    installed = bdocpythonutils.BDocConfig()
+    installed.load(Election().get_bdoc_conf())
+    bdocpython.initialize()
+    try:
+        installed.save_snapshot()
+    finally:
+        bdocpython.terminate()
+
 def usage():
 
     """
@@ -163,24 +163,28 @@ class InputList:
         return retval
 
     def check_format(self, filename, msg=''):
-        retval = True
         infile = None
-        self.__tic = ticker.Ticker(os.stat(filename).st_size, msg)
-        self.__count = 0
-        self.__curline = None
         try:
             infile = open(filename, 'r')
-            if not self._check_header(infile):
-                retval = False
-                if not self.__ignore_errors:
-                    return retval
-            if not self._check_body(infile):
-                retval = False
-            return retval
+            return self.check_stream(infile, os.stat(filename).st_size, msg)
         finally:
             if not infile == None:
                 infile.close()
 
+    def check_stream(self, infile, size, msg=''):
+        # Avatud faili või toru kontroll, size on edenemise näitamiseks
+        retval = True
+        self.__tic = ticker.Ticker(size, msg)
+        self.__count = 0
+        self.__curline = None
+        if not self._check_header(infile):
+            retval = False
+            if not self.__ignore_errors:
+                return retval
+        if not self._check_body(infile):
+            retval = False
+        return retval
+
 
 class Districts(InputList):
 
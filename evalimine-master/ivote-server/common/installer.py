@@ -123,11 +123,10 @@ class ElectionInstaller:
         if len(self.__bdoc.signatures) != 1:
             return False, "BDoc sisaldab rohkem kui ühte allkirja"
 
-        verifier = bdocpython.BDocVerifier()
-        config.populate(verifier)
+        verifier = config.verifier()
 
         for el in self.__bdoc.documents:
-            verifier.setDocument(self.__bdoc.documents[el], el)
+            verifier.borrowDocument(self.__bdoc.documents[el], el)
 
         _, sig_content = self.__bdoc.signatures.popitem()
 
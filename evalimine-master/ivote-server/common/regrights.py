@@ -15,7 +15,6 @@ http://creativecommons.org/licenses/by-nc-nd/3.0/.
 import sys
 from election import Election
 import formatutil
-import bdocpython
 import bdocpythonutils
 import evlogdata
 
@@ -87,7 +86,7 @@ def analyze_vote_for_log(bdocdata):
 def analyze_vote(bdocfile, config):
 
     bdoc = bdocpythonutils.BDocContainer()
-    bdoc.load(bdocfile)
+    bdoc.load_mapped(bdocfile)
     profile = bdocpythonutils.ManifestProfile('TM')
     bdoc.validate(profile)
 
@@ -98,14 +97,8 @@ def analyze_vote(bdocfile, config):
     if len(bdoc.signatures) != 1:
         raise Exception, "BDoc sisaldab rohkem kui ühte allkirja"
 
-    verifier = bdocpython.BDocVerifier()
-    config.populate(verifier)
-
-    for el in bdoc.documents:
-        verifier.setDocument(bdoc.documents[el], el)
-
-    _, sig_content = bdoc.signatures.popitem()
-    return verifier.verifyTMOffline(sig_content)
+    verifier = config.verifier()
+    return verifier.verifyContainerTMOffline(bdoc.container())[0]
 
 def check_vote_hes_mobid(bdocdata, config):
 
@@ -121,11 +114,10 @@ def check_vote_hes_mobid(bdocdata, config):
     if len(bdoc.signatures) != 1:
         raise Exception, "BDoc sisaldab rohkem kui ühte allkirja"
 
-    verifier = bdocpython.BDocVerifier()
-    config.populate(verifier)
+    verifier = config.verifier()
 
     for el in bdoc.documents:
-        verifier.setDocument(bdoc.documents[el], el)
+        verifier.borrowDocument(bdoc.documents[el], el)
 
     _, sig_content = bdoc.signatures.popitem()
     return verifier.verifyTMOffline(sig_content)
@@ -145,11 +137,10 @@ def check_vote_hes(bdocdata, config):
     if len(bdoc.signatures) != 1:
         raise Exception, "BDoc sisaldab rohkem kui ühte allkirja"
 
-    verifier = bdocpython.BDocVerifier()
-    config.populate(verifier)
+    verifier = config.verifier()
 
     for el in bdoc.documents:
-        verifier.setDocument(bdoc.documents[el], el)
+        verifier.borrowDocument(bdoc.documents[el], el)
 
     _, sig_content = bdoc.signatures.popitem()
     return verifier.verifyBESOffline(sig_content)
@@ -158,7 +149,7 @@ def check_vote_hes(bdocdata, config):
 def kontrolli_volitusi(elid, bdocfile, volitus, config):
 
     bdoc = bdocpythonutils.BDocContainer()
-    bdoc.load(bdocfile)
+    bdoc.load_mapped(bdocfile)
     profile = bdocpythonutils.ManifestProfile('TM', 'application/octet-stream')
     bdoc.validate(profile)
 
@@ -172,15 +163,11 @@ def kontrolli_volitusi(elid, bdocfile, volitus, config):
     if len(bdoc.signatures) != 1:
         raise Exception, "BDoc sisaldab rohkem kui ühte allkirja"
 
-    verifier = bdocpython.BDocVerifier()
-    config.populate(verifier)
+    verifier = config.verifier()
 
-    doc_fn, doc_content = bdoc.documents.popitem()
-    verifier.setDocument(doc_content, doc_fn)
     _signercode = None
-    _, sig_content = bdoc.signatures.popitem()
 
-    res = verifier.verifyTMOffline(sig_content)
+    res = verifier.verifyContainerTMOffline(bdoc.container())[0]
     if res.result:
         _signercode = get_personal_code(res.subject)
     else:
@@ -11,7 +11,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <string.h>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+# define BASE64_SIMD
+# include <immintrin.h>
+#endif
 
 #include "base64.h"
 
@@ -43,136 +49,442 @@ void buffer_delete(struct buffer_st *b)
     b->data = NULL;
 }
 
-void Base64::encode(struct buffer_st *b, const char *source, 
-		int length, bool strip_new_line)
+static const char etable[64] = {
+	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
+	'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',
+	'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm',
+	'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z',
+	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'
+};
+
+// Decoding table, 0x80 marks characters that are skipped
+#define D_SKIP 0x80
+#define D_PAD 0x40
+
+#define S D_SKIP
+static const unsigned char dtable[256] = {
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, 62, S, S, S, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, S, S, S, D_PAD, S, S,
+	S, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, S, S, S, S, S,
+	S, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S
+};
+#undef S
+
+/*
+ * Scalar codec, also handles the tails the vector loops leave over.
+ * */
+static size_t encodeScalar(char *out, const unsigned char *in, size_t len)
 {
-	unsigned char dtable[512];
+	char *o = out;
 
-    int i, hiteof = 0;
-    int offset = 0;
+	while (len >= 3) {
+		o[0] = etable[in[0] >> 2];
+		o[1] = etable[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+		o[2] = etable[((in[1] & 0x0F) << 2) | (in[2] >> 6)];
+		o[3] = etable[in[2] & 0x3F];
+		in += 3;
+		len -= 3;
+		o += 4;
+	}
 
-    buffer_new(b);
+	if (len > 0) {
+		unsigned char b1 = len > 1 ? in[1] : 0;
+		o[0] = etable[in[0] >> 2];
+		o[1] = etable[((in[0] & 0x03) << 4) | (b1 >> 4)];
+		o[2] = len > 1 ? etable[(b1 & 0x0F) << 2] : '=';
+		o[3] = '=';
+		o += 4;
+	}
 
-    for (i = 0; i < 26; i++) {
-        dtable[i] = 'A' + i;
-        dtable[26 + i] = 'a' + i;
-    }
-    for (i = 0; i < 10; i++) {
-        dtable[52 + i] = '0' + i;
-    }
-    dtable[62] = '+';
-    dtable[63] = '/';
-
-    while (!hiteof) {
-        unsigned char igroup[3], ogroup[4];
-        int c, n;
-
-        igroup[0] = igroup[1] = igroup[2] = 0;
-        for (n = 0; n < 3; n++) {
-            c = *(source++);
-            offset++;
-            if (offset > length) {
-                hiteof = 1;
-                break;
-            }
-            igroup[n] = (unsigned char) c;
-        }
-        if (n > 0) {
-            ogroup[0] = dtable[igroup[0] >> 2];
-            ogroup[1] = dtable[((igroup[0] & 3) << 4) | (igroup[1] >> 4)];
-            ogroup[2] = dtable[((igroup[1] & 0xF) << 2) | (igroup[2] >> 6)];
-            ogroup[3] = dtable[igroup[2] & 0x3F];
-
-            /* Replace characters in output stream with "=" pad
-             * characters if fewer than three characters were
-             * read from the end of the input stream. */
-
-            if (n < 3) {
-                ogroup[3] = '=';
-                if (n < 2) {
-                    ogroup[2] = '=';
-                }
-            }
-            for (i = 0; i < 4; i++) {
-                buffer_add(b, ogroup[i]);
-                if (!strip_new_line && !(b->offset % 72)) {
-					buffer_add(b, '\n');
-                }
-            }
-        }
-    }
-	if (!strip_new_line) {
-		buffer_add(b, '\n');
+	return o - out;
+}
+
+/*
+ * Whitespace and characters outside the alphabet are skipped, decoding
+ * stops at the first group with padding and an incomplete last group is
+ * dropped, same as the original decoder did.
+ * */
+static size_t decodeScalar(unsigned char *out, const char *in, size_t len)
+{
+	unsigned char *o = out;
+	unsigned char a[4];
+	unsigned char b[4];
+	int n = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = in[i];
+		unsigned char d = dtable[c];
+		if (d & D_SKIP) {
+			continue;
+		}
+
+		a[n] = c;
+		b[n] = d & 0x3F;
+		if (++n < 4) {
+			continue;
+		}
+		n = 0;
+
+		int count = a[2] == '=' ? 1 : (a[3] == '=' ? 2 : 3);
+		o[0] = (b[0] << 2) | (b[1] >> 4);
+		if (count > 1) {
+			o[1] = (b[1] << 4) | (b[2] >> 2);
+		}
+		if (count > 2) {
+			o[2] = (b[2] << 6) | b[3];
+		}
+		o += count;
+		if (count < 3) {
+			break;
+		}
 	}
+
+	return o - out;
 }
 
-void Base64::decode(struct buffer_st *bfr, const char *source, \
-		int length)
+#ifdef BASE64_SIMD
+
+/*
+ * Vector loops after Wojciech Mula's SIMD base64 algorithms. They stop at
+ * the first block with anything but alphabet characters and leave the
+ * rest to the scalar code.
+ * */
+
+__attribute__((target("sse4.1")))
+static inline __m128i encReshuffle128(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(
+			10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003F03F0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i encTranslate128(__m128i in)
 {
-	unsigned char dtable[512];
+	const __m128i lut = _mm_setr_epi8(
+			65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	const __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+	indices = _mm_sub_epi8(indices, mask);
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
 
+__attribute__((target("sse4.1")))
+static size_t encodeSSE41(char *out, const unsigned char *in, size_t len)
+{
+	size_t done = 0;
+	// Each round loads 16 bytes and uses 12 of them
+	while (len - done >= 16) {
+		__m128i str = _mm_loadu_si128((const __m128i *)(in + done));
+		str = encTranslate128(encReshuffle128(str));
+		_mm_storeu_si128((__m128i *)out, str);
+		out += 16;
+		done += 12;
+	}
+	return done;
+}
 
-    int i;
-    int offset = 0;
-    int endoffile;
-    int count;
+__attribute__((target("sse4.1")))
+static size_t decodeSSE41(unsigned char *out, const char *in, size_t len,
+		size_t *written)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2F);
 
-    buffer_new(bfr);
+	size_t done = 0;
+	unsigned char *o = out;
+	// Each round stores 16 bytes of which 12 are output
+	while (len - done >= 24) {
+		__m128i str = _mm_loadu_si128((const __m128i *)(in + done));
+		const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+		const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm_testz_si128(lo, hi)) {
+			break;
+		}
+		const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+		const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+		str = _mm_add_epi8(str, roll);
 
-    for (i = 0; i < 255; i++) {
-        dtable[i] = 0x80;
-    }
-    for (i = 'A'; i <= 'Z'; i++) {
-        dtable[i] = 0 + (i - 'A');
-    }
-    for (i = 'a'; i <= 'z'; i++) {
-        dtable[i] = 26 + (i - 'a');
-    }
-    for (i = '0'; i <= '9'; i++) {
-        dtable[i] = 52 + (i - '0');
-    }
-    dtable[(int)'+'] = 62;
-    dtable[(int)'/'] = 63;
-    dtable[(int)'='] = 0;
-
-    endoffile = 0;
-
-    /*CONSTANTCONDITION*/
-    while (1) {
-        unsigned char a[4], b[4], o[3];
-
-        for (i = 0; i < 4; i++) {
-            int c;
-            while (1) {
-                c = *(source++);
-                offset++;
-                if (offset > length) endoffile = 1;
-                if (isspace(c) || c == '\n' || c == '\r') continue;
-                break;
-            }
-
-            if (endoffile) {
-                return;
-            }
-
-            if (dtable[c] & 0x80) {
-                i--;
-                continue;
-            }
-            a[i] = (unsigned char) c;
-            b[i] = (unsigned char) dtable[c];
-        }
-        o[0] = (b[0] << 2) | (b[1] >> 4);
-        o[1] = (b[1] << 4) | (b[2] >> 2);
-        o[2] = (b[2] << 6) | b[3];
-        i = a[2] == '=' ? 1 : (a[3] == '=' ? 2 : 3);
-        count = 0;
-        while (count < i) {
-            buffer_add(bfr, o[count++]);
-        }
-        if (i < 3) {
-            return;
-        }
-    }
+		const __m128i ab_bc = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, _mm_setr_epi8(
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		_mm_storeu_si128((__m128i *)o, str);
+		o += 12;
+		done += 16;
+	}
+	*written = o - out;
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t encodeAVX2(char *out, const unsigned char *in, size_t len)
+{
+	const __m256i lut = _mm256_setr_epi8(
+			65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+			65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	const __m256i shuf = _mm256_set_epi8(
+			10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+			10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+
+	size_t done = 0;
+	// Each lane loads 16 bytes and uses 12 of them
+	while (len - done >= 28) {
+		__m256i str = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *)(in + done))),
+				_mm_loadu_si128((const __m128i *)(in + done + 12)), 1);
+
+		str = _mm256_shuffle_epi8(str, shuf);
+		const __m256i t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0FC0FC00));
+		const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		const __m256i t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003F03F0));
+		const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		str = _mm256_or_si256(t1, t3);
+
+		__m256i indices = _mm256_subs_epu8(str, _mm256_set1_epi8(51));
+		const __m256i mask = _mm256_cmpgt_epi8(str, _mm256_set1_epi8(25));
+		indices = _mm256_sub_epi8(indices, mask);
+		str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut, indices));
+
+		_mm256_storeu_si256((__m256i *)out, str);
+		out += 32;
+		done += 24;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t decodeAVX2(unsigned char *out, const char *in, size_t len,
+		size_t *written)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+
+	size_t done = 0;
+	unsigned char *o = out;
+	// Each round stores 32 bytes of which 24 are output
+	while (len - done >= 45) {
+		__m256i str = _mm256_loadu_si256((const __m256i *)(in + done));
+		const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+		const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+		const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi)) {
+			break;
+		}
+		const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+		const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		const __m256i ab_bc = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+		_mm256_storeu_si256((__m256i *)o, str);
+		o += 24;
+		done += 32;
+	}
+	*written = o - out;
+	return done;
+}
+
+enum CpuLevel {
+	CPU_SCALAR = 0,
+	CPU_SSE41,
+	CPU_AVX2
+};
+
+static int detectCpu()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return CPU_AVX2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		return CPU_SSE41;
+	}
+	return CPU_SCALAR;
+}
+
+// Resolved during static initialization, before any worker starts
+static const int cpu_level = detectCpu();
+
+#endif
+
+size_t Base64::encodedLength(size_t length)
+{
+	return ((length + 2) / 3) * 4;
+}
+
+size_t Base64::decodedLength(size_t length)
+{
+	return (length / 4) * 3;
+}
+
+size_t Base64::encodeTo(char *out, const unsigned char *source, size_t length)
+{
+	size_t done = 0;
+	char *o = out;
+
+#ifdef BASE64_SIMD
+	if (cpu_level == CPU_AVX2) {
+		done = encodeAVX2(o, source, length);
+	}
+	else if (cpu_level == CPU_SSE41) {
+		done = encodeSSE41(o, source, length);
+	}
+	o += (done / 3) * 4;
+#endif
+
+	return (o - out) + encodeScalar(o, source + done, length - done);
+}
+
+size_t Base64::decodeTo(unsigned char *out, const char *source, size_t length)
+{
+	size_t done = 0;
+	size_t written = 0;
+
+#ifdef BASE64_SIMD
+	if (cpu_level == CPU_AVX2) {
+		done = decodeAVX2(out, source, length, &written);
+	}
+	else if (cpu_level == CPU_SSE41) {
+		done = decodeSSE41(out, source, length, &written);
+	}
+#endif
+
+	return written + decodeScalar(out + written, source + done, length - done);
+}
+
+bool Base64::validate(const char *source, size_t length, size_t &decoded)
+{
+	size_t chars = 0;
+	size_t pad = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		unsigned char c = source[i];
+		unsigned char d = dtable[c];
+		if (d == D_PAD) {
+			pad++;
+		}
+		else if (d & D_SKIP) {
+			// The decoder skips the rest too, but that is no base64
+			if (c == ' ' || (c >= '\t' && c <= '\r')) {
+				continue;
+			}
+			return false;
+		}
+		else if (pad > 0) {
+			return false;
+		}
+		chars++;
+	}
+
+	if (chars % 4 != 0 || pad > 2) {
+		return false;
+	}
+	decoded = chars / 4 * 3 - pad;
+	return true;
+}
+
+/*
+ * The old interface. The line breaks follow the original encoder: a
+ * newline after each output position divisible by 72 (counting earlier
+ * newlines) and one at the end.
+ * */
+void Base64::encode(struct buffer_st *b, const char *source,
+		int length, bool strip_new_line)
+{
+	size_t len = length > 0 ? length : 0;
+	size_t enc_len = encodedLength(len);
+	size_t cap = enc_len + 1;
+
+	if (!strip_new_line) {
+		cap += enc_len / 71 + 1;
+	}
+
+	b->data = (char *)malloc(cap);
+	if (b->data == NULL) {
+		throw std::bad_alloc();
+	}
+	b->length = cap;
+
+	if (strip_new_line) {
+		b->offset = encodeTo(b->data, (const unsigned char *)source, len);
+	}
+	else {
+		// Encode into the tail and spread it forward with the newlines
+		char *enc = b->data + cap - enc_len;
+		encodeTo(enc, (const unsigned char *)source, len);
+
+		size_t off = 0;
+		for (size_t i = 0; i < enc_len; i++) {
+			b->data[off++] = enc[i];
+			if (off % 72 == 0) {
+				b->data[off++] = '\n';
+			}
+		}
+		b->data[off++] = '\n';
+		b->offset = off;
+	}
+
+	b->ptr = b->data + b->offset;
+}
+
+void Base64::decode(struct buffer_st *bfr, const char *source,
+		int length)
+{
+	size_t len = length > 0 ? length : 0;
+	size_t cap = decodedLength(len) + 1;
+
+	bfr->data = (char *)malloc(cap);
+	if (bfr->data == NULL) {
+		throw std::bad_alloc();
+	}
+	bfr->length = cap;
+	bfr->offset = decodeTo((unsigned char *)bfr->data, source, len);
+	bfr->ptr = bfr->data + bfr->offset;
 }
 
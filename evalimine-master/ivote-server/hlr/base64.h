@@ -13,6 +13,8 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+#include <stddef.h>
+
 struct buffer_st {
   char *data;
   int length;
@@ -45,8 +47,25 @@ class Base64
 		void decode(struct buffer_st *b, const char *source,
 				int length);
 
-	private:
-		unsigned char dtable[512];
+		/*
+		 * Buffer based codec. Output buffers are allocated by the caller
+		 * from encodedLength()/decodedLength(). Uses AVX2 or SSE4.1 when
+		 * the CPU has them.
+		 * */
+		static size_t encodedLength(size_t length);
+		static size_t decodedLength(size_t length);
+
+		static size_t encodeTo(char *out, const unsigned char *source,
+				size_t length);
+		static size_t decodeTo(unsigned char *out, const char *source,
+				size_t length);
+
+		/*
+		 * Whether source is padded base64 that decodeTo() takes whole,
+		 * whitespace aside. decoded is then the length it decodes to.
+		 * */
+		static bool validate(const char *source, size_t length,
+				size_t &decoded);
 };
 
 #endif
@@ -0,0 +1,452 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "base64.h"
+#include "vote_file.h"
+
+/*
+ * Benchmark of threaded_decrypt against mock_pkcs11.so. Generates a key
+ * and N votes encrypted with it, decrypts them with each of the given
+ * thread counts and checks every plaintext. Reports the votes per
+ * second, the 99th percentile of the time of one C_Decrypt() from the
+ * statistics of the module and the peak RSS of threaded_decrypt.
+ *
+ * The latency, concurrency limit and failure rate of the token are set
+ * with the MOCK_PKCS11_* variables of mock_pkcs11.cpp, which are passed
+ * on. Options after the module are given to threaded_decrypt.
+ * */
+
+enum ExitCodes {
+	EXIT_OK = 0,
+	EXIT_INVALID_ARGUMENT_COUNT,
+	EXIT_CANNOT_PREPARE_INPUT,
+	EXIT_CANNOT_RUN_DECRYPT,
+	EXIT_DECRYPT_FAILED,
+	EXIT_WRONG_RESULT
+};
+
+#define DEFAULT_VOTES 10000
+#define DEFAULT_KEY_BITS 2048
+#define DEFAULT_THREADS "1,2,4,8"
+#define DEFAULT_DIR "bench_data"
+
+#define BENCH_VERSION "1"
+#define BENCH_ELID "BENCH"
+
+struct RunResult
+{
+	int threads;
+	double seconds;
+	long max_rss_kb;
+	unsigned long calls;
+	unsigned long failures;
+	unsigned long p50_us;
+	unsigned long p99_us;
+	unsigned long max_us;
+};
+
+static std::string sslError(const std::string& prefix)
+{
+	char buf[256];
+	unsigned long e = ERR_get_error();
+	ERR_clear_error();
+	if (e == 0) {
+		return prefix;
+	}
+	ERR_error_string_n(e, buf, sizeof(buf));
+	return prefix + ": " + buf;
+}
+
+static std::string getEnv(const char *name, const char *def)
+{
+	const char *v = getenv(name);
+	return v != NULL && *v != '\0' ? v : def;
+}
+
+// The plaintext of vote k, a few different choices
+static std::string plaintext(size_t k)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s\n%s\n0.%d\n", BENCH_VERSION, BENCH_ELID,
+			101 + (int)(k * 7919 % 13));
+	return buf;
+}
+
+static EVP_PKEY *generateKey(int bits, const std::string& path)
+{
+	EVP_PKEY *key = NULL;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+	if (ctx == NULL || EVP_PKEY_keygen_init(ctx) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, bits) <= 0 ||
+			EVP_PKEY_keygen(ctx, &key) <= 0) {
+		fprintf(stderr, "%s\n", sslError("Cannot generate RSA key").c_str());
+		EVP_PKEY_CTX_free(ctx);
+		return NULL;
+	}
+	EVP_PKEY_CTX_free(ctx);
+
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == NULL || !PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL) ||
+			fclose(f) != 0) {
+		fprintf(stderr, "Cannot write %s: %s\n", path.c_str(), strerror(errno));
+		EVP_PKEY_free(key);
+		return NULL;
+	}
+	return key;
+}
+
+static bool writeVotes(EVP_PKEY *key, size_t votes, const std::string& path)
+{
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+	if (ctx == NULL || EVP_PKEY_encrypt_init(ctx) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0) {
+		fprintf(stderr, "%s\n", sslError("Cannot set up RSA-OAEP encryption").c_str());
+		EVP_PKEY_CTX_free(ctx);
+		return false;
+	}
+
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open %s for writing: %s\n", path.c_str(),
+				strerror(errno));
+		EVP_PKEY_CTX_free(ctx);
+		return false;
+	}
+
+	std::vector<unsigned char> cipher(EVP_PKEY_size(key));
+	std::vector<char> b64(Base64::encodedLength(cipher.size()) + 1);
+	bool ok = fprintf(f, "%s\n%s\n", BENCH_VERSION, BENCH_ELID) > 0;
+
+	for (size_t k = 0; ok && k < votes; k++) {
+		std::string vote = plaintext(k);
+		size_t len = cipher.size();
+		if (EVP_PKEY_encrypt(ctx, &cipher[0], &len,
+					(const unsigned char *)vote.data(), vote.size()) <= 0) {
+			fprintf(stderr, "%s\n", sslError("Cannot encrypt vote").c_str());
+			ok = false;
+			break;
+		}
+		size_t n = Base64::encodeTo(&b64[0], &cipher[0], len);
+		ok = fprintf(f, "0\t%lu\t0\t1\t", (unsigned long)(k % 100 + 1)) > 0 &&
+			fwrite(&b64[0], 1, n, f) == n && fputc('\n', f) != EOF;
+	}
+
+	EVP_PKEY_CTX_free(ctx);
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "Cannot write %s: %s\n", path.c_str(), strerror(errno));
+	}
+	return ok;
+}
+
+/*
+ * Counts the plaintexts of the output that are not the expected ones.
+ * Returns -1 if the output cannot be read or has the wrong lines.
+ * */
+static long countWrong(const std::string& path, size_t votes)
+{
+	VoteFile vf;
+	const char *line;
+	size_t len;
+
+	if (!vf.open(path.c_str()) || !vf.map()) {
+		fprintf(stderr, "Cannot read %s: %s\n", path.c_str(), strerror(errno));
+		return -1;
+	}
+	if (!vf.next(line, len) || !vf.next(line, len)) {
+		return -1;
+	}
+
+	long wrong = 0;
+	size_t k = 0;
+	std::vector<unsigned char> buf;
+	while (vf.next(line, len)) {
+		const char *tab = (const char *)memrchr(line, '\t', len);
+		if (tab == NULL || k >= votes) {
+			return -1;
+		}
+		tab++;
+		size_t b64_len = line + len - tab;
+		buf.resize(Base64::decodedLength(b64_len) + 1);
+		size_t n = Base64::decodeTo(&buf[0], tab, b64_len);
+		if (plaintext(k) != std::string((const char *)&buf[0], n)) {
+			wrong++;
+		}
+		k++;
+	}
+	return k == votes ? wrong : -1;
+}
+
+static bool readStats(const std::string& path, RunResult& r)
+{
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == NULL) {
+		return false;
+	}
+	int peak = 0;
+	int n = fscanf(f, "calls %lu\nfailures %lu\npeak %d\n"
+			"p50_us %lu\np99_us %lu\nmax_us %lu\n", &r.calls, &r.failures,
+			&peak, &r.p50_us, &r.p99_us, &r.max_us);
+	fclose(f);
+	return n == 6;
+}
+
+static int runDecrypt(const std::string& td, const std::string& module,
+		const std::vector<std::string>& extra, const std::string& dir,
+		int threads, RunResult& r)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d", threads);
+	std::string out = dir + "/out" + suffix;
+	std::string stats = dir + "/stats" + suffix;
+	std::string log = dir + "/log" + suffix;
+	char threads_arg[32];
+	snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+
+	std::vector<std::string> args;
+	args.push_back(td);
+	args.push_back("--threads");
+	args.push_back(threads_arg);
+	args.insert(args.end(), extra.begin(), extra.end());
+	args.push_back(dir + "/votes");
+	args.push_back(out);
+	args.push_back(getEnv("MOCK_PKCS11_TOKEN", "mock"));
+	args.push_back(getEnv("MOCK_PKCS11_KEY_LABEL", "mock"));
+	args.push_back(getEnv("MOCK_PKCS11_PIN", "1234"));
+	args.push_back(module);
+
+	std::vector<char *> argv;
+	for (size_t i = 0; i < args.size(); i++) {
+		argv.push_back((char *)args[i].c_str());
+	}
+	argv.push_back(NULL);
+
+	unlink(stats.c_str());
+
+	struct timeval start;
+	struct timeval end;
+	gettimeofday(&start, NULL);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+		return EXIT_CANNOT_RUN_DECRYPT;
+	}
+	if (pid == 0) {
+		int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			_exit(127);
+		}
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+		setenv("MOCK_PKCS11_KEY", (dir + "/key.pem").c_str(), 1);
+		setenv("MOCK_PKCS11_STATS", stats.c_str(), 1);
+		execv(argv[0], &argv[0]);
+		fprintf(stderr, "Cannot run %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+
+	int status = 0;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) != pid) {
+		fprintf(stderr, "wait4() failed: %s\n", strerror(errno));
+		return EXIT_CANNOT_RUN_DECRYPT;
+	}
+	gettimeofday(&end, NULL);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "threaded_decrypt --threads %d failed, see %s\n",
+				threads, log.c_str());
+		return EXIT_DECRYPT_FAILED;
+	}
+
+	r.threads = threads;
+	r.seconds = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+	r.max_rss_kb = ru.ru_maxrss;
+	if (!readStats(stats, r)) {
+		fprintf(stderr, "No statistics from the module in %s\n", stats.c_str());
+		return EXIT_DECRYPT_FAILED;
+	}
+	return EXIT_OK;
+}
+
+static bool parseThreads(const char *arg, std::vector<int>& threads)
+{
+	threads.clear();
+	const char *p = arg;
+	while (*p != '\0') {
+		char *end = NULL;
+		long n = strtol(p, &end, 10);
+		if (end == p || n < 1 || (*end != ',' && *end != '\0')) {
+			return false;
+		}
+		threads.push_back(n);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return !threads.empty();
+}
+
+void usage(const char *self)
+{
+	printf("Kasutamine:\n");
+	printf("    %s [--votes N] [--threads N,N...] [--key-bits N] [--dir D] "
+		   "<threaded_decrypt> <mock_pkcs11.so> [threaded_decrypt options]\n",
+		   self);
+	printf("\n    --votes N       genereeritavate häälte arv (vaikimisi %d)\n",
+			DEFAULT_VOTES);
+	printf("    --threads N,... proovitavad lõimede arvud (vaikimisi %s)\n",
+			DEFAULT_THREADS);
+	printf("    --key-bits N    RSA võtme pikkus (vaikimisi %d)\n",
+			DEFAULT_KEY_BITS);
+	printf("    --dir D         kataloog võtme, häälte ja väljundite jaoks "
+		   "(vaikimisi %s)\n", DEFAULT_DIR);
+	printf("\n    Tokeni latentsus, samaaegsete dekrüptimiste arv, "
+		   "nurjumiste osakaal ja\n    tõrkesiire antakse "
+		   "keskkonnamuutujatega MOCK_PKCS11_LATENCY_US,\n    "
+		   "MOCK_PKCS11_CONCURRENCY, MOCK_PKCS11_FAILURE_RATE ja "
+		   "MOCK_PKCS11_FAILOVER_AFTER,\n    vt mock_pkcs11.cpp.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"votes", required_argument, NULL, 'n'},
+		{"threads", required_argument, NULL, 't'},
+		{"key-bits", required_argument, NULL, 'k'},
+		{"dir", required_argument, NULL, 'd'},
+		{NULL, 0, NULL, 0}
+	};
+
+	long votes = DEFAULT_VOTES;
+	long bits = DEFAULT_KEY_BITS;
+	std::string dir = DEFAULT_DIR;
+	std::vector<int> threads;
+	parseThreads(DEFAULT_THREADS, threads);
+	int c;
+
+	// Stop at the first argument that is not an option of ours
+	while ((c = getopt_long(argc, argv, "+n:t:k:d:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'n':
+				votes = strtol(optarg, NULL, 10);
+				if (votes < 1) {
+					fprintf(stderr, "Invalid vote count: %s\n", optarg);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			case 't':
+				if (!parseThreads(optarg, threads)) {
+					fprintf(stderr, "Invalid thread counts: %s\n", optarg);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			case 'k':
+				bits = strtol(optarg, NULL, 10);
+				if (bits < 1024) {
+					fprintf(stderr, "Invalid key length: %s\n", optarg);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_INVALID_ARGUMENT_COUNT;
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return EXIT_INVALID_ARGUMENT_COUNT;
+	}
+	std::string td = argv[optind];
+	std::string module = argv[optind + 1];
+	std::vector<std::string> extra(argv + optind + 2, argv + argc);
+
+	// The module is loaded with dlopen(), which needs a path for a file
+	// in the current directory
+	if (module.find('/') == std::string::npos) {
+		module = "./" + module;
+	}
+
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Cannot create %s: %s\n", dir.c_str(), strerror(errno));
+		return EXIT_CANNOT_PREPARE_INPUT;
+	}
+
+	printf("Genereerin %d-bitise võtme ja %ld häält...\n", (int)bits, votes);
+	fflush(stdout);
+	EVP_PKEY *key = generateKey(bits, dir + "/key.pem");
+	if (key == NULL) {
+		return EXIT_CANNOT_PREPARE_INPUT;
+	}
+	bool ok = writeVotes(key, votes, dir + "/votes");
+	EVP_PKEY_free(key);
+	if (!ok) {
+		return EXIT_CANNOT_PREPARE_INPUT;
+	}
+
+	// The widths are in bytes, õ and ä take two
+	printf("%9s %14s %10s %10s %10s %10s\n", "lõimi", "hääli/s",
+			"p50 ms", "p99 ms", "RSS MB", "nurjunud");
+	fflush(stdout);
+	for (size_t i = 0; i < threads.size(); i++) {
+		RunResult r;
+		int rc = runDecrypt(td, module, extra, dir, threads[i], r);
+		if (rc != EXIT_OK) {
+			return rc;
+		}
+
+		// Every vote the module did not fail must have decrypted right,
+		// the failed ones may have been retried in a new session
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%d", threads[i]);
+		long wrong = countWrong(dir + "/out" + suffix, votes);
+		if (wrong < 0 || (unsigned long)wrong > r.failures) {
+			fprintf(stderr, "Wrong output with %d threads: %ld votes differ, "
+					"%lu failed in the module\n", threads[i], wrong, r.failures);
+			return EXIT_WRONG_RESULT;
+		}
+
+		printf("%8d %12.1f %10.2f %10.2f %10.1f %10lu\n", r.threads,
+				votes / r.seconds, r.p50_us / 1000.0, r.p99_us / 1000.0,
+				r.max_rss_kb / 1024.0, r.failures);
+		fflush(stdout);
+	}
+
+	return EXIT_OK;
+}
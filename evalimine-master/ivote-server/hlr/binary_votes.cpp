@@ -0,0 +1,293 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binary_votes.h"
+
+#define BINARY_VOTES_MAGIC "HLRVOTES"
+#define BINARY_VOTES_MAGIC_LEN 8
+#define BINARY_VOTES_VERSION 1
+#define BINARY_VOTES_HEADER_LEN 48
+
+// Buffer of the writer
+#define BINARY_VOTES_BUFFER (1024 * 1024)
+
+static void putLE(std::string& out, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++) {
+		out += (char)((v >> (8 * i)) & 0xff);
+	}
+}
+
+static uint64_t getLE(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < bytes; i++) {
+		v |= (uint64_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+/*
+ *
+ * Class BinaryVoteFile
+ *
+ * */
+
+BinaryVoteFile::BinaryVoteFile()
+{
+	_data = NULL;
+	_flags = 0;
+	_cipher_len = 0;
+	_count = 0;
+	_start = 0;
+	_table = 0;
+}
+
+BinaryVoteFile::~BinaryVoteFile()
+{
+	close();
+}
+
+bool BinaryVoteFile::open(const char *path)
+{
+	if (!_vf.open(path) || !_vf.map()) {
+		return false;
+	}
+	_data = (const unsigned char *)_vf.data();
+
+	size_t size = _vf.size();
+	if (size < BINARY_VOTES_HEADER_LEN ||
+			memcmp(_data, BINARY_VOTES_MAGIC, BINARY_VOTES_MAGIC_LEN) != 0 ||
+			getLE(_data + 8, 4) != BINARY_VOTES_VERSION) {
+		errno = EINVAL;
+		return false;
+	}
+
+	_flags = getLE(_data + 12, 4);
+	_cipher_len = getLE(_data + 16, 4);
+	uint64_t count = getLE(_data + 24, 8);
+	uint64_t table = getLE(_data + 32, 8);
+	uint64_t version_len = getLE(_data + 40, 4);
+	uint64_t elid_len = getLE(_data + 44, 4);
+
+	// The table fills the file from its offset to the end
+	uint64_t start = BINARY_VOTES_HEADER_LEN + version_len + elid_len;
+	if (start > table || table > size || (size - table) / 8 != count ||
+			(size - table) % 8 != 0) {
+		errno = EINVAL;
+		return false;
+	}
+
+	_version.assign((const char *)_data + BINARY_VOTES_HEADER_LEN, version_len);
+	_elid.assign((const char *)_data + BINARY_VOTES_HEADER_LEN + version_len, elid_len);
+	_count = count;
+	_start = start;
+	_table = table;
+	return true;
+}
+
+void BinaryVoteFile::close()
+{
+	_vf.close();
+	_data = NULL;
+}
+
+const std::string& BinaryVoteFile::version() const
+{
+	return _version;
+}
+
+const std::string& BinaryVoteFile::elid() const
+{
+	return _elid;
+}
+
+bool BinaryVoteFile::hasResults() const
+{
+	return (_flags & BINARY_VOTES_RESULTS) != 0;
+}
+
+size_t BinaryVoteFile::cipherLength() const
+{
+	return _cipher_len;
+}
+
+size_t BinaryVoteFile::count() const
+{
+	return _count;
+}
+
+size_t BinaryVoteFile::size() const
+{
+	return _vf.size();
+}
+
+size_t BinaryVoteFile::start() const
+{
+	return _start;
+}
+
+bool BinaryVoteFile::record(size_t k, BinaryVote& vote) const
+{
+	if (k >= _count) {
+		return false;
+	}
+
+	size_t pos = getLE(_data + _table + 8 * k, 8);
+	const unsigned char *field[3];
+	size_t len[3];
+	int fields = hasResults() ? 3 : 2;
+
+	for (int i = 0; i < fields; i++) {
+		if (pos < _start || pos > _table || _table - pos < 4) {
+			return false;
+		}
+		len[i] = getLE(_data + pos, 4);
+		pos += 4;
+		if (_table - pos < len[i]) {
+			return false;
+		}
+		field[i] = _data + pos;
+		pos += len[i];
+	}
+
+	vote.context = (const char *)field[0];
+	vote.context_len = len[0];
+	vote.cipher = field[1];
+	vote.cipher_len = len[1];
+	vote.result = fields > 2 ? field[2] : NULL;
+	vote.result_len = fields > 2 ? len[2] : 0;
+	vote.end = pos;
+	return true;
+}
+
+/*
+ *
+ * Class BinaryVoteWriter
+ *
+ * */
+
+BinaryVoteWriter::BinaryVoteWriter()
+{
+	_f = NULL;
+	_pos = 0;
+	_cipher_len = 0;
+	_results = false;
+}
+
+BinaryVoteWriter::~BinaryVoteWriter()
+{
+	if (_f != NULL) {
+		fclose(_f);
+	}
+}
+
+std::string BinaryVoteWriter::header(uint64_t table) const
+{
+	std::string out(BINARY_VOTES_MAGIC);
+	putLE(out, BINARY_VOTES_VERSION, 4);
+	putLE(out, _results ? BINARY_VOTES_RESULTS : 0, 4);
+	putLE(out, _cipher_len, 4);
+	putLE(out, 0, 4);
+	putLE(out, _offsets.size(), 8);
+	putLE(out, table, 8);
+	putLE(out, _version.size(), 4);
+	putLE(out, _elid.size(), 4);
+	return out;
+}
+
+bool BinaryVoteWriter::put(const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, _f) != len) {
+		return false;
+	}
+	_pos += len;
+	return true;
+}
+
+bool BinaryVoteWriter::putField(const void *data, size_t len)
+{
+	std::string prefix;
+	putLE(prefix, len, 4);
+	return put(prefix.data(), prefix.size()) && put(data, len);
+}
+
+/*
+ * The header is written again by finish(), until then the record count
+ * and the table offset are zero.
+ * */
+bool BinaryVoteWriter::open(const char *path, const std::string& version,
+		const std::string& elid, size_t cipher_len, bool results)
+{
+	_version = version;
+	_elid = elid;
+	_cipher_len = cipher_len;
+	_results = results;
+	_offsets.clear();
+	_pos = 0;
+
+	_f = fopen(path, "w");
+	if (_f == NULL) {
+		return false;
+	}
+	_buf.resize(BINARY_VOTES_BUFFER);
+	setvbuf(_f, &_buf[0], _IOFBF, _buf.size());
+
+	std::string head = header(0);
+	return put(head.data(), head.size()) &&
+		put(_version.data(), _version.size()) &&
+		put(_elid.data(), _elid.size());
+}
+
+bool BinaryVoteWriter::add(const char *context, size_t context_len,
+		const unsigned char *cipher, size_t cipher_len,
+		const unsigned char *result, size_t result_len)
+{
+	if (_cipher_len == 0) {
+		_cipher_len = cipher_len;
+	}
+	_offsets.push_back(_pos);
+	return putField(context, context_len) &&
+		putField(cipher, cipher_len) &&
+		(!_results || putField(result, result_len));
+}
+
+bool BinaryVoteWriter::finish()
+{
+	uint64_t table = _pos;
+	std::string tab;
+	tab.reserve(8 * _offsets.size());
+	for (size_t i = 0; i < _offsets.size(); i++) {
+		putLE(tab, _offsets[i], 8);
+	}
+
+	std::string head = header(table);
+	bool ok = put(tab.data(), tab.size()) &&
+		fflush(_f) == 0 &&
+		pwrite(fileno(_f), head.data(), head.size(), 0) == (ssize_t)head.size() &&
+		fsync(fileno(_f)) == 0;
+
+	if (fclose(_f) != 0) {
+		ok = false;
+	}
+	_f = NULL;
+	return ok;
+}
+
+size_t BinaryVoteWriter::count() const
+{
+	return _offsets.size();
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#ifndef BINARY_VOTES_H
+#define BINARY_VOTES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "vote_file.h"
+
+/*
+ * Binary form of a votes file and of the decrypted votes, so that the
+ * decryption needs neither line scanning nor base64. All numbers are
+ * little-endian.
+ *
+ *     header     "HLRVOTES", u32 format version, u32 flags,
+ *                u32 ciphertext length of the key, u32 zero,
+ *                u64 record count, u64 offset of the table,
+ *                u32 version length, u32 election id length
+ *     version    the first line of the votes file without the newline
+ *     elid       the second line
+ *     records    u32 length and the fields of the line before the
+ *                ciphertext, including the tab after them,
+ *                u32 length and the raw ciphertext,
+ *                with BINARY_VOTES_RESULTS u32 length and the plaintext
+ *     table      u64 file offset of every record
+ *
+ * A record is found from the table without reading the ones before it.
+ * The ciphertexts are normally all of the key length given in the
+ * header, one of another length is kept as is and fails decryption as
+ * in the text form. A line with no ciphertext or with one that is not
+ * base64 is kept whole as the context with an empty ciphertext, unlike
+ * that of a vote its context does not end in a tab.
+ * */
+
+#define BINARY_VOTES_RESULTS 0x01
+
+struct BinaryVote
+{
+	const char *context;
+	size_t context_len;
+	const unsigned char *cipher;
+	size_t cipher_len;
+	const unsigned char *result;
+	size_t result_len;
+
+	// File offset after the record
+	size_t end;
+};
+
+class BinaryVoteFile
+{
+	public:
+
+		BinaryVoteFile();
+		~BinaryVoteFile();
+
+		// Sets errno to EINVAL if the file is not in the binary form
+		bool open(const char *path);
+		void close();
+
+		const std::string& version() const;
+		const std::string& elid() const;
+		bool hasResults() const;
+		size_t cipherLength() const;
+		size_t count() const;
+		size_t size() const;
+
+		// Offset of the first record
+		size_t start() const;
+
+		// False if the record does not fit in the file
+		bool record(size_t k, BinaryVote& vote) const;
+
+	protected:
+
+	private:
+
+		BinaryVoteFile(const BinaryVoteFile&);
+		BinaryVoteFile& operator=(const BinaryVoteFile&);
+
+		VoteFile _vf;
+		const unsigned char *_data;
+		std::string _version;
+		std::string _elid;
+		uint32_t _flags;
+		size_t _cipher_len;
+		size_t _count;
+		size_t _start;
+		size_t _table;
+};
+
+class BinaryVoteWriter
+{
+	public:
+
+		BinaryVoteWriter();
+		~BinaryVoteWriter();
+
+		// With cipher_len 0 the length of the first non-empty ciphertext
+		// is used
+		bool open(const char *path, const std::string& version,
+				const std::string& elid, size_t cipher_len, bool results);
+
+		bool add(const char *context, size_t context_len,
+				const unsigned char *cipher, size_t cipher_len,
+				const unsigned char *result, size_t result_len);
+
+		// Writes the table and the header and syncs the file to disk
+		bool finish();
+
+		size_t count() const;
+
+	protected:
+
+	private:
+
+		BinaryVoteWriter(const BinaryVoteWriter&);
+		BinaryVoteWriter& operator=(const BinaryVoteWriter&);
+
+		bool put(const void *data, size_t len);
+		bool putField(const void *data, size_t len);
+		std::string header(uint64_t table) const;
+
+		FILE *_f;
+		std::vector<char> _buf;
+		std::vector<uint64_t> _offsets;
+		uint64_t _pos;
+		std::string _version;
+		std::string _elid;
+		size_t _cipher_len;
+		bool _results;
+};
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include <vector>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "threaded_decrypt checkpoint 1"
+
+Checkpoint::Checkpoint(const std::string& path)
+{
+	_path = path;
+	input_size = 0;
+	line_nr = 0;
+	input_offset = 0;
+	output_offset = 0;
+}
+
+Checkpoint::~Checkpoint()
+{
+}
+
+const std::string& Checkpoint::path() const
+{
+	return _path;
+}
+
+/*
+ * Reads the checkpoint. A missing file is not an error, found tells the
+ * two apart.
+ * */
+bool Checkpoint::load(bool& found)
+{
+	char magic[64];
+	unsigned long in_size, in_off, out_off;
+	int line;
+
+	found = false;
+
+	FILE *f = fopen(_path.c_str(), "r");
+	if (f == NULL) {
+		return errno == ENOENT;
+	}
+	found = true;
+
+	bool ok = fgets(magic, sizeof(magic), f) != NULL &&
+		strcmp(magic, CHECKPOINT_MAGIC "\n") == 0 &&
+		fscanf(f, "%lu %d %lu %lu", &in_size, &line, &in_off, &out_off) == 4;
+	fclose(f);
+
+	if (!ok) {
+		errno = EINVAL;
+		return false;
+	}
+
+	input_size = in_size;
+	line_nr = line;
+	input_offset = in_off;
+	output_offset = out_off;
+	return true;
+}
+
+static bool syncDir(const std::string& path)
+{
+	std::vector<char> buf(path.begin(), path.end());
+	buf.push_back('\0');
+
+	int fd = open(dirname(&buf[0]), O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+/*
+ * Replaces the checkpoint atomically: written and synced to a temporary
+ * file first, then renamed over the old one. The caller must have synced
+ * the output up to output_offset before.
+ * */
+bool Checkpoint::save()
+{
+	std::string tmp = _path + ".tmp";
+
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (f == NULL) {
+		return false;
+	}
+
+	bool ok = fprintf(f, CHECKPOINT_MAGIC "\n%lu %d %lu %lu\n",
+			(unsigned long)input_size, line_nr,
+			(unsigned long)input_offset,
+			(unsigned long)output_offset) > 0 &&
+		fflush(f) == 0 &&
+		fsync(fileno(f)) == 0;
+
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+
+	if (!ok || rename(tmp.c_str(), _path.c_str()) != 0) {
+		int err = errno;
+		unlink(tmp.c_str());
+		errno = err;
+		return false;
+	}
+
+	return syncDir(_path);
+}
+
+bool Checkpoint::remove()
+{
+	return unlink(_path.c_str()) == 0 || errno == ENOENT;
+}
+
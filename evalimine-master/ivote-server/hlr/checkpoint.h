@@ -0,0 +1,52 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+#include <string>
+
+/*
+ * Progress of a decryption run that has reached the disk: every line
+ * before line_nr + 1 is in the output file up to output_offset, and the
+ * input continues at input_offset.
+ * */
+class Checkpoint
+{
+	public:
+
+		Checkpoint(const std::string& path);
+		~Checkpoint();
+
+		bool load(bool& found);
+		bool save();
+		bool remove();
+
+		const std::string& path() const;
+
+		size_t input_size;
+		int line_nr;
+		size_t input_offset;
+		size_t output_offset;
+
+	protected:
+
+	private:
+
+		std::string _path;
+};
+
+#endif
+
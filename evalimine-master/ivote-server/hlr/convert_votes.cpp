@@ -0,0 +1,203 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "base64.h"
+#include "binary_votes.h"
+#include "vote_file.h"
+
+/*
+ * Converts a votes file into the binary form of binary_votes.h for
+ * threaded_decrypt --binary, and the binary input or output of it back
+ * into text. The text has the base64 of the ciphertexts and plaintexts
+ * without line breaks, as threaded_decrypt writes it.
+ * */
+
+enum ExitCodes {
+	EXIT_OK = 0,
+	EXIT_INVALID_ARGUMENT_COUNT,
+	EXIT_CANNOT_OPEN_INPUT,
+	EXIT_CANNOT_OPEN_OUTPUT,
+	EXIT_INVALID_INPUT,
+	EXIT_ERROR_WRITING_OUTPUT
+};
+
+// Buffer of the text output
+#define TEXT_BUFFER (1024 * 1024)
+
+static int toBinary(const char *in, const char *out)
+{
+	VoteFile vf;
+	const char *version;
+	const char *elid;
+	const char *line;
+	size_t version_len;
+	size_t elid_len;
+	size_t len;
+
+	if (!vf.open(in) || !vf.map()) {
+		fprintf(stderr, "Cannot read votes file %s: %s\n", in, strerror(errno));
+		return EXIT_CANNOT_OPEN_INPUT;
+	}
+	if (!vf.next(version, version_len) || !vf.next(elid, elid_len)) {
+		fprintf(stderr, "Invalid votes file %s: no version or election id\n", in);
+		return EXIT_INVALID_INPUT;
+	}
+
+	BinaryVoteWriter w;
+	if (!w.open(out, std::string(version, version_len),
+				std::string(elid, elid_len), 0, false)) {
+		fprintf(stderr, "Cannot open %s for writing: %s\n", out, strerror(errno));
+		return EXIT_CANNOT_OPEN_OUTPUT;
+	}
+
+	std::vector<unsigned char> cipher;
+	while (vf.next(line, len)) {
+		// A line that is not a vote is kept whole for threaded_decrypt to
+		// reject, see binary_votes.h
+		const char *tab = (const char *)memrchr(line, '\t', len);
+		size_t decoded = 0;
+		const char *reason = NULL;
+		if (tab == NULL) {
+			reason = "line-format";
+		}
+		else if (!Base64::validate(tab + 1, line + len - tab - 1, decoded)) {
+			reason = "base64";
+		}
+
+		bool ok;
+		if (reason != NULL) {
+			fprintf(stderr, "Vote kept unconverted (%s): line nr %d\n",
+					reason, vf.lines());
+			ok = w.add(line, len, NULL, 0, NULL, 0);
+		}
+		else {
+			tab++;
+			cipher.resize(decoded + 1);
+			size_t cipher_len = Base64::decodeTo(&cipher[0], tab,
+					line + len - tab);
+			ok = w.add(line, tab - line, &cipher[0], cipher_len, NULL, 0);
+		}
+		if (!ok) {
+			fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+			unlink(out);
+			return EXIT_ERROR_WRITING_OUTPUT;
+		}
+	}
+
+	if (!w.finish()) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		unlink(out);
+		return EXIT_ERROR_WRITING_OUTPUT;
+	}
+
+	printf("Hääled (%lu) on teisendatud.\n", (unsigned long)w.count());
+	return EXIT_OK;
+}
+
+static bool putBase64(FILE *f, std::vector<char>& buf,
+		const unsigned char *data, size_t len)
+{
+	buf.resize(Base64::encodedLength(len) + 1);
+	size_t n = Base64::encodeTo(&buf[0], data, len);
+	return fwrite(&buf[0], 1, n, f) == n;
+}
+
+static int toText(const char *in, const char *out)
+{
+	BinaryVoteFile bf;
+	if (!bf.open(in)) {
+		if (errno == EINVAL) {
+			fprintf(stderr, "Invalid binary votes file %s\n", in);
+			return EXIT_INVALID_INPUT;
+		}
+		fprintf(stderr, "Cannot read votes file %s: %s\n", in, strerror(errno));
+		return EXIT_CANNOT_OPEN_INPUT;
+	}
+
+	FILE *f = fopen(out, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open %s for writing: %s\n", out, strerror(errno));
+		return EXIT_CANNOT_OPEN_OUTPUT;
+	}
+	std::vector<char> fbuf(TEXT_BUFFER);
+	setvbuf(f, &fbuf[0], _IOFBF, fbuf.size());
+
+	bool ok = fprintf(f, "%s\n%s\n", bf.version().c_str(), bf.elid().c_str()) > 0;
+
+	std::vector<char> buf;
+	BinaryVote vote;
+	for (size_t k = 0; ok && k < bf.count(); k++) {
+		if (!bf.record(k, vote)) {
+			fprintf(stderr, "Invalid vote record: line nr %lu\n",
+					(unsigned long)k + 3);
+			fclose(f);
+			unlink(out);
+			return EXIT_INVALID_INPUT;
+		}
+
+		ok = fwrite(vote.context, 1, vote.context_len, f) == vote.context_len &&
+			putBase64(f, buf, vote.cipher, vote.cipher_len) &&
+			(!bf.hasResults() || (fputc('\t', f) != EOF &&
+				putBase64(f, buf, vote.result, vote.result_len))) &&
+			fputc('\n', f) != EOF;
+	}
+
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		unlink(out);
+		return EXIT_ERROR_WRITING_OUTPUT;
+	}
+
+	printf("Hääled (%lu) on teisendatud.\n", (unsigned long)bf.count());
+	return EXIT_OK;
+}
+
+void usage(const char *self)
+{
+	printf("Kasutamine:\n");
+	printf("    %s --to-binary <input file> <binary file>\n", self);
+	printf("    %s --to-text <binary file> <output file>\n", self);
+	printf("\n    --to-binary  teisenda häältefail threaded_decrypt "
+		   "--binary sisendiks\n");
+	printf("    --to-text    teisenda binaarne sisend või väljund "
+		   "tagasi tekstiks\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 4) {
+		usage(argv[0]);
+		return EXIT_INVALID_ARGUMENT_COUNT;
+	}
+
+	if (strcmp(argv[1], "--to-binary") == 0) {
+		return toBinary(argv[2], argv[3]);
+	}
+	if (strcmp(argv[1], "--to-text") == 0) {
+		return toText(argv[2], argv[3]);
+	}
+
+	usage(argv[0]);
+	return EXIT_INVALID_ARGUMENT_COUNT;
+}
@@ -1,20 +0,0 @@
-/*
- * Copyright: Eesti Vabariigi Valimiskomisjon
- * (Estonian National Electoral Committee), www.vvk.ee
- * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
- *
- * This work is licensed under the Creative Commons
- * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
- * To view a copy of this license, visit
- * http://creativecommons.org/licenses/by-nc-nd/3.0/.
- * */
-
-
-
-#ifndef COUNT_LINES_H
-#define COUNT_LINES_H
-
-int countLines(const char *filen);
-
-#endif
-
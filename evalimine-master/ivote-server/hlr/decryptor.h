@@ -0,0 +1,46 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#ifndef DECRYPTOR_H
+#define DECRYPTOR_H
+
+#include <vector>
+
+#include "p11.h"
+
+/*
+ * Decryption backend of one worker thread. Instances are not shared
+ * between threads.
+ * */
+class Decryptor
+{
+	public:
+
+		virtual ~Decryptor() {}
+
+		// Upper bound of a plaintext in bytes
+		virtual CK_ULONG outputLength() = 0;
+
+		// Length of a ciphertext in bytes, 0 when it is not checked
+		virtual CK_ULONG inputLength() = 0;
+
+		// Decrypts the first count items, see Session::decryptBatch()
+		virtual size_t decryptBatch(std::vector<DecryptItem> &items,
+				size_t count) = 0;
+
+		// Times the backend was set up again after a transient error
+		virtual unsigned long recoveries() const { return 0; }
+};
+
+#endif
+
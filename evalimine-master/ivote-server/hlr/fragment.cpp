@@ -0,0 +1,180 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <new>
+
+#include "fragment.h"
+
+#define FRAGMENT_MAGIC "threaded_decrypt fragment 1"
+
+// SHA-256 in hex
+#define DIGEST_HEX_LEN 64
+
+Fragment::Fragment()
+{
+	shard = 0;
+	shards = 0;
+	first_line = 0;
+	last_line = 0;
+	begin = 0;
+	end = 0;
+	input_size = 0;
+	input_digest = std::string(DIGEST_HEX_LEN, '0');
+	output_digest = std::string(DIGEST_HEX_LEN, '0');
+}
+
+Fragment::~Fragment()
+{
+}
+
+std::string Fragment::header() const
+{
+	char buf[512];
+	snprintf(buf, sizeof(buf), FRAGMENT_MAGIC "\t%d/%d\t%d\t%d\t%lu\t%lu\t%lu\t%s\t%s\n",
+			shard, shards, first_line, last_line,
+			(unsigned long)begin, (unsigned long)end,
+			(unsigned long)input_size,
+			input_digest.c_str(), output_digest.c_str());
+	return buf;
+}
+
+bool Fragment::parse(const std::string& line)
+{
+	char in_md[DIGEST_HEX_LEN + 1];
+	char out_md[DIGEST_HEX_LEN + 1];
+	unsigned long b, e, size;
+	int n = 0;
+
+	if (line.empty() || line[line.size() - 1] != '\n' ||
+			line.compare(0, sizeof(FRAGMENT_MAGIC) - 1, FRAGMENT_MAGIC) != 0 ||
+			sscanf(line.c_str() + sizeof(FRAGMENT_MAGIC) - 1,
+				"\t%d/%d\t%d\t%d\t%lu\t%lu\t%lu\t%64[0-9a-f]\t%64[0-9a-f]\n%n",
+				&shard, &shards, &first_line, &last_line, &b, &e, &size,
+				in_md, out_md, &n) != 9 ||
+			n == 0 || sizeof(FRAGMENT_MAGIC) - 1 + n != line.size() ||
+			strlen(in_md) != DIGEST_HEX_LEN || strlen(out_md) != DIGEST_HEX_LEN) {
+		return false;
+	}
+
+	begin = b;
+	end = e;
+	input_size = size;
+	input_digest = in_md;
+	output_digest = out_md;
+
+	return shards > 0 && shard >= 1 && shard <= shards &&
+		begin <= end && end <= input_size && last_line >= first_line - 1;
+}
+
+// The first line start at or after offset
+static size_t lineStart(const char *data, size_t size, size_t body, size_t offset)
+{
+	if (offset <= body) {
+		return body;
+	}
+	if (offset >= size) {
+		return size;
+	}
+	if (data[offset - 1] == '\n') {
+		return offset;
+	}
+	const char *nl = (const char *)memchr(data + offset, '\n', size - offset);
+	return nl != NULL ? nl + 1 - data : size;
+}
+
+void Fragment::range(const char *data, size_t size, size_t body,
+		int shard, int shards, size_t& begin, size_t& end)
+{
+	unsigned long long len = size - body;
+	begin = lineStart(data, size, body,
+			body + (size_t)(len * (shard - 1) / shards));
+	end = lineStart(data, size, body,
+			body + (size_t)(len * shard / shards));
+}
+
+static int countLines(const char *data, size_t begin, size_t end)
+{
+	int n = 0;
+	const char *p = data + begin;
+	const char *stop = data + end;
+	while (p < stop) {
+		const char *nl = (const char *)memchr(p, '\n', stop - p);
+		n++;
+		if (nl == NULL) {
+			break;
+		}
+		p = nl + 1;
+	}
+	return n;
+}
+
+void Fragment::measure(const char *data, size_t size, size_t body)
+{
+	range(data, size, body, shard, shards, begin, end);
+	input_size = size;
+	first_line = 3 + countLines(data, body, begin);
+	last_line = first_line - 1 + countLines(data, begin, end);
+	input_digest = digest(data + begin, end - begin);
+}
+
+std::string Fragment::hex(const unsigned char *md, unsigned int len)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string ret;
+	for (unsigned int i = 0; i < len; i++) {
+		ret += digits[md[i] >> 4];
+		ret += digits[md[i] & 0x0f];
+	}
+	return ret;
+}
+
+std::string Fragment::digest(const char *data, size_t len)
+{
+	FragmentDigest d;
+	d.update(data, len);
+	return d.hex();
+}
+
+FragmentDigest::FragmentDigest()
+{
+	_ctx = EVP_MD_CTX_create();
+	if (_ctx == NULL) {
+		throw std::bad_alloc();
+	}
+	reset();
+}
+
+FragmentDigest::~FragmentDigest()
+{
+	EVP_MD_CTX_destroy(_ctx);
+}
+
+void FragmentDigest::reset()
+{
+	EVP_DigestInit_ex(_ctx, EVP_sha256(), NULL);
+}
+
+void FragmentDigest::update(const void *data, size_t len)
+{
+	EVP_DigestUpdate(_ctx, data, len);
+}
+
+std::string FragmentDigest::hex()
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	EVP_DigestFinal_ex(_ctx, md, &len);
+	reset();
+	return Fragment::hex(md, len);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include <stddef.h>
+#include <string>
+
+#include <openssl/evp.h>
+
+/*
+ * Output of one shard of a decryption run (threaded_decrypt --shard i/N).
+ * The fragment starts with a header line, followed by what a single run
+ * would write for the lines of the shard: the version and election id
+ * lines and the decrypted votes.
+ *
+ * The shards split the votes after the two header lines of the votes
+ * file into N byte ranges of about equal size, each moved forward to the
+ * next line start, so every host computes the same ranges from the same
+ * file. The header names the range, the SHA-256 of that part of the
+ * votes file and the SHA-256 of the fragment after the header line.
+ * */
+class Fragment
+{
+	public:
+
+		Fragment();
+		~Fragment();
+
+		// Fixed length for the same numbers, the output digest is
+		// filled in when the fragment is done
+		std::string header() const;
+		bool parse(const std::string& line);
+
+		// Fills in everything but the output digest for shard of the
+		// votes file in data, body is where the votes start
+		void measure(const char *data, size_t size, size_t body);
+
+		// Byte range of shard (1..shards) of data
+		static void range(const char *data, size_t size, size_t body,
+				int shard, int shards, size_t& begin, size_t& end);
+
+		static std::string hex(const unsigned char *md, unsigned int len);
+		static std::string digest(const char *data, size_t len);
+
+		int shard;
+		int shards;
+		// Line numbers in the votes file, last_line is first_line - 1
+		// for an empty shard
+		int first_line;
+		int last_line;
+		size_t begin;
+		size_t end;
+		size_t input_size;
+		std::string input_digest;
+		std::string output_digest;
+
+	protected:
+
+	private:
+};
+
+/*
+ * SHA-256 over data given in pieces.
+ * */
+class FragmentDigest
+{
+	public:
+
+		FragmentDigest();
+		~FragmentDigest();
+
+		void reset();
+		void update(const void *data, size_t len);
+		std::string hex();
+
+	protected:
+
+	private:
+
+		FragmentDigest(const FragmentDigest&);
+		FragmentDigest& operator=(const FragmentDigest&);
+
+		EVP_MD_CTX *_ctx;
+};
+
+#endif
@@ -30,9 +30,21 @@ import formatutil
 VOTING_ID_LENGTH = 28
 DECRYPT_PROGRAM = "threaded_decrypt"
 CORRUPTED_VOTE = "xxx"
+CORRUPTED_VOTE_B64 = base64.b64encode(CORRUPTED_VOTE)
+
+# Dekrüpteerija katsete arv, kordus jätkab kontrollpunktist
+DECRYPT_ATTEMPTS = 2
+DECRYPT_UTIL_FAILED = 9
 
 ENV_EVOTE_TMPDIR = "EVOTE_TMPDIR"
 
+# Kui seatud väärtusele "1", loeb hääled kokku dekrüpteerija ise
+ENV_EVOTE_NATIVE_TALLY = "EVOTE_NATIVE_TALLY"
+
+# Kui seatud väärtusele "1", loetakse hääli dekrüpteerija väljundist
+# juba dekrüpteerimise ajal
+ENV_EVOTE_STREAM_DECRYPT = "EVOTE_STREAM_DECRYPT"
+
 G_DECRYPT_ERRORS = {1: 'Dekrüpteerija sai vale arvu argumente',
     2: 'Häälte faili ei önnestunud lugemiseks avada',
     3: 'Dekrüptitud häälte faili ei õnnestunud kirjutamiseks avada',
@@ -41,7 +53,9 @@ G_DECRYPT_ERRORS = {1: 'Dekrüpteerija sai vale arvu argumente',
     6: 'Viga sisendi lugemisel',
     7: 'Viga väljundi kirjutamisel',
     8: 'Häälte faili rida ei vastanud formaadile',
-    9: 'Dekrüpteerija ebaõnnestus'}
+    9: 'Dekrüpteerija ebaõnnestus',
+    10: 'Valikute nimekiri ei vastanud formaadile',
+    11: 'Häälte failis oli tundmatu ringkond või jaoskond'}
 
 
 class DecodedVoteList(inputlists.InputList):
@@ -55,8 +69,23 @@ class DecodedVoteList(inputlists.InputList):
     def checkuniq(self, line):
         return True
 
+    def _reject_reason(self, lst):
+        # Dekrüpteerija ei katkesta vigase rea pärast, vaid kirjutab
+        # rea järele "xxx" hääle
+        if len(lst) < 2 or lst[-1] != CORRUPTED_VOTE_B64:
+            return None
+        if len(lst) != 6:
+            return 'rea vorming'
+        if not formatutil.is_base64(lst[4]):
+            return 'base64'
+        return None
+
     def dataline(self, line):
         lst = line.split('\t')
+        reason = self._reject_reason(lst)
+        if reason != None:
+            return self._vote_handler.handle_rejected(lst, self.processed(),
+                    reason)
         if not len(lst) == 6:
             self.errform('Kirjete arv real')
             return False
@@ -169,6 +198,14 @@ class ChoicesCounter:
                         choice.split('.')[1]]
                     out_f.write("\t".join(count_line) + "\n")
 
+    def outputchoices(self, out_f):
+        # One line per choice allowed in a station, for --tally
+        for rk in self.__cdata:
+            for stat in self.__cdata[rk]:
+                for choice in self.__cdata[rk][stat]:
+                    out_f.write("\t".join([rk[0], rk[1], stat[0], stat[1],
+                        choice]) + "\n")
+
     def outputdist(self, out_f):
         for rk in self._sort(self.__ddata, ringkonnad_cmp):
             for choice in self._sort(self.__ddata[rk], valikud_cmp):
@@ -200,14 +237,26 @@ class HLR:
         tmpreg.ensure_key([])
         tmpreg.delete_sub_keys([])
         self.output_file = tmpreg.path(['decrypted_votes'])
+        self.checkpoint_file = tmpreg.path(['decrypted_votes.checkpoint'])
+        # Dekrüpteerija viimane olekurida (JSON) jälgimiseks, vt telemetry.h
+        self.status_file = tmpreg.path(['decrypt_status'])
+        self.choices_file = tmpreg.path(['choices'])
+        self.log4_file = tmpreg.path(['log4'])
+        self.log5_file = tmpreg.path(['log5'])
         self.decrypt_prog = DECRYPT_PROGRAM
+        self.native_tally = os.environ.get(ENV_EVOTE_NATIVE_TALLY) == "1"
+        self.stream_decrypt = \
+            os.environ.get(ENV_EVOTE_STREAM_DECRYPT) == "1"
         self.__cnt = ChoicesCounter()
 
     def __del__(self):
-        try:
-            os.remove(self.output_file)
-        except:
-            pass
+        for name in [self.output_file, self.checkpoint_file,
+                self.status_file, self.choices_file, self.log4_file,
+                self.log5_file]:
+            try:
+                os.remove(name)
+            except:
+                pass
 
     def _decrypt_votes(self, pin):
 
@@ -215,22 +264,46 @@ class HLR:
         token_name = Election().get_hsm_token_name()
         priv_key_label = Election().get_hsm_priv_key()
         pkcs11lib = Election().get_pkcs11_path()
-        args = [input_file, self.output_file, \
-            token_name, priv_key_label, pin, pkcs11lib]
+        if self.native_tally:
+            # Loendamisel kontrollpunkte ei ole, kordus alustab otsast
+            args = self._tally_args() + [input_file, '-']
+        else:
+            args = ['--checkpoint', self.checkpoint_file, \
+                input_file, self.output_file]
+        args = ['--status-file', self.status_file] + args + \
+            [token_name, priv_key_label, pin, pkcs11lib]
 
         exit_code = 0
 
-        try:
-            exit_code = subprocess.call([self.decrypt_prog] + args)
-        except OSError, oserr:
-            errstr = "Häälte faili '%s' dekrüpteerimine nurjus: %s" % \
-                (input_file, oserr)
-            evlog.log_error(errstr)
-            return False
+        for attempt in range(DECRYPT_ATTEMPTS):
+            resume = []
+            if attempt > 0 and not self.native_tally:
+                resume = ['--resume']
+            try:
+                exit_code = subprocess.call([self.decrypt_prog] + \
+                    resume + args)
+            except OSError, oserr:
+                errstr = "Häälte faili '%s' dekrüpteerimine nurjus: %s" % \
+                    (input_file, oserr)
+                evlog.log_error(errstr)
+                return False
 
-        if exit_code == 0:
-            return True
+            if exit_code == 0:
+                return True
+
+            # Sisendi vigu kordamine ei paranda
+            if exit_code > 0 and exit_code != DECRYPT_UTIL_FAILED:
+                break
+
+            if attempt + 1 < DECRYPT_ATTEMPTS:
+                evlog.log_error(
+                    "Häälte faili '%s' dekrüpteerimine katkes (kood %d), "
+                    "jätkan kontrollpunktist" % (input_file, exit_code))
+
+        self._log_decrypt_error(input_file, exit_code)
+        return False
 
+    def _log_decrypt_error(self, input_file, exit_code):
         if exit_code > 0:
             errstr2 = "Tundmatu viga"
             if exit_code in G_DECRYPT_ERRORS:
@@ -240,12 +313,100 @@ class HLR:
                 "Häälte faili '%s' dekrüpteerimine nurjus: %s (kood %d)" % \
                 (input_file, errstr2, exit_code)
             evlog.log_error(errstr)
-            return False
+            return
 
         errstr = "Häälte faili '%s' dekrüpteerimine nurjus (signaal %d)" % \
                 (input_file, exit_code)
         evlog.log_error(errstr)
-        return False
+
+    def _decrypt_and_count(self, pin):
+        # Dekrüpteerija kirjutab hääled toru kaudu, lugemine käib samal
+        # ajal. Kontrollpunkte ei ole, viga katkestab kogu lugemise.
+        input_file = self._reg.path(['hlr', 'input', 'votes'])
+        args = ['--stream', '--status-file', self.status_file,
+            input_file, '/dev/stdout',
+            Election().get_hsm_token_name(),
+            Election().get_hsm_priv_key(), pin,
+            Election().get_pkcs11_path()]
+
+        try:
+            proc = subprocess.Popen([self.decrypt_prog] + args,
+                stdout=subprocess.PIPE)
+        except OSError, oserr:
+            errstr = "Häälte faili '%s' dekrüpteerimine nurjus: %s" % \
+                (input_file, oserr)
+            evlog.log_error(errstr)
+            return False
+
+        counted = False
+        try:
+            dvl = DecodedVoteList(self, self.__cnt)
+            dvl.attach_logger(evlog.AppLog())
+            dvl.attach_elid(self._elid)
+            counted = dvl.check_stream(proc.stdout, 0, 'Loen hääli: ')
+        finally:
+            if not counted:
+                # Lugemise viga, ülejäänud väljundit keegi ei loe
+                try:
+                    proc.kill()
+                except OSError:
+                    pass
+            proc.stdout.close()
+            exit_code = proc.wait()
+
+        if not counted:
+            # Katkenud dekrüpteerija jätab väljundi poolikuks
+            if exit_code > 0:
+                self._log_decrypt_error(input_file, exit_code)
+            evlog.log_error('Häälte lugemine ebaõnnestus')
+            return False
+        if exit_code != 0:
+            self._log_decrypt_error(input_file, exit_code)
+            return False
+        return True
+
+    def _result_paths(self):
+        return (self._reg.path(\
+                    ['hlr', 'output', evcommon.ELECTIONRESULT_FILE]),
+                self._reg.path(\
+                    ['hlr', 'output', evcommon.ELECTIONRESULT_STAT_FILE]))
+
+    def _tally_args(self):
+        out_f = file(self.choices_file, 'w')
+        out_f.write(evcommon.VERSION + '\n' + self._elid + '\n')
+        self.__cnt.outputchoices(out_f)
+        out_f.close()
+
+        result_dist_fn, result_stat_fn = self._result_paths()
+        return ['--tally', self.choices_file,
+            '--result', result_dist_fn,
+            '--result-stat', result_stat_fn,
+            '--log4', self.log4_file,
+            '--log5', self.log5_file]
+
+    def _store_tally(self):
+        # Dekrüpteerija kirjutas tulemused, lisame logikirjed ja
+        # kontrollsummad
+        for tmp, log in [(self.log4_file, 'log4'), (self.log5_file, 'log5')]:
+            in_f = open(tmp, 'r')
+            try:
+                evlog.LogFile(self._reg.path(['common', log])).write(
+                        in_f.read())
+            finally:
+                in_f.close()
+
+        count = 0
+        for name in self._result_paths():
+            ksum.store(name)
+        in_f = open(self._result_paths()[1], 'r')
+        try:
+            for line in in_f.readlines()[2:]:
+                count += int(line.split('\t')[4])
+        finally:
+            in_f.close()
+
+        print "Hääled (%d) on loetud." % count
+        return count
 
     def _add_kehtetu(self, ringkond, district):
         self.__cnt.add_vote(ringkond, district, ringkond[0] + ".kehtetu")
@@ -300,6 +461,37 @@ class HLR:
             evlog.log_exception()
             return False
 
+    def handle_rejected(self, votelst, line_nr, reason):
+        # Nagu dekrüpteerija enda lugemisel: tagasi lükatud hääl on oma
+        # jaoskonnas kehtetu, jaoskonnata häält ei loeta ega logita
+        evlog.log_error("Hääl (rida=%d) lükati tagasi: %s" % \
+                (line_nr, reason))
+        if len(votelst) != 6 or \
+            not formatutil.is_jaoskonna_number_kov_koodiga(\
+                votelst[0], votelst[1]) or \
+            not formatutil.is_ringkonna_number_kov_koodiga(\
+                votelst[2], votelst[3]):
+            evlog.log_error("Häält (rida=%d) ei loetud, jaoskond puudub" % \
+                    line_nr)
+            return True
+
+        dist = (votelst[0], votelst[1])
+        ring = (votelst[2], votelst[3])
+        if not self.__cnt.has_ring(ring) or \
+            not self.__cnt.has_stat(ring, dist):
+            evlog.log_error("Häält (rida=%d) ei loetud, jaoskond puudub" % \
+                    line_nr)
+            return True
+
+        self._add_kehtetu(ring, dist)
+        # Räsi võetakse vigasest häälest endast
+        self._log4.log_info(
+                tyyp=4,
+                haal=votelst[4],
+                ringkond_omavalitsus=votelst[2],
+                ringkond=votelst[3])
+        return True
+
     def _count_votes(self):
         dvl = DecodedVoteList(self, self.__cnt)
         dvl.attach_logger(evlog.AppLog())
@@ -310,16 +502,13 @@ class HLR:
         return True
 
     def _write_result(self):
-        result_dist_fn = self._reg.path(\
-                ['hlr', 'output', evcommon.ELECTIONRESULT_FILE])
+        result_dist_fn, result_stat_fn = self._result_paths()
         out_f = file(result_dist_fn, 'w')
         out_f.write(evcommon.VERSION + '\n' + self._elid + '\n')
         self.__cnt.outputdist(out_f)
         out_f.close()
         ksum.store(result_dist_fn)
 
-        result_stat_fn = self._reg.path(\
-                ['hlr', 'output', evcommon.ELECTIONRESULT_STAT_FILE])
         out_f = file(result_stat_fn, 'w')
         out_f.write(evcommon.VERSION + '\n' + self._elid + '\n')
         self.__cnt.outputstat(out_f)
@@ -327,18 +516,19 @@ class HLR:
         ksum.store(result_stat_fn)
 
         print "Hääled (%d) on loetud." % self.__cnt.count()
+        return self.__cnt.count()
 
-    def _check_logs(self):
+    def _check_logs(self, count):
         log_lines = 0
         log_lines = log_lines + self._log4.lines_in_file()
         log_lines = log_lines + self._log5.lines_in_file()
         # remove header
         log_lines = log_lines - 6
-        if log_lines != self.__cnt.count():
+        if log_lines != count:
             errstr = \
                 "Log4 ja Log5 ridade arv (%d) "\
                     "ei klapi häälte arvuga (%d)" % \
-                        (log_lines, self.__cnt.count())
+                        (log_lines, count)
             evlog.log_error(errstr)
             return False
         return True
@@ -346,12 +536,20 @@ class HLR:
     def run(self, pin):
         try:
             self.__cnt.load(self._reg)
+            if self.stream_decrypt and not self.native_tally:
+                if not self._decrypt_and_count(pin):
+                    return False
+                count = self._write_result()
+                return self._check_logs(count)
             if not self._decrypt_votes(pin):
                 return False
-            if not self._count_votes():
-                return False
-            self._write_result()
-            if not self._check_logs():
+            if self.native_tally:
+                count = self._store_tally()
+            else:
+                if not self._count_votes():
+                    return False
+                count = self._write_result()
+            if not self._check_logs(count):
                 return False
             return True
         except:
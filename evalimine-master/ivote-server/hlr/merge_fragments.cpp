@@ -0,0 +1,285 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "fragment.h"
+#include "vote_file.h"
+
+/*
+ * Puts the fragments of threaded_decrypt --shard i/N together into the
+ * file a single run over the whole votes file would have written. The
+ * fragments must cover the votes file without gaps or overlaps and
+ * every fragment must match the digest in its header. With the votes
+ * file the ranges and input digests are checked against it as well.
+ * */
+
+enum ExitCodes {
+	EXIT_OK = 0,
+	EXIT_INVALID_ARGUMENT_COUNT,
+	EXIT_CANNOT_OPEN_FRAGMENT,
+	EXIT_INVALID_FRAGMENT,
+	EXIT_FRAGMENTS_DO_NOT_MATCH,
+	EXIT_ERROR_READING_INPUT,
+	EXIT_ERROR_WRITING_OUTPUT
+};
+
+// Bytes copied at once
+#define COPY_CHUNK (1024 * 1024)
+
+struct Part
+{
+	std::string path;
+	FILE *f;
+	Fragment fragment;
+	std::string version;
+	std::string elid;
+};
+
+static bool shardLess(const Part *a, const Part *b)
+{
+	return a->fragment.shard < b->fragment.shard;
+}
+
+static std::string tmpPath;
+
+static void fail(int code, const char *fmt, const char *arg)
+{
+	fprintf(stderr, fmt, arg);
+	fputc('\n', stderr);
+	if (!tmpPath.empty()) {
+		unlink(tmpPath.c_str());
+	}
+	exit(code);
+}
+
+static bool readLine(FILE *f, std::string& line)
+{
+	char *buf = NULL;
+	size_t cap = 0;
+	ssize_t n = getline(&buf, &cap, f);
+	if (n > 0) {
+		line.assign(buf, n);
+	}
+	free(buf);
+	return n > 0 && line[n - 1] == '\n';
+}
+
+static void openPart(Part& part)
+{
+	std::string header;
+
+	part.f = fopen(part.path.c_str(), "r");
+	if (part.f == NULL) {
+		fail(EXIT_CANNOT_OPEN_FRAGMENT, "Cannot open fragment %s", part.path.c_str());
+	}
+	if (!readLine(part.f, header) || !part.fragment.parse(header) ||
+			!readLine(part.f, part.version) || !readLine(part.f, part.elid)) {
+		fail(EXIT_INVALID_FRAGMENT, "Invalid fragment %s", part.path.c_str());
+	}
+}
+
+/*
+ * The same split threaded_decrypt made, from the votes file itself.
+ * */
+static void checkVotes(const char *path, const std::vector<Part *>& parts)
+{
+	VoteFile vf;
+	const char *line;
+	size_t len;
+
+	if (!vf.open(path) || !vf.map()) {
+		fail(EXIT_ERROR_READING_INPUT, "Cannot read votes file %s", path);
+	}
+	if (!vf.next(line, len) || !vf.next(line, len)) {
+		fail(EXIT_ERROR_READING_INPUT, "Invalid votes file %s", path);
+	}
+
+	for (size_t i = 0; i < parts.size(); i++) {
+		const Fragment& got = parts[i]->fragment;
+		Fragment want;
+		want.shard = got.shard;
+		want.shards = got.shards;
+		want.measure(vf.data(), vf.size(), vf.position());
+		if (want.input_size != got.input_size || want.begin != got.begin ||
+				want.end != got.end || want.first_line != got.first_line ||
+				want.last_line != got.last_line ||
+				want.input_digest != got.input_digest) {
+			fail(EXIT_FRAGMENTS_DO_NOT_MATCH,
+					"Fragment %s does not match the votes file",
+					parts[i]->path.c_str());
+		}
+	}
+}
+
+/*
+ * Every shard exactly once, one after another from the first vote line
+ * to the end of the votes file.
+ * */
+static void checkCoverage(const std::vector<Part *>& parts)
+{
+	const Fragment& first = parts[0]->fragment;
+	if ((size_t)first.shards != parts.size()) {
+		fail(EXIT_FRAGMENTS_DO_NOT_MATCH, "Wrong number of fragments for %s",
+				parts[0]->path.c_str());
+	}
+
+	for (size_t i = 0; i < parts.size(); i++) {
+		const Part& part = *parts[i];
+		const Fragment& fr = part.fragment;
+		if (fr.shards != first.shards || fr.shard != (int)i + 1 ||
+				fr.input_size != first.input_size ||
+				part.version != parts[0]->version || part.elid != parts[0]->elid) {
+			fail(EXIT_FRAGMENTS_DO_NOT_MATCH, "Fragment %s does not belong with the others",
+					part.path.c_str());
+		}
+		if (i == 0 ? fr.first_line != 3 :
+				(fr.begin != parts[i - 1]->fragment.end ||
+				 fr.first_line != parts[i - 1]->fragment.last_line + 1)) {
+			fail(EXIT_FRAGMENTS_DO_NOT_MATCH, "Gap or overlap before fragment %s",
+					part.path.c_str());
+		}
+	}
+
+	if (parts.back()->fragment.end != first.input_size) {
+		fail(EXIT_FRAGMENTS_DO_NOT_MATCH, "Fragment %s does not reach the end of the votes file",
+				parts.back()->path.c_str());
+	}
+}
+
+/*
+ * Copies the votes of part into out, checking the output digest and the
+ * line count on the way.
+ * */
+static unsigned long copyVotes(Part& part, FILE *out, std::vector<char>& buf)
+{
+	FragmentDigest md;
+	md.update(part.version.data(), part.version.size());
+	md.update(part.elid.data(), part.elid.size());
+
+	unsigned long lines = 0;
+	char last = '\n';
+	size_t n;
+	while ((n = fread(&buf[0], 1, buf.size(), part.f)) > 0) {
+		md.update(&buf[0], n);
+		for (const char *p = &buf[0]; (p = (const char *)memchr(p, '\n', &buf[0] + n - p)) != NULL; p++) {
+			lines++;
+		}
+		last = buf[n - 1];
+		if (fwrite(&buf[0], 1, n, out) != n) {
+			fail(EXIT_ERROR_WRITING_OUTPUT, "Error writing output: %s", strerror(errno));
+		}
+	}
+	if (ferror(part.f)) {
+		fail(EXIT_ERROR_READING_INPUT, "Error reading fragment %s", part.path.c_str());
+	}
+
+	const Fragment& fr = part.fragment;
+	if (last != '\n' || lines != (unsigned long)(fr.last_line - fr.first_line + 1) ||
+			md.hex() != fr.output_digest) {
+		fail(EXIT_INVALID_FRAGMENT, "Fragment %s is damaged or incomplete",
+				part.path.c_str());
+	}
+	return lines;
+}
+
+void usage(const char *self)
+{
+	printf("Kasutamine:\n");
+	printf("    %s [--votes <input file>] <output file> <fragment>...\n", self);
+	printf("\n    Ühendab threaded_decrypt --shard i/N fragmendid üheks "
+		   "väljundfailiks.\n");
+	printf("\n    --votes F  kontrolli fragmente ka häältefaili F vastu\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"votes", required_argument, NULL, 'v'},
+		{NULL, 0, NULL, 0}
+	};
+
+	const char *votes = NULL;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "v:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'v':
+				votes = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_INVALID_ARGUMENT_COUNT;
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return EXIT_INVALID_ARGUMENT_COUNT;
+	}
+	const char *output = argv[optind];
+
+	std::vector<Part> storage(argc - optind - 1);
+	std::vector<Part *> parts;
+	for (size_t i = 0; i < storage.size(); i++) {
+		storage[i].path = argv[optind + 1 + i];
+		storage[i].f = NULL;
+		openPart(storage[i]);
+		parts.push_back(&storage[i]);
+	}
+	std::sort(parts.begin(), parts.end(), shardLess);
+
+	checkCoverage(parts);
+	if (votes != NULL) {
+		checkVotes(votes, parts);
+	}
+
+	// Written aside and renamed, the output appears only when complete
+	tmpPath = std::string(output) + ".tmp";
+	FILE *out = fopen(tmpPath.c_str(), "w");
+	if (out == NULL) {
+		tmpPath.clear();
+		fail(EXIT_ERROR_WRITING_OUTPUT, "Cannot open %s for writing", output);
+	}
+
+	if (fputs(parts[0]->version.c_str(), out) == EOF ||
+			fputs(parts[0]->elid.c_str(), out) == EOF) {
+		fail(EXIT_ERROR_WRITING_OUTPUT, "Error writing output: %s", strerror(errno));
+	}
+
+	std::vector<char> buf(COPY_CHUNK);
+	unsigned long total = 0;
+	for (size_t i = 0; i < parts.size(); i++) {
+		total += copyVotes(*parts[i], out, buf);
+		fclose(parts[i]->f);
+		parts[i]->f = NULL;
+	}
+
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0) {
+		fail(EXIT_ERROR_WRITING_OUTPUT, "Error writing output: %s", strerror(errno));
+	}
+	if (rename(tmpPath.c_str(), output) != 0) {
+		fail(EXIT_ERROR_WRITING_OUTPUT, "Error writing output: %s", strerror(errno));
+	}
+
+	printf("Fragmendid (%lu) on ühendatud, %lu häält.\n",
+			(unsigned long)parts.size(), total);
+	return EXIT_OK;
+}
@@ -0,0 +1,1033 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "pkcs11.h"
+
+/*
+ * PKCS#11 module for running threaded_decrypt without an HSM. The
+ * tokens hold one RSA key pair read from a PEM file and C_Decrypt()
+ * really does RSA-OAEP with it, so the output can be checked like that
+ * of a token. Only the calls p11.cpp makes for decryption are
+ * implemented, the rest of the function list is NULL.
+ *
+ * The module is set up from the environment when C_Initialize() is
+ * called:
+ *
+ *     MOCK_PKCS11_KEY           PEM file of the RSA private key, required
+ *     MOCK_PKCS11_TOKEN         token label, "mock" by default
+ *     MOCK_PKCS11_KEY_LABEL     label of the key objects, "mock" by default
+ *     MOCK_PKCS11_PIN           user PIN, "1234" by default
+ *     MOCK_PKCS11_SLOTS         number of tokens with the same key, 1
+ *     MOCK_PKCS11_SESSIONS      sessions allowed per token, 0 for no limit
+ *     MOCK_PKCS11_LATENCY_US    time a decryption takes on the token
+ *     MOCK_PKCS11_CONCURRENCY   decryptions a token does at once, 0 for
+ *                               no limit, the others wait for their turn
+ *     MOCK_PKCS11_FAILURE_RATE  share of decryptions failing with
+ *                               CKR_DEVICE_ERROR, from 0 to 1
+ *     MOCK_PKCS11_SEED          seed of the failures, 1 by default
+ *     MOCK_PKCS11_FAILOVER_AFTER  number of decryptions after which the
+ *                               tokens fail over once: that decryption
+ *                               fails with CKR_DEVICE_ERROR, all sessions
+ *                               and logins are lost, 0 for never
+ *     MOCK_PKCS11_FAILOVER_MS   time no session can be opened after the
+ *                               failover, 1000 by default
+ *     MOCK_PKCS11_STATS         file the C_Decrypt() statistics are
+ *                               written to by C_Finalize()
+ *
+ * The latency is spent while holding a place of the concurrency limit,
+ * as a token would be busy with the vote. The statistics have the
+ * number of calls and failures, the most decryptions seen at once and
+ * the percentiles of the time spent in C_Decrypt() in microseconds,
+ * waiting for the turn included, and the number of failovers.
+ * */
+
+#define MOCK_PRIVATE_KEY 1
+#define MOCK_PUBLIC_KEY 2
+
+struct MockToken
+{
+	bool logged_in;
+	CK_ULONG sessions;
+	int busy;
+	int peak;
+	pthread_cond_t turn;
+};
+
+struct MockSession
+{
+	CK_SLOT_ID slot;
+	EVP_PKEY_CTX *ctx;
+	std::vector<CK_OBJECT_HANDLE> found;
+	bool finding;
+	bool decrypting;
+	// Dropped by a failover, kept until closed as the owner may use it
+	bool lost;
+	unsigned int seed;
+	unsigned long failures;
+	std::vector<unsigned long> usec;
+};
+
+static pthread_mutex_t mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool mock_initialized = false;
+
+static EVP_PKEY *mock_key = NULL;
+static std::string mock_modulus;
+static std::string mock_exponent;
+static CK_ULONG mock_bits = 0;
+
+static std::string mock_token_label;
+static std::string mock_key_label;
+static std::string mock_pin;
+static CK_ULONG mock_max_sessions = 0;
+static long mock_latency = 0;
+static int mock_concurrency = 0;
+static double mock_failure_rate = 0;
+static unsigned int mock_seed = 1;
+static unsigned long mock_failover_after = 0;
+static long mock_failover_ms = 0;
+static unsigned long mock_decryptions = 0;
+static struct timeval mock_down_until;
+static int mock_failovers = 0;
+static std::string mock_stats;
+
+static std::vector<MockToken> mock_tokens;
+static std::map<CK_SESSION_HANDLE, MockSession *> mock_sessions;
+static CK_SESSION_HANDLE mock_next_session = 1;
+
+// Statistics of the sessions already closed
+static unsigned long mock_failures = 0;
+static std::vector<unsigned long> mock_usec;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *mock_ssl_locks = NULL;
+
+static void mockLockingCallback(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK) {
+		pthread_mutex_lock(&mock_ssl_locks[n]);
+	}
+	else {
+		pthread_mutex_unlock(&mock_ssl_locks[n]);
+	}
+}
+
+static unsigned long mockThreadIdCallback()
+{
+	return (unsigned long)pthread_self();
+}
+#endif
+
+static std::string getEnv(const char *name, const char *def)
+{
+	const char *v = getenv(name);
+	return v != NULL && *v != '\0' ? v : def;
+}
+
+static std::string bnBytes(const BIGNUM *bn)
+{
+	std::string out(BN_num_bytes(bn), '\0');
+	BN_bn2bin(bn, (unsigned char *)&out[0]);
+	return out;
+}
+
+static bool loadKey(const std::string& path)
+{
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == NULL) {
+		fprintf(stderr, "mock_pkcs11: cannot open %s: %s\n", path.c_str(),
+				strerror(errno));
+		return false;
+	}
+	mock_key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+
+	RSA *rsa = mock_key != NULL ? EVP_PKEY_get1_RSA(mock_key) : NULL;
+	if (rsa == NULL) {
+		fprintf(stderr, "mock_pkcs11: %s is not an RSA private key\n",
+				path.c_str());
+		ERR_clear_error();
+		EVP_PKEY_free(mock_key);
+		mock_key = NULL;
+		return false;
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	mock_modulus = bnBytes(rsa->n);
+	mock_exponent = bnBytes(rsa->e);
+#else
+	const BIGNUM *n = NULL;
+	const BIGNUM *e = NULL;
+	RSA_get0_key(rsa, &n, &e, NULL);
+	mock_modulus = bnBytes(n);
+	mock_exponent = bnBytes(e);
+#endif
+	mock_bits = EVP_PKEY_bits(mock_key);
+	RSA_free(rsa);
+	return true;
+}
+
+static void padded(CK_UTF8CHAR *out, size_t size, const std::string& s)
+{
+	memset(out, ' ', size);
+	memcpy(out, s.data(), std::min(size, s.size()));
+}
+
+static unsigned long elapsedUsec(const struct timeval& start)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000000L +
+		(now.tv_usec - start.tv_usec);
+}
+
+static void sleepUsec(long usec)
+{
+	struct timespec ts;
+	ts.tv_sec = usec / 1000000L;
+	ts.tv_nsec = (usec % 1000000L) * 1000L;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+	}
+}
+
+/*
+ * Takes the session from the table. The session itself is then used
+ * without the lock, PKCS#11 leaves a session to one thread at a time.
+ * */
+static MockSession *findSession(CK_SESSION_HANDLE h)
+{
+	MockSession *s = NULL;
+	pthread_mutex_lock(&mock_mutex);
+	std::map<CK_SESSION_HANDLE, MockSession *>::iterator it =
+		mock_sessions.find(h);
+	if (mock_initialized && it != mock_sessions.end() && !it->second->lost) {
+		s = it->second;
+	}
+	pthread_mutex_unlock(&mock_mutex);
+	return s;
+}
+
+// Called with mock_mutex held
+static void closeSession(std::map<CK_SESSION_HANDLE, MockSession *>::iterator it)
+{
+	MockSession *s = it->second;
+	if (!s->lost) {
+		mock_tokens[s->slot].sessions--;
+	}
+	mock_failures += s->failures;
+	mock_usec.insert(mock_usec.end(), s->usec.begin(), s->usec.end());
+	EVP_PKEY_CTX_free(s->ctx);
+	delete s;
+	mock_sessions.erase(it);
+}
+
+/*
+ * Every session becomes invalid and every token logged out, as when a
+ * cluster switches to another node. Called with mock_mutex held.
+ * */
+static void failOver()
+{
+	std::map<CK_SESSION_HANDLE, MockSession *>::iterator it;
+	for (it = mock_sessions.begin(); it != mock_sessions.end(); it++) {
+		if (!it->second->lost) {
+			it->second->lost = true;
+			mock_tokens[it->second->slot].sessions--;
+		}
+	}
+	for (size_t i = 0; i < mock_tokens.size(); i++) {
+		mock_tokens[i].logged_in = false;
+	}
+
+	gettimeofday(&mock_down_until, NULL);
+	mock_down_until.tv_sec += mock_failover_ms / 1000;
+	mock_down_until.tv_usec += (mock_failover_ms % 1000) * 1000;
+	if (mock_down_until.tv_usec >= 1000000) {
+		mock_down_until.tv_sec++;
+		mock_down_until.tv_usec -= 1000000;
+	}
+	mock_failovers++;
+}
+
+// Called with mock_mutex held
+static bool down()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return mock_failovers > 0 && timercmp(&now, &mock_down_until, <);
+}
+
+static unsigned long percentile(const std::vector<unsigned long>& v, int p)
+{
+	if (v.empty()) {
+		return 0;
+	}
+	size_t k = (v.size() * p + 99) / 100;
+	return v[k > 0 ? k - 1 : 0];
+}
+
+static void writeStats()
+{
+	FILE *f = fopen(mock_stats.c_str(), "w");
+	if (f == NULL) {
+		fprintf(stderr, "mock_pkcs11: cannot open %s: %s\n",
+				mock_stats.c_str(), strerror(errno));
+		return;
+	}
+
+	int peak = 0;
+	for (size_t i = 0; i < mock_tokens.size(); i++) {
+		peak += mock_tokens[i].peak;
+	}
+
+	std::sort(mock_usec.begin(), mock_usec.end());
+	fprintf(f, "calls %lu\nfailures %lu\npeak %d\n"
+			"p50_us %lu\np99_us %lu\nmax_us %lu\nfailovers %d\n",
+			(unsigned long)mock_usec.size(), mock_failures, peak,
+			percentile(mock_usec, 50), percentile(mock_usec, 99),
+			mock_usec.empty() ? 0 : mock_usec.back(), mock_failovers);
+	fclose(f);
+}
+
+/*
+ * Object attributes as bytes, in the form C_GetAttributeValue() gives
+ * them out.
+ * */
+static CK_RV getAttribute(CK_OBJECT_HANDLE obj, CK_ATTRIBUTE_TYPE type,
+		std::string& value)
+{
+	bool priv = obj == MOCK_PRIVATE_KEY;
+	CK_OBJECT_CLASS cls = priv ? CKO_PRIVATE_KEY : CKO_PUBLIC_KEY;
+	CK_KEY_TYPE kt = CKK_RSA;
+	CK_BBOOL t = CK_TRUE;
+	CK_BBOOL f = CK_FALSE;
+
+	switch (type) {
+		case CKA_CLASS:
+			value.assign((const char *)&cls, sizeof(cls));
+			break;
+		case CKA_KEY_TYPE:
+			value.assign((const char *)&kt, sizeof(kt));
+			break;
+		case CKA_TOKEN:
+			value.assign((const char *)&t, sizeof(t));
+			break;
+		case CKA_PRIVATE:
+		case CKA_SENSITIVE:
+		case CKA_DECRYPT:
+			value.assign((const char *)(priv ? &t : &f), sizeof(t));
+			break;
+		case CKA_ENCRYPT:
+			value.assign((const char *)(priv ? &f : &t), sizeof(t));
+			break;
+		case CKA_EXTRACTABLE:
+			value.assign((const char *)&f, sizeof(f));
+			break;
+		case CKA_LABEL:
+			value = mock_key_label;
+			break;
+		case CKA_MODULUS_BITS:
+			value.assign((const char *)&mock_bits, sizeof(mock_bits));
+			break;
+		case CKA_MODULUS:
+			value = mock_modulus;
+			break;
+		case CKA_PUBLIC_EXPONENT:
+			value = mock_exponent;
+			break;
+		case CKA_PRIVATE_EXPONENT:
+		case CKA_PRIME_1:
+		case CKA_PRIME_2:
+		case CKA_EXPONENT_1:
+		case CKA_EXPONENT_2:
+		case CKA_COEFFICIENT:
+			return priv ? CKR_ATTRIBUTE_SENSITIVE : CKR_ATTRIBUTE_TYPE_INVALID;
+		default:
+			return CKR_ATTRIBUTE_TYPE_INVALID;
+	}
+	return CKR_OK;
+}
+
+static bool visible(CK_SLOT_ID slot, CK_OBJECT_HANDLE obj)
+{
+	if (obj == MOCK_PUBLIC_KEY) {
+		return true;
+	}
+	pthread_mutex_lock(&mock_mutex);
+	bool ok = obj == MOCK_PRIVATE_KEY && mock_tokens[slot].logged_in;
+	pthread_mutex_unlock(&mock_mutex);
+	return ok;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(CK_VOID_PTR pInitArgs)
+{
+	pthread_mutex_lock(&mock_mutex);
+	if (mock_initialized) {
+		pthread_mutex_unlock(&mock_mutex);
+		return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	// Unless the application has set up the locks already
+	if (CRYPTO_get_locking_callback() == NULL) {
+		mock_ssl_locks = new pthread_mutex_t[CRYPTO_num_locks()];
+		for (int i = 0; i < CRYPTO_num_locks(); i++) {
+			pthread_mutex_init(&mock_ssl_locks[i], NULL);
+		}
+		CRYPTO_set_id_callback(mockThreadIdCallback);
+		CRYPTO_set_locking_callback(mockLockingCallback);
+	}
+#endif
+
+	std::string key = getEnv("MOCK_PKCS11_KEY", "");
+	if (key.empty()) {
+		fprintf(stderr, "mock_pkcs11: MOCK_PKCS11_KEY is not set\n");
+		pthread_mutex_unlock(&mock_mutex);
+		return CKR_GENERAL_ERROR;
+	}
+	if (!loadKey(key)) {
+		pthread_mutex_unlock(&mock_mutex);
+		return CKR_GENERAL_ERROR;
+	}
+
+	mock_token_label = getEnv("MOCK_PKCS11_TOKEN", "mock");
+	mock_key_label = getEnv("MOCK_PKCS11_KEY_LABEL", "mock");
+	mock_pin = getEnv("MOCK_PKCS11_PIN", "1234");
+	mock_max_sessions = strtoul(getEnv("MOCK_PKCS11_SESSIONS", "0").c_str(), NULL, 10);
+	mock_latency = atol(getEnv("MOCK_PKCS11_LATENCY_US", "0").c_str());
+	mock_concurrency = atoi(getEnv("MOCK_PKCS11_CONCURRENCY", "0").c_str());
+	mock_failure_rate = atof(getEnv("MOCK_PKCS11_FAILURE_RATE", "0").c_str());
+	mock_seed = strtoul(getEnv("MOCK_PKCS11_SEED", "1").c_str(), NULL, 10);
+	mock_stats = getEnv("MOCK_PKCS11_STATS", "");
+	mock_failover_after = strtoul(getEnv("MOCK_PKCS11_FAILOVER_AFTER", "0").c_str(), NULL, 10);
+	mock_failover_ms = atol(getEnv("MOCK_PKCS11_FAILOVER_MS", "1000").c_str());
+
+	int slots = atoi(getEnv("MOCK_PKCS11_SLOTS", "1").c_str());
+	if (slots < 1) {
+		slots = 1;
+	}
+	mock_tokens.resize(slots);
+	for (int i = 0; i < slots; i++) {
+		mock_tokens[i].logged_in = false;
+		mock_tokens[i].sessions = 0;
+		mock_tokens[i].busy = 0;
+		mock_tokens[i].peak = 0;
+		pthread_cond_init(&mock_tokens[i].turn, NULL);
+	}
+
+	mock_failures = 0;
+	mock_usec.clear();
+	mock_decryptions = 0;
+	mock_failovers = 0;
+	mock_initialized = true;
+	pthread_mutex_unlock(&mock_mutex);
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Finalize)(CK_VOID_PTR pReserved)
+{
+	pthread_mutex_lock(&mock_mutex);
+	if (!mock_initialized) {
+		pthread_mutex_unlock(&mock_mutex);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+
+	while (!mock_sessions.empty()) {
+		closeSession(mock_sessions.begin());
+	}
+	if (!mock_stats.empty()) {
+		writeStats();
+	}
+
+	for (size_t i = 0; i < mock_tokens.size(); i++) {
+		pthread_cond_destroy(&mock_tokens[i].turn);
+	}
+	mock_tokens.clear();
+	mock_usec.clear();
+	EVP_PKEY_free(mock_key);
+	mock_key = NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if (mock_ssl_locks != NULL) {
+		CRYPTO_set_locking_callback(NULL);
+		CRYPTO_set_id_callback(NULL);
+		for (int i = 0; i < CRYPTO_num_locks(); i++) {
+			pthread_mutex_destroy(&mock_ssl_locks[i]);
+		}
+		delete[] mock_ssl_locks;
+		mock_ssl_locks = NULL;
+	}
+#endif
+
+	mock_initialized = false;
+	pthread_mutex_unlock(&mock_mutex);
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetInfo)(CK_INFO_PTR pInfo)
+{
+	if (!mock_initialized) {
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	memset(pInfo, 0, sizeof(*pInfo));
+	pInfo->cryptokiVersion.major = 2;
+	pInfo->cryptokiVersion.minor = 20;
+	padded(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "hlr");
+	padded(pInfo->libraryDescription, sizeof(pInfo->libraryDescription),
+			"mock_pkcs11");
+	pInfo->libraryVersion.major = 1;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(CK_BBOOL tokenPresent,
+		CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount)
+{
+	if (!mock_initialized) {
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	CK_ULONG count = mock_tokens.size();
+	if (pSlotList == NULL_PTR) {
+		*pulCount = count;
+		return CKR_OK;
+	}
+	if (*pulCount < count) {
+		*pulCount = count;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	for (CK_ULONG i = 0; i < count; i++) {
+		pSlotList[i] = i;
+	}
+	*pulCount = count;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetSlotInfo)(CK_SLOT_ID slotID,
+		CK_SLOT_INFO_PTR pInfo)
+{
+	if (!mock_initialized) {
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	if (slotID >= mock_tokens.size()) {
+		return CKR_SLOT_ID_INVALID;
+	}
+	memset(pInfo, 0, sizeof(*pInfo));
+	padded(pInfo->slotDescription, sizeof(pInfo->slotDescription),
+			"mock_pkcs11 slot");
+	padded(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "hlr");
+	pInfo->flags = CKF_TOKEN_PRESENT;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetTokenInfo)(CK_SLOT_ID slotID,
+		CK_TOKEN_INFO_PTR pInfo)
+{
+	if (!mock_initialized) {
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	if (slotID >= mock_tokens.size()) {
+		return CKR_SLOT_ID_INVALID;
+	}
+
+	char serial[32];
+	snprintf(serial, sizeof(serial), "%lu", slotID);
+
+	memset(pInfo, 0, sizeof(*pInfo));
+	padded(pInfo->label, sizeof(pInfo->label), mock_token_label);
+	padded(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "hlr");
+	padded(pInfo->model, sizeof(pInfo->model), "mock_pkcs11");
+	padded(pInfo->serialNumber, sizeof(pInfo->serialNumber), serial);
+	padded(pInfo->utcTime, sizeof(pInfo->utcTime), "");
+	pInfo->flags = CKF_TOKEN_INITIALIZED | CKF_USER_PIN_INITIALIZED |
+		CKF_LOGIN_REQUIRED;
+
+	pthread_mutex_lock(&mock_mutex);
+	CK_ULONG sessions = mock_tokens[slotID].sessions;
+	pthread_mutex_unlock(&mock_mutex);
+
+	CK_ULONG max = mock_max_sessions > 0 ? mock_max_sessions :
+		CK_EFFECTIVELY_INFINITE;
+	pInfo->ulMaxSessionCount = max;
+	pInfo->ulSessionCount = sessions;
+	pInfo->ulMaxRwSessionCount = max;
+	pInfo->ulRwSessionCount = sessions;
+	pInfo->ulMaxPinLen = 255;
+	pInfo->ulMinPinLen = 1;
+	pInfo->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+	pInfo->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+	pInfo->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	pInfo->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismList)(CK_SLOT_ID slotID,
+		CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount)
+{
+	if (!mock_initialized) {
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	if (slotID >= mock_tokens.size()) {
+		return CKR_SLOT_ID_INVALID;
+	}
+	if (pMechanismList != NULL_PTR) {
+		if (*pulCount < 1) {
+			*pulCount = 1;
+			return CKR_BUFFER_TOO_SMALL;
+		}
+		pMechanismList[0] = CKM_RSA_PKCS_OAEP;
+	}
+	*pulCount = 1;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_OpenSession)(CK_SLOT_ID slotID, CK_FLAGS flags,
+		CK_VOID_PTR pApplication, CK_NOTIFY Notify,
+		CK_SESSION_HANDLE_PTR phSession)
+{
+	if (!mock_initialized) {
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	if (slotID >= mock_tokens.size()) {
+		return CKR_SLOT_ID_INVALID;
+	}
+	if (!(flags & CKF_SERIAL_SESSION)) {
+		return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+	}
+
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(mock_key, NULL);
+	if (ctx == NULL || EVP_PKEY_decrypt_init(ctx) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0) {
+		ERR_clear_error();
+		EVP_PKEY_CTX_free(ctx);
+		return CKR_HOST_MEMORY;
+	}
+
+	pthread_mutex_lock(&mock_mutex);
+	MockToken& token = mock_tokens[slotID];
+	if (down()) {
+		pthread_mutex_unlock(&mock_mutex);
+		EVP_PKEY_CTX_free(ctx);
+		return CKR_DEVICE_ERROR;
+	}
+	if (mock_max_sessions > 0 && token.sessions >= mock_max_sessions) {
+		pthread_mutex_unlock(&mock_mutex);
+		EVP_PKEY_CTX_free(ctx);
+		return CKR_SESSION_COUNT;
+	}
+
+	MockSession *s = new MockSession;
+	s->slot = slotID;
+	s->ctx = ctx;
+	s->finding = false;
+	s->decrypting = false;
+	s->lost = false;
+	s->seed = mock_seed + (unsigned int)mock_next_session;
+	s->failures = 0;
+
+	token.sessions++;
+	*phSession = mock_next_session++;
+	mock_sessions[*phSession] = s;
+	pthread_mutex_unlock(&mock_mutex);
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_CloseSession)(CK_SESSION_HANDLE hSession)
+{
+	pthread_mutex_lock(&mock_mutex);
+	std::map<CK_SESSION_HANDLE, MockSession *>::iterator it =
+		mock_sessions.find(hSession);
+	if (!mock_initialized || it == mock_sessions.end()) {
+		pthread_mutex_unlock(&mock_mutex);
+		return mock_initialized ? CKR_SESSION_HANDLE_INVALID :
+			CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	CK_SLOT_ID slot = it->second->slot;
+	bool lost = it->second->lost;
+	closeSession(it);
+	if (lost) {
+		pthread_mutex_unlock(&mock_mutex);
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+
+	// The login ends with the last session of the token
+	if (mock_tokens[slot].sessions == 0) {
+		mock_tokens[slot].logged_in = false;
+	}
+	pthread_mutex_unlock(&mock_mutex);
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_CloseAllSessions)(CK_SLOT_ID slotID)
+{
+	pthread_mutex_lock(&mock_mutex);
+	if (!mock_initialized || slotID >= mock_tokens.size()) {
+		pthread_mutex_unlock(&mock_mutex);
+		return mock_initialized ? CKR_SLOT_ID_INVALID :
+			CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	std::map<CK_SESSION_HANDLE, MockSession *>::iterator it =
+		mock_sessions.begin();
+	while (it != mock_sessions.end()) {
+		std::map<CK_SESSION_HANDLE, MockSession *>::iterator cur = it++;
+		if (cur->second->slot == slotID) {
+			closeSession(cur);
+		}
+	}
+	mock_tokens[slotID].logged_in = false;
+	pthread_mutex_unlock(&mock_mutex);
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Login)(CK_SESSION_HANDLE hSession,
+		CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (userType != CKU_USER) {
+		return CKR_USER_TYPE_INVALID;
+	}
+	if (std::string((const char *)pPin, ulPinLen) != mock_pin) {
+		return CKR_PIN_INCORRECT;
+	}
+
+	CK_RV rc = CKR_OK;
+	pthread_mutex_lock(&mock_mutex);
+	if (mock_tokens[s->slot].logged_in) {
+		rc = CKR_USER_ALREADY_LOGGED_IN;
+	}
+	mock_tokens[s->slot].logged_in = true;
+	pthread_mutex_unlock(&mock_mutex);
+	return rc;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetSessionInfo)(CK_SESSION_HANDLE hSession,
+		CK_SESSION_INFO_PTR pInfo)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+
+	pthread_mutex_lock(&mock_mutex);
+	bool logged_in = mock_tokens[s->slot].logged_in;
+	pthread_mutex_unlock(&mock_mutex);
+
+	pInfo->slotID = s->slot;
+	pInfo->state = logged_in ? CKS_RW_USER_FUNCTIONS : CKS_RW_PUBLIC_SESSION;
+	pInfo->flags = CKF_SERIAL_SESSION | CKF_RW_SESSION;
+	pInfo->ulDeviceError = 0;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Logout)(CK_SESSION_HANDLE hSession)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+
+	CK_RV rc = CKR_OK;
+	pthread_mutex_lock(&mock_mutex);
+	if (!mock_tokens[s->slot].logged_in) {
+		rc = CKR_USER_NOT_LOGGED_IN;
+	}
+	mock_tokens[s->slot].logged_in = false;
+	pthread_mutex_unlock(&mock_mutex);
+	return rc;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetAttributeValue)(CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (!visible(s->slot, hObject)) {
+		return CKR_OBJECT_HANDLE_INVALID;
+	}
+
+	// All attributes are filled in, the last error is returned
+	CK_RV ret = CKR_OK;
+	for (CK_ULONG i = 0; i < ulCount; i++) {
+		CK_ATTRIBUTE& a = pTemplate[i];
+		std::string value;
+		CK_RV rc = getAttribute(hObject, a.type, value);
+		if (rc == CKR_OK && a.pValue != NULL_PTR && a.ulValueLen < value.size()) {
+			rc = CKR_BUFFER_TOO_SMALL;
+		}
+		if (rc != CKR_OK) {
+			a.ulValueLen = (CK_ULONG)-1;
+			ret = rc;
+			continue;
+		}
+		if (a.pValue != NULL_PTR) {
+			memcpy(a.pValue, value.data(), value.size());
+		}
+		a.ulValueLen = value.size();
+	}
+	return ret;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsInit)(CK_SESSION_HANDLE hSession,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (s->finding) {
+		return CKR_OPERATION_ACTIVE;
+	}
+
+	CK_OBJECT_HANDLE objects[] = { MOCK_PRIVATE_KEY, MOCK_PUBLIC_KEY };
+	s->found.clear();
+	for (size_t k = 0; k < sizeof(objects) / sizeof(objects[0]); k++) {
+		if (!visible(s->slot, objects[k])) {
+			continue;
+		}
+		bool match = true;
+		for (CK_ULONG i = 0; match && i < ulCount; i++) {
+			std::string value;
+			match = getAttribute(objects[k], pTemplate[i].type, value) == CKR_OK &&
+				value.size() == pTemplate[i].ulValueLen &&
+				memcmp(value.data(), pTemplate[i].pValue, value.size()) == 0;
+		}
+		if (match) {
+			s->found.push_back(objects[k]);
+		}
+	}
+	s->finding = true;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_FindObjects)(CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount,
+		CK_ULONG_PTR pulObjectCount)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (!s->finding) {
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+
+	CK_ULONG n = 0;
+	while (n < ulMaxObjectCount && !s->found.empty()) {
+		phObject[n++] = s->found.front();
+		s->found.erase(s->found.begin());
+	}
+	*pulObjectCount = n;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsFinal)(CK_SESSION_HANDLE hSession)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (!s->finding) {
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	s->found.clear();
+	s->finding = false;
+	return CKR_OK;
+}
+
+/*
+ * Only the OAEP parameters hlr uses are accepted, SHA-1 with MGF1-SHA1
+ * and no label, so that a change in p11.cpp does not pass unnoticed.
+ * */
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (s->decrypting) {
+		return CKR_OPERATION_ACTIVE;
+	}
+	if (!visible(s->slot, hKey)) {
+		return CKR_KEY_HANDLE_INVALID;
+	}
+	if (hKey != MOCK_PRIVATE_KEY) {
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+	}
+
+	CK_RSA_PKCS_OAEP_PARAMS *params =
+		(CK_RSA_PKCS_OAEP_PARAMS *)pMechanism->pParameter;
+	if (pMechanism->mechanism != CKM_RSA_PKCS_OAEP) {
+		return CKR_MECHANISM_INVALID;
+	}
+	if (params == NULL_PTR ||
+			pMechanism->ulParameterLen != sizeof(CK_RSA_PKCS_OAEP_PARAMS) ||
+			params->hashAlg != CKM_SHA_1 || params->mgf != CKG_MGF1_SHA1 ||
+			params->source != CKZ_DATA_SPECIFIED ||
+			params->ulSourceDataLen != 0) {
+		return CKR_MECHANISM_PARAM_INVALID;
+	}
+
+	s->decrypting = true;
+	return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	MockSession *s = findSession(hSession);
+	if (s == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (!s->decrypting) {
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+
+	// A length query or a short buffer leaves the operation active
+	CK_ULONG len = mock_modulus.size();
+	if (pData == NULL_PTR) {
+		*pulDataLen = len;
+		return CKR_OK;
+	}
+	if (*pulDataLen < len) {
+		*pulDataLen = len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	s->decrypting = false;
+
+	if (mock_failover_after > 0) {
+		pthread_mutex_lock(&mock_mutex);
+		bool failover = ++mock_decryptions == mock_failover_after;
+		if (failover) {
+			failOver();
+		}
+		pthread_mutex_unlock(&mock_mutex);
+		if (failover) {
+			s->failures++;
+			return CKR_DEVICE_ERROR;
+		}
+	}
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	MockToken& token = mock_tokens[s->slot];
+	pthread_mutex_lock(&mock_mutex);
+	while (mock_concurrency > 0 && token.busy >= mock_concurrency) {
+		pthread_cond_wait(&token.turn, &mock_mutex);
+	}
+	token.busy++;
+	if (token.busy > token.peak) {
+		token.peak = token.busy;
+	}
+	pthread_mutex_unlock(&mock_mutex);
+
+	struct timeval service;
+	gettimeofday(&service, NULL);
+
+	CK_RV rc = CKR_OK;
+	if (ulEncryptedDataLen != len) {
+		rc = CKR_ENCRYPTED_DATA_LEN_RANGE;
+	}
+	else {
+		size_t out_len = *pulDataLen;
+		if (EVP_PKEY_decrypt(s->ctx, pData, &out_len,
+					pEncryptedData, ulEncryptedDataLen) > 0) {
+			*pulDataLen = out_len;
+		}
+		else {
+			ERR_clear_error();
+			rc = CKR_ENCRYPTED_DATA_INVALID;
+		}
+	}
+
+	if (mock_latency > 0) {
+		long left = mock_latency - (long)elapsedUsec(service);
+		if (left > 0) {
+			sleepUsec(left);
+		}
+	}
+	if (rc == CKR_OK && mock_failure_rate > 0 &&
+			rand_r(&s->seed) < mock_failure_rate * ((double)RAND_MAX + 1)) {
+		rc = CKR_DEVICE_ERROR;
+	}
+
+	pthread_mutex_lock(&mock_mutex);
+	token.busy--;
+	pthread_cond_signal(&token.turn);
+	pthread_mutex_unlock(&mock_mutex);
+
+	if (rc != CKR_OK) {
+		s->failures++;
+	}
+	s->usec.push_back(elapsedUsec(start));
+	return rc;
+}
+
+static CK_FUNCTION_LIST mock_function_list;
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetFunctionList)(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
+{
+	if (ppFunctionList == NULL_PTR) {
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	CK_FUNCTION_LIST& fl = mock_function_list;
+	memset(&fl, 0, sizeof(fl));
+	fl.version.major = 2;
+	fl.version.minor = 20;
+	fl.C_Initialize = C_Initialize;
+	fl.C_Finalize = C_Finalize;
+	fl.C_GetInfo = C_GetInfo;
+	fl.C_GetFunctionList = C_GetFunctionList;
+	fl.C_GetSlotList = C_GetSlotList;
+	fl.C_GetSlotInfo = C_GetSlotInfo;
+	fl.C_GetTokenInfo = C_GetTokenInfo;
+	fl.C_GetMechanismList = C_GetMechanismList;
+	fl.C_OpenSession = C_OpenSession;
+	fl.C_CloseSession = C_CloseSession;
+	fl.C_CloseAllSessions = C_CloseAllSessions;
+	fl.C_GetSessionInfo = C_GetSessionInfo;
+	fl.C_Login = C_Login;
+	fl.C_Logout = C_Logout;
+	fl.C_GetAttributeValue = C_GetAttributeValue;
+	fl.C_FindObjectsInit = C_FindObjectsInit;
+	fl.C_FindObjects = C_FindObjects;
+	fl.C_FindObjectsFinal = C_FindObjectsFinal;
+	fl.C_DecryptInit = C_DecryptInit;
+	fl.C_Decrypt = C_Decrypt;
+
+	*ppFunctionList = &fl;
+	return CKR_OK;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "openssl_decryptor.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/*
+ * OpenSSL before 1.1 needs locking callbacks from the application to be
+ * used from several threads, RSA blinding takes these locks.
+ * */
+static pthread_mutex_t *ssl_locks = NULL;
+
+static void lockingCallback(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK) {
+		pthread_mutex_lock(&ssl_locks[n]);
+	}
+	else {
+		pthread_mutex_unlock(&ssl_locks[n]);
+	}
+}
+
+static unsigned long threadIdCallback()
+{
+	return (unsigned long)pthread_self();
+}
+#endif
+
+void OpenSSLDecryptor::initThreads()
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if (ssl_locks != NULL) {
+		return;
+	}
+	ssl_locks = new pthread_mutex_t[CRYPTO_num_locks()];
+	for (int i = 0; i < CRYPTO_num_locks(); i++) {
+		pthread_mutex_init(&ssl_locks[i], NULL);
+	}
+	CRYPTO_set_id_callback(threadIdCallback);
+	CRYPTO_set_locking_callback(lockingCallback);
+#endif
+}
+
+void OpenSSLDecryptor::cleanupThreads()
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if (ssl_locks == NULL) {
+		return;
+	}
+	CRYPTO_set_locking_callback(NULL);
+	CRYPTO_set_id_callback(NULL);
+	for (int i = 0; i < CRYPTO_num_locks(); i++) {
+		pthread_mutex_destroy(&ssl_locks[i]);
+	}
+	delete[] ssl_locks;
+	ssl_locks = NULL;
+#endif
+}
+
+static std::string sslError(const std::string& prefix)
+{
+	char buf[256];
+	unsigned long e = ERR_get_error();
+	ERR_clear_error();
+	if (e == 0) {
+		return prefix;
+	}
+	ERR_error_string_n(e, buf, sizeof(buf));
+	return prefix + ": " + buf;
+}
+
+/*
+ * Reads an RSA private key in PEM, as written by
+ * Session::exportRsaPrivKey().
+ * */
+EVP_PKEY* OpenSSLDecryptor::loadKey(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		throw std::runtime_error(std::string("Cannot open key file: ")
+				+ strerror(errno));
+	}
+
+	EVP_PKEY *key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+
+	if (key == NULL) {
+		throw std::runtime_error(sslError("Cannot read private key"));
+	}
+	if (EVP_PKEY_base_id(key) != EVP_PKEY_RSA) {
+		EVP_PKEY_free(key);
+		throw std::runtime_error("Private key is not an RSA key");
+	}
+
+	return key;
+}
+
+OpenSSLDecryptor::OpenSSLDecryptor(EVP_PKEY *key)
+{
+	_len = EVP_PKEY_size(key);
+
+	_ctx = EVP_PKEY_CTX_new(key, NULL);
+	if (_ctx == NULL) {
+		throw std::runtime_error(sslError("EVP_PKEY_CTX_new() failed"));
+	}
+
+	// OAEP with SHA-1 and MGF1-SHA-1, same as the PKCS#11 mechanism
+	if (EVP_PKEY_decrypt_init(_ctx) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_padding(_ctx, RSA_PKCS1_OAEP_PADDING) <= 0) {
+		EVP_PKEY_CTX_free(_ctx);
+		throw std::runtime_error(sslError("Cannot set up RSA-OAEP decryption"));
+	}
+}
+
+OpenSSLDecryptor::~OpenSSLDecryptor()
+{
+	EVP_PKEY_CTX_free(_ctx);
+}
+
+CK_ULONG OpenSSLDecryptor::outputLength()
+{
+	return _len;
+}
+
+CK_ULONG OpenSSLDecryptor::inputLength()
+{
+	return _len;
+}
+
+size_t OpenSSLDecryptor::decryptBatch(std::vector<DecryptItem> &items,
+		size_t count)
+{
+	size_t failed = 0;
+	for (size_t i = 0; i < count; i++) {
+		DecryptItem &item = items[i];
+		size_t out_len = item.out_len;
+		if (EVP_PKEY_decrypt(_ctx, item.out, &out_len,
+				(const unsigned char *)item.data, item.len) > 0) {
+			item.out_len = out_len;
+			item.rc = CKR_OK;
+		}
+		else {
+			ERR_clear_error();
+			item.out_len = 0;
+			item.rc = CKR_ENCRYPTED_DATA_INVALID;
+			failed++;
+		}
+	}
+	return failed;
+}
+
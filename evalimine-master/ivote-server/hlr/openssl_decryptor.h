@@ -0,0 +1,55 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#ifndef OPENSSL_DECRYPTOR_H
+#define OPENSSL_DECRYPTOR_H
+
+#include <openssl/evp.h>
+
+#include "decryptor.h"
+
+/*
+ * Software RSA-OAEP decryption with an exported key, for rehearsals and
+ * re-counts without the HSM. Each worker has its own EVP_PKEY_CTX on the
+ * shared key.
+ * */
+class OpenSSLDecryptor : public Decryptor
+{
+	public:
+
+		OpenSSLDecryptor(EVP_PKEY *key);
+		virtual ~OpenSSLDecryptor();
+
+		virtual CK_ULONG outputLength();
+		virtual CK_ULONG inputLength();
+		virtual size_t decryptBatch(std::vector<DecryptItem> &items,
+				size_t count);
+
+		static EVP_PKEY* loadKey(const char *path);
+
+		static void initThreads();
+		static void cleanupThreads();
+
+	protected:
+
+	private:
+
+		OpenSSLDecryptor(const OpenSSLDecryptor&);
+		OpenSSLDecryptor& operator=(const OpenSSLDecryptor&);
+
+		EVP_PKEY_CTX *_ctx;
+		CK_ULONG _len;
+};
+
+#endif
+
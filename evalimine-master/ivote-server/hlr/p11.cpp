@@ -41,7 +41,7 @@ static struct {
 };
 
 
-void throwCKR(const std::string &prefix, CK_RV rc)
+std::string describeCKR(const std::string &prefix, CK_RV rc)
 {
 	char buf[64];
 	std::string s(prefix);
@@ -58,7 +58,33 @@ void throwCKR(const std::string &prefix, CK_RV rc)
 		}
 	}
 
-	throw std::runtime_error(s);
+	return s;
+}
+
+void throwCKR(const std::string &prefix, CK_RV rc)
+{
+	throw std::runtime_error(describeCKR(prefix, rc));
+}
+
+/*
+ * Errors of the session or the device rather than of the ciphertext,
+ * as seen when an HSM cluster fails over: the same call may succeed in
+ * a new session. CKR_FUNCTION_FAILED is not one of them, some HSMs give
+ * it for a ciphertext that fails the OAEP decoding.
+ * */
+bool isTransientCKR(CK_RV rc)
+{
+	switch (rc) {
+		case CKR_DEVICE_ERROR:
+		case CKR_DEVICE_REMOVED:
+		case CKR_SESSION_CLOSED:
+		case CKR_SESSION_HANDLE_INVALID:
+		case CKR_TOKEN_NOT_PRESENT:
+		case CKR_USER_NOT_LOGGED_IN:
+			return true;
+		default:
+			return false;
+	}
 }
 
 /*
@@ -75,6 +101,7 @@ PKCS11::PKCS11(const std::string &libname)
 	_slots.session = NULL;
 	_flist = NULL_PTR;
 	_dso = NULL;
+	pthread_mutex_init(&_reopen_mutex, NULL);
 
 	_dso = dlopen(libname.c_str(), RTLD_LAZY);
 	if (_dso == 0) {
@@ -117,6 +144,8 @@ PKCS11::~PKCS11()
 	if (_dso) {
 		dlclose(_dso);
 	}
+
+	pthread_mutex_destroy(&_reopen_mutex);
 }
 
 
@@ -144,6 +173,20 @@ void PKCS11::init(bool threads)
 
 void PKCS11::logout()
 {
+	// The first device shares its session with _slots
+	for (size_t i = 1; i < _devices.size(); i++) {
+		if (_logged_in) {
+			_devices[i].session->logout();
+		}
+		delete _devices[i].session;
+
+		CK_RV rc = _flist->C_CloseAllSessions(_devices[i].slot);
+		if (rc != CKR_OK) {
+			throwCKR("C_CloseAllSessions() failed", rc);
+		}
+	}
+	_devices.clear();
+
 	if (_slots.session != NULL) {
 		if (_logged_in) {
 			_logged_in = false;
@@ -158,12 +201,14 @@ void PKCS11::logout()
 			throwCKR("C_CloseAllSessions() failed", rc);
 		}
 	}
+	_logged_in = false;
+	_pin.clear();
 }
 
-Session* PKCS11::getSession()
+Session* PKCS11::openSession(CK_SLOT_ID slot)
 {
 	CK_SESSION_HANDLE h;
-	CK_RV rc = _flist->C_OpenSession(_slots.current,
+	CK_RV rc = _flist->C_OpenSession(slot,
 		CKF_SERIAL_SESSION | CKF_RW_SESSION,
 		NULL_PTR, NULL_PTR, &h);
 
@@ -174,42 +219,231 @@ Session* PKCS11::getSession()
 	return new Session(h, _flist);
 }
 
-void PKCS11::login(const std::string &token, const std::string &pin)
+Session* PKCS11::getSession()
+{
+	return openSession(_slots.current);
+}
+
+Session* PKCS11::getSession(size_t device)
+{
+	return openSession(_devices.at(device).slot);
+}
+
+size_t PKCS11::deviceCount() const
+{
+	return _devices.size();
+}
+
+const std::string& PKCS11::deviceName(size_t device) const
+{
+	return _devices.at(device).name;
+}
+
+static bool isFiniteCount(CK_ULONG c)
+{
+	return c != CK_EFFECTIVELY_INFINITE && c != CK_UNAVAILABLE_INFORMATION;
+}
+
+bool PKCS11::getFreeSessionCount(CK_ULONG &count)
+{
+	if (_devices.empty()) {
+		return false;
+	}
+	return getFreeSessionCount(0, count);
+}
+
+/*
+ * How many more sessions the token of a device allows. Returns false
+ * when the token does not report a limit.
+ * */
+bool PKCS11::getFreeSessionCount(size_t device, CK_ULONG &count)
 {
-	CK_RV rc;
 	CK_TOKEN_INFO tinfo;
-	CK_SLOT_ID slot;
-	bool slot_found = false;
-	char label[32];
+	CK_RV rc = _flist->C_GetTokenInfo(_devices.at(device).slot, &tinfo);
+	if (rc != CKR_OK) {
+		throwCKR("C_GetTokenInfo() failed", rc);
+	}
 
-	// Do nothing if no token name.
-	if (token.size() < 1) {
-		return;
+	bool limited = false;
+	count = 0;
+
+	if (isFiniteCount(tinfo.ulMaxRwSessionCount) &&
+			isFiniteCount(tinfo.ulRwSessionCount)) {
+		count = tinfo.ulMaxRwSessionCount > tinfo.ulRwSessionCount ?
+			tinfo.ulMaxRwSessionCount - tinfo.ulRwSessionCount : 0;
+		limited = true;
 	}
 
-	getSlots(CK_TRUE);
+	if (isFiniteCount(tinfo.ulMaxSessionCount) &&
+			isFiniteCount(tinfo.ulSessionCount)) {
+		CK_ULONG c = tinfo.ulMaxSessionCount > tinfo.ulSessionCount ?
+			tinfo.ulMaxSessionCount - tinfo.ulSessionCount : 0;
+		if (!limited || c < count) {
+			count = c;
+		}
+		limited = true;
+	}
+
+	return limited;
+}
+
+/*
+ * Replaces a session of a device that failed with a transient error.
+ * The broken session is closed first, so that a token with a session
+ * limit has room for the new one. When the token has lost the login as
+ * well, as it does when a cluster fails over, the device is logged in
+ * again in a session of its own. Throws when the token cannot be
+ * reached yet; session then still points to the closed session and the
+ * caller may try again later. The keys have to be looked up again in
+ * the new session.
+ * */
+void PKCS11::reopenSession(size_t device, Session *&session)
+{
+	Device &dev = _devices.at(device);
+
+	// One worker at a time, so that a lost login is fixed only once
+	pthread_mutex_lock(&_reopen_mutex);
+	try {
+		// Not closed twice when the last try failed after this, by then
+		// the module may have given the handle to another worker
+		if (session->_session != CK_INVALID_HANDLE) {
+			_flist->C_CloseSession(session->_session);
+			session->_session = CK_INVALID_HANDLE;
+		}
+
+		if (!hasLogin(dev.session)) {
+			relogin(dev);
+		}
+
+		Session *fresh = openSession(dev.slot);
+		delete session;
+		session = fresh;
+	}
+	catch (...) {
+		pthread_mutex_unlock(&_reopen_mutex);
+		throw;
+	}
+	pthread_mutex_unlock(&_reopen_mutex);
+}
+
+bool PKCS11::hasLogin(Session *session)
+{
+	CK_SESSION_INFO info;
+	CK_RV rc = _flist->C_GetSessionInfo(session->_session, &info);
+	return rc == CKR_OK && (info.state == CKS_RO_USER_FUNCTIONS ||
+			info.state == CKS_RW_USER_FUNCTIONS);
+}
+
+/*
+ * Logs the device in again in a new session, which takes the place of
+ * the session holding the lost login.
+ * */
+void PKCS11::relogin(Device &dev)
+{
+	Session *login = openSession(dev.slot);
+
+	CK_RV rc = _flist->C_Login(login->_session, CKU_USER,
+			(CK_CHAR_PTR)_pin.c_str(), _pin.length());
+	if (rc != CKR_OK && rc != CKR_USER_ALREADY_LOGGED_IN) {
+		_flist->C_CloseSession(login->_session);
+		delete login;
+		throwCKR("C_Login() failed", rc);
+	}
+
+	_flist->C_CloseSession(dev.session->_session);
+	if (_slots.session == dev.session) {
+		_slots.session = login;
+	}
+	delete dev.session;
+	dev.session = login;
+}
+
+/*
+ * Finds the slot of a token given by its label, or by "slot:N" for the
+ * slot with ID N.
+ * */
+CK_SLOT_ID PKCS11::findSlot(const std::string &token)
+{
+	CK_TOKEN_INFO tinfo;
+	char label[32];
+
+	if (token.compare(0, 5, "slot:") == 0) {
+		char *end = NULL;
+		unsigned long id = strtoul(token.c_str() + 5, &end, 10);
+		if (token.size() > 5 && *end == '\0') {
+			for (CK_ULONG i = 0; i < _slots.count; ++i) {
+				if (_slots.list[i] == id) {
+					return id;
+				}
+			}
+		}
+		throw std::runtime_error("Requested slot cannot be found: " + token);
+	}
 
 	memset(label, ' ', 32);
 	strncpy(label, (token + std::string(label, 32)).c_str(), 32);
 	for (CK_ULONG i = 0; i < _slots.count; ++i) {
-		rc = _flist->C_GetTokenInfo(_slots.list[i], &tinfo);
+		CK_RV rc = _flist->C_GetTokenInfo(_slots.list[i], &tinfo);
 		if (rc != CKR_OK) {
 			throwCKR("C_GetTokenInfo() failed", rc);
 		}
 		if (memcmp(label, tinfo.label, 32) == 0) {
-			slot = _slots.list[i];
-			slot_found = true;
-			break;
+			return _slots.list[i];
 		}
 	}
-	if (!slot_found) {
-		throw std::runtime_error("Requested token cannot be found");
+	throw std::runtime_error("Requested token cannot be found");
+}
+
+/*
+ * Logs in to one or more tokens. Several tokens holding the same key are
+ * given as a comma separated list, each either a token label or
+ * "slot:N". The first one is also the current slot for getSession().
+ * */
+void PKCS11::login(const std::string &token, const std::string &pin)
+{
+	// Do nothing if no token name.
+	if (token.size() < 1) {
+		return;
 	}
 
-	_slots.current = slot;
-	_slots.session = getSession();
-	_slots.session->login(pin);
-	_logged_in = true;
+	getSlots(CK_TRUE);
+
+	std::string::size_type start = 0;
+	while (start <= token.size()) {
+		std::string::size_type end = token.find(',', start);
+		if (end == std::string::npos) {
+			end = token.size();
+		}
+		std::string name = token.substr(start, end - start);
+		start = end + 1;
+
+		CK_SLOT_ID slot = findSlot(name);
+		for (size_t i = 0; i < _devices.size(); i++) {
+			if (_devices[i].slot == slot) {
+				throw std::runtime_error("Token given more than once: " + name);
+			}
+		}
+
+		Device dev;
+		dev.name = name;
+		dev.slot = slot;
+		dev.session = openSession(slot);
+		try {
+			dev.session->login(pin);
+		}
+		catch (...) {
+			delete dev.session;
+			throw;
+		}
+
+		_devices.push_back(dev);
+		if (_devices.size() == 1) {
+			_slots.current = slot;
+			_slots.session = dev.session;
+		}
+		_logged_in = true;
+	}
+	_pin = pin;
 }
 
 void PKCS11::getSlots(CK_BBOOL withtoken)
@@ -378,6 +612,16 @@ Session::Session(CK_SESSION_HANDLE h, CK_FUNCTION_LIST_PTR fl)
 	_session = h;
 	_flist = fl;
 	_buffer = NULL_PTR;
+
+	_oaep_params.hashAlg = CKM_SHA_1;
+	_oaep_params.mgf = CKG_MGF1_SHA1;
+	_oaep_params.source = CKZ_DATA_SPECIFIED;
+	_oaep_params.pSourceData = NULL_PTR;
+	_oaep_params.ulSourceDataLen = 0;
+
+	_oaep.mechanism = CKM_RSA_PKCS_OAEP;
+	_oaep.pParameter = &_oaep_params;
+	_oaep.ulParameterLen = sizeof(_oaep_params);
 }
 
 Session::~Session()
@@ -561,32 +805,70 @@ std::string Session::encrypt(const char *data, size_t len)
 
 std::string Session::decrypt(const char *data, size_t len, CK_BYTE_PTR ctx, CK_ULONG_PTR ctx_len)
 {
-	CK_RSA_PKCS_OAEP_PARAMS params = {
-		CKM_SHA_1,
-		CKG_MGF1_SHA1,
-		CKZ_DATA_SPECIFIED,
-		NULL_PTR,
-		0
-	};
-
-	CK_MECHANISM mechanism = {
-		CKM_RSA_PKCS_OAEP, &params, sizeof(params)
-	};
+	*ctx_len = decryptTo(data, len, ctx, *ctx_len);
+	return std::string((char *)ctx, (unsigned int)(*ctx_len));
+}
 
+/*
+ * Decrypts into a caller owned buffer of out_len bytes and returns the
+ * plaintext length. Does not allocate unless it fails.
+ * */
+CK_ULONG Session::decryptTo(const char *data, size_t len, CK_BYTE_PTR out, CK_ULONG out_len)
+{
 	if (_hpriv == NULL_PTR) {
 		throw std::runtime_error("Private key == NULL");
 	}
 
-	CK_RV rc = _flist->C_DecryptInit(_session, &mechanism, _hpriv);
+	CK_RV rc = _flist->C_DecryptInit(_session, &_oaep, _hpriv);
 	if (rc != CKR_OK) {
 		throwCKR("C_DecryptInit() failed", rc);
 	}
 
-	rc = _flist->C_Decrypt(_session, (CK_BYTE_PTR)data, len, ctx, ctx_len);
+	rc = _flist->C_Decrypt(_session, (CK_BYTE_PTR)data, len, out, &out_len);
 	if (rc != CKR_OK) {
 		throwCKR("C_Decrypt() failed", rc);
 	}
-	return std::string((char *)ctx, (unsigned int)(*ctx_len));
+	return out_len;
+}
+
+/*
+ * Decrypts one item, the result is in its rc. Returns false when it
+ * failed.
+ * */
+bool Session::decryptItem(DecryptItem &item)
+{
+	if (_hpriv == NULL_PTR) {
+		throw std::runtime_error("Private key == NULL");
+	}
+
+	item.rc = _flist->C_DecryptInit(_session, &_oaep, _hpriv);
+	if (item.rc == CKR_OK) {
+		item.rc = _flist->C_Decrypt(_session, (CK_BYTE_PTR)item.data,
+				item.len, item.out, &item.out_len);
+	}
+	if (item.rc != CKR_OK) {
+		item.out_len = 0;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Decrypts the first count items with the private key and the OAEP
+ * mechanism prepared once for the session. PKCS#11 2.20 has no batch
+ * call for RSA, so each vote is still one C_DecryptInit()/C_Decrypt()
+ * pair, but a failed vote does not stop the rest of the batch. Returns
+ * the number of items that failed.
+ * */
+size_t Session::decryptBatch(std::vector<DecryptItem> &items, size_t count)
+{
+	size_t failed = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!decryptItem(items[i])) {
+			failed++;
+		}
+	}
+	return failed;
 }
 
 void Session::listObjects(FILE *out)
@@ -15,18 +15,34 @@
 #define P11_H_INCLUDED
 
 # include <stdio.h>
+# include <pthread.h>
 
 # include <vector>
 # include <string>
 
 # include "pkcs11.h"
 
+std::string describeCKR(const std::string &prefix, CK_RV rc);
 void throwCKR(const std::string &prefix, CK_RV rc);
+bool isTransientCKR(CK_RV rc);
 
 class PKCS11;
 class Session;
 
 
+/*
+ * One ciphertext of a batch. out_len is the capacity of out on input and
+ * the plaintext length on output, rc the result of that vote alone.
+ * */
+typedef struct DecryptItem {
+	const char *data;
+	size_t len;
+	CK_BYTE_PTR out;
+	CK_ULONG out_len;
+	CK_RV rc;
+} DecryptItem;
+
+
 typedef struct Slots {
 	CK_SLOT_ID_PTR list;
 	CK_ULONG count;
@@ -35,6 +51,14 @@ typedef struct Slots {
 } Slots;
 
 
+// A token logged in to, with the session that holds the login
+typedef struct Device {
+	std::string name;
+	CK_SLOT_ID slot;
+	Session *session;
+} Device;
+
+
 class PKCS11 {
 
 	public:
@@ -49,22 +73,39 @@ class PKCS11 {
 		void logout();
 
 		Session* getSession();
+		bool getFreeSessionCount(CK_ULONG &count);
+
+		size_t deviceCount() const;
+		const std::string& deviceName(size_t device) const;
+		Session* getSession(size_t device);
+		bool getFreeSessionCount(size_t device, CK_ULONG &count);
+		void reopenSession(size_t device, Session *&session);
 
 		void listInfo();
 
 	protected:
 
 		void getSlots(CK_BBOOL withtoken = CK_FALSE);
+		CK_SLOT_ID findSlot(const std::string &token);
+		Session* openSession(CK_SLOT_ID slot);
 
 		void listMechanisms(CK_SLOT_ID sl);
 		void listTokenInfo(CK_SLOT_ID sl);
 
+		bool hasLogin(Session *session);
+		void relogin(Device &dev);
+
 	private:
 
 		CK_FUNCTION_LIST_PTR _flist;
 		void *_dso;
 		bool _logged_in;
 		Slots _slots;
+		std::vector<Device> _devices;
+
+		// Kept for logging in again after the token has lost the login
+		std::string _pin;
+		pthread_mutex_t _reopen_mutex;
 };
 
 
@@ -85,6 +126,13 @@ class Session {
 			size_t len,
 			CK_BYTE_PTR ctx,
 			CK_ULONG_PTR ctx_len);
+		CK_ULONG decryptTo(
+			const char *data,
+			size_t len,
+			CK_BYTE_PTR out,
+			CK_ULONG out_len);
+		bool decryptItem(DecryptItem &item);
+		size_t decryptBatch(std::vector<DecryptItem> &items, size_t count);
 
 		void listObjects(FILE *out);
 		void deleteObject(unsigned int onum);
@@ -112,6 +160,9 @@ class Session {
 		CK_OBJECT_HANDLE _hpub;
 		CK_OBJECT_HANDLE _hpriv;
 
+		CK_RSA_PKCS_OAEP_PARAMS _oaep_params;
+		CK_MECHANISM _oaep;
+
 		CK_BYTE_PTR _buffer;
 };
 
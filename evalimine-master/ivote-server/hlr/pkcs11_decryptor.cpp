@@ -0,0 +1,164 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "pkcs11_decryptor.h"
+
+#ifdef WITHOUT_PKCS11
+#define DUMMY_VOTE "WITHOUTPKCS11"
+#endif
+
+// Wait before the second retry, doubled for each further one
+#define RETRY_DELAY_MS 100
+#define RETRY_MAX_DELAY_MS 5000
+
+Pkcs11Decryptor::Pkcs11Decryptor(PKCS11 *p, size_t device, Session *s,
+		const std::string& label, unsigned int retries)
+{
+	_p = p;
+	_device = device;
+	_sess = s;
+	_label = label;
+	_retries = retries;
+	_recoveries = 0;
+#ifndef WITHOUT_PKCS11
+	_sess->setCurrentPrivKey(label);
+	_len = (_sess->getRSAModulusLen() + 7) / 8;
+#else
+	_len = sizeof(DUMMY_VOTE) - 1;
+#endif
+}
+
+Pkcs11Decryptor::~Pkcs11Decryptor()
+{
+	delete _sess;
+}
+
+CK_ULONG Pkcs11Decryptor::outputLength()
+{
+	return _len;
+}
+
+// The modulus length, the dummy votes are not encrypted
+CK_ULONG Pkcs11Decryptor::inputLength()
+{
+#ifndef WITHOUT_PKCS11
+	return _len;
+#else
+	return 0;
+#endif
+}
+
+unsigned long Pkcs11Decryptor::recoveries() const
+{
+	return _recoveries;
+}
+
+CK_RV Pkcs11Decryptor::firstTransient(const std::vector<DecryptItem> &items,
+		size_t count) const
+{
+	for (size_t i = 0; i < count; i++) {
+		if (items[i].rc != CKR_OK && !_settled[i] &&
+				isTransientCKR(items[i].rc)) {
+			return items[i].rc;
+		}
+	}
+	return CKR_OK;
+}
+
+/*
+ * Sets up a new session after the error rc, false when the token does
+ * not answer yet.
+ * */
+bool Pkcs11Decryptor::recover(CK_RV rc)
+{
+	fprintf(stderr, "%s, reopening the session\n",
+			describeCKR("Token '" + _p->deviceName(_device) + "' failed",
+				rc).c_str());
+	try {
+		_p->reopenSession(_device, _sess);
+		_sess->setCurrentPrivKey(_label);
+	}
+	catch (std::exception& e) {
+		fprintf(stderr, "Reopening the session failed: %s\n", e.what());
+		return false;
+	}
+	_recoveries++;
+	return true;
+}
+
+/*
+ * Decrypts again the items that failed with a transient error. One that
+ * fails with the same error in the fresh session is taken as an error
+ * of the vote and not tried again.
+ * */
+size_t Pkcs11Decryptor::retry(std::vector<DecryptItem> &items, size_t count)
+{
+	size_t failed = 0;
+	for (size_t i = 0; i < count; i++) {
+		DecryptItem &item = items[i];
+		if (item.rc == CKR_OK) {
+			continue;
+		}
+		if (!_settled[i] && isTransientCKR(item.rc)) {
+			CK_RV before = item.rc;
+			item.out_len = _len;
+			if (_sess->decryptItem(item)) {
+				continue;
+			}
+			if (item.rc == before) {
+				_settled[i] = 1;
+			}
+		}
+		failed++;
+	}
+	return failed;
+}
+
+size_t Pkcs11Decryptor::decryptBatch(std::vector<DecryptItem> &items,
+		size_t count)
+{
+#ifndef WITHOUT_PKCS11
+	size_t failed = _sess->decryptBatch(items, count);
+	_settled.assign(count, 0);
+
+	CK_RV rc;
+	unsigned int delay = RETRY_DELAY_MS;
+	for (unsigned int attempt = 0; attempt < _retries && failed > 0 &&
+			(rc = firstTransient(items, count)) != CKR_OK; attempt++) {
+		// The first reopening is at once, a failover is often over
+		// by then
+		if (attempt > 0) {
+			usleep(delay * 1000);
+			delay = delay * 2 < RETRY_MAX_DELAY_MS ?
+				delay * 2 : RETRY_MAX_DELAY_MS;
+		}
+		if (recover(rc)) {
+			failed = retry(items, count);
+		}
+	}
+	return failed;
+#else
+	for (size_t i = 0; i < count; i++) {
+		memcpy(items[i].out, DUMMY_VOTE, _len);
+		items[i].out_len = _len;
+		items[i].rc = CKR_OK;
+	}
+	return 0;
+#endif
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#ifndef PKCS11_DECRYPTOR_H
+#define PKCS11_DECRYPTOR_H
+
+#include <string>
+
+#include "decryptor.h"
+
+/*
+ * Decrypts with the private key on the token through one session, which
+ * the decryptor owns. Votes failing with a transient error are retried
+ * up to retries times in a reopened session of the same device, see
+ * PKCS11::reopenSession(). Only this worker backs off meanwhile. A vote
+ * failing again with the same error in the fresh session is not retried
+ * any further.
+ * */
+class Pkcs11Decryptor : public Decryptor
+{
+	public:
+
+		Pkcs11Decryptor(PKCS11 *p, size_t device, Session *s,
+				const std::string& label, unsigned int retries);
+		virtual ~Pkcs11Decryptor();
+
+		virtual CK_ULONG outputLength();
+		virtual CK_ULONG inputLength();
+		virtual size_t decryptBatch(std::vector<DecryptItem> &items,
+				size_t count);
+		virtual unsigned long recoveries() const;
+
+	protected:
+
+	private:
+
+		Pkcs11Decryptor(const Pkcs11Decryptor&);
+		Pkcs11Decryptor& operator=(const Pkcs11Decryptor&);
+
+		CK_RV firstTransient(const std::vector<DecryptItem> &items,
+				size_t count) const;
+		bool recover(CK_RV rc);
+		size_t retry(std::vector<DecryptItem> &items, size_t count);
+
+		PKCS11 *_p;
+		size_t _device;
+		Session *_sess;
+		std::string _label;
+		CK_ULONG _len;
+		unsigned int _retries;
+		unsigned long _recoveries;
+		// Items of the batch that are not retried any more
+		std::vector<char> _settled;
+};
+
+#endif
+
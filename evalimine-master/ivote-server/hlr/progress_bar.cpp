@@ -13,7 +13,7 @@
 
 #include <stdio.h>
 
-ProgressBar::ProgressBar(int max)
+ProgressBar::ProgressBar(long long max)
 {
 	my_max = max;
 	my_curr = 0;
@@ -25,9 +25,28 @@ ProgressBar::~ProgressBar()
 {
 }
 
+long long ProgressBar::current() const
+{
+	return my_curr;
+}
+
+long long ProgressBar::max() const
+{
+	return my_max;
+}
+
 void ProgressBar::next(const std::string& out)
 {
-	my_curr++;
+	set(my_curr + 1, out);
+}
+
+void ProgressBar::set(long long curr, const std::string& out)
+{
+	my_curr = curr;
+
+	if (my_max <= 0) {
+		return;
+	}
 
 	tmp_level = (my_curr * 100) / my_max;
 
@@ -20,16 +20,21 @@ class ProgressBar
 {
 	public:
 
-		ProgressBar(int max);
+		ProgressBar(long long max);
 		~ProgressBar();
 		void next(const std::string& out);
+		void set(long long curr, const std::string& out);
+
+		// May be read from another thread than the one setting them
+		long long current() const;
+		long long max() const;
 
 	protected:
 
 	private:
 
-		int my_max;
-		int my_curr;
+		volatile long long my_max;
+		volatile long long my_curr;
 		int my_level;
 		int tmp_level;
 };
@@ -0,0 +1,242 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <new>
+
+#include "stream_writer.h"
+
+// Buffers and their size, one is filled while the others are written
+#define STREAM_BUFFERS 4
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+#define STREAM_BUFFER_ALIGN 4096
+
+StreamWriter::StreamWriter()
+{
+	_fd = -1;
+	_sync = false;
+	_started = false;
+	_done = false;
+	_error = 0;
+	_cur.data = NULL;
+	_cur.len = 0;
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_cond_init(&_cond, NULL);
+}
+
+StreamWriter::~StreamWriter()
+{
+	if (_started) {
+		pthread_mutex_lock(&_mutex);
+		_done = true;
+		pthread_cond_broadcast(&_cond);
+		pthread_mutex_unlock(&_mutex);
+		pthread_join(_thread, NULL);
+	}
+	if (_fd != -1) {
+		::close(_fd);
+	}
+	for (size_t i = 0; i < _buffers.size(); i++) {
+		free(_buffers[i].data);
+	}
+	pthread_cond_destroy(&_cond);
+	pthread_mutex_destroy(&_mutex);
+}
+
+bool StreamWriter::open(const char *path, bool sync)
+{
+	// A FIFO blocks here until its reader is there
+	_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (_fd == -1) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(_fd, &st) != 0) {
+		return false;
+	}
+	_sync = sync && S_ISREG(st.st_mode);
+
+	for (int i = 0; i < STREAM_BUFFERS; i++) {
+		Buffer buf;
+		void *p = NULL;
+		if (posix_memalign(&p, STREAM_BUFFER_ALIGN, STREAM_BUFFER_SIZE) != 0) {
+			throw std::bad_alloc();
+		}
+		buf.data = (char *)p;
+		buf.len = 0;
+		_buffers.push_back(buf);
+		_free.push_back(buf);
+	}
+	_cur = _free.front();
+	_free.pop_front();
+
+	int rc = pthread_create(&_thread, NULL, threadMain, this);
+	if (rc != 0) {
+		errno = rc;
+		return false;
+	}
+	_started = true;
+	return true;
+}
+
+bool StreamWriter::isStdout() const
+{
+	struct stat a;
+	struct stat b;
+	return fstat(_fd, &a) == 0 && fstat(STDOUT_FILENO, &b) == 0 &&
+		a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+bool StreamWriter::write(const void *data, size_t len)
+{
+	const char *p = (const char *)data;
+	while (len > 0) {
+		size_t n = STREAM_BUFFER_SIZE - _cur.len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(_cur.data + _cur.len, p, n);
+		_cur.len += n;
+		p += n;
+		len -= n;
+
+		if (_cur.len == STREAM_BUFFER_SIZE && !submit()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool StreamWriter::put(char c)
+{
+	return write(&c, 1);
+}
+
+bool StreamWriter::flush()
+{
+	return _cur.len == 0 || submit();
+}
+
+/*
+ * Queues the current buffer and takes a free one, waiting for the
+ * thread when all of them are queued.
+ * */
+bool StreamWriter::submit()
+{
+	pthread_mutex_lock(&_mutex);
+	_full.push_back(_cur);
+	pthread_cond_broadcast(&_cond);
+	while (_free.empty() && _error == 0) {
+		pthread_cond_wait(&_cond, &_mutex);
+	}
+	int err = _error;
+	if (err == 0) {
+		_cur = _free.front();
+		_free.pop_front();
+		_cur.len = 0;
+	}
+	pthread_mutex_unlock(&_mutex);
+
+	if (err != 0) {
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+bool StreamWriter::close()
+{
+	bool ok = flush();
+
+	pthread_mutex_lock(&_mutex);
+	_done = true;
+	pthread_cond_broadcast(&_cond);
+	pthread_mutex_unlock(&_mutex);
+	pthread_join(_thread, NULL);
+	_started = false;
+
+	if (_error != 0) {
+		errno = _error;
+		ok = false;
+	}
+	if (ok && _sync && fsync(_fd) != 0) {
+		ok = false;
+	}
+	if (::close(_fd) != 0) {
+		ok = false;
+	}
+	_fd = -1;
+	return ok;
+}
+
+bool StreamWriter::writeOut(const Buffer& buf)
+{
+	size_t done = 0;
+	while (done < buf.len) {
+		ssize_t n = ::write(_fd, buf.data + done, buf.len - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	return !_sync || fdatasync(_fd) == 0;
+}
+
+void *StreamWriter::threadMain(void *arg)
+{
+	((StreamWriter *)arg)->run();
+	return NULL;
+}
+
+/*
+ * Writes the queued buffers in order until close() and the queue is
+ * empty. After an error nothing more is written, the next submit()
+ * reports it.
+ * */
+void StreamWriter::run()
+{
+	pthread_mutex_lock(&_mutex);
+	while (true) {
+		while (_full.empty() && !_done) {
+			pthread_cond_wait(&_cond, &_mutex);
+		}
+		if (_full.empty()) {
+			break;
+		}
+		Buffer buf = _full.front();
+		_full.pop_front();
+		pthread_mutex_unlock(&_mutex);
+
+		bool ok = writeOut(buf);
+		int err = errno;
+
+		pthread_mutex_lock(&_mutex);
+		_free.push_back(buf);
+		if (!ok) {
+			_error = err != 0 ? err : EIO;
+			_full.clear();
+			pthread_cond_broadcast(&_cond);
+			break;
+		}
+		pthread_cond_broadcast(&_cond);
+	}
+	pthread_mutex_unlock(&_mutex);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#ifndef STREAM_WRITER_H
+#define STREAM_WRITER_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+/*
+ * Output written by a thread of its own, so that the writer of the ring
+ * only copies into memory while a pipe or a slow disk is waited for.
+ * The data goes through a few large page aligned buffers, a full one is
+ * handed to the thread and the next free one is filled meanwhile.
+ *
+ * Works with regular files as well as pipes and FIFOs, which are read
+ * by the next program while the output is still being written.
+ * */
+class StreamWriter
+{
+	public:
+
+		StreamWriter();
+		~StreamWriter();
+
+		// With sync every buffer written is synced to disk, for a
+		// regular file only
+		bool open(const char *path, bool sync);
+
+		// The same file as the standard output
+		bool isStdout() const;
+
+		// False once the thread has failed, errno tells why
+		bool write(const void *data, size_t len);
+		bool put(char c);
+
+		// Hands the data so far to the thread without waiting for it
+		bool flush();
+
+		// Everything written, synced with sync and the file closed
+		bool close();
+
+	protected:
+
+	private:
+
+		StreamWriter(const StreamWriter&);
+		StreamWriter& operator=(const StreamWriter&);
+
+		struct Buffer {
+			char *data;
+			size_t len;
+		};
+
+		bool submit();
+		bool writeOut(const Buffer& buf);
+		static void *threadMain(void *arg);
+		void run();
+
+		int _fd;
+		bool _sync;
+		bool _started;
+		pthread_t _thread;
+		pthread_mutex_t _mutex;
+		pthread_cond_t _cond;
+
+		std::vector<Buffer> _buffers;
+		std::deque<Buffer> _full;
+		std::deque<Buffer> _free;
+		Buffer _cur;
+
+		bool _done;
+		int _error;
+};
+
+#endif
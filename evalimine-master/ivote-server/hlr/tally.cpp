@@ -0,0 +1,446 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "tally.h"
+
+#define INVALID_CHOICE "kehtetu"
+
+// Longest accepted line of the choices file
+#define CHOICE_LINE_MAX 256
+
+static unsigned long long number(const std::string& s)
+{
+	return strtoull(s.c_str(), NULL, 10);
+}
+
+static bool isDigits(const char *p, size_t len, size_t max)
+{
+	if (len < 1 || len > max) {
+		return false;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (p[i] < '0' || p[i] > '9') {
+			return false;
+		}
+	}
+	return true;
+}
+
+// formatutil.is_valiku_kood()
+static bool isChoiceCode(const char *p, size_t len)
+{
+	const char *dot = (const char *)memchr(p, '.', len);
+	return dot != NULL && isDigits(p, dot - p, 10) &&
+		isDigits(dot + 1, p + len - dot - 1, 11);
+}
+
+// The code after the dot, as the result files have it
+static std::string choiceSuffix(const std::string& choice)
+{
+	size_t dot = choice.find('.');
+	return dot == std::string::npos ? choice : choice.substr(dot + 1);
+}
+
+// valikud_cmp() of hlr.py: by number, the invalid choice last
+static bool choiceLess(const std::string& a, const std::string& b)
+{
+	std::string ca = choiceSuffix(a);
+	std::string cb = choiceSuffix(b);
+	bool ia = ca == INVALID_CHOICE;
+	bool ib = cb == INVALID_CHOICE;
+	if (ia || ib) {
+		return !ia && ib;
+	}
+	if (number(ca) != number(cb)) {
+		return number(ca) < number(cb);
+	}
+	return a < b;
+}
+
+// ringkonnad_cmp() of hlr.py
+static bool pairLess(const std::string& kov1, const std::string& nr1,
+		const std::string& kov2, const std::string& nr2)
+{
+	if (number(kov1) != number(kov2)) {
+		return number(kov1) < number(kov2);
+	}
+	return number(nr1) < number(nr2);
+}
+
+static std::vector<std::string> split(const char *line, size_t len)
+{
+	std::vector<std::string> ret;
+	const char *p = line;
+	const char *end = line + len;
+	while (true) {
+		const char *tab = (const char *)memchr(p, '\t', end - p);
+		if (tab == NULL) {
+			ret.push_back(std::string(p, end - p));
+			return ret;
+		}
+		ret.push_back(std::string(p, tab - p));
+		p = tab + 1;
+	}
+}
+
+Tally::Tally()
+{
+	_slots = 0;
+	_bad_line = 0;
+}
+
+Tally::~Tally()
+{
+}
+
+int Tally::badLine() const
+{
+	return _bad_line;
+}
+
+size_t Tally::slots() const
+{
+	return _slots;
+}
+
+bool Tally::addChoice(const std::string& ring_kov, const std::string& ring_nr,
+		const std::string& kov, const std::string& nr,
+		const std::string& choice)
+{
+	if (!isDigits(ring_kov.data(), ring_kov.size(), 10) ||
+			!isDigits(ring_nr.data(), ring_nr.size(), 10) ||
+			!isDigits(kov.data(), kov.size(), 10) ||
+			!isDigits(nr.data(), nr.size(), 10)) {
+		return false;
+	}
+
+	std::string key = kov + "\t" + nr + "\t" + ring_kov + "\t" + ring_nr;
+	std::map<std::string, Station>::iterator it = _stations.find(key);
+	if (it == _stations.end()) {
+		Station st;
+		st.ring_kov = ring_kov;
+		st.ring_nr = ring_nr;
+		st.kov = kov;
+		st.nr = nr;
+		st.invalid = 0;
+		it = _stations.insert(std::make_pair(key, st)).first;
+	}
+
+	if (it->second.choices.find(choice) == it->second.choices.end()) {
+		it->second.choices[choice] = _slots++;
+	}
+	return true;
+}
+
+bool Tally::load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return false;
+	}
+
+	char buf[CHOICE_LINE_MAX];
+	int line_nr = 0;
+	bool ok = true;
+
+	_bad_line = 0;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		line_nr++;
+		size_t len = strlen(buf);
+		if (len == 0 || buf[len - 1] != '\n') {
+			ok = false;
+			break;
+		}
+		buf[--len] = '\0';
+
+		if (line_nr == 1) {
+			_version = buf;
+			continue;
+		}
+		if (line_nr == 2) {
+			_elid = buf;
+			continue;
+		}
+
+		std::vector<std::string> lst = split(buf, len);
+		if (lst.size() != 5 ||
+				(!isChoiceCode(lst[4].data(), lst[4].size()) &&
+				 choiceSuffix(lst[4]) != INVALID_CHOICE)) {
+			ok = false;
+			break;
+		}
+		if (!addChoice(lst[0], lst[1], lst[2], lst[3], lst[4])) {
+			ok = false;
+			break;
+		}
+	}
+
+	if (ferror(f)) {
+		int err = errno;
+		fclose(f);
+		errno = err;
+		return false;
+	}
+	fclose(f);
+
+	if (ok && line_nr < 2) {
+		ok = false;
+	}
+
+	// Every station counts its invalid votes in the choice of its
+	// district, HLR._add_kehtetu()
+	for (std::map<std::string, Station>::iterator it = _stations.begin();
+			ok && it != _stations.end(); it++) {
+		Station& st = it->second;
+		std::map<std::string, size_t>::const_iterator inv =
+			st.choices.find(st.ring_kov + "." INVALID_CHOICE);
+		if (inv == st.choices.end()) {
+			line_nr = 0;
+			ok = false;
+			break;
+		}
+		st.invalid = inv->second;
+	}
+
+	if (!ok) {
+		_bad_line = line_nr;
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Finds the station of context and the first four tabs, TALLY_INVALID
+ * when it is there.
+ * */
+TallyVerdict Tally::findStation(const char *context, size_t context_len,
+		std::string& key, const char **tab, const Station *&st) const
+{
+	// station kov, station nr, ring kov, ring nr, encrypted vote
+	const char *p = context;
+	const char *end = context + context_len;
+	for (int i = 0; i < 4; i++) {
+		tab[i] = (const char *)memchr(p, '\t', end - p);
+		if (tab[i] == NULL) {
+			return TALLY_BAD_LINE;
+		}
+		p = tab[i] + 1;
+	}
+
+	key.assign(context, tab[3] - context);
+	std::map<std::string, Station>::const_iterator it = _stations.find(key);
+	if (it == _stations.end()) {
+		return TALLY_UNKNOWN_STATION;
+	}
+	st = &it->second;
+	return TALLY_INVALID;
+}
+
+TallyVerdict Tally::locate(const char *context, size_t context_len,
+		std::string& key, size_t& slot) const
+{
+	const char *tab[4];
+	const Station *st = NULL;
+	TallyVerdict v = findStation(context, context_len, key, tab, st);
+	if (v == TALLY_INVALID) {
+		slot = st->invalid;
+	}
+	return v;
+}
+
+TallyVerdict Tally::classify(const char *context, size_t context_len,
+		const unsigned char *vote, size_t vote_len,
+		std::string& key, size_t& slot) const
+{
+	const char *tab[4];
+	const Station *found = NULL;
+	TallyVerdict verdict = findStation(context, context_len, key, tab, found);
+	if (verdict != TALLY_INVALID) {
+		return verdict;
+	}
+	const Station& st = *found;
+	slot = st.invalid;
+
+	// "<version>\n<election id>\n<choice>\n"
+	size_t head = _version.size() + 1 + _elid.size() + 1;
+	const char *v = (const char *)vote;
+	if (vote_len <= head + 1 || v[vote_len - 1] != '\n' ||
+			memcmp(v, _version.data(), _version.size()) != 0 ||
+			v[_version.size()] != '\n' ||
+			memcmp(v + _version.size() + 1, _elid.data(), _elid.size()) != 0 ||
+			v[head - 1] != '\n') {
+		return TALLY_INVALID;
+	}
+
+	const char *choice = v + head;
+	size_t choice_len = vote_len - head - 1;
+	if (!isChoiceCode(choice, choice_len)) {
+		return TALLY_INVALID;
+	}
+
+	// The choice must belong to the district of the station
+	const char *ring_kov = tab[1] + 1;
+	size_t ring_kov_len = tab[2] - ring_kov;
+	const char *dot = (const char *)memchr(choice, '.', choice_len);
+	if ((size_t)(dot - choice) != ring_kov_len ||
+			memcmp(choice, ring_kov, ring_kov_len) != 0) {
+		return TALLY_INVALID;
+	}
+
+	key.assign(choice, choice_len);
+	std::map<std::string, size_t>::const_iterator c = st.choices.find(key);
+	if (c == st.choices.end()) {
+		return TALLY_INVALID;
+	}
+
+	slot = c->second;
+	return TALLY_VALID;
+}
+
+void Tally::merge(TallyCounts& total, const TallyCounts& part)
+{
+	if (total.size() < part.size()) {
+		total.resize(part.size(), 0);
+	}
+	for (size_t i = 0; i < part.size(); i++) {
+		total[i] += part[i];
+	}
+}
+
+bool Tally::stationLess(const Station *a, const Station *b)
+{
+	if (a->ring_kov != b->ring_kov || a->ring_nr != b->ring_nr) {
+		return pairLess(a->ring_kov, a->ring_nr, b->ring_kov, b->ring_nr);
+	}
+	return pairLess(a->kov, a->nr, b->kov, b->nr);
+}
+
+std::vector<const Tally::Station *> Tally::sortedStations() const
+{
+	std::vector<const Station *> ret;
+	for (std::map<std::string, Station>::const_iterator it = _stations.begin();
+			it != _stations.end(); it++) {
+		ret.push_back(&it->second);
+	}
+	std::sort(ret.begin(), ret.end(), stationLess);
+	return ret;
+}
+
+static std::vector<std::string> sortedChoices(
+		const std::map<std::string, size_t>& choices)
+{
+	std::vector<std::string> ret;
+	for (std::map<std::string, size_t>::const_iterator it = choices.begin();
+			it != choices.end(); it++) {
+		ret.push_back(it->first);
+	}
+	std::sort(ret.begin(), ret.end(), choiceLess);
+	return ret;
+}
+
+static bool writeFile(const char *path, const std::string& version,
+		const std::string& elid, const std::string& body)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		return false;
+	}
+
+	bool ok = fprintf(f, "%s\n%s\n", version.c_str(), elid.c_str()) > 0 &&
+		fwrite(body.data(), 1, body.size(), f) == body.size() &&
+		fflush(f) == 0 &&
+		fsync(fileno(f)) == 0;
+
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	return ok;
+}
+
+static std::string countString(unsigned long n)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%lu", n);
+	return buf;
+}
+
+/*
+ * ChoicesCounter.outputstat(): station, district, count and choice,
+ * ordered by district, station and choice.
+ * */
+bool Tally::writeStations(const char *path, const TallyCounts& counts) const
+{
+	std::string body;
+	std::vector<const Station *> stations = sortedStations();
+	for (size_t i = 0; i < stations.size(); i++) {
+		const Station& st = *stations[i];
+		std::vector<std::string> choices = sortedChoices(st.choices);
+		for (size_t j = 0; j < choices.size(); j++) {
+			size_t slot = st.choices.find(choices[j])->second;
+			body += st.kov + "\t" + st.nr + "\t" + st.ring_kov + "\t" +
+				st.ring_nr + "\t" +
+				countString(slot < counts.size() ? counts[slot] : 0) +
+				"\t" + choiceSuffix(choices[j]) + "\n";
+		}
+	}
+	return writeFile(path, _version, _elid, body);
+}
+
+/*
+ * ChoicesCounter.outputdist(): district, count and choice, the choices
+ * of all stations of the district summed.
+ * */
+bool Tally::writeDistricts(const char *path, const TallyCounts& counts) const
+{
+	std::string body;
+	std::vector<const Station *> stations = sortedStations();
+	size_t i = 0;
+	while (i < stations.size()) {
+		const Station& first = *stations[i];
+		std::map<std::string, size_t> sums;
+		for (; i < stations.size() &&
+				stations[i]->ring_kov == first.ring_kov &&
+				stations[i]->ring_nr == first.ring_nr; i++) {
+			const Station& st = *stations[i];
+			for (std::map<std::string, size_t>::const_iterator it =
+					st.choices.begin(); it != st.choices.end(); it++) {
+				sums[it->first] += it->second < counts.size() ?
+					counts[it->second] : 0;
+			}
+		}
+
+		std::vector<std::string> choices = sortedChoices(sums);
+		for (size_t j = 0; j < choices.size(); j++) {
+			body += first.ring_kov + "\t" + first.ring_nr + "\t" +
+				countString(sums[choices[j]]) + "\t" +
+				choiceSuffix(choices[j]) + "\n";
+		}
+	}
+	return writeFile(path, _version, _elid, body);
+}
+
+unsigned long Tally::total(const TallyCounts& counts)
+{
+	unsigned long n = 0;
+	for (size_t i = 0; i < counts.size(); i++) {
+		n += counts[i];
+	}
+	return n;
+}
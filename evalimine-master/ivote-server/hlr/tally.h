@@ -0,0 +1,112 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#ifndef TALLY_H
+#define TALLY_H
+
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Counts by slot, one slot per choice of every station
+typedef std::vector<unsigned long> TallyCounts;
+
+enum TallyVerdict {
+	TALLY_VALID = 0,
+	TALLY_INVALID,
+	TALLY_UNKNOWN_STATION,
+	TALLY_BAD_LINE
+};
+
+/*
+ * Counting of decrypted votes with the checks of HLR._check_vote() in
+ * hlr.py. The choices file has the version and election id lines of
+ * the other HLR files and then one line per choice allowed in a
+ * station:
+ *
+ *     ring kov \t ring nr \t station kov \t station nr \t choice
+ *
+ * Every station needs the "<kov>.kehtetu" choice of its district, an
+ * invalid vote is counted there. After load() the tally is read-only
+ * and shared by the workers, each counting into its own TallyCounts.
+ * */
+class Tally
+{
+	public:
+
+		Tally();
+		~Tally();
+
+		// Sets errno to EINVAL on a format error, badLine() tells where
+		bool load(const char *path);
+		int badLine() const;
+
+		size_t slots() const;
+
+		/*
+		 * Checks the plaintext of a vote whose line in the votes file
+		 * is context and finds the slot it is counted in. key is a
+		 * buffer of the caller, reused between calls.
+		 * */
+		TallyVerdict classify(const char *context, size_t context_len,
+				const unsigned char *vote, size_t vote_len,
+				std::string& key, size_t& slot) const;
+
+		/*
+		 * The slot of an invalid vote of the station of context, for a
+		 * vote that was not decrypted. TALLY_INVALID when it is found.
+		 * */
+		TallyVerdict locate(const char *context, size_t context_len,
+				std::string& key, size_t& slot) const;
+
+		static void merge(TallyCounts& total, const TallyCounts& part);
+		static unsigned long total(const TallyCounts& counts);
+
+		// The result files of hlr.py, by station and by district
+		bool writeStations(const char *path, const TallyCounts& counts) const;
+		bool writeDistricts(const char *path, const TallyCounts& counts) const;
+
+	protected:
+
+	private:
+
+		Tally(const Tally&);
+		Tally& operator=(const Tally&);
+
+		struct Station {
+			std::string ring_kov;
+			std::string ring_nr;
+			std::string kov;
+			std::string nr;
+			std::map<std::string, size_t> choices;
+			size_t invalid;
+		};
+
+		bool addChoice(const std::string& ring_kov, const std::string& ring_nr,
+				const std::string& kov, const std::string& nr,
+				const std::string& choice);
+		TallyVerdict findStation(const char *context, size_t context_len,
+				std::string& key, const char **tab, const Station *&st) const;
+		std::vector<const Station *> sortedStations() const;
+		static bool stationLess(const Station *a, const Station *b);
+
+		std::string _version;
+		std::string _elid;
+		// By "station kov \t station nr \t ring kov \t ring nr", the
+		// first four fields of a vote line
+		std::map<std::string, Station> _stations;
+		size_t _slots;
+		int _bad_line;
+};
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "telemetry.h"
+#include "progress_bar.h"
+#include "vote_ring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <stdexcept>
+
+void SessionTelemetry::begin(unsigned long long now)
+{
+	busy_since = now;
+}
+
+void SessionTelemetry::end(unsigned long long now,
+		unsigned long long batch_usec, unsigned int count,
+		size_t failed_count, unsigned int rejected_count)
+{
+	if (count > 0) {
+		unsigned long long usec = batch_usec / count;
+		int b = 0;
+		while (b < TELEMETRY_BUCKETS - 1 && usec >= (2ULL << b)) {
+			b++;
+		}
+		hist[b] += count;
+	}
+	votes += count;
+	failed += failed_count;
+	rejected += rejected_count;
+	last = now;
+	busy_since = 0;
+}
+
+Telemetry::Telemetry(int fd, const std::string& status_file,
+		unsigned int interval)
+{
+	_fd = fd;
+	_status_file = status_file;
+	_interval = interval;
+	_progress = NULL;
+	_ring = NULL;
+	_votes = 0;
+	_started = 0;
+	_last_time = 0;
+	_last_votes = 0;
+	_first_progress = 0;
+	_running = false;
+	_stopping = false;
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_cond_init(&_wakeup, NULL);
+}
+
+Telemetry::~Telemetry()
+{
+	stop(false);
+	pthread_cond_destroy(&_wakeup);
+	pthread_mutex_destroy(&_mutex);
+}
+
+unsigned long long Telemetry::now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/*
+ * The sessions are set up before the workers start, so that their
+ * addresses do not change.
+ * */
+void Telemetry::start(const ProgressBar *progress, const VoteRing *ring,
+		int sessions)
+{
+	_progress = progress;
+	_ring = ring;
+
+	SessionTelemetry empty;
+	memset(&empty, 0, sizeof(empty));
+	empty.device = "";
+	_sessions.assign(sessions, empty);
+
+	_votes = 0;
+	_started = now();
+	_last_time = _started;
+	_last_votes = 0;
+	_first_progress = _progress->current();
+	_stopping = false;
+
+	int rc = pthread_create(&_thread, NULL, reporterMain, this);
+	if (rc != 0) {
+		throw std::runtime_error(std::string("Cannot start the telemetry "
+					"reporter: ") + strerror(rc));
+	}
+	_running = true;
+}
+
+/*
+ * Ends the reporter after a last line with the final state. The ring
+ * must still be there.
+ * */
+void Telemetry::stop(bool ok)
+{
+	if (!_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&_mutex);
+	_stopping = true;
+	pthread_cond_signal(&_wakeup);
+	pthread_mutex_unlock(&_mutex);
+	pthread_join(_thread, NULL);
+	_running = false;
+
+	report(ok ? "done" : "failed");
+}
+
+SessionTelemetry* Telemetry::session(int worker)
+{
+	return &_sessions.at(worker);
+}
+
+void Telemetry::voteDone()
+{
+	_votes++;
+}
+
+void* Telemetry::reporterMain(void *arg)
+{
+	// A reader gone from the pipe ends the lines, not the decryption
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	((Telemetry *)arg)->reporterLoop();
+	return NULL;
+}
+
+void Telemetry::reporterLoop()
+{
+	pthread_mutex_lock(&_mutex);
+	while (!_stopping) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += _interval;
+
+		while (!_stopping && pthread_cond_timedwait(&_wakeup, &_mutex,
+					&until) != ETIMEDOUT) {
+		}
+		if (_stopping) {
+			break;
+		}
+
+		pthread_mutex_unlock(&_mutex);
+		report("running");
+		pthread_mutex_lock(&_mutex);
+	}
+	pthread_mutex_unlock(&_mutex);
+}
+
+static unsigned long long percentileUsec(const volatile unsigned long *hist,
+		unsigned long total, int p)
+{
+	if (total == 0) {
+		return 0;
+	}
+	unsigned long want = (total * p + 99) / 100;
+	unsigned long seen = 0;
+	for (int b = 0; b < TELEMETRY_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= want) {
+			return 2ULL << b;
+		}
+	}
+	return 2ULL << (TELEMETRY_BUCKETS - 1);
+}
+
+static void appendJSONString(std::string& out, const char *s)
+{
+	out += '"';
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		}
+		else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+// Only called by the reporter, or by stop() after it has ended
+void Telemetry::report(const char *state)
+{
+	unsigned long long t = now();
+	unsigned long votes = _votes;
+
+	double elapsed = (t - _started) / 1e6;
+	double interval = (t - _last_time) / 1e6;
+	double rate = interval > 0 ? (votes - _last_votes) / interval : 0;
+	double avg = elapsed > 0 ? votes / elapsed : 0;
+	_last_time = t;
+	_last_votes = votes;
+
+	long long curr = _progress->current();
+	long long max = _progress->max();
+	double progress = max > 0 ? (double)curr / max : 1;
+	if (progress > 1) {
+		progress = 1;
+	}
+	// From the input rate since the start, a resumed run counts only
+	// what it has done itself
+	double eta = -1;
+	if (curr > _first_progress && elapsed > 0) {
+		eta = (max - curr) / ((curr - _first_progress) / elapsed);
+	}
+
+	unsigned long failed = 0;
+	unsigned long rejected = 0;
+	unsigned long recoveries = 0;
+	for (size_t i = 0; i < _sessions.size(); i++) {
+		failed += _sessions[i].failed;
+		rejected += _sessions[i].rejected;
+		recoveries += _sessions[i].recoveries;
+	}
+
+	char eta_buf[32];
+	if (eta >= 0) {
+		snprintf(eta_buf, sizeof(eta_buf), "%.1f", eta);
+	}
+	else {
+		strcpy(eta_buf, "null");
+	}
+
+	char buf[512];
+	std::string line;
+	snprintf(buf, sizeof(buf), "{\"time\":%.3f,\"state\":\"%s\","
+			"\"elapsed_s\":%.3f,\"votes\":%lu,\"votes_per_s\":%.1f,"
+			"\"avg_votes_per_s\":%.1f,\"progress\":%.4f,\"eta_s\":%s,"
+			"\"window_depth\":%lu,\"window_peak\":%lu,\"window\":%lu,"
+			"\"failed\":%lu,\"rejected\":%lu,\"recoveries\":%lu,"
+			"\"sessions\":[",
+			t / 1e6, state, elapsed, votes, rate, avg, progress, eta_buf,
+			_ring->depth(), _ring->peak(), _ring->window(), failed,
+			rejected, recoveries);
+	line += buf;
+
+	for (size_t i = 0; i < _sessions.size(); i++) {
+		const SessionTelemetry& s = _sessions[i];
+		unsigned long long busy_since = s.busy_since;
+		unsigned long long last = s.last;
+		unsigned long long busy = busy_since != 0 && t > busy_since ?
+			(t - busy_since) / 1000 : 0;
+		unsigned long long idle = busy_since == 0 && last != 0 &&
+			t > last ? (t - last) / 1000 : 0;
+
+		unsigned long hist[TELEMETRY_BUCKETS];
+		unsigned long total = 0;
+		for (int b = 0; b < TELEMETRY_BUCKETS; b++) {
+			hist[b] = s.hist[b];
+			total += hist[b];
+		}
+
+		snprintf(buf, sizeof(buf), "%s{\"worker\":%lu,\"device\":",
+				i > 0 ? "," : "", (unsigned long)i);
+		line += buf;
+		appendJSONString(line, s.device);
+		snprintf(buf, sizeof(buf), ",\"votes\":%lu,\"failed\":%lu,"
+				"\"rejected\":%lu,\"recoveries\":%lu,\"busy_ms\":%llu,"
+				"\"idle_ms\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,"
+				"\"hist\":[",
+				(unsigned long)s.votes, (unsigned long)s.failed,
+				(unsigned long)s.rejected, (unsigned long)s.recoveries,
+				busy, idle,
+				percentileUsec(hist, total, 50),
+				percentileUsec(hist, total, 99));
+		line += buf;
+		for (int b = 0; b < TELEMETRY_BUCKETS; b++) {
+			snprintf(buf, sizeof(buf), "%s%lu", b > 0 ? "," : "", hist[b]);
+			line += buf;
+		}
+		line += "]}";
+	}
+	line += "]}\n";
+
+	publish(line);
+}
+
+void Telemetry::publish(const std::string& line)
+{
+	if (_fd >= 0) {
+		const char *p = line.data();
+		size_t left = line.size();
+		while (left > 0) {
+			ssize_t n = write(_fd, p, left);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				fprintf(stderr, "Telemetry not written any more: %s\n",
+						strerror(errno));
+				_fd = -1;
+				break;
+			}
+			p += n;
+			left -= n;
+		}
+	}
+
+	if (!_status_file.empty()) {
+		// Readers see either the previous line or this one
+		std::string tmp = _status_file + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "w");
+		bool ok = f != NULL &&
+			fwrite(line.data(), 1, line.size(), f) == line.size();
+		if (f != NULL && fclose(f) != 0) {
+			ok = false;
+		}
+		if (!ok || rename(tmp.c_str(), _status_file.c_str()) != 0) {
+			fprintf(stderr, "Cannot write status file %s: %s\n",
+					_status_file.c_str(), strerror(errno));
+			unlink(tmp.c_str());
+		}
+	}
+}
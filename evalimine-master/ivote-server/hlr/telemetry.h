@@ -0,0 +1,129 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+class ProgressBar;
+class VoteRing;
+
+// Buckets of the latency histogram, bucket i counts the votes that took
+// less than 2^(i + 1) microseconds, the last one the rest
+#define TELEMETRY_BUCKETS 24
+
+/*
+ * Counters of one worker and its session. Only the worker writes them,
+ * the reporter reads whatever is there, so the hot loop takes no lock.
+ * */
+struct SessionTelemetry
+{
+	const char *device;
+	volatile unsigned long votes;
+	volatile unsigned long failed;
+	volatile unsigned long recoveries;
+	volatile unsigned long rejected;
+
+	// Start of the batch being decrypted, 0 between batches
+	volatile unsigned long long busy_since;
+	// End of the last batch
+	volatile unsigned long long last;
+
+	volatile unsigned long hist[TELEMETRY_BUCKETS];
+
+	void begin(unsigned long long now);
+	// count is the votes given to the token, rejected those that were not
+	void end(unsigned long long now, unsigned long long batch_usec,
+			unsigned int count, size_t failed_count,
+			unsigned int rejected_count);
+};
+
+/*
+ * Progress and throughput of threaded_decrypt for monitoring, one JSON
+ * object per line every interval seconds and once more at the end:
+ *
+ *   {"time":..., "state":"running"|"done"|"failed", "elapsed_s":...,
+ *    "votes":..., "votes_per_s":..., "avg_votes_per_s":...,
+ *    "progress":0..1, "eta_s":..., "window_depth":..., "window_peak":...,
+ *    "window":..., "failed":..., "rejected":..., "recoveries":...,
+ *    "sessions":[{"worker":..., "device":..., "votes":..., "failed":...,
+ *        "rejected":..., "recoveries":..., "busy_ms":..., "idle_ms":..., "p50_us":...,
+ *        "p99_us":..., "hist":[...]}, ...]}
+ *
+ * votes_per_s is that of the last interval, eta_s is null until there
+ * is a rate. A vote of a batch is counted in the histogram with the
+ * time of the batch divided by its votes. The votes of a session are
+ * those it gave to the token, rejected ones are counted apart.
+ * busy_ms is how long the current batch of a session has taken, a
+ * growing value is a stalled token. The lines go to a file descriptor,
+ * the status file is replaced by the latest line.
+ * */
+class Telemetry
+{
+	public:
+
+		Telemetry(int fd, const std::string& status_file,
+				unsigned int interval);
+		~Telemetry();
+
+		void start(const ProgressBar *progress, const VoteRing *ring,
+				int sessions);
+		void stop(bool ok);
+
+		SessionTelemetry* session(int worker);
+
+		// Called by the writer for every vote written
+		void voteDone();
+
+		static unsigned long long now();
+
+	protected:
+
+	private:
+
+		Telemetry(const Telemetry&);
+		Telemetry& operator=(const Telemetry&);
+
+		static void* reporterMain(void *arg);
+		void reporterLoop();
+		void report(const char *state);
+		void publish(const std::string& line);
+
+		int _fd;
+		std::string _status_file;
+		unsigned int _interval;
+
+		const ProgressBar *_progress;
+		const VoteRing *_ring;
+		std::vector<SessionTelemetry> _sessions;
+
+		volatile unsigned long _votes;
+
+		unsigned long long _started;
+		unsigned long long _last_time;
+		unsigned long _last_votes;
+		long long _first_progress;
+
+		bool _running;
+		bool _stopping;
+		pthread_t _thread;
+		pthread_mutex_t _mutex;
+		pthread_cond_t _wakeup;
+};
+
+#endif
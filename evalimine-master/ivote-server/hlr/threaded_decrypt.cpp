@@ -18,16 +18,30 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
-#include <map>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
 #include <vector>
 #include <stdexcept>
 #include <assert.h>
+#include <openssl/sha.h>
 
 #include "pkcs11.h"
 #include "base64.h"
+#include "binary_votes.h"
+#include "checkpoint.h"
+#include "fragment.h"
 #include "p11.h"
 #include "progress_bar.h"
-#include "count_lines.h"
+#include "stream_writer.h"
+#include "tally.h"
+#include "telemetry.h"
+#include "pkcs11_decryptor.h"
+#include "openssl_decryptor.h"
+#include "vote_file.h"
+#include "vote_ring.h"
 #include "threaded_decrypt.h"
 
 enum ExitCodes {
@@ -40,20 +54,68 @@ enum ExitCodes {
 	EXIT_ERROR_READING_INPUT,
 	EXIT_ERROR_WRITING_OUTPUT,
 	EXIT_INVALID_VOTES_FILE_LINE_FORMAT,
-	EXIT_DECRYPT_UTIL_FAILED
+	EXIT_DECRYPT_UTIL_FAILED,
+	EXIT_INVALID_CHOICES_FILE,
+	EXIT_UNKNOWN_STATION
 };
 
 
 #define CORRUPTED_VOTE "xxx"
 
+// Output file name for not writing the decrypted votes, with --tally
+#define NO_OUTPUT "-"
+
+// Votes written between two checkpoints
+#define CHECKPOINT_INTERVAL 10000
+
+// Longest accepted vote line including the newline
 #define LINE_MAX_LEN (172 * 1024 + 2)
 
-#define MAX_THREADS 9
+// Worker count when --threads is not given
+#define DEFAULT_THREADS 9
+
+// Sanity limit for --threads
+#define MAX_THREADS 256
+
+// Upper bound for --threads auto
+#define AUTO_THREADS_LIMIT 64
+
+// Votes that may be in flight ahead of the writer when --window is not
+// given, and the sanity limit for --window
+#define DEFAULT_WINDOW 1024
+#define MAX_WINDOW (1024 * 1024)
+
+// Votes a worker claims from the ring and decrypts at once when
+// --batch is not given, and the sanity limit for --batch
+#define DEFAULT_BATCH 8
+#define MAX_BATCH 256
+
+// Times a vote failing with a transient token error is tried again in
+// a new session when --retries is not given, and the sanity limit
+#define DEFAULT_RETRIES 6
+#define MAX_RETRIES 20
+
+// Sanity limit for the shard count of --shard
+#define MAX_SHARDS 1024
 
-pthread_mutex_t boss_mutex;
+// Seconds between two telemetry lines when --telemetry-interval is not
+// given, and the sanity limit
+#define DEFAULT_TELEMETRY_INTERVAL 5
+#define MAX_TELEMETRY_INTERVAL 3600
+
+// Bytes of the output hashed at once for the fragment header
+#define DIGEST_CHUNK (1024 * 1024)
+
+pthread_mutex_t session_mutex;
 
 Boss *boss = NULL;
 
+VoteRing *ring = NULL;
+
+unsigned int batch_size = DEFAULT_BATCH;
+
+unsigned int retry_count = DEFAULT_RETRIES;
+
 /*
  *
  * Class Boss
@@ -65,22 +127,66 @@ Boss::Boss(const std::string& input, const std::string& output, PKCS11 *p, const
 	_in = input;
 	_out = output;
 	_p = p;
+	_key = NULL;
 	_label = label;
 
 	_line_nr = 0;
-	_last_saved = 0;
 
-	_fin = NULL;
 	_fout = NULL;
 
 	_pc = NULL;
+
+	_ckpt = NULL;
+	_resume = false;
+
+	_tally = NULL;
+	_uncounted = 0;
+	pthread_mutex_init(&_counts_mutex, NULL);
+	_log4 = NULL;
+	_log5 = NULL;
+	_log_time = 0;
+	_log_stamp[0] = '\0';
+
+	_fragment = NULL;
+	_header_len = 0;
+	_progress_base = 0;
+
+	_binary = false;
+	_binary_end = 0;
+	_bw = NULL;
+
+	_stream = NULL;
+	_stream_sync = false;
+	_flush_votes = 0;
+	_unflushed = 0;
+
+	_telemetry = NULL;
 }
 
 Boss::~Boss()
 {
-	fclose(_fout);
-	fclose(_fin);
+	if (_fout != NULL) {
+		fclose(_fout);
+	}
+	if (_log4 != NULL) {
+		fclose(_log4);
+	}
+	if (_log5 != NULL) {
+		fclose(_log5);
+	}
+	delete _tally;
+	delete _fragment;
+	delete _bw;
+	delete _stream;
+	delete _telemetry;
+	_bf.close();
+	pthread_mutex_destroy(&_counts_mutex);
+	_vf.close();
 	delete _pc;
+	delete _ckpt;
+	if (_key != NULL) {
+		EVP_PKEY_free(_key);
+	}
 }
 
 const std::string& Boss::label() const
@@ -88,124 +194,674 @@ const std::string& Boss::label() const
 	return _label;
 }
 
-int Boss::getTask(std::string& task, std::string& context)
+bool Boss::writesOutput() const
 {
-	char line[LINE_MAX_LEN];
-	if (fgets(line, LINE_MAX_LEN, _fin) != NULL) {
+	return _out != NO_OUTPUT;
+}
 
-		char *index = strrchr(line, '\t');
-		_line_nr++;
+/*
+ * Write the output through a StreamWriter, for a pipe or a FIFO read while
+ * the votes are decrypted. With flush_votes the data is handed on at
+ * least every so many votes, with sync it is also synced to disk.
+ * */
+void Boss::useStream(unsigned int flush_votes, bool sync)
+{
+	_flush_votes = flush_votes;
+	_stream_sync = sync;
+	_stream = new StreamWriter();
+}
 
-		if (index == NULL) {
-			fprintf(stderr, "Invalid vote line format: line nr %d\n",
-					_line_nr);
-			exit(EXIT_INVALID_VOTES_FILE_LINE_FORMAT);
-		}
+/*
+ * The messages of the standard output would be mixed into the votes
+ * streamed there, they go to the standard error instead.
+ * */
+void Boss::prepareStream(const char *version, size_t version_len,
+		const char *elid, size_t elid_len)
+{
+	if (!_stream->open(_out.c_str(), _stream_sync)) {
+		exit(EXIT_CANNOT_OPEN_DECRYPTED_VOTES_FILE_FOR_WRITING);
+	}
+	if (_stream->isStdout()) {
+		fflush(stdout);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+
+	if (!_stream->write(version, version_len) || !_stream->put('\n') ||
+			!_stream->write(elid, elid_len) || !_stream->put('\n')) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+}
+
+void Boss::writeStream(const VoteRecord& rec)
+{
+	bool ok = _stream->write(rec.context, rec.context_len) &&
+		_stream->put('\t') &&
+		_stream->write(rec.result, rec.result_len) &&
+		_stream->put('\n');
+
+	if (ok && _flush_votes > 0 && ++_unflushed >= _flush_votes) {
+		_unflushed = 0;
+		ok = _stream->flush();
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+}
+
+/*
+ * Read and write the binary form of binary_votes.h instead of text.
+ * */
+void Boss::useBinary()
+{
+	_binary = true;
+}
+
+bool Boss::binary() const
+{
+	return _binary;
+}
+
+ResultFormat Boss::resultFormat() const
+{
+	if (!writesOutput()) {
+		return RESULT_NONE;
+	}
+	return _binary ? RESULT_RAW : RESULT_BASE64;
+}
+
+int Boss::getTask(VoteRecord& rec)
+{
+	const char *line;
+	size_t len;
+
+	if (_binary) {
+		return getBinaryTask(rec);
+	}
+
+	if (!_vf.next(line, len)) {
+		return -1;
+	}
+
+	_line_nr++;
+
+	// A bad line is written as a corrupted vote by its worker, it does
+	// not end the run
+	rec.reject = REJECT_NONE;
+	const char *index = (const char *)memrchr(line, '\t', len);
+	if (index == NULL) {
+		rec.reject = REJECT_LINE_FORMAT;
+		index = line + len;
+	}
+	else {
 		index++;
+	}
+	if (len + 1 >= LINE_MAX_LEN) {
+		rec.reject = REJECT_LINE_TOO_LONG;
+	}
 
-		task = std::string(index);
-		context = std::string(line, strlen(line) - 1);
+	rec.no = _line_nr;
+	rec.task = index;
+	rec.task_len = line + len - index;
+	rec.context = line;
+	rec.context_len = len;
+	rec.end = _vf.position();
 
 #ifdef WITHOUT_PKCS11
-		fprintf(stderr, "\nINPUT: %s", line);
-		fprintf(stderr, "TASK: %s", task.c_str());
-		fprintf(stderr, "CONTEXT: %s\n\n", context.c_str());
+	fprintf(stderr, "\nINPUT: %.*s\n", (int)len, line);
+	fprintf(stderr, "TASK: %.*s\n", (int)rec.task_len, rec.task);
+	fprintf(stderr, "CONTEXT: %.*s\n\n", (int)rec.context_len, rec.context);
 #endif
+	return _line_nr;
+}
+
+/*
+ * Records are numbered like the lines of the text form, the first one
+ * is line 3.
+ * */
+int Boss::getBinaryTask(VoteRecord& rec)
+{
+	size_t k = _line_nr - 2;
+	BinaryVote vote;
+
+	if (k >= _bf.count()) {
+		return -1;
+	}
+
+	_line_nr++;
+
+	rec.no = _line_nr;
+
+	// An unreadable record is written empty as a corrupted vote, the
+	// input counts as consumed up to the last readable one
+	if (!_bf.record(k, vote)) {
+		rec.reject = REJECT_BAD_RECORD;
+		rec.task = "";
+		rec.task_len = 0;
+		rec.context = "";
+		rec.context_len = 0;
+		rec.end = _binary_end;
 		return _line_nr;
 	}
 
-	if (ferror(_fin)) {
-		fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+	_binary_end = vote.end;
+	rec.reject = REJECT_NONE;
+	if (vote.cipher_len == 0 && (vote.context_len == 0 ||
+				vote.context[vote.context_len - 1] != '\t')) {
+		rec.reject = memchr(vote.context, '\t', vote.context_len) == NULL ?
+			REJECT_LINE_FORMAT : REJECT_BASE64;
+	}
+	rec.task = (const char *)vote.cipher;
+	rec.task_len = vote.cipher_len;
+	rec.context = vote.context;
+	rec.context_len = vote.context_len;
+	rec.end = vote.end;
+	return _line_nr;
+}
+
+void Boss::setResult(const VoteRecord& rec)
+{
+	// Records arrive in input order, the ring writer drains them so
+	if (_fout != NULL &&
+			(fwrite(rec.context, 1, rec.context_len, _fout) != rec.context_len ||
+			fputc('\t', _fout) == EOF ||
+			fwrite(rec.result, 1, rec.result_len, _fout) != rec.result_len ||
+			fputc('\n', _fout) == EOF)) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	if (_stream != NULL) {
+		writeStream(rec);
+	}
+
+	if (_bw != NULL && !_bw->add(rec.context, rec.context_len,
+				(const unsigned char *)rec.task, rec.task_len,
+				(const unsigned char *)rec.result, rec.result_len)) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	if (_tally != NULL && rec.counted) {
+		logVote(rec);
+	}
+
+	if (_ckpt != NULL && rec.no - _ckpt->line_nr >= CHECKPOINT_INTERVAL) {
+		saveCheckpoint(rec.no, rec.end);
+	}
+
+	_pc->set(rec.end - _progress_base, "Dekrüpteerin hääli");
+
+	if (_telemetry != NULL) {
+		_telemetry->voteDone();
+	}
+}
+
+/*
+ * Report progress and throughput as JSON lines to fd, or as the latest
+ * line in status_file, every interval seconds, see telemetry.h.
+ * */
+void Boss::useTelemetry(int fd, const std::string& status_file,
+		unsigned int interval)
+{
+	_telemetry = new Telemetry(fd, status_file, interval);
+}
+
+Telemetry* Boss::telemetry() const
+{
+	return _telemetry;
+}
+
+const ProgressBar* Boss::progress() const
+{
+	return _pc;
+}
+
+/*
+ * Write a checkpoint into path every CHECKPOINT_INTERVAL votes. With
+ * resume an existing checkpoint is continued from.
+ * */
+void Boss::useCheckpoint(const std::string& path, bool resume)
+{
+	_ckpt = new Checkpoint(path);
+	_resume = resume;
+}
+
+void Boss::saveCheckpoint(int line_nr, size_t input_offset)
+{
+	if (fflush(_fout) != 0 || fsync(fileno(_fout)) != 0) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	_ckpt->input_size = _vf.size();
+	_ckpt->line_nr = line_nr;
+	_ckpt->input_offset = input_offset;
+	_ckpt->output_offset = ftell(_fout);
+
+	if (!_ckpt->save()) {
+		fprintf(stderr, "Error writing checkpoint %s: %s\n",
+				_ckpt->path().c_str(), strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+}
+
+/*
+ * Continues from the checkpoint if there is one. The output is cut back
+ * to what the checkpoint covers, anything after it is written again.
+ * */
+bool Boss::resumeWork()
+{
+	bool found = false;
+	if (!_ckpt->load(found)) {
+		fprintf(stderr, "Error reading checkpoint %s: %s\n",
+				_ckpt->path().c_str(), strerror(errno));
 		exit(EXIT_ERROR_READING_INPUT);
 	}
+	if (!found) {
+		return false;
+	}
+
+	// A checkpoint of another shard must not be continued from
+	if (_ckpt->input_size != _vf.size() ||
+			(_fragment != NULL &&
+			 (_ckpt->input_offset < _fragment->begin ||
+			  _ckpt->line_nr < _fragment->first_line - 1 ||
+			  _ckpt->output_offset < _header_len)) ||
+			!_vf.seek(_ckpt->input_offset, _ckpt->line_nr)) {
+		fprintf(stderr, "Checkpoint %s does not match the votes file\n",
+				_ckpt->path().c_str());
+		exit(EXIT_ERROR_READING_INPUT);
+	}
+
+	_fout = fopen(_out.c_str(), "r+");
+	if (_fout == NULL) {
+		exit(EXIT_CANNOT_OPEN_DECRYPTED_VOTES_FILE_FOR_WRITING);
+	}
+	if (ftruncate(fileno(_fout), _ckpt->output_offset) != 0 ||
+			fseek(_fout, 0, SEEK_END) != 0 ||
+			ftell(_fout) != (long)_ckpt->output_offset) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	_line_nr = _ckpt->line_nr;
+	_pc->set(_vf.position() - _progress_base, "Dekrüpteerin hääli");
+	return true;
+}
 
-	return -1;
+/*
+ * Decrypt only shard of shards (1..shards) of the votes file and write
+ * it as a fragment, see fragment.h. merge_fragments puts the fragments
+ * of all shards together into what a single run would have written.
+ * */
+void Boss::useShard(int shard, int shards)
+{
+	_fragment = new Fragment();
+	_fragment->shard = shard;
+	_fragment->shards = shards;
 }
 
-void Boss::setResult(const std::string& result, const std::string& context, int no)
+void Boss::prepareShard(size_t body)
 {
-	std::string decrypted_line = context + "\t" + result + "\n";
+	_fragment->measure(_vf.data(), _vf.size(), body);
 
-	if (no == _last_saved + 1) {
-		if (fputs(decrypted_line.c_str(), _fout) == EOF) {
-			fprintf(stderr, "Error writing output: %s\n", strerror(errno));
-			exit(EXIT_ERROR_WRITING_OUTPUT);
-		}
-		_last_saved++;
+	if (!_vf.seek(_fragment->begin, _fragment->first_line - 1) ||
+			!_vf.limit(_fragment->end)) {
+		fprintf(stderr, "Error reading input: cannot seek to shard %d/%d\n",
+				_fragment->shard, _fragment->shards);
+		exit(EXIT_ERROR_READING_INPUT);
+	}
 
-		while (!_cache.empty()) {
-			if (_cache.count(_last_saved + 1) > 0) {
-				if (fputs(_cache[_last_saved + 1].c_str(), _fout) == EOF) {
-					fprintf(stderr, "Error writing output: %s\n", strerror(errno));
-					exit(EXIT_ERROR_WRITING_OUTPUT);
-				}
-				_cache.erase(_last_saved + 1);
-				_last_saved++;
-			}
-			else {
-				break;
+	_header_len = _fragment->header().size();
+	_progress_base = _fragment->begin;
+}
+
+/*
+ * The output digest covers the fragment after the header, it is read
+ * back once everything is written. The header keeps its length, so it
+ * is overwritten in place.
+ * */
+void Boss::finishFragment()
+{
+	if (fflush(_fout) != 0) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	int fd = fileno(_fout);
+	std::vector<char> buf(DIGEST_CHUNK);
+	FragmentDigest md;
+	off_t off = _header_len;
+	ssize_t n;
+	while ((n = pread(fd, &buf[0], buf.size(), off)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			fprintf(stderr, "Error reading output: %s\n", strerror(errno));
+			exit(EXIT_ERROR_READING_INPUT);
 		}
+		md.update(&buf[0], n);
+		off += n;
 	}
-	else {
-		assert(_cache.count(no) == 0);
-		_cache[no] = decrypted_line;
+	_fragment->output_digest = md.hex();
+
+	std::string header = _fragment->header();
+	assert(header.size() == _header_len);
+	if (pwrite(fd, header.data(), header.size(), 0) != (ssize_t)header.size()) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
 	}
 
-	_pc->next("Dekrüpteerin hääli");
+	printf("Osa %d/%d: read %d-%d, %d häält.\n", _fragment->shard,
+			_fragment->shards, _fragment->first_line, _fragment->last_line,
+			_fragment->last_line - _fragment->first_line + 1);
+}
 
+/*
+ * Count the decrypted votes in the workers instead of leaving it to
+ * hlr.py. The results by district and by station and the log4 and log5
+ * entries of the votes are written into the given files.
+ * */
+void Boss::useTally(const std::string& choices, const std::string& result,
+		const std::string& result_stat, const std::string& log4,
+		const std::string& log5)
+{
+	_tally = new Tally();
+	if (!_tally->load(choices.c_str())) {
+		if (errno == EINVAL) {
+			fprintf(stderr, "Invalid choices file %s: line nr %d\n",
+					choices.c_str(), _tally->badLine());
+		}
+		else {
+			fprintf(stderr, "Error reading choices file %s: %s\n",
+					choices.c_str(), strerror(errno));
+		}
+		exit(EXIT_INVALID_CHOICES_FILE);
+	}
+	_counts.assign(_tally->slots(), 0);
+
+	_result = result;
+	_result_stat = result_stat;
+	_log4_path = log4;
+	_log5_path = log5;
 }
 
+const Tally* Boss::tally() const
+{
+	return _tally;
+}
 
-void Boss::prepareWork()
+void Boss::addCounts(const TallyCounts& counts, unsigned long uncounted)
 {
-	char line[LINE_MAX_LEN];
-	int lines = countLines(_in.c_str());
-	if (lines < 0) {
-		fprintf(stderr, "Error reading input: %s\n", strerror(errno));
-		exit(EXIT_ERROR_READING_INPUT);
+	pthread_mutex_lock(&_counts_mutex);
+	Tally::merge(_counts, counts);
+	_uncounted += uncounted;
+	pthread_mutex_unlock(&_counts_mutex);
+}
+
+void Boss::openLog(const std::string& path, FILE *&f)
+{
+	f = fopen(path.c_str(), "w");
+	if (f == NULL) {
+		fprintf(stderr, "Error writing %s: %s\n", path.c_str(), strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
 	}
-	else {
-		if (lines == 0) {
+}
+
+void Boss::closeLog(const std::string& path, FILE *&f)
+{
+	bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	f = NULL;
+	if (!ok) {
+		fprintf(stderr, "Error writing %s: %s\n", path.c_str(), strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+}
+
+/*
+ * The entry hlr.py would log for the vote, EvLogFormat of type 4 or 5:
+ * time, hash of the encrypted vote and the district.
+ * */
+void Boss::logVote(const VoteRecord& rec)
+{
+	time_t now = time(NULL);
+	if (now != _log_time) {
+		struct tm tm;
+		localtime_r(&now, &tm);
+		strftime(_log_stamp, sizeof(_log_stamp), "%Y%m%d%H%M%S", &tm);
+		_log_time = now;
+	}
+
+	// Third and fourth field of the line, the tally checked there are
+	// at least five
+	const char *p = (const char *)memchr(rec.context, '\t', rec.context_len);
+	p = (const char *)memchr(p + 1, '\t', rec.context + rec.context_len - p - 1) + 1;
+	const char *q = (const char *)memchr(p, '\t', rec.context + rec.context_len - p);
+	q = (const char *)memchr(q + 1, '\t', rec.context + rec.context_len - q - 1);
+
+	if (fprintf(rec.valid ? _log5 : _log4, "%s\t%s\t%.*s\n",
+				_log_stamp, rec.vote_hash, (int)(q - p), p) < 0) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+}
+
+void Boss::finishTally()
+{
+	closeLog(_log4_path, _log4);
+	closeLog(_log5_path, _log5);
+
+	if (!_tally->writeDistricts(_result.c_str(), _counts)) {
+		fprintf(stderr, "Error writing %s: %s\n", _result.c_str(), strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+	if (!_tally->writeStations(_result_stat.c_str(), _counts)) {
+		fprintf(stderr, "Error writing %s: %s\n", _result_stat.c_str(), strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	printf("Hääled (%lu) on loetud.\n", Tally::total(_counts));
+	if (_uncounted > 0) {
+		printf("Jaoskonnata hääli (%lu) ei loetud.\n", _uncounted);
+	}
+}
+
+/*
+ * Everything is written, make it durable and drop the checkpoint.
+ * */
+void Boss::finishWork()
+{
+	if (_fragment != NULL) {
+		finishFragment();
+	}
+
+	if (_fout != NULL && (fflush(_fout) != 0 || fsync(fileno(_fout)) != 0)) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	if (_stream != NULL && !_stream->close()) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	if (_bw != NULL && !_bw->finish()) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+
+	if (_tally != NULL) {
+		finishTally();
+	}
+
+	if (_ckpt != NULL && !_ckpt->remove()) {
+		fprintf(stderr, "Error removing checkpoint %s: %s\n",
+				_ckpt->path().c_str(), strerror(errno));
+		exit(EXIT_ERROR_WRITING_OUTPUT);
+	}
+}
+
+
+void Boss::prepareBinary()
+{
+	if (!_bf.open(_in.c_str())) {
+		if (errno == EINVAL) {
+			fprintf(stderr, "Invalid binary votes file %s\n", _in.c_str());
 			exit(EXIT_INVALID_VOTES_FILE_FORMAT_NO_VERSION_NUMBER);
 		}
-		if (lines == 1) {
-			exit(EXIT_INVALID_VOTES_FILE_FORMAT_NO_IDENTIFICATOR);
+		exit(EXIT_CANNOT_OPEN_VOTES_FILE_FOR_READING);
+	}
+	if (_bf.hasResults()) {
+		fprintf(stderr, "Votes file %s is already decrypted\n", _in.c_str());
+		exit(EXIT_INVALID_VOTES_FILE_FORMAT_NO_VERSION_NUMBER);
+	}
+
+	_pc = new ProgressBar(_bf.size());
+
+	if (_tally != NULL) {
+		openLog(_log4_path, _log4);
+		openLog(_log5_path, _log5);
+	}
+
+	if (writesOutput()) {
+		_bw = new BinaryVoteWriter();
+		if (!_bw->open(_out.c_str(), _bf.version(), _bf.elid(),
+					_bf.cipherLength(), true)) {
+			exit(EXIT_CANNOT_OPEN_DECRYPTED_VOTES_FILE_FOR_WRITING);
 		}
 	}
 
-	_pc = new ProgressBar(lines);
+	_line_nr = 2;
+	_binary_end = _bf.start();
+	_pc->set(_bf.start(), "Dekrüpteerin hääli");
+}
 
-	_fin = fopen(_in.c_str(), "r");
-	if (_fin == NULL) {
+void Boss::prepareWork()
+{
+	const char *version;
+	const char *elid;
+	size_t version_len;
+	size_t elid_len;
+
+	if (_binary) {
+		prepareBinary();
+		return;
+	}
+
+	if (!_vf.open(_in.c_str())) {
 		exit(EXIT_CANNOT_OPEN_VOTES_FILE_FOR_READING);
 	}
-	_fout = fopen(_out.c_str(), "w");
-	if (_fout  == NULL) {
-		exit(EXIT_CANNOT_OPEN_DECRYPTED_VOTES_FILE_FOR_WRITING);
+	if (!_vf.map()) {
+		fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+		exit(EXIT_ERROR_READING_INPUT);
 	}
 
-	if (fgets(line, LINE_MAX_LEN, _fin) == NULL) {
+	if (!_vf.next(version, version_len)) {
 		exit(EXIT_INVALID_VOTES_FILE_FORMAT_NO_VERSION_NUMBER);
 	}
-	fputs(line, _fout);
-
-	if (fgets(line, LINE_MAX_LEN, _fin) == NULL) {
+	if (!_vf.next(elid, elid_len)) {
 		exit(EXIT_INVALID_VOTES_FILE_FORMAT_NO_IDENTIFICATOR);
 	}
-	fputs(line, _fout);
 
 	_line_nr = 2;
-	_last_saved = 2;
+	if (_fragment != NULL) {
+		prepareShard(_vf.position());
+		_line_nr = _fragment->first_line - 1;
+	}
+
+	// Progress is measured in input bytes, so no separate pass is
+	// needed to count the lines first
+	_pc = new ProgressBar(_fragment != NULL ?
+			_fragment->end - _fragment->begin : _vf.size());
+
+	if (_ckpt != NULL && _resume && resumeWork()) {
+		return;
+	}
+
+	if (_tally != NULL) {
+		openLog(_log4_path, _log4);
+		openLog(_log5_path, _log5);
+	}
+
+	if (writesOutput() && _stream != NULL) {
+		prepareStream(version, version_len, elid, elid_len);
+	}
+	else if (writesOutput()) {
+		// A fragment is read back for its digest
+		_fout = fopen(_out.c_str(), _fragment != NULL ? "w+" : "w");
+		if (_fout  == NULL) {
+			exit(EXIT_CANNOT_OPEN_DECRYPTED_VOTES_FILE_FOR_WRITING);
+		}
+
+		// Filled in with the output digest by finishFragment()
+		if (_fragment != NULL) {
+			std::string header = _fragment->header();
+			fwrite(header.data(), 1, header.size(), _fout);
+		}
+
+		fwrite(version, 1, version_len, _fout);
+		fputc('\n', _fout);
+		fwrite(elid, 1, elid_len, _fout);
+		fputc('\n', _fout);
+	}
+
+	_pc->set(_vf.position() - _progress_base, "Dekrüpteerin hääli");
+
+	if (_ckpt != NULL) {
+		saveCheckpoint(_line_nr, _vf.position());
+	}
 }
 
-Session* Boss::getSession()
+/*
+ * One entry per device the workers are spread over: every token logged
+ * in to, or the single software or dummy backend.
+ * */
+void Boss::prepareDevices()
 {
+	std::vector<std::string> names;
+
+	if (_key != NULL) {
+		names.push_back("OpenSSL");
+	}
+	else {
 #ifndef WITHOUT_PKCS11
-	return _p->getSession();
+		for (size_t i = 0; i < _p->deviceCount(); i++) {
+			names.push_back(_p->deviceName(i));
+		}
 #else
-	return NULL;
+		names.push_back("WITHOUT_PKCS11");
 #endif
+	}
+
+	_devices.resize(names.size());
+	for (size_t i = 0; i < names.size(); i++) {
+		_devices[i].name = names[i];
+		_devices[i].workers = 0;
+		_devices[i].votes = 0;
+		_devices[i].failed = 0;
+		_devices[i].recoveries = 0;
+		_devices[i].rejected = 0;
+		_devices[i].busy_usec = 0;
+	}
+}
+
+void Boss::printStats() const
+{
+	for (size_t i = 0; i < _devices.size(); i++) {
+		const DeviceStats& d = _devices[i];
+		double ms = d.votes > 0 ? d.busy_usec / 1000.0 / d.votes : 0;
+		printf("Seade '%s': %lu häält, %lu nurjunud, %lu tagasi lükatud, "
+				"%lu sessiooni taastatud, %d lõime, %.2f ms häälele\n",
+				d.name.c_str(), d.votes, d.failed, d.rejected, d.recoveries,
+				d.workers, ms);
+	}
 }
 
 void Boss::preparePKCS11(const std::string& token, const std::string& pin)
@@ -219,110 +875,403 @@ void Boss::preparePKCS11(const std::string& token, const std::string& pin)
 void Boss::cleanupPKCS11()
 {
 #ifndef WITHOUT_PKCS11
-	_p->logout();
-	_p = NULL;
+	if (_p != NULL) {
+		_p->logout();
+		_p = NULL;
+	}
 #endif
 }
 
+/*
+ * Decrypt with an exported private key instead of the token.
+ * */
+void Boss::useKeyFile(const std::string& path)
+{
+	_key = OpenSSLDecryptor::loadKey(path.c_str());
+}
+
+/*
+ * Workers are spread round-robin over the devices. They all pull from
+ * the same ring, so a faster device simply comes back for more votes.
+ * */
+Decryptor* Boss::createDecryptor(long worker, DeviceStats *&stats)
+{
+	size_t device = worker % _devices.size();
+	stats = &_devices[device];
+	__sync_fetch_and_add(&stats->workers, 1);
+
+	if (_key != NULL) {
+		return new OpenSSLDecryptor(_key);
+	}
+
+	Session *sess = NULL;
+	pthread_mutex_lock(&session_mutex);
+	try {
+#ifndef WITHOUT_PKCS11
+		sess = _p->getSession(device);
+#endif
+	}
+	catch (...) {
+		pthread_mutex_unlock(&session_mutex);
+		throw;
+	}
+	pthread_mutex_unlock(&session_mutex);
+
+	try {
+		return new Pkcs11Decryptor(_p, device, sess, _label, retry_count);
+	}
+	catch (...) {
+		delete sess;
+		throw;
+	}
+}
+
 /*
  *
  * Class Worker
  *
  * */
 
-Worker::Worker(Session *s)
+Worker::Worker(Decryptor *d, DeviceStats *stats, unsigned int batch,
+		const Tally *tally, bool raw_input, ResultFormat result)
 {
-	_sess = s;
+	_dec = d;
+	_stats = stats;
+	_telemetry = NULL;
+	_batch = batch;
+	_tally = tally;
+	_raw_input = raw_input;
+	_result = result;
+	_cipher = NULL;
+	_cipher_len = 0;
 	_ctx = NULL;
 	_ctx_len = 0;
+	_input_len = 0;
+	_uncounted = 0;
 }
 
 Worker::~Worker()
 {
+	free(_cipher);
 	free(_ctx);
 }
 
-void Worker::init(const std::string& label)
+/*
+ * All buffers of the hot loop are sized here once, one ciphertext and
+ * one plaintext per vote in a batch, both from the key modulus. A
+ * ciphertext of another length is rejected before it is decoded, only
+ * without a known modulus does the slot fit the longest accepted line.
+ * */
+void Worker::init()
 {
-#ifndef WITHOUT_PKCS11
-	_sess->setCurrentPrivKey(label);
-	_ctx_len = _sess->getRSAModulusLen();
+	_ctx_len = _dec->outputLength();
+	if (_ctx_len < sizeof(CORRUPTED_VOTE)) {
+		_ctx_len = sizeof(CORRUPTED_VOTE);
+	}
+	_input_len = _dec->inputLength();
+	// Raw ciphertexts are decrypted where they are mapped
+	if (_raw_input) {
+		_cipher_len = 1;
+	}
+	else if (_input_len != 0) {
+		_cipher_len = _input_len;
+	}
+	else {
+		_cipher_len = Base64::decodedLength(LINE_MAX_LEN);
+	}
 
-	_ctx = (CK_BYTE_PTR)malloc(_ctx_len);
-	if (_ctx == NULL) {
+	_ctx = (CK_BYTE_PTR)malloc(_batch * _ctx_len);
+	_cipher = (unsigned char *)malloc(_batch * _cipher_len);
+	if (_ctx == NULL || _cipher == NULL) {
 		throw std::bad_alloc();
 	}
-#endif
+
+	_items.resize(_batch);
+	for (unsigned int i = 0; i < _batch; i++) {
+		_items[i].data = (const char *)_cipher + i * _cipher_len;
+		_items[i].out = _ctx + i * _ctx_len;
+	}
+
+	if (_tally != NULL) {
+		_counts.assign(_tally->slots(), 0);
+		_key.reserve(256);
+	}
 }
 
-std::string Worker::solveTask(const std::string& task, Base64 &base64)
+void Worker::useTelemetry(SessionTelemetry *t)
 {
-	struct buffer_st buf;
-	base64.decode(&buf, task.c_str(), task.length());
+	_telemetry = t;
+}
 
-	std::string decrypted_vote;
+const TallyCounts& Worker::counts() const
+{
+	return _counts;
+}
 
-#ifndef WITHOUT_PKCS11
-	try {
-		CK_ULONG tmp_len = _ctx_len;
-		decrypted_vote = _sess->decrypt(buf.data, buf.offset, _ctx, &tmp_len);
+unsigned long Worker::uncounted() const
+{
+	return _uncounted;
+}
+
+void Worker::storeResult(VoteRecord& rec, const unsigned char *data, size_t len)
+{
+	size_t need = _result == RESULT_RAW ? len : Base64::encodedLength(len);
+
+	// Grows only until every slot has seen the longest result
+	if (rec.result_cap < need) {
+		char *p = (char *)realloc(rec.result, need);
+		if (p == NULL) {
+			throw std::bad_alloc();
+		}
+		rec.result = p;
+		rec.result_cap = need;
 	}
-	catch (std::exception &e) {
-		fprintf(stderr, "Vote decryption failed: %s\n", e.what());
-		// Kui hääle dekrüptimine ei õnnestunud, siis paneme "xxx"
-		// hääle asemele, mis kindlasti feilib ja läheb Log4.
-		decrypted_vote = CORRUPTED_VOTE;
+
+	if (_result == RESULT_RAW) {
+		memcpy(rec.result, data, len);
+		rec.result_len = len;
+		return;
 	}
-#else
-	decrypted_vote = "WITHOUTPKCS11";
-#endif
 
-	struct buffer_st buf2;
-	base64.encode(&buf2, decrypted_vote.c_str(),
-				  decrypted_vote.length(), true);
+	rec.result_len = Base64::encodeTo(rec.result, data, len);
+}
+
+void Worker::countVote(VoteRecord& rec, const DecryptItem& item,
+		const unsigned char *data, size_t len)
+{
+	size_t slot = 0;
+	TallyVerdict verdict;
+
+	if (rec.reject != REJECT_NONE) {
+		// Invalid in its station, and without a station not counted at
+		// all, a rejected vote never ends the run
+		verdict = _tally->locate(rec.context, rec.context_len, _key, slot);
+		if (verdict != TALLY_INVALID) {
+			fprintf(stderr, "Rejected vote not counted, no station: "
+					"line nr %d\n", rec.no);
+			rec.valid = false;
+			rec.counted = false;
+			_uncounted++;
+			return;
+		}
+	}
+	else {
+		verdict = _tally->classify(rec.context, rec.context_len, data, len,
+				_key, slot);
+	}
 
-	std::string ret(buf2.data, buf2.offset);
+	switch (verdict) {
+		case TALLY_VALID:
+			rec.valid = true;
+			break;
+		case TALLY_INVALID:
+			rec.valid = false;
+			break;
+		case TALLY_UNKNOWN_STATION:
+			fprintf(stderr, "Unknown district or station: line nr %d\n", rec.no);
+			exit(EXIT_UNKNOWN_STATION);
+		default:
+			fprintf(stderr, "Invalid vote line format: line nr %d\n", rec.no);
+			exit(EXIT_INVALID_VOTES_FILE_LINE_FORMAT);
+	}
+	rec.counted = true;
+	_counts[slot]++;
 
-	buffer_delete(&buf);
-	buffer_delete(&buf2);
-	return ret;
+	unsigned char md[SHA_DIGEST_LENGTH];
+	SHA1((const unsigned char *)item.data, item.len, md);
+	rec.vote_hash[Base64::encodeTo(rec.vote_hash, md, sizeof(md))] = '\0';
+}
+
+static const char* rejectReason(int reject)
+{
+	switch (reject) {
+		case REJECT_LINE_FORMAT:
+			return "line-format";
+		case REJECT_LINE_TOO_LONG:
+			return "line-too-long";
+		case REJECT_BASE64:
+			return "base64";
+		case REJECT_LENGTH:
+			return "length";
+		case REJECT_BAD_RECORD:
+			return "bad-record";
+		default:
+			return "unknown";
+	}
+}
+
+/*
+ * Takes the ciphertext of rec into item, or tells why it cannot decrypt.
+ * */
+int Worker::prepareItem(const VoteRecord& rec, DecryptItem& item)
+{
+	if (_raw_input) {
+		if (_input_len != 0 && rec.task_len != _input_len) {
+			return REJECT_LENGTH;
+		}
+		item.data = rec.task;
+		item.len = rec.task_len;
+		return REJECT_NONE;
+	}
+
+	size_t decoded = 0;
+	if (!Base64::validate(rec.task, rec.task_len, decoded)) {
+		return REJECT_BASE64;
+	}
+	// Checked before decoding, the slot holds no more
+	if ((_input_len != 0 && decoded != _input_len) || decoded > _cipher_len) {
+		return REJECT_LENGTH;
+	}
+	item.len = Base64::decodeTo((unsigned char *)item.data, rec.task,
+			rec.task_len);
+	return REJECT_NONE;
+}
+
+/*
+ * The votes are checked here, by all the workers at once, so that the
+ * token gets only the ciphertexts that can decrypt. The rest are written
+ * as corrupted votes right away.
+ * */
+void Worker::solveBatch(VoteRecord *const *recs, unsigned int count)
+{
+	assert(count <= _batch);
+
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		if (recs[i]->reject == REJECT_NONE) {
+			recs[i]->reject = prepareItem(*recs[i], _items[n]);
+		}
+		if (recs[i]->reject != REJECT_NONE) {
+			continue;
+		}
+		_items[n].out_len = _ctx_len;
+		n++;
+	}
+	unsigned int rejected = count - n;
+
+	struct timeval start;
+	struct timeval end;
+
+	gettimeofday(&start, NULL);
+	if (_telemetry != NULL) {
+		_telemetry->begin(start.tv_sec * 1000000ULL + start.tv_usec);
+	}
+	size_t failed = n > 0 ? _dec->decryptBatch(_items, n) : 0;
+	gettimeofday(&end, NULL);
+
+	unsigned long long usec = (end.tv_sec - start.tv_sec) * 1000000LL +
+		(end.tv_usec - start.tv_usec);
+	__sync_fetch_and_add(&_stats->votes, n);
+	__sync_fetch_and_add(&_stats->failed, failed);
+	__sync_fetch_and_add(&_stats->rejected, rejected);
+	__sync_fetch_and_add(&_stats->busy_usec, usec);
+	if (_telemetry != NULL) {
+		_telemetry->recoveries = _dec->recoveries();
+		_telemetry->end(end.tv_sec * 1000000ULL + end.tv_usec, usec,
+				n, failed, rejected);
+	}
+
+	unsigned int k = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		VoteRecord& rec = *recs[i];
+		DecryptItem rejected_item;
+		const DecryptItem *item = &rejected_item;
+		const unsigned char *data = (const unsigned char *)CORRUPTED_VOTE;
+		size_t len = sizeof(CORRUPTED_VOTE) - 1;
+
+		if (rec.reject != REJECT_NONE) {
+			fprintf(stderr, "Vote rejected (%s): line nr %d\n",
+					rejectReason(rec.reject), rec.no);
+			// The log entry gets the hash of the line as it is
+			rejected_item.data = rec.task;
+			rejected_item.len = rec.task_len;
+		}
+		else {
+			item = &_items[k++];
+			if (item->rc == CKR_OK) {
+				data = item->out;
+				len = item->out_len;
+			}
+			else {
+				fprintf(stderr, "%s\n",
+						describeCKR("Vote decryption failed", item->rc).c_str());
+				// Kui hääle dekrüptimine ei õnnestunud, siis paneme "xxx"
+				// hääle asemele, mis kindlasti feilib ja läheb Log4.
+			}
+		}
+
+		if (_result != RESULT_NONE) {
+			storeResult(rec, data, len);
+		}
+		if (_tally != NULL) {
+			countVote(rec, *item, data, len);
+		}
+	}
+}
+
+void *readerMain(void *t)
+{
+	VoteRecord *rec;
+	while ((rec = ring->acquire()) != NULL) {
+		if (boss->getTask(*rec) < 0) {
+			break;
+		}
+		ring->publish();
+	}
+
+	ring->close();
+	pthread_exit(NULL);
+}
+
+void *writerMain(void *t)
+{
+	VoteRecord *rec;
+	while ((rec = ring->drain()) != NULL) {
+		boss->setResult(*rec);
+		ring->release();
+	}
+
+	pthread_exit(NULL);
 }
 
 void *threadMain(void *t)
 {
 	int *ret = new int;
 	try {
-		pthread_mutex_lock(&boss_mutex);
-		Session *sess = boss->getSession();
-		pthread_mutex_unlock(&boss_mutex);
-
-		Worker *w = new Worker(sess);
+		DeviceStats *stats = NULL;
+		Decryptor *dec = boss->createDecryptor((long)t, stats);
 
-		w->init(boss->label());
+		Worker *w = new Worker(dec, stats, batch_size, boss->tally(),
+				boss->binary(), boss->resultFormat());
 
-		std::string task;
-		std::string ctx;
-		int no;
-		Base64 base64;
+		w->init();
+		if (boss->telemetry() != NULL) {
+			SessionTelemetry *st = boss->telemetry()->session((long)t);
+			st->device = stats->name.c_str();
+			w->useTelemetry(st);
+		}
 
-		while (true) {
-			pthread_mutex_lock(&boss_mutex);
-			no = boss->getTask(task, ctx);
-			pthread_mutex_unlock(&boss_mutex);
+		std::vector<VoteRecord *> recs(batch_size);
+		unsigned long first;
+		unsigned int count;
 
-			if (no > -1) {
-				std::string res = w->solveTask(task, base64);
-				pthread_mutex_lock(&boss_mutex);
-				boss->setResult(res, ctx, no);
-				pthread_mutex_unlock(&boss_mutex);
+		while ((count = ring->claim(batch_size, first)) > 0) {
+			for (unsigned int i = 0; i < count; i++) {
+				recs[i] = &ring->at(first + i);
 			}
-			else {
-				break;
+			w->solveBatch(&recs[0], count);
+			for (unsigned int i = 0; i < count; i++) {
+				ring->complete(first + i);
 			}
 		}
 
+		if (boss->tally() != NULL) {
+			boss->addCounts(w->counts(), w->uncounted());
+		}
+		__sync_fetch_and_add(&stats->recoveries, dec->recoveries());
+
 		delete w;
-		delete sess;
+		delete dec;
 		*ret = 0;
 	}
 	catch (std::exception& e) {
@@ -334,17 +1283,32 @@ void *threadMain(void *t)
 		fprintf(stderr, "Unknown exception caught\n");
 	}
 
+	if (*ret != 0) {
+		// A vote claimed by this thread would never complete and
+		// the writer would wait for it forever
+		ring->abort();
+	}
+
 	pthread_exit(ret);
 }
 
-int createThreads(int num)
+int createThreads(int num, int window)
 {
-	assert(num <= MAX_THREADS);
-	pthread_t threads[MAX_THREADS];
+	assert(num > 0 && num <= MAX_THREADS);
+	std::vector<pthread_t> threads(num);
+	pthread_t reader;
+	pthread_t writer;
 	pthread_attr_t attr;
 	int *status = NULL;
 	int ret = 1;
 
+	ring = new VoteRing(window);
+
+	Telemetry *telemetry = boss->telemetry();
+	if (telemetry != NULL) {
+		telemetry->start(boss->progress(), ring, num);
+	}
+
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
@@ -356,6 +1320,12 @@ int createThreads(int num)
 		}
 	}
 
+	if (pthread_create(&reader, &attr, readerMain, NULL) ||
+			pthread_create(&writer, &attr, writerMain, NULL)) {
+		printf("ERROR; cannot create reader or writer thread\n");
+		return -1;
+	}
+
 	pthread_attr_destroy(&attr);
 
 	for (int t = 0; t < num; t++) {
@@ -363,44 +1333,405 @@ int createThreads(int num)
 		if (*status == -1) {
 			ret = -1;
 		}
+		delete status;
+	}
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+
+	if (ring->aborted()) {
+		ret = -1;
+	}
+	if (telemetry != NULL) {
+		telemetry->stop(ret != -1);
 	}
+	if (!ring->aborted()) {
+		printf("Järjestamisakna suurim täituvus: %lu/%lu\n",
+				ring->peak(), ring->window());
+		boss->printStats();
+	}
+
+	delete ring;
+	ring = NULL;
 
 	return ret;
 }
 
+/*
+ * Worker count for --threads auto. Each worker holds its own session, so
+ * when all tokens report a session limit their sum decides it, otherwise
+ * one worker per online CPU. Every token gets at least one worker.
+ * */
+int autoThreads(PKCS11 *p)
+{
+	long num = 0;
+	long devices = 1;
+
+#ifndef WITHOUT_PKCS11
+	if (p != NULL) {
+		devices = p->deviceCount();
+		for (size_t i = 0; i < p->deviceCount(); i++) {
+			CK_ULONG free_sessions;
+			if (!p->getFreeSessionCount(i, free_sessions)) {
+				num = 0;
+				break;
+			}
+			num += free_sessions;
+		}
+	}
+#endif
+	if (num <= 0) {
+		num = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	if (num < devices) {
+		num = devices;
+	}
+	if (num < 1) {
+		num = 1;
+	}
+	if (num > AUTO_THREADS_LIMIT) {
+		num = AUTO_THREADS_LIMIT;
+	}
+
+	return num;
+}
+
 void usage(const char *self)
 {
 	printf("Kasutamine:\n");
-	printf("    %s <input file> <output file> <token name> "
+	printf("    %s [--threads N|auto] [--window N] [--batch N] "
+		   "<input file> <output file> <token name>[,<token name>...] "
 		   "<priv key label> <PIN> <PKCS11 lib>\n", self);
+	printf("    %s [--threads N|auto] [--window N] [--batch N] "
+		   "--key-file <private key> <input file> <output file>\n", self);
+	printf("\n    --threads N     dekrüpteerivate lõimede arv "
+		   "(vaikimisi %d, maksimaalselt %d)\n", DEFAULT_THREADS, MAX_THREADS);
+	printf("    --threads auto  lõimede arv tuvastatakse tokeni "
+		   "sessioonide ja protsessorite arvu järgi\n");
+	printf("    --window N      kui mitu häält võib olla väljundi "
+		   "kirjutamisest ees (vaikimisi %d)\n", DEFAULT_WINDOW);
+	printf("    --batch N       mitu häält lõim korraga dekrüpteerib "
+		   "(vaikimisi %d)\n", DEFAULT_BATCH);
+	printf("    --retries N     mitu korda proovitakse tokeni mööduva vea "
+		   "järel häält uues\n                    sessioonis uuesti "
+		   "(vaikimisi %d, 0 ei proovi)\n", DEFAULT_RETRIES);
+	printf("    --key-file F    dekrüpteeri eksporditud PEM võtmega "
+		   "tarkvaras, ilma HSM-ita\n");
+	printf("    --checkpoint F  kirjuta iga %d hääle järel faili F "
+		   "kontrollpunkt\n", CHECKPOINT_INTERVAL);
+	printf("    --resume        jätka kontrollpunktist, kui see on "
+		   "olemas (vajab --checkpoint)\n");
+	printf("    --tally F       loe hääled kohe kokku, F on jaoskondade "
+		   "lubatud valikute nimekiri\n");
+	printf("    --result F      ringkondade kaupa tulemus (vajab --tally)\n");
+	printf("    --result-stat F jaoskondade kaupa tulemus (vajab --tally)\n");
+	printf("    --log4 F        kehtetute häälte logikirjed (vajab --tally)\n");
+	printf("    --log5 F        arvestatud häälte logikirjed (vajab --tally)\n");
+	printf("    --shard i/N     dekrüpteeri N-st võrdsest osast ainult i-s, "
+		   "väljundiks on\n                    fragment, osad ühendab "
+		   "merge_fragments\n");
+	printf("    --binary        sisend ja väljund on binaarkujul, vt "
+		   "convert_votes\n");
+	printf("    --stream        kirjuta väljund eraldi lõimest, ka torusse "
+		   "või standardväljundisse\n                    (/dev/stdout), "
+		   "mida järgmine programm juba loeb\n");
+	printf("    --stream-flush N anna väljund edasi vähemalt iga N hääle "
+		   "järel (vajab --stream)\n");
+	printf("    --stream-fsync  sünkrooni väljund kettale iga puhvri järel "
+		   "(vajab --stream)\n");
+	printf("    --telemetry-fd N kirjuta edenemine ja läbilaskevõime "
+		   "JSON-ridadena failipidemesse N\n");
+	printf("    --status-file F hoia failis F viimast JSON-rida "
+		   "edenemise ja läbilaskevõimega\n");
+	printf("    --telemetry-interval N kirjuta JSON-rida iga N sekundi "
+		   "järel (vaikimisi %d)\n", DEFAULT_TELEMETRY_INTERVAL);
+	printf("\n    Väljundfaili nimi \"%s\" jätab dekrüpteeritud hääled "
+		   "kirjutamata (vajab --tally).\n    Loendamine ei kasuta "
+		   "kontrollpunkte ega osi.\n    Binaarkuju ja --stream ei "
+		   "kasuta kontrollpunkte ega osi.\n", NO_OUTPUT);
+	printf("\n    Tokeni nime asemel võib anda ka pesa kujul slot:N. Mitme "
+		   "tokeni korral jagatakse\n    lõimed nende vahel ja kiirem "
+		   "seade saab rohkem hääli.\n");
+}
+
+/*
+ * Parses a positive number no larger than max, returns -1 otherwise.
+ * */
+int parseCount(const char *arg, long max)
+{
+	char *end = NULL;
+	long n = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || n < 1 || n > max) {
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * Parses i/N of --shard, 1 <= i <= N <= MAX_SHARDS.
+ * */
+bool parseShard(const char *arg, int& shard, int& shards)
+{
+	const char *slash = strchr(arg, '/');
+	if (slash == NULL) {
+		return false;
+	}
+	std::string first(arg, slash - arg);
+	shards = parseCount(slash + 1, MAX_SHARDS);
+	shard = parseCount(first.c_str(), MAX_SHARDS);
+	return shards > 0 && shard > 0 && shard <= shards;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 7) {
+	static struct option long_options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"window", required_argument, NULL, 'w'},
+		{"batch", required_argument, NULL, 'b'},
+		{"retries", required_argument, NULL, 'y'},
+		{"key-file", required_argument, NULL, 'k'},
+		{"checkpoint", required_argument, NULL, 'c'},
+		{"resume", no_argument, NULL, 'r'},
+		{"tally", required_argument, NULL, 'T'},
+		{"result", required_argument, NULL, 'R'},
+		{"result-stat", required_argument, NULL, 'S'},
+		{"log4", required_argument, NULL, '4'},
+		{"log5", required_argument, NULL, '5'},
+		{"shard", required_argument, NULL, 's'},
+		{"binary", no_argument, NULL, 'B'},
+		{"stream", no_argument, NULL, 'o'},
+		{"stream-flush", required_argument, NULL, 'F'},
+		{"stream-fsync", no_argument, NULL, 'Y'},
+		{"telemetry-fd", required_argument, NULL, 'm'},
+		{"status-file", required_argument, NULL, 'M'},
+		{"telemetry-interval", required_argument, NULL, 'i'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int threads = DEFAULT_THREADS;
+	int window = DEFAULT_WINDOW;
+	bool auto_threads = false;
+	const char *key_file = NULL;
+	const char *checkpoint = NULL;
+	bool resume = false;
+	const char *tally = NULL;
+	const char *result = NULL;
+	const char *result_stat = NULL;
+	const char *log4 = NULL;
+	const char *log5 = NULL;
+	int shard = 0;
+	int shards = 0;
+	bool binary = false;
+	bool stream = false;
+	int stream_flush = 0;
+	bool stream_fsync = false;
+	int telemetry_fd = -1;
+	const char *status_file = NULL;
+	int telemetry_interval = 0;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "t:w:b:y:k:c:rT:R:S:4:5:s:BoF:Ym:M:i:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 't':
+				if (strcmp(optarg, "auto") == 0) {
+					auto_threads = true;
+				}
+				else {
+					threads = parseCount(optarg, MAX_THREADS);
+					if (threads < 0) {
+						fprintf(stderr, "Invalid thread count: %s\n", optarg);
+						usage(argv[0]);
+						return EXIT_INVALID_ARGUMENT_COUNT;
+					}
+					auto_threads = false;
+				}
+				break;
+			case 'w':
+				window = parseCount(optarg, MAX_WINDOW);
+				if (window < 0) {
+					fprintf(stderr, "Invalid window size: %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			case 'b': {
+				int n = parseCount(optarg, MAX_BATCH);
+				if (n < 0) {
+					fprintf(stderr, "Invalid batch size: %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				batch_size = n;
+				break;
+			}
+			case 'y': {
+				int n = strcmp(optarg, "0") == 0 ? 0 :
+					parseCount(optarg, MAX_RETRIES);
+				if (n < 0) {
+					fprintf(stderr, "Invalid retry count: %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				retry_count = n;
+				break;
+			}
+			case 'k':
+				key_file = optarg;
+				break;
+			case 'c':
+				checkpoint = optarg;
+				break;
+			case 'r':
+				resume = true;
+				break;
+			case 'T':
+				tally = optarg;
+				break;
+			case 'R':
+				result = optarg;
+				break;
+			case 'S':
+				result_stat = optarg;
+				break;
+			case '4':
+				log4 = optarg;
+				break;
+			case '5':
+				log5 = optarg;
+				break;
+			case 's':
+				if (!parseShard(optarg, shard, shards)) {
+					fprintf(stderr, "Invalid shard: %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			case 'B':
+				binary = true;
+				break;
+			case 'o':
+				stream = true;
+				break;
+			case 'F':
+				stream_flush = parseCount(optarg, MAX_WINDOW);
+				if (stream_flush < 0) {
+					fprintf(stderr, "Invalid flush interval: %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			case 'Y':
+				stream_fsync = true;
+				break;
+			case 'm':
+				telemetry_fd = parseCount(optarg, 65535);
+				if (telemetry_fd < 0 || fcntl(telemetry_fd, F_GETFD) == -1) {
+					fprintf(stderr, "Invalid file descriptor: %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			case 'M':
+				status_file = optarg;
+				break;
+			case 'i':
+				telemetry_interval = parseCount(optarg, MAX_TELEMETRY_INTERVAL);
+				if (telemetry_interval < 0) {
+					fprintf(stderr, "Invalid telemetry interval: %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_INVALID_ARGUMENT_COUNT;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_INVALID_ARGUMENT_COUNT;
+		}
+	}
+
+	if (argc - optind != (key_file != NULL ? 2 : 6) ||
+			(resume && checkpoint == NULL)) {
+		usage(argv[0]);
+		return EXIT_INVALID_ARGUMENT_COUNT;
+	}
+	char **args = argv + optind;
+
+	// The counts are not in the checkpoint, a tally starts over. The
+	// counts of shards are not merged, the tally needs the whole file
+	bool has_tally_files = result != NULL && result_stat != NULL &&
+		log4 != NULL && log5 != NULL;
+	if ((tally != NULL && (!has_tally_files || checkpoint != NULL)) ||
+			(tally == NULL && (result != NULL || result_stat != NULL ||
+				log4 != NULL || log5 != NULL ||
+				strcmp(args[1], NO_OUTPUT) == 0)) ||
+			(shards > 0 && tally != NULL) ||
+			(binary && (checkpoint != NULL || shards > 0)) ||
+			(stream && (checkpoint != NULL || shards > 0 || binary ||
+				strcmp(args[1], NO_OUTPUT) == 0)) ||
+			(!stream && (stream_flush > 0 || stream_fsync)) ||
+			(telemetry_interval > 0 && telemetry_fd < 0 &&
+				status_file == NULL)) {
 		usage(argv[0]);
 		return EXIT_INVALID_ARGUMENT_COUNT;
 	}
 
 	int ret = EXIT_OK;
 
-	pthread_mutex_init(&boss_mutex, NULL);
+	pthread_mutex_init(&session_mutex, NULL);
 
 	try {
 		PKCS11 *p11 = NULL;
+
+		if (key_file != NULL) {
+			OpenSSLDecryptor::initThreads();
+			boss = new Boss(args[0], args[1], NULL, "");
+			boss->useKeyFile(key_file);
+		}
+		else {
 #ifndef WITHOUT_PKCS11
-		p11 = new PKCS11(argv[6]);
+			p11 = new PKCS11(args[5]);
 #endif
-		boss = new Boss(argv[1], argv[2], p11, argv[4]);
-		boss->preparePKCS11(argv[3], argv[5]);
+			boss = new Boss(args[0], args[1], p11, args[3]);
+			boss->preparePKCS11(args[2], args[4]);
+		}
+		if (checkpoint != NULL) {
+			boss->useCheckpoint(checkpoint, resume);
+		}
+		if (tally != NULL) {
+			boss->useTally(tally, result, result_stat, log4, log5);
+		}
+		if (shards > 0) {
+			boss->useShard(shard, shards);
+		}
+		if (binary) {
+			boss->useBinary();
+		}
+		if (stream) {
+			boss->useStream(stream_flush, stream_fsync);
+		}
+		if (telemetry_fd >= 0 || status_file != NULL) {
+			boss->useTelemetry(telemetry_fd,
+					status_file != NULL ? status_file : "",
+					telemetry_interval > 0 ? telemetry_interval :
+					DEFAULT_TELEMETRY_INTERVAL);
+		}
+		boss->prepareDevices();
 		boss->prepareWork();
 
-		if (createThreads(MAX_THREADS) == -1) {
+		if (auto_threads) {
+			threads = autoThreads(p11);
+		}
+
+		if (createThreads(threads, window) == -1) {
 			ret = EXIT_DECRYPT_UTIL_FAILED;
 		}
+		else {
+			boss->finishWork();
+		}
 
 		boss->cleanupPKCS11();
-        delete p11;
+		delete p11;
+		OpenSSLDecryptor::cleanupThreads();
 	}
 	catch (std::exception &e) {
 		fprintf(stderr, "Exception caught: %s\n", e.what());
@@ -411,7 +1742,7 @@ int main(int argc, char **argv)
 		return EXIT_DECRYPT_UTIL_FAILED;
 	}
 
-	pthread_mutex_destroy(&boss_mutex);
+	pthread_mutex_destroy(&session_mutex);
 //	pthread_exit(NULL);
 
 	return ret;
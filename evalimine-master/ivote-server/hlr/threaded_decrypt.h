@@ -15,6 +15,34 @@
 
 class Boss;
 class Worker;
+class Decryptor;
+class Checkpoint;
+class Tally;
+class Fragment;
+class StreamWriter;
+class Telemetry;
+struct SessionTelemetry;
+struct VoteRecord;
+
+// How a worker keeps the plaintext of a vote for the output
+enum ResultFormat {
+	RESULT_NONE = 0,
+	RESULT_BASE64,
+	RESULT_RAW
+};
+
+// Work done by the workers of one decryption device
+struct DeviceStats
+{
+	std::string name;
+	volatile int workers;
+	volatile unsigned long votes;
+	volatile unsigned long failed;
+	volatile unsigned long recoveries;
+	// Not given to the device, see Worker::solveBatch()
+	volatile unsigned long rejected;
+	volatile unsigned long long busy_usec;
+};
 
 class Boss
 {
@@ -25,31 +53,113 @@ class Boss
 
 		void preparePKCS11(const std::string& token, const std::string& pin);
 		void cleanupPKCS11();
-		Session* getSession();
+
+		void useKeyFile(const std::string& path);
+		void prepareDevices();
+		Decryptor* createDecryptor(long worker, DeviceStats *&stats);
+		void printStats() const;
+
+		void useCheckpoint(const std::string& path, bool resume);
+
+		void useTally(const std::string& choices, const std::string& result,
+				const std::string& result_stat, const std::string& log4,
+				const std::string& log5);
+		const Tally* tally() const;
+		void addCounts(const TallyCounts& counts, unsigned long uncounted);
+
+		void useShard(int shard, int shards);
+
+		void useStream(unsigned int flush_votes, bool sync);
+
+		void useTelemetry(int fd, const std::string& status_file,
+				unsigned int interval);
+		Telemetry* telemetry() const;
+		const ProgressBar* progress() const;
+
+		void useBinary();
+		bool binary() const;
+		ResultFormat resultFormat() const;
 
 		void prepareWork();
+		void finishWork();
 
-		int getTask(std::string& task, std::string& context);
+		int getTask(VoteRecord& rec);
 
-		void setResult(const std::string& result, const std::string& context, int no);
+		void setResult(const VoteRecord& rec);
 
 		const std::string& label() const;
+		bool writesOutput() const;
 
 	protected:
 
 	private:
 
-		std::map<int, std::string> _cache;
-		int _last_saved;
-
 		std::string _in;
 		std::string _out;
 		std::string _label;
 		PKCS11 *_p;
-		FILE *_fin;
+		EVP_PKEY *_key;
 		FILE *_fout;
 
 		ProgressBar *_pc;
+		VoteFile _vf;
+
+		std::vector<DeviceStats> _devices;
+
+		Checkpoint *_ckpt;
+		bool _resume;
+
+		bool resumeWork();
+		void saveCheckpoint(int line_nr, size_t input_offset);
+
+		Tally *_tally;
+		TallyCounts _counts;
+		// Rejected votes without a station, in no count and no log
+		unsigned long _uncounted;
+		pthread_mutex_t _counts_mutex;
+		std::string _result;
+		std::string _result_stat;
+		std::string _log4_path;
+		std::string _log5_path;
+		FILE *_log4;
+		FILE *_log5;
+		time_t _log_time;
+		char _log_stamp[16];
+
+		void openLog(const std::string& path, FILE *&f);
+		void closeLog(const std::string& path, FILE *&f);
+		void logVote(const VoteRecord& rec);
+		void finishTally();
+
+		Fragment *_fragment;
+		size_t _header_len;
+		// Where the bytes counted by the progress bar start
+		size_t _progress_base;
+
+		void prepareShard(size_t body);
+		void finishFragment();
+
+		bool _binary;
+		BinaryVoteFile _bf;
+		BinaryVoteWriter *_bw;
+		// End of the last readable record
+		size_t _binary_end;
+
+		void prepareBinary();
+		int getBinaryTask(VoteRecord& rec);
+
+		StreamWriter *_stream;
+		bool _stream_sync;
+		// Votes after which the stream is flushed, 0 when only full
+		// buffers are written
+		unsigned int _flush_votes;
+		unsigned int _unflushed;
+
+		void prepareStream(const char *version, size_t version_len,
+				const char *elid, size_t elid_len);
+		void writeStream(const VoteRecord& rec);
+
+		Telemetry *_telemetry;
 
 		int _line_nr;
 };
@@ -58,20 +168,49 @@ class Worker
 {
 	public:
 
-		Worker(Session *s);
+		Worker(Decryptor *d, DeviceStats *stats, unsigned int batch,
+				const Tally *tally, bool raw_input, ResultFormat result);
 		~Worker();
 
-		void init(const std::string& label);
+		void init();
+		void useTelemetry(SessionTelemetry *t);
 
-		std::string solveTask(const std::string& task, Base64 &base64);
+		void solveBatch(VoteRecord *const *recs, unsigned int count);
+
+		const TallyCounts& counts() const;
+		unsigned long uncounted() const;
 
 	protected:
 
 	private:
 
+		int prepareItem(const VoteRecord& rec, DecryptItem& item);
+		void storeResult(VoteRecord& rec, const unsigned char *data, size_t len);
+		void countVote(VoteRecord& rec, const DecryptItem& item,
+				const unsigned char *data, size_t len);
+
+		unsigned int _batch;
+		std::vector<DecryptItem> _items;
+
+		unsigned char *_cipher;
+		size_t _cipher_len;
 		CK_BYTE_PTR _ctx;
 		CK_ULONG _ctx_len;
-		Session *_sess;
+		// Ciphertext length of the key, 0 when not checked
+		CK_ULONG _input_len;
+		Decryptor *_dec;
+		DeviceStats *_stats;
+		SessionTelemetry *_telemetry;
+
+		// Counts of this worker only, merged by the boss at the end
+		const Tally *_tally;
+		TallyCounts _counts;
+		unsigned long _uncounted;
+		std::string _key;
+
+		// Ciphertexts straight from a binary votes file, no base64
+		bool _raw_input;
+		ResultFormat _result;
 
 };
 
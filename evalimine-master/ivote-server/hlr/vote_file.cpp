@@ -0,0 +1,157 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "vote_file.h"
+
+VoteFile::VoteFile()
+{
+	_fd = -1;
+	_data = NULL;
+	_size = 0;
+	_end = 0;
+	_pos = 0;
+	_lines = 0;
+}
+
+VoteFile::~VoteFile()
+{
+	close();
+}
+
+bool VoteFile::open(const char *path)
+{
+	struct stat st;
+
+	_fd = ::open(path, O_RDONLY);
+	if (_fd == -1) {
+		return false;
+	}
+
+	if (fstat(_fd, &st) != 0) {
+		return false;
+	}
+
+	_size = st.st_size;
+	_end = _size;
+	return true;
+}
+
+bool VoteFile::map()
+{
+	// mmap() refuses zero length, an empty file simply has no lines
+	if (_size == 0) {
+		return true;
+	}
+
+	void *p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+
+	madvise(p, _size, MADV_SEQUENTIAL);
+	_data = (const char *)p;
+	return true;
+}
+
+void VoteFile::close()
+{
+	if (_data != NULL) {
+		munmap((void *)_data, _size);
+		_data = NULL;
+	}
+	if (_fd != -1) {
+		::close(_fd);
+		_fd = -1;
+	}
+}
+
+/*
+ * Next line without its terminating newline. The last line does not need
+ * to end with one.
+ * */
+bool VoteFile::next(const char *&line, size_t &len)
+{
+	if (_pos >= _end) {
+		return false;
+	}
+
+	line = _data + _pos;
+	const char *nl = (const char *)memchr(line, '\n', _end - _pos);
+	if (nl != NULL) {
+		len = nl - line;
+		_pos += len + 1;
+	}
+	else {
+		len = _end - _pos;
+		_pos = _end;
+	}
+
+	_lines++;
+	return true;
+}
+
+/*
+ * Continues at offset, which must be the start of a line, as if lines
+ * lines had been read already.
+ * */
+bool VoteFile::seek(size_t offset, int lines)
+{
+	if (offset > _end || (offset > 0 && _data[offset - 1] != '\n')) {
+		return false;
+	}
+
+	_pos = offset;
+	_lines = lines;
+	return true;
+}
+
+/*
+ * Stops reading at end, which must be the start of a line or the end of
+ * the file.
+ * */
+bool VoteFile::limit(size_t end)
+{
+	if (end > _size || (end > 0 && end < _size && _data[end - 1] != '\n')) {
+		return false;
+	}
+
+	_end = end;
+	return true;
+}
+
+const char* VoteFile::data() const
+{
+	return _data;
+}
+
+size_t VoteFile::position() const
+{
+	return _pos;
+}
+
+size_t VoteFile::size() const
+{
+	return _size;
+}
+
+int VoteFile::lines() const
+{
+	return _lines;
+}
+
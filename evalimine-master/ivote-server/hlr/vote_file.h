@@ -0,0 +1,59 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#ifndef VOTE_FILE_H
+#define VOTE_FILE_H
+
+#include <stddef.h>
+
+/*
+ * Read-only memory mapped votes file. Lines are handed out as views into
+ * the mapping, so they stay valid until the file is closed.
+ * */
+class VoteFile
+{
+	public:
+
+		VoteFile();
+		~VoteFile();
+
+		bool open(const char *path);
+		bool map();
+		void close();
+
+		bool next(const char *&line, size_t &len);
+		bool seek(size_t offset, int lines);
+		bool limit(size_t end);
+
+		const char* data() const;
+		size_t position() const;
+		size_t size() const;
+		int lines() const;
+
+	protected:
+
+	private:
+
+		VoteFile(const VoteFile&);
+		VoteFile& operator=(const VoteFile&);
+
+		int _fd;
+		const char *_data;
+		size_t _size;
+		size_t _end;
+		size_t _pos;
+		int _lines;
+};
+
+#endif
+
@@ -0,0 +1,239 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "vote_ring.h"
+
+enum SlotState {
+	SLOT_FREE = 0,
+	SLOT_READY,
+	SLOT_DONE
+};
+
+#define SPIN_LIMIT 64
+#define YIELD_LIMIT 128
+#define SLEEP_USEC 50
+
+/*
+ * Waiting side of the ring. Spin a little first, then give the CPU away,
+ * and if the other side is still not ready (HSM round-trip, slow disk)
+ * sleep so idle threads do not burn cores.
+ * */
+static void relax(unsigned int& spins)
+{
+	if (spins < SPIN_LIMIT) {
+		__sync_synchronize();
+	}
+	else if (spins < YIELD_LIMIT) {
+		sched_yield();
+	}
+	else {
+		usleep(SLEEP_USEC);
+	}
+	spins++;
+}
+
+VoteRing::VoteRing(unsigned int window)
+{
+	assert(window > 0);
+
+	// Twice the window, so the reader can parse ahead while the workers
+	// are held back
+	unsigned long capacity = 1;
+	while (capacity < 2UL * window) {
+		capacity <<= 1;
+	}
+
+	_slots = new VoteRecord[capacity];
+	for (unsigned long i = 0; i < capacity; i++) {
+		_slots[i].no = -1;
+		_slots[i].task = NULL;
+		_slots[i].task_len = 0;
+		_slots[i].context = NULL;
+		_slots[i].context_len = 0;
+		_slots[i].end = 0;
+		_slots[i].result = NULL;
+		_slots[i].result_len = 0;
+		_slots[i].result_cap = 0;
+		_slots[i].valid = false;
+		_slots[i].vote_hash[0] = '\0';
+		_slots[i].state = SLOT_FREE;
+	}
+	_mask = capacity - 1;
+	_window = window;
+	_head = 0;
+	_claimed = 0;
+	_tail = 0;
+	_peak = 0;
+	_closed = 0;
+	_aborted = 0;
+}
+
+VoteRing::~VoteRing()
+{
+	for (unsigned long i = 0; i <= _mask; i++) {
+		free(_slots[i].result);
+	}
+	delete[] _slots;
+}
+
+VoteRecord* VoteRing::acquire()
+{
+	VoteRecord *rec = &_slots[_head & _mask];
+	unsigned int spins = 0;
+	while (rec->state != SLOT_FREE) {
+		if (_aborted) {
+			return NULL;
+		}
+		relax(spins);
+	}
+	__sync_synchronize();
+	return rec;
+}
+
+void VoteRing::publish()
+{
+	__sync_synchronize();
+	_slots[_head & _mask].state = SLOT_READY;
+	__sync_fetch_and_add(&_head, 1);
+}
+
+void VoteRing::close()
+{
+	__sync_synchronize();
+	_closed = 1;
+	__sync_synchronize();
+}
+
+unsigned int VoteRing::claim(unsigned int max, unsigned long& first)
+{
+	unsigned int spins = 0;
+	while (true) {
+		if (_aborted) {
+			return 0;
+		}
+
+		unsigned long c = _claimed;
+		unsigned long h = _head;
+
+		if (c < h) {
+			unsigned long limit = _tail + _window;
+			unsigned long n = h - c;
+			if (n > max) {
+				n = max;
+			}
+			if (c + n > limit) {
+				n = limit > c ? limit - c : 0;
+			}
+			if (n == 0) {
+				// Window full, wait for the writer to catch up
+				relax(spins);
+				continue;
+			}
+			if (__sync_bool_compare_and_swap(&_claimed, c, c + n)) {
+				__sync_synchronize();
+				first = c;
+				return n;
+			}
+			continue;
+		}
+
+		if (_closed) {
+			// _head is final once _closed is seen
+			__sync_synchronize();
+			if (_head == c) {
+				return 0;
+			}
+			continue;
+		}
+		relax(spins);
+	}
+}
+
+VoteRecord& VoteRing::at(unsigned long seq)
+{
+	return _slots[seq & _mask];
+}
+
+void VoteRing::complete(unsigned long seq)
+{
+	// Results held back by the writer, including this one
+	unsigned long span = seq + 1 - _tail;
+	unsigned long peak = _peak;
+	while (span > peak && !__sync_bool_compare_and_swap(&_peak, peak, span)) {
+		peak = _peak;
+	}
+
+	__sync_synchronize();
+	_slots[seq & _mask].state = SLOT_DONE;
+}
+
+VoteRecord* VoteRing::drain()
+{
+	VoteRecord *rec = &_slots[_tail & _mask];
+	unsigned int spins = 0;
+	while (rec->state != SLOT_DONE) {
+		if (_aborted) {
+			return NULL;
+		}
+		if (_closed) {
+			__sync_synchronize();
+			if (_head == _tail) {
+				return NULL;
+			}
+		}
+		relax(spins);
+	}
+	__sync_synchronize();
+	return rec;
+}
+
+void VoteRing::release()
+{
+	__sync_synchronize();
+	_slots[_tail & _mask].state = SLOT_FREE;
+	__sync_fetch_and_add(&_tail, 1);
+}
+
+void VoteRing::abort()
+{
+	__sync_synchronize();
+	_aborted = 1;
+	__sync_synchronize();
+}
+
+bool VoteRing::aborted() const
+{
+	return _aborted != 0;
+}
+
+unsigned long VoteRing::window() const
+{
+	return _window;
+}
+
+unsigned long VoteRing::peak() const
+{
+	return _peak;
+}
+
+unsigned long VoteRing::depth() const
+{
+	unsigned long tail = _tail;
+	unsigned long claimed = _claimed;
+	return claimed > tail ? claimed - tail : 0;
+}
+
@@ -0,0 +1,132 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2004-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+
+
+#ifndef VOTE_RING_H
+#define VOTE_RING_H
+
+#include <stddef.h>
+
+// Why a vote was not given to the decryptor, such votes are written as
+// corrupted
+enum VoteReject {
+	REJECT_NONE = 0,
+	// No tab before the encrypted vote
+	REJECT_LINE_FORMAT,
+	REJECT_LINE_TOO_LONG,
+	// Not base64 or not whole groups of it
+	REJECT_BASE64,
+	// Not as long as the key modulus
+	REJECT_LENGTH,
+	// Record of a binary votes file that cannot be read
+	REJECT_BAD_RECORD
+};
+
+/*
+ * One vote travelling through the decryption pipeline. Records live in
+ * the ring slots and are reused, so the result buffer keeps its capacity
+ * and the steady state does not allocate.
+ * */
+struct VoteRecord
+{
+	int no;
+
+	// Views into the memory mapped votes file
+	const char *task;
+	size_t task_len;
+	const char *context;
+	size_t context_len;
+
+	// Input consumed up to and including this line
+	size_t end;
+
+	// VoteReject, set by the reader for the line and by the worker for
+	// the ciphertext
+	int reject;
+
+	// Base64 of the decrypted vote, owned by the slot
+	char *result;
+	size_t result_len;
+	size_t result_cap;
+
+	// Tally stage: whether the vote counted for its choice, whether it
+	// was counted and logged at all, and the hash of the encrypted vote
+	// for the log entry (ksum.votehash())
+	bool valid;
+	bool counted;
+	char vote_hash[32];
+
+	volatile int state;
+};
+
+/*
+ * Bounded single-producer, multi-consumer, single-drainer ring.
+ *
+ * The reader fills free slots at _head and publishes them, workers claim
+ * batches of published slots by advancing _claimed with a CAS, and the
+ * writer drains completed slots at _tail in input order. Sequence
+ * numbers grow monotonically, the slot index is seq & (capacity - 1).
+ *
+ * Workers never claim more than window votes ahead of the writer, so a
+ * stalled vote holds back at most window finished results.
+ * */
+class VoteRing
+{
+	public:
+
+		VoteRing(unsigned int window);
+		~VoteRing();
+
+		// Reader side
+		VoteRecord* acquire();
+		void publish();
+		void close();
+
+		// Worker side
+		unsigned int claim(unsigned int max, unsigned long& first);
+		VoteRecord& at(unsigned long seq);
+		void complete(unsigned long seq);
+
+		// Writer side
+		VoteRecord* drain();
+		void release();
+
+		void abort();
+		bool aborted() const;
+
+		unsigned long window() const;
+		unsigned long peak() const;
+		// Votes claimed by the workers and not yet written
+		unsigned long depth() const;
+
+	protected:
+
+	private:
+
+		VoteRing(const VoteRing&);
+		VoteRing& operator=(const VoteRing&);
+
+		VoteRecord *_slots;
+		unsigned long _mask;
+		unsigned long _window;
+
+		volatile unsigned long _head;
+		volatile unsigned long _claimed;
+		volatile unsigned long _tail;
+		volatile unsigned long _peak;
+
+		volatile int _closed;
+		volatile int _aborted;
+};
+
+#endif
+
@@ -83,10 +83,9 @@ class HTSStore:
         if len(sigfiles) != 1:
             raise Exception, "BDoc sisaldab rohkem kui ühte allkirja"
 
-        verifier = bdocpython.BDocVerifier()
-        config.populate(verifier)
+        verifier = config.verifier()
         for el in self.bdoc.documents:
-            verifier.setDocument(self.bdoc.documents[el], el)
+            verifier.borrowDocument(self.bdoc.documents[el], el)
 
         sig_fn = sigfiles[0]
         sig_content = self.bdoc.signatures[sig_fn]
@@ -1,4 +1,4 @@
-%module bdocpython
+%module(threads="1") bdocpython
 
 /*
 Copyright: Eesti Vabariigi Valimiskomisjon
@@ -14,17 +14,60 @@ http://creativecommons.org/licenses/by-nc-nd/3.0/.
 
 %{
 	#include "PyBDoc.h"
+	#include "ValidationError.h"
 %}
 
 %rename(assign) *::operator=;
-%apply (char *STRING, int LENGTH) { (const char *xml, size_t xml_len) };
-%apply (char *STRING, int LENGTH) { (const unsigned char *buf, size_t len) };
+
+/*
+Byte arguments come from anything with a buffer interface (str, buffer,
+bytearray, memoryview, mmap) without a copy. A new-style buffer is held
+until the call returns. Old-style ones (mmap) are not locked, so they
+must not be closed while a call that released the GIL is using them.
+*/
+%define BDOC_BUFFER(PTR_TYPE, PTR, LEN)
+%typemap(in) (PTR_TYPE PTR, size_t LEN) (Py_buffer view, int has_view = 0) {
+        if (PyObject_CheckBuffer($input)) {
+                if (PyObject_GetBuffer($input, &view, PyBUF_SIMPLE) != 0) {
+                        SWIG_fail;
+                }
+                has_view = 1;
+                $1 = ($1_ltype)view.buf;
+                $2 = (size_t)view.len;
+        }
+        else {
+                const void *buf = NULL;
+                Py_ssize_t len = 0;
+                if (PyObject_AsReadBuffer($input, &buf, &len) != 0) {
+                        SWIG_fail;
+                }
+                $1 = ($1_ltype)buf;
+                $2 = (size_t)len;
+        }
+}
+%typemap(freearg) (PTR_TYPE PTR, size_t LEN) {
+        if (has_view$argnum) {
+                PyBuffer_Release(&view$argnum);
+        }
+}
+%typemap(typecheck, precedence=SWIG_TYPECHECK_STRING) (PTR_TYPE PTR, size_t LEN) {
+        $1 = (PyObject_CheckBuffer($input) ||
+                PyObject_CheckReadBuffer($input)) ? 1 : 0;
+}
+%enddef
+
+BDOC_BUFFER(const char *, xml, xml_len)
+BDOC_BUFFER(const unsigned char *, buf, len)
+BDOC_BUFFER(const unsigned char *, sig, sig_len)
 
 %include std_string.i
 
 %include std_list.i
+%include std_vector.i
 
 %template(strlist) std::list<std::string>;
+%template(intlist) std::vector<int>;
+%template(doublelist) std::vector<double>;
 
 %include exception.i
 %exception {
@@ -39,5 +82,51 @@ http://creativecommons.org/licenses/by-nc-nd/3.0/.
         }
 }
 
+/*
+Only the verifications and the blocking file and network calls release
+the GIL, they do not touch Python objects and use the shared
+configuration read-only.
+*/
+%nothread;
+%thread BDocVerifier::verifyBESOffline;
+%thread BDocVerifier::verifyBESOnline;
+%thread BDocVerifier::verifyTMOffline;
+%thread BDocVerifier::verifyBESOfflineBatch;
+%thread BDocVerifier::verifyTMOfflineBatch;
+%thread BDocVerifier::verifyContainerBESOffline;
+%thread BDocVerifier::verifyContainerBESOnline;
+%thread BDocVerifier::verifyContainerTMOffline;
+%thread BDocVerifier::submitBESOnline;
+%thread BDocVerifier::pollBESOnline;
+%thread BDocContainerFile::open;
+%thread ChallengeVerifier::isChallengeOk;
+%thread ChallengeVerifier::verifyAll;
+
+/* The verifier borrows the configuration, keep it alive as long */
+%pythonappend BDocVerifier::BDocVerifier %{
+        if len(args) == 1:
+            self._config = args[0]
+%}
+
+/* Borrowed documents point into the string, keep it alive as long */
+%pythonappend BDocVerifier::borrowDocument %{
+        try:
+            self._documents.append(args[0])
+        except AttributeError:
+            self._documents = [args[0]]
+%}
+
+/* A borrowed container points into the string, keep it alive as long */
+%pythonappend BDocContainerFile::borrow %{
+        self._data = args[0]
+%}
+
+/* Instantiated before the batch methods returning it are wrapped */
+class BDocVerifierResult;
+%template(resultlist) std::vector<BDocVerifierResult>;
+class TimingSummary;
+%template(timinglist) std::vector<TimingSummary>;
+
+%include ValidationError.h
 %include PyBDoc.h
 
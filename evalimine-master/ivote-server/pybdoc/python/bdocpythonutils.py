@@ -54,7 +54,11 @@ REF_MANIFEST_DDS_LINES = [ \
     REF_MANIFEST_TMPL_4]
 
 CONF_KNOWN_PARAMS = [ \
-    'digest.uri']
+    'digest.uri',
+    'tm.splice']
+
+# Written by save_snapshot(), read by verifier() instead of the files
+CONF_SNAPSHOT = 'bdoc.snapshot'
 
 CONF_NECESSARY_ELEMS = [ \
     'bdoc.conf',
@@ -74,6 +78,7 @@ class BDocConfig:
         self.__ocsp = {}
         self.__param = {}
         self.__oids = []
+        self.__shared = None
 
     def __del__(self):
         pass
@@ -125,6 +130,10 @@ class BDocConfig:
         if os.path.exists(dirname):
             shutil.rmtree(dirname)
         shutil.copytree(self.__root, dirname)
+        # Made from the files of this directory only
+        _snap = os.path.join(dirname, CONF_SNAPSHOT)
+        if os.path.exists(_snap):
+            os.unlink(_snap)
         fmode = stat.S_IRUSR | stat.S_IWUSR | stat.S_IRGRP | stat.S_IWGRP
         dmode = stat.S_IRWXU | stat.S_IRWXG
         os.chmod(dirname, dmode)
@@ -137,6 +146,7 @@ class BDocConfig:
 
     def load(self, dirname):
         self.__root = dirname
+        self.__shared = None
 
         for _el in CONF_NECESSARY_ELEMS:
             _path = os.path.join(self.__root, _el)
@@ -170,12 +180,64 @@ class BDocConfig:
 
         ver.setSchemaDir(os.path.join(self.__root, 'schema'))
         ver.setDigestURI(self.__param['digest.uri'])
+        # TM signatures are written without a DOM only on request
+        if self.__param.get('tm.splice', 'false') == 'true':
+            ver.setTMSplicing(True)
 
         cadir = os.path.join(self.__root, 'ca')
 
         for el in os.listdir(cadir):
             ver.addCertToStore(os.path.join(cadir, el))
 
+    def _snapshot_path(self):
+        return os.path.join(self.__root, CONF_SNAPSHOT)
+
+    def _snapshot_sources(self):
+        # Everything populate() reads, and the directories so that an
+        # added or removed file is noticed too
+        ret = [os.path.join(self.__root, 'bdoc.conf')]
+        for el in self.__ocsp:
+            ret.append(self._ocsp_cert_path(el))
+        for sub in ['ca', 'schema']:
+            for root, dirs, files in os.walk(os.path.join(self.__root, sub)):
+                ret.append(root)
+                for name in sorted(files):
+                    ret.append(os.path.join(root, name))
+        return ret
+
+    def save_snapshot(self):
+        # The populated configuration in one file, so that short-lived
+        # processes skip reading the certificates and schemas. The files
+        # it is made from are recorded in it, verifier() goes back to
+        # the files once one of them changes; call this again then.
+        shared = bdocpython.VerifierConfig()
+        self.populate(shared)
+        shared.saveSnapshot(self._snapshot_path(), self._snapshot_sources())
+
+    def _load_snapshot(self):
+        if not os.access(self._snapshot_path(), os.R_OK):
+            return None
+        try:
+            shared = bdocpython.VerifierConfig()
+            shared.loadSnapshot(self._snapshot_path())
+            return shared
+        except:
+            # Damaged, out of date or from another library version, the
+            # files are still there
+            return None
+
+    def verifier(self):
+        # Certificates, OCSP configuration and schemas are loaded once
+        # into a frozen native configuration shared by all verifiers
+        if self.__shared == None:
+            shared = self._load_snapshot()
+            if shared == None:
+                shared = bdocpython.VerifierConfig()
+                self.populate(shared)
+            shared.freeze()
+            self.__shared = shared
+        return bdocpython.BDocVerifier(self.__shared)
+
     def get_ocsp_responders(self):
         # NB! One URL gets into dict only once
         ret = {}
@@ -247,6 +309,7 @@ class BDocContainer:
 
     def __init__(self):
         self.__bdoc = None
+        self.__native = None
         self.__manifest = None
         self.documents = {}
         self.signatures = {}
@@ -268,6 +331,19 @@ class BDocContainer:
         if self.__bdoc.testzip() != None:
             raise Exception, 'Invalid zipfile'
 
+    def load_mapped(self, bdocfile):
+        # The members are not read into Python: validate() leaves None
+        # in documents and signatures, the verifier takes them straight
+        # from the mapped file through container(). The CRC checks of
+        # testzip() are done there, of stored members when the file is
+        # opened and of deflated ones when they are inflated
+        self.__native = bdocpython.BDocContainerFile()
+        self.__native.open(bdocfile)
+        self.__bdoc = self.__native
+
+    def container(self):
+        return self.__native
+
     def load_bytes(self, data):
         import StringIO
         dfile = StringIO.StringIO(data)
@@ -321,15 +397,27 @@ class BDocContainer:
         self.__manifest = self.__bdoc.read(REF_FILE_MANIFEST)
         return True
 
+    def _list_contents(self):
+        _contents = {}
+        if self.__native:
+            for _el in self.__native.namelist():
+                _contents[_el] = None
+        else:
+            for _el in self.__bdoc.infolist():
+                _contents[_el.filename.encode("utf8")] = None
+        return _contents
+
+    def _read_member(self, name):
+        if self.__native:
+            return None
+        return self.__bdoc.read(name)
+
     def validateflex(self):
 
         profile_b = ManifestProfile('BES')
         profile_t = ManifestProfile('TM')
 
-        _infos = self.__bdoc.infolist()
-        _contents = {}
-        for _el in _infos:
-            _contents[_el.filename.encode("utf8")] = None
+        _contents = self._list_contents()
 
         if not self._validate_mimetype(_contents):
             raise Exception, 'Invalid or missing MIME type'
@@ -369,17 +457,14 @@ class BDocContainer:
         for _el in _contents:
             if (_el != 'META-INF/'):
                 if profile.is_signature(_el):
-                    self.signatures[_el] = self.__bdoc.read(_el)
+                    self.signatures[_el] = self._read_member(_el)
                 else:
-                    self.documents[_el] = self.__bdoc.read(_el)
+                    self.documents[_el] = self._read_member(_el)
 
 
     def validate(self, profile):
 
-        _infos = self.__bdoc.infolist()
-        _contents = {}
-        for _el in _infos:
-            _contents[_el.filename.encode("utf8")] = None
+        _contents = self._list_contents()
 
         if not self._validate_mimetype(_contents):
             raise Exception, 'Invalid or missing MIME type'
@@ -410,9 +495,9 @@ class BDocContainer:
         for _el in _contents:
             if (_el != 'META-INF/'):
                 if profile.is_signature(_el):
-                    self.signatures[_el] = self.__bdoc.read(_el)
+                    self.signatures[_el] = self._read_member(_el)
                 else:
-                    self.documents[_el] = self.__bdoc.read(_el)
+                    self.documents[_el] = self._read_member(_el)
 
 
 def save_temporary(data):
@@ -16,7 +16,14 @@
 #include <iostream>
 
 #include "crypto/Digest.h"
+#include "crypto/X509Cert.h"
 #include "crypto/X509CertStore.h"
+#include "GrammarPool.h"
+#include "StackException.h"
+#include "TMSignatureWriter.h"
+#include "Timing.h"
+#include "XMLHelper.h"
+#include "ZipContainer.h"
 
 bdoc::Buffer::Buffer()
 {
@@ -32,11 +39,12 @@ void bdoc::Buffer::init()
 {
 	_buf = NULL;
 	_len = 0;
+	_owned = false;
 }
 
 void bdoc::Buffer::reset()
 {
-	if (_buf) {
+	if (_buf && _owned) {
 		free(_buf);
 	}
 	init();
@@ -52,10 +60,20 @@ void bdoc::Buffer::set(const unsigned char* data, size_t len)
 			throw std::bad_alloc();
 		}
 		_len = len;
+		_owned = true;
 		memcpy(_buf, data, len);
 	}
 }
 
+void bdoc::Buffer::borrow(const unsigned char* data, size_t len)
+{
+	reset();
+	if ((len > 0) && (data != NULL)) {
+		_buf = const_cast<unsigned char *>(data);
+		_len = len;
+	}
+}
+
 size_t bdoc::Buffer::len() const
 {
 	return _len;
@@ -69,34 +87,62 @@ const unsigned char* bdoc::Buffer::peek() const
 //
 //
 
-bdoc::ContainerInfo::ContainerInfo() : _hm(), _dm()
+bdoc::ContainerInfo::ContainerInfo() : _docs(), errors()
 {
 }
 
 bdoc::ContainerInfo::~ContainerInfo()
 {
-	for (DataMap::const_iterator iter = _dm.begin(); iter != _dm.end(); iter++) {
+	for (DocumentMap::const_iterator iter = _docs.begin(); iter != _docs.end(); iter++) {
 		delete iter->second;
 	}
 }
 
 unsigned int bdoc::ContainerInfo::documentCount() const
 {
-	return _dm.size();
+	return _docs.size();
+}
+
+bdoc::ContainerInfo::Document* bdoc::ContainerInfo::addDocument(const std::string& uri)
+{
+	Document *&doc = _docs[uri];
+	delete doc;
+	doc = new Document();
+	doc->zip = NULL;
+	doc->entry = 0;
+	doc->handled = false;
+	return doc;
 }
 
 void bdoc::ContainerInfo::setDocument(const std::string& uri, const unsigned char *buf, size_t len)
 {
-	_hm[uri] = false;
-	Buffer *b = new Buffer();
-	b->set(buf, len);
-	_dm[uri] = b;
+	addDocument(uri)->data.set(buf, len);
+}
+
+void bdoc::ContainerInfo::borrowDocument(const std::string& uri, const unsigned char *buf, size_t len)
+{
+	addDocument(uri)->data.borrow(buf, len);
+}
+
+void bdoc::ContainerInfo::zipDocument(const std::string& uri, const ZipContainer *zip, size_t entry)
+{
+	Document *doc = addDocument(uri);
+	const unsigned char *data = zip->view(entry);
+	if (data != NULL) {
+		doc->data.borrow(data, zip->entry(entry).size);
+	}
+	else {
+		doc->zip = zip;
+		doc->entry = entry;
+	}
 }
 
 void bdoc::ContainerInfo::checkDocumentsBegin()
 {
-	for (HandleMap::iterator it1 = _hm.begin(); it1 != _hm.end(); it1++) {
-		_hm[it1->first] = false;
+	// Each signature of a container is checked on its own
+	errors.clear();
+	for (DocumentMap::iterator it = _docs.begin(); it != _docs.end(); it++) {
+		it->second->handled = false;
 	}
 }
 
@@ -104,31 +150,43 @@ void bdoc::ContainerInfo::checkDocument(const std::string& uri,
 			const bdoc::dsig::DigestMethodType::AlgorithmType& alg,
 			const bdoc::dsig::DigestValueType& dig)
 {
-	if ((_hm.count(uri) == 0) || (_dm.count(uri) == 0)) {
+	StageTimer timer(TIMING_DIGEST);
+
+	DocumentMap::iterator it = _docs.find(uri);
+	if (it == _docs.end()) {
 		errors.push_back(uri + " is unknown");
 		return;
 	}
 
-	if (_hm[uri]) {
+	Document *doc = it->second;
+	if (doc->handled) {
 		errors.push_back(uri + " inspected more than once");
 		return;
 	}
 
-	_hm[uri] = true;
-
-	if (_dm[uri] == NULL) {
-		errors.push_back(uri + " is invalid");
-		return;
-	}
+	doc->handled = true;
 
 	if (!bdoc::Digest::isSupported(alg)) {
 		errors.push_back("Algorithm not supported: " + alg);
 	}
 
-	std::auto_ptr<bdoc::Digest> docDigest; // only this scope
-	docDigest = bdoc::Digest::create(alg);
-	docDigest->update(_dm[uri]->peek(), _dm[uri]->len());
-	std::vector<unsigned char> docDigestBuf = docDigest->getDigest();
+	// Hashed once per algorithm, whichever signature asks first
+	std::map<std::string, std::vector<unsigned char> >::iterator d =
+						doc->digests.find(alg);
+	if (d == doc->digests.end()) {
+		std::auto_ptr<bdoc::Digest> docDigest; // only this scope
+		docDigest = bdoc::Digest::create(alg);
+		if (doc->zip != NULL) {
+			doc->zip->digest(doc->entry, *docDigest);
+		}
+		else {
+			docDigest->update(doc->data.peek(), doc->data.len());
+		}
+		d = doc->digests.insert(std::make_pair(
+			std::string(alg), docDigest->getDigest())).first;
+	}
+
+	const std::vector<unsigned char>& docDigestBuf = d->second;
 	const unsigned char* refDigest = reinterpret_cast<const unsigned char* >(dig.data());
 
 	if (docDigestBuf.size() != dig.size()
@@ -139,8 +197,8 @@ void bdoc::ContainerInfo::checkDocument(const std::string& uri,
 
 bool bdoc::ContainerInfo::checkDocumentsResult()
 {
-	for (HandleMap::iterator it = _hm.begin(); it != _hm.end(); it++) {
-		if (!it->second) {
+	for (DocumentMap::iterator it = _docs.begin(); it != _docs.end(); it++) {
+		if (!it->second->handled) {
 			errors.push_back("Unhandled document: " + it->first);
 		}
 	}
@@ -153,24 +211,52 @@ bool bdoc::ContainerInfo::checkDocumentsResult()
 //
 
 bdoc::Configuration::Configuration() :
+	ocsp(),
+	responders(),
+	retired(),
 	schema_dir(),
-	store(new bdoc::X509CertStore())
+	grammar(NULL),
+	store(new bdoc::X509CertStore()),
+	tm_splicing(false),
+	keep_signature(false)
 {
+	pthread_mutex_init(&responders_mutex, NULL);
 }
 
 bdoc::Configuration::~Configuration()
 {
+	dropResponders();
+	for (std::list<OCSPResponder*>::iterator it = retired.begin();
+			it != retired.end(); it++) {
+		delete *it;
+	}
+	pthread_mutex_destroy(&responders_mutex);
 	delete store;
 }
 
+void bdoc::Configuration::dropResponders()
+{
+	pthread_mutex_lock(&responders_mutex);
+	for (std::map<std::string, OCSPResponder*>::iterator it = responders.begin();
+			it != responders.end(); it++) {
+		retired.push_back(it->second);
+	}
+	responders.clear();
+	pthread_mutex_unlock(&responders_mutex);
+}
+
 void bdoc::Configuration::setSchemaDir(const char *path)
 {
+	// Shared by all configurations using the same schemas,
+	// released in terminate()
+	grammar = bdoc::GrammarPool::get(path);
 	schema_dir = path;
 }
 
 void bdoc::Configuration::addCertToStore(const char *path)
 {
 	store->addCert(path);
+	dropResponders();
 }
 
 const char* bdoc::Configuration::getSchemaDir() const
@@ -178,6 +264,11 @@ const char* bdoc::Configuration::getSchemaDir() const
 	return schema_dir.c_str();
 }
 
+const bdoc::GrammarPool* bdoc::Configuration::getGrammarPool() const
+{
+	return grammar;
+}
+
 bdoc::X509CertStore* bdoc::Configuration::getCertStore()
 {
 	return store;
@@ -188,6 +279,7 @@ void bdoc::Configuration::addOCSPConf(const char *issuer,
 {
 	OCSPConf a(url, cert, skew, maxAge);
 	ocsp[issuer] = a;
+	dropResponders();
 }
 
 bool bdoc::Configuration::hasOCSPConf(const std::string& issuer)
@@ -197,7 +289,48 @@ bool bdoc::Configuration::hasOCSPConf(const std::string& issuer)
 
 const bdoc::OCSPConf& bdoc::Configuration::getOCSPConf(const std::string& issuer)
 {
-	return ocsp[issuer];
+	// Lookup only, verifiers may share the configuration between threads
+	std::map<std::string, OCSPConf>::const_iterator it = ocsp.find(issuer);
+	if (it == ocsp.end()) {
+		THROW_STACK_EXCEPTION("Failed to find ocsp responder.");
+	}
+	return it->second;
+}
+
+const bdoc::OCSPResponder* bdoc::Configuration::getOCSPResponder(
+		const std::string& issuerName)
+{
+	pthread_mutex_lock(&responders_mutex);
+	std::map<std::string, OCSPResponder*>::const_iterator it =
+					responders.find(issuerName);
+	if (it != responders.end()) {
+		OCSPResponder *r = it->second;
+		pthread_mutex_unlock(&responders_mutex);
+		return r;
+	}
+	pthread_mutex_unlock(&responders_mutex);
+
+	int pos = issuerName.find("CN=", 0) + 3;
+	std::string issuer_cn =
+		issuerName.substr(pos, issuerName.find(",", pos) - pos);
+	if (!hasOCSPConf(issuer_cn)) {
+		THROW_STACK_EXCEPTION("Failed to find ocsp responder.");
+	}
+
+	// Loaded outside the lock, the first one to finish is kept
+	OCSPResponder *loaded =
+		new OCSPResponder(getOCSPConf(issuer_cn), store, digest);
+
+	pthread_mutex_lock(&responders_mutex);
+	std::pair<std::map<std::string, OCSPResponder*>::iterator, bool> ins =
+		responders.insert(std::make_pair(issuerName, loaded));
+	OCSPResponder *r = ins.first->second;
+	pthread_mutex_unlock(&responders_mutex);
+
+	if (!ins.second) {
+		delete loaded;
+	}
+	return r;
 }
 
 const char* bdoc::Configuration::getDigestURI() const
@@ -208,6 +341,94 @@ const char* bdoc::Configuration::getDigestURI() const
 void bdoc::Configuration::setDigestURI(const char *uri)
 {
 	digest = uri;
+	dropResponders();
+}
+
+bool bdoc::Configuration::getTMSplicing() const
+{
+	return tm_splicing;
+}
+
+void bdoc::Configuration::setTMSplicing(bool splice)
+{
+	tm_splicing = splice;
+}
+
+bool bdoc::Configuration::getKeepSignature() const
+{
+	return keep_signature;
+}
+
+void bdoc::Configuration::setKeepSignature(bool keep)
+{
+	keep_signature = keep;
+}
+
+//
+//
+//
+
+bdoc::OCSPResponder::OCSPResponder(const OCSPConf& oc,
+		X509CertStore *store, const std::string& uri) :
+	conf(oc),
+	certs(NULL),
+	issuer(NULL),
+	digestUri(uri),
+	issuerDigest(),
+	responderCertValue(),
+	responderName(),
+	issuerCertDigest(),
+	issuerSerial()
+{
+	if (conf.der.empty()) {
+		certs = X509Cert::loadX509Stack(conf.cert);
+	}
+	else {
+		certs = X509Cert::decodeX509Stack(&conf.der[0], conf.der.size());
+	}
+	if (sk_X509_num(certs) < 1) {
+		return;
+	}
+
+	try {
+		X509Cert rc(sk_X509_value(certs, 0));
+		responderCertValue = renderXMLBase64(rc.encodeDER());
+		responderName = TMSignatureWriter::escape(rc.getSubject());
+	}
+	catch (...) {
+		responderCertValue.clear();
+		responderName.clear();
+	}
+
+	issuer = store->findIssuer(sk_X509_value(certs, 0));
+	if (issuer == NULL) {
+		return;
+	}
+
+	try {
+		X509Cert oic(issuer);
+		issuerSerial = renderXMLIssuerSerial(oic);
+		if (!digestUri.empty()) {
+			std::auto_ptr<bdoc::Digest> calc = bdoc::Digest::create(digestUri);
+			calc->update(oic.encodeDER());
+			issuerDigest = calc->getDigest();
+			issuerCertDigest = renderXMLDigestMethodAndValue(
+						issuerDigest, digestUri);
+		}
+	}
+	catch (...) {
+		// Calculated and reported by the signature that needs it
+		issuerDigest.clear();
+		issuerCertDigest.clear();
+		issuerSerial.clear();
+	}
+}
+
+bdoc::OCSPResponder::~OCSPResponder()
+{
+	if (certs) {
+		sk_X509_pop_free(certs, X509_free);
+	}
 }
 
 
@@ -219,7 +440,8 @@ bdoc::OCSPConf::OCSPConf() :
 	url(),
 	cert(),
 	skew(0),
-	maxAge(0)
+	maxAge(0),
+	der()
 {
 }
 
@@ -227,7 +449,8 @@ bdoc::OCSPConf::OCSPConf(const char* u, const char* c, long s, long m) :
 	url(u),
 	cert(c),
 	skew(s),
-	maxAge(m)
+	maxAge(m),
+	der()
 {
 }
 
@@ -235,7 +458,8 @@ bdoc::OCSPConf::OCSPConf(const OCSPConf& oc) :
 	url(oc.url),
 	cert(oc.cert),
 	skew(oc.skew),
-	maxAge(oc.maxAge)
+	maxAge(oc.maxAge),
+	der(oc.der)
 {
 }
 
@@ -245,6 +469,7 @@ bdoc::OCSPConf& bdoc::OCSPConf::operator=(OCSPConf& oc)
 	cert = oc.cert;
 	skew = oc.skew;
 	maxAge = oc.maxAge;
+	der = oc.der;
 	return *this;
 }
 
@@ -16,6 +16,9 @@
 #include "xml/XAdES.hxx"
 #include "xml/xmldsig-core-schema.hxx"
 
+#include <openssl/x509.h>
+#include <pthread.h>
+
 #include <list>
 
 namespace bdoc {
@@ -24,10 +27,10 @@ namespace bdoc {
 class Buffer;
 class ContainerInfo;
 class Configuration;
+class ConfigurationSnapshot;
+class GrammarPool;
 class X509CertStore;
-
-typedef std::map<std::string, bool> HandleMap;
-typedef std::map<std::string, Buffer*> DataMap;
+class ZipContainer;
 
 class Buffer {
 
@@ -39,6 +42,10 @@ class Buffer {
 
 		void set(const unsigned char* data, size_t len);
 
+		// Refers to the data without copying, it must outlive
+		// the buffer
+		void borrow(const unsigned char* data, size_t len);
+
 		size_t len() const;
 
 		const unsigned char* peek() const;
@@ -55,6 +62,7 @@ class Buffer {
 
 		unsigned char *_buf;
 		size_t _len;
+		bool _owned;
 
 };
 
@@ -73,9 +81,54 @@ class OCSPConf {
 		long skew;
 		long maxAge;
 
+		// Responder certificates DER-encoded back to back, used
+		// instead of reading cert when not empty
+		std::vector<unsigned char> der;
+
+};
+
+/*
+ * OCSP responder of an issuer with its certificates loaded, shared
+ * read-only by the verifications using the configuration.
+ * */
+class OCSPResponder {
+
+	public:
+
+		OCSPResponder(const OCSPConf& oc, X509CertStore *store,
+				const std::string& digestUri);
+		~OCSPResponder();
+
+		OCSPConf conf;
+
+		// Responder certificates, the first one signs the responses
+		STACK_OF(X509)* certs;
+
+		// Issuer of the first responder certificate, borrowed from
+		// the certificate store, NULL if not there
+		X509* issuer;
+
+		// Digest of the issuer certificate, for digestUri
+		std::string digestUri;
+		std::vector<unsigned char> issuerDigest;
+
+		// Parts of the TM signature rendered once for splicing,
+		// empty if not available
+		std::string responderCertValue;
+		std::string responderName;
+		std::string issuerCertDigest;
+		std::string issuerSerial;
+
+	private:
+
+		OCSPResponder(const OCSPResponder&);
+		OCSPResponder& operator=(const OCSPResponder&);
 };
 
 class Configuration {
+
+	friend class ConfigurationSnapshot;
+
 	public:
 		Configuration();
 		~Configuration();
@@ -89,18 +142,45 @@ class Configuration {
 		bool hasOCSPConf(const std::string& issuer);
 		const OCSPConf& getOCSPConf(const std::string& issuer);
 
+		// Responder for certificates of the issuer (the full name,
+		// the CN selects the OCSPConf), loaded on first use
+		const OCSPResponder* getOCSPResponder(const std::string& issuerName);
+
 		const char* getSchemaDir() const;
+		const bdoc::GrammarPool* getGrammarPool() const;
 		bdoc::X509CertStore* getCertStore();
 
 		const char* getDigestURI() const;
 		void setDigestURI(const char *uri);
 
+		// TM signatures are spliced into the original XML instead of
+		// rebuilt through a DOM
+		bool getTMSplicing() const;
+		void setTMSplicing(bool splice);
+
+		// Results carry the verified signature XML, off unless asked
+		// for: the TM signature of an online check is always there
+		bool getKeepSignature() const;
+		void setKeepSignature(bool keep);
+
 	private:
 
+		Configuration(const Configuration&);
+		Configuration& operator=(const Configuration&);
+
+		void dropResponders();
+
 		std::map<std::string, OCSPConf> ocsp;
+		std::map<std::string, OCSPResponder*> responders;
+		// Replaced ones, validators may still use them
+		std::list<OCSPResponder*> retired;
+		pthread_mutex_t responders_mutex;
 		std::string schema_dir;
+		bdoc::GrammarPool *grammar;
 		std::string digest;
 		bdoc::X509CertStore *store;
+		bool tm_splicing;
+		bool keep_signature;
 };
 
 class ContainerInfo {
@@ -115,6 +195,17 @@ class ContainerInfo {
 	void setDocument(const std::string& uri,
 				const unsigned char *buf, size_t len);
 
+	// As setDocument() without copying, the data must outlive the
+	// container
+	void borrowDocument(const std::string& uri,
+				const unsigned char *buf, size_t len);
+
+	// Member of a container, the container must outlive this one.
+	// Stored members are used in place, deflated ones are inflated
+	// into the digest when checked.
+	void zipDocument(const std::string& uri,
+				const ZipContainer *zip, size_t entry);
+
 	void checkDocumentsBegin();
 
 	void checkDocument(const std::string& uri,
@@ -123,11 +214,29 @@ class ContainerInfo {
 
 	bool checkDocumentsResult();
 
-	HandleMap _hm;
-	DataMap _dm;
+	struct Document {
+		Buffer data;
+		// Deflated member of a container instead of data
+		const ZipContainer *zip;
+		size_t entry;
+		bool handled;
+		// By digest algorithm URI, shared by all signatures
+		std::map<std::string, std::vector<unsigned char> > digests;
+	};
+
+	typedef std::map<std::string, Document*> DocumentMap;
+
+	DocumentMap _docs;
 
 	std::list<std::string> errors;
 
+	private:
+
+	ContainerInfo(const ContainerInfo&);
+	ContainerInfo& operator=(const ContainerInfo&);
+
+	Document* addDocument(const std::string& uri);
+
 };
 
 }
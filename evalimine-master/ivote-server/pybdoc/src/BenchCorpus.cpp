@@ -0,0 +1,679 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "BenchCorpus.h"
+#include "GrammarPool.h"
+#include "StackException.h"
+#include "TMSignatureWriter.h"
+#include "XMLHelper.h"
+#include "crypto/Digest.h"
+#include "crypto/X509Cert.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+
+#include <xercesc/dom/DOM.hpp>
+#include <xsec/canon/XSECC14n20010315.hpp>
+#include <xsec/dsig/DSIGConstants.hpp>
+
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+// Keys of the test PKI and of the voters, as on the ID card
+#define BENCH_KEY_BITS 2048
+#define BENCH_CERT_DAYS 3650
+
+// A ballot is encrypted with the 2048 bit election key
+#define BENCH_BALLOT_LEN 256
+#define BENCH_ELECTION "RK2015"
+#define BENCH_CHALLENGE_LEN 20
+
+#define BENCH_ROOT_CN "BENCH of EE Certification Centre Root CA"
+#define BENCH_ISSUER_CN "BENCH of ESTEID-SK 2011"
+#define BENCH_OCSP_CN "BENCH of SK OCSP RESPONDER 2011"
+
+#define BENCH_C14N_CHUNK_SIZE (64 * 1024)
+
+static const char *XADES111_NS = "http://uri.etsi.org/01903/v1.1.1#";
+static const char *XADES132_NS = "http://uri.etsi.org/01903/v1.3.2#";
+static const char *DSIG_NS = "http://www.w3.org/2000/09/xmldsig#";
+
+bdoc::BenchCorpus::BenchCorpus() :
+	certs(),
+	responders(),
+	signatures(),
+	challenges()
+{
+}
+
+static std::string readFile(const std::string& path)
+{
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (!in) {
+		THROW_STACK_EXCEPTION("Failed to open '%s'", path.c_str());
+	}
+	std::ostringstream oss;
+	oss << in.rdbuf();
+	if (in.bad()) {
+		THROW_STACK_EXCEPTION("Failed to read '%s'", path.c_str());
+	}
+	return oss.str();
+}
+
+static void writeFile(const std::string& path, const std::string& data)
+{
+	std::ofstream out(path.c_str(),
+			std::ios::out | std::ios::binary | std::ios::trunc);
+	out.write(data.data(), data.size());
+	out.close();
+	if (!out) {
+		THROW_STACK_EXCEPTION("Failed to write '%s'", path.c_str());
+	}
+}
+
+static std::vector<std::string> split(const std::string& line, char sep)
+{
+	std::vector<std::string> ret;
+	size_t pos = 0;
+	while (true) {
+		size_t next = line.find(sep, pos);
+		ret.push_back(line.substr(pos, next - pos));
+		if (next == std::string::npos) {
+			break;
+		}
+		pos = next + 1;
+	}
+	return ret;
+}
+
+void bdoc::BenchCorpus::load(const std::string& dir)
+{
+	std::string conf = dir + "/corpus.conf";
+	std::istringstream in(readFile(conf));
+
+	std::string line;
+	int nr = 0;
+	while (std::getline(in, line)) {
+		nr++;
+		if (!line.empty() && line[line.size() - 1] == '\r') {
+			line.erase(line.size() - 1);
+		}
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		std::vector<std::string> f = split(line, '\t');
+		if (f[0] == "cert" && f.size() == 2) {
+			certs.push_back(dir + "/" + f[1]);
+		}
+		else if (f[0] == "ocsp" && f.size() == 4) {
+			Responder r;
+			r.issuer = f[1];
+			r.cert = dir + "/" + f[2];
+			r.key = dir + "/" + f[3];
+			responders.push_back(r);
+		}
+		else if (f[0] == "signature" && f.size() >= 2) {
+			SignatureFile s;
+			s.name = f[1];
+			s.xml = readFile(dir + "/" + f[1]);
+			for (size_t i = 2; i < f.size(); i++) {
+				size_t eq = f[i].find('=');
+				if (eq == std::string::npos || eq == 0) {
+					THROW_STACK_EXCEPTION("%s:%d: invalid "
+						"document '%s'", conf.c_str(),
+						nr, f[i].c_str());
+				}
+				Document d;
+				d.uri = f[i].substr(0, eq);
+				d.data = readFile(dir + "/" + f[i].substr(eq + 1));
+				s.documents.push_back(d);
+			}
+			signatures.push_back(s);
+		}
+		else if (f[0] == "challenge" && f.size() == 4) {
+			Challenge c;
+			c.certificate = readFile(dir + "/" + f[1]);
+			c.challenge = readFile(dir + "/" + f[2]);
+			c.signature = readFile(dir + "/" + f[3]);
+			challenges.push_back(c);
+		}
+		else {
+			THROW_STACK_EXCEPTION("%s:%d: invalid entry",
+				conf.c_str(), nr);
+		}
+	}
+}
+
+//
+// Generating a corpus
+//
+
+static std::string base64(const unsigned char *data, size_t len)
+{
+	std::vector<unsigned char> out(((len + 2) / 3) * 4 + 1);
+	int n = EVP_EncodeBlock(&out[0], data, len);
+	return std::string((const char *)&out[0], n);
+}
+
+static std::string base64(const std::vector<unsigned char>& data)
+{
+	return data.empty() ? std::string() : base64(&data[0], data.size());
+}
+
+static std::string base64(const std::string& data)
+{
+	return base64((const unsigned char *)data.data(), data.size());
+}
+
+static std::string randomBytes(size_t len)
+{
+	std::vector<unsigned char> buf(len);
+	if (RAND_bytes(&buf[0], len) != 1) {
+		THROW_STACK_EXCEPTION("RAND_bytes() failed");
+	}
+	return std::string((const char *)&buf[0], len);
+}
+
+static EVP_PKEY* generateKey(int bits)
+{
+	EVP_PKEY *key = NULL;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+	bool ok = ctx != NULL && EVP_PKEY_keygen_init(ctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, bits) > 0 &&
+		EVP_PKEY_keygen(ctx, &key) > 0;
+	EVP_PKEY_CTX_free(ctx);
+	if (!ok) {
+		THROW_STACK_EXCEPTION("Failed to generate a %d bit RSA key",
+			bits);
+	}
+	return key;
+}
+
+static void addEntry(X509_NAME *name, const char *field, const char *value)
+{
+	if (value != NULL && !X509_NAME_add_entry_by_txt(name, field,
+				MBSTRING_UTF8, (const unsigned char *)value,
+				-1, -1, 0)) {
+		THROW_STACK_EXCEPTION("Failed to add %s to a name", field);
+	}
+}
+
+static void addExtension(X509 *cert, X509 *issuer, int nid, const char *value)
+{
+	if (value == NULL) {
+		return;
+	}
+	X509V3_CTX ctx;
+	X509V3_set_ctx(&ctx, issuer, cert, NULL, NULL, 0);
+	X509_EXTENSION *ext =
+		X509V3_EXT_conf_nid(NULL, &ctx, nid, const_cast<char *>(value));
+	if (ext == NULL || !X509_add_ext(cert, ext, -1)) {
+		X509_EXTENSION_free(ext);
+		THROW_STACK_EXCEPTION("Failed to add extension %s",
+			OBJ_nid2sn(nid));
+	}
+	X509_EXTENSION_free(ext);
+}
+
+/*
+ * A certificate for key with the name, issued by issuer or self-signed
+ * when issuer is NULL.
+ * */
+static X509* issue(EVP_PKEY *key, X509_NAME *name, long serial,
+		X509 *issuer, EVP_PKEY *issuerKey,
+		const char *constraints, const char *usage, const char *extUsage)
+{
+	X509 *cert = X509_new();
+	if (cert == NULL) {
+		THROW_STACK_EXCEPTION("X509_new() failed");
+	}
+	X509 *signer = issuer != NULL ? issuer : cert;
+
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+	X509_gmtime_adj(X509_get_notBefore(cert), -86400);
+	X509_gmtime_adj(X509_get_notAfter(cert), 86400L * BENCH_CERT_DAYS);
+	X509_set_subject_name(cert, name);
+	X509_set_issuer_name(cert, X509_get_subject_name(signer));
+	X509_set_pubkey(cert, key);
+
+	addExtension(cert, signer, NID_basic_constraints, constraints);
+	addExtension(cert, signer, NID_key_usage, usage);
+	addExtension(cert, signer, NID_ext_key_usage, extUsage);
+	addExtension(cert, signer, NID_subject_key_identifier, "hash");
+	addExtension(cert, signer, NID_authority_key_identifier,
+			"keyid:always");
+
+	if (!X509_sign(cert, issuer != NULL ? issuerKey : key, EVP_sha256())) {
+		X509_free(cert);
+		THROW_STACK_EXCEPTION("Failed to sign a certificate");
+	}
+	return cert;
+}
+
+static X509* issueCA(EVP_PKEY *key, const char *cn, long serial,
+		X509 *issuer, EVP_PKEY *issuerKey)
+{
+	X509_NAME *name = X509_NAME_new();
+	addEntry(name, "C", "EE");
+	addEntry(name, "O", "AS Sertifitseerimiskeskus");
+	addEntry(name, "CN", cn);
+	X509 *cert = issue(key, name, serial, issuer, issuerKey,
+			"critical,CA:TRUE", "critical,keyCertSign,cRLSign",
+			NULL);
+	X509_NAME_free(name);
+	return cert;
+}
+
+static void writeCert(const std::string& path, X509 *cert)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	bool ok = f != NULL && PEM_write_X509(f, cert);
+	if (f != NULL && fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		THROW_STACK_EXCEPTION("Failed to write '%s'", path.c_str());
+	}
+}
+
+static void writeKey(const std::string& path, EVP_PKEY *key)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	bool ok = f != NULL &&
+		PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+	if (f != NULL && fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		THROW_STACK_EXCEPTION("Failed to write '%s'", path.c_str());
+	}
+}
+
+static void makeDir(const std::string& path)
+{
+	if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+		THROW_STACK_EXCEPTION("Failed to create '%s': %s",
+			path.c_str(), strerror(errno));
+	}
+}
+
+/*
+ * Personal identification code born on the given day, with the check
+ * digit of the Estonian standard.
+ * */
+static std::string personalCode(int century, int yy, int mm, int dd, int seq)
+{
+	char code[64];
+	snprintf(code, sizeof(code), "%d%02d%02d%02d%03d",
+			century % 10, yy % 100, mm % 100, dd % 100, seq % 1000);
+
+	static const int w1[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 1 };
+	static const int w2[10] = { 3, 4, 5, 6, 7, 8, 9, 1, 2, 3 };
+	int s1 = 0;
+	int s2 = 0;
+	for (int i = 0; i < 10; i++) {
+		s1 += (code[i] - '0') * w1[i];
+		s2 += (code[i] - '0') * w2[i];
+	}
+	int check = s1 % 11;
+	if (check == 10) {
+		check = s2 % 11;
+		if (check == 10) {
+			check = 0;
+		}
+	}
+	code[10] = '0' + check;
+	code[11] = '\0';
+	return code;
+}
+
+struct Signer {
+	EVP_PKEY *key;
+	X509 *cert;
+	std::string der;
+};
+
+static Signer issueSigner(int i, X509 *ca, EVP_PKEY *caKey)
+{
+	static const char *surnames[] = {
+		"TAMM", "SAAR", "SEPP", "MÄGI", "KASK", "KUKK", "RAUD", "ILVES"
+	};
+	static const char *givennames[] = {
+		"MARI-LIIS", "JÜRI", "KATRIN", "ANDRES", "PIRET", "TÕNU",
+		"KADRI", "MART"
+	};
+	const char *sn = surnames[i % 8];
+	const char *gn = givennames[(i / 8 + i) % 8];
+	bool female = ((i / 8 + i) % 8) % 2 == 0;
+	std::string code = personalCode(female ? 4 : 3, 50 + i % 40,
+			1 + i % 12, 1 + i % 28, i);
+	std::string cn = std::string(sn) + "," + gn + "," + code;
+
+	X509_NAME *name = X509_NAME_new();
+	addEntry(name, "C", "EE");
+	addEntry(name, "O", "ESTEID");
+	addEntry(name, "OU", "digital signature");
+	addEntry(name, "CN", cn.c_str());
+	addEntry(name, "SN", sn);
+	addEntry(name, "GN", gn);
+	addEntry(name, "serialNumber", code.c_str());
+
+	Signer s;
+	s.key = generateKey(BENCH_KEY_BITS);
+	s.cert = issue(s.key, name, 1000 + i, ca, caKey, "CA:FALSE",
+			"critical,digitalSignature,nonRepudiation", NULL);
+	X509_NAME_free(name);
+
+	std::vector<unsigned char> der = bdoc::X509Cert(s.cert).encodeDER();
+	s.der.assign((const char *)&der[0], der.size());
+	return s;
+}
+
+static std::vector<unsigned char> digest(const char *uri,
+		const std::string& data)
+{
+	std::auto_ptr<bdoc::Digest> calc = bdoc::Digest::create(uri);
+	calc->update((const unsigned char *)data.data(), data.size());
+	return calc->getDigest();
+}
+
+/*
+ * Canonical form of the element, from the DOM the verifier builds of
+ * the signature, canonicalized as in Signature::calcDigestOnNode().
+ * */
+static std::string canonicalize(const bdoc::GrammarPool *grammar,
+		const std::string& xml, const char *ns, const char *tag)
+{
+	std::auto_ptr<xercesc::DOMDocument> doc =
+		grammar->parse(xml.data(), xml.size());
+	xercesc::DOMNodeList *nl =
+		doc->getElementsByTagNameNS(XMLStr(ns), XMLStr(tag));
+	if (nl == NULL || nl->getLength() != 1) {
+		THROW_STACK_EXCEPTION("No single '%s' in the signature", tag);
+	}
+
+	XSECC14n20010315 canonicalizer(doc.get(), nl->item(0));
+	canonicalizer.setCommentsProcessing(false);
+	canonicalizer.setUseNamespaceStack(true);
+
+	std::string out;
+	unsigned char buffer[BENCH_C14N_CHUNK_SIZE];
+	int bytes = 0;
+	while ((bytes = canonicalizer.outputBuffer(buffer,
+					BENCH_C14N_CHUNK_SIZE)) > 0) {
+		out.append((const char *)buffer, bytes);
+	}
+	return out;
+}
+
+static std::string sign(EVP_PKEY *key, const EVP_MD *md,
+		const std::string& data)
+{
+	std::vector<unsigned char> sig(EVP_PKEY_size(key));
+	unsigned int len = 0;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+	bool ok = ctx != NULL && EVP_SignInit_ex(ctx, md, NULL) &&
+		EVP_SignUpdate(ctx, data.data(), data.size()) &&
+		EVP_SignFinal(ctx, &sig[0], &len, key);
+	EVP_MD_CTX_destroy(ctx);
+	if (!ok) {
+		THROW_STACK_EXCEPTION("Failed to sign SignedInfo");
+	}
+	return std::string((const char *)&sig[0], len);
+}
+
+// The signature of a challenge is over its bytes as a SHA-1 digest
+static std::string signChallenge(EVP_PKEY *key, const std::string& challenge)
+{
+	std::vector<unsigned char> sig(EVP_PKEY_size(key));
+	size_t len = sig.size();
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+	bool ok = ctx != NULL && EVP_PKEY_sign_init(ctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha1()) > 0 &&
+		EVP_PKEY_sign(ctx, &sig[0], &len,
+			(const unsigned char *)challenge.data(),
+			challenge.size()) > 0;
+	EVP_PKEY_CTX_free(ctx);
+	if (!ok) {
+		THROW_STACK_EXCEPTION("Failed to sign a challenge");
+	}
+	return std::string((const char *)&sig[0], len);
+}
+
+/*
+ * What a vote signature is made of. XAdES 1.1.1 ones are signed with
+ * RSA-SHA1 and have the implied signature policy the schema demands,
+ * XAdES 1.3.2 ones are signed with RSA-SHA256 and have no policy.
+ * */
+struct VoteTemplate {
+	bool xades111;
+	std::string signingTime;
+	std::string cert;
+	std::string certDigest;
+	std::string issuerName;
+	std::string serial;
+	std::string uri;
+	std::string docDigest;
+};
+
+static const char* digestUri(const VoteTemplate& v)
+{
+	return v.xades111 ? URI_SHA1 : URI_SHA256;
+}
+
+// Without whitespace between the elements
+static std::string renderVote(const VoteTemplate& v,
+		const std::string& propsDigest, const std::string& value)
+{
+	std::string xades = v.xades111 ? XADES111_NS : XADES132_NS;
+	std::string dm = std::string("<ds:DigestMethod Algorithm=\"") +
+		digestUri(v) + "\"/>";
+
+	std::ostringstream x;
+	x << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		<< "<ds:Signature xmlns:ds=\"" << DSIG_NS << "\" Id=\"S0\">"
+		<< "<ds:SignedInfo>"
+		<< "<ds:CanonicalizationMethod Algorithm=\""
+			<< URI_ID_C14N_NOC << "\"/>"
+		<< "<ds:SignatureMethod Algorithm=\""
+			<< (v.xades111 ? URI_ID_RSA_SHA1 : URI_ID_RSA_SHA256)
+			<< "\"/>"
+		<< "<ds:Reference Id=\"S0-RefId0\" URI=\"/"
+			<< bdoc::TMSignatureWriter::escape(v.uri) << "\">"
+			<< dm << "<ds:DigestValue>" << v.docDigest
+			<< "</ds:DigestValue></ds:Reference>"
+		<< "<ds:Reference Id=\"S0-RefId1\" Type=\"" << xades
+			<< "SignedProperties\" URI=\"#S0-SignedProperties\">"
+			<< dm << "<ds:DigestValue>" << propsDigest
+			<< "</ds:DigestValue></ds:Reference>"
+		<< "</ds:SignedInfo>"
+		<< "<ds:SignatureValue Id=\"S0-SIG\">" << value
+			<< "</ds:SignatureValue>"
+		<< "<ds:KeyInfo Id=\"S0-KeyInfo\"><ds:X509Data>"
+			<< "<ds:X509Certificate>" << v.cert
+			<< "</ds:X509Certificate></ds:X509Data></ds:KeyInfo>"
+		<< "<ds:Object>"
+		<< "<xades:QualifyingProperties xmlns:xades=\"" << xades
+			<< "\" Target=\"#S0\">"
+		<< "<xades:SignedProperties Id=\"S0-SignedProperties\">"
+		<< "<xades:SignedSignatureProperties>"
+		<< "<xades:SigningTime>" << v.signingTime
+			<< "</xades:SigningTime>"
+		<< "<xades:SigningCertificate><xades:Cert><xades:CertDigest>"
+			<< dm << "<ds:DigestValue>" << v.certDigest
+			<< "</ds:DigestValue></xades:CertDigest>"
+		<< "<xades:IssuerSerial><ds:X509IssuerName>" << v.issuerName
+			<< "</ds:X509IssuerName><ds:X509SerialNumber>"
+			<< v.serial << "</ds:X509SerialNumber>"
+			<< "</xades:IssuerSerial></xades:Cert>"
+			<< "</xades:SigningCertificate>";
+	if (v.xades111) {
+		x << "<xades:SignaturePolicyIdentifier>"
+			<< "<xades:SignaturePolicyImplied/>"
+			<< "</xades:SignaturePolicyIdentifier>";
+	}
+	x << "</xades:SignedSignatureProperties>"
+		<< "<xades:SignedDataObjectProperties>"
+		<< "<xades:DataObjectFormat ObjectReference=\"#S0-RefId0\">"
+		<< "<xades:MimeType>application/octet-stream</xades:MimeType>"
+		<< "</xades:DataObjectFormat></xades:SignedDataObjectProperties>"
+		<< "</xades:SignedProperties>"
+		<< "<xades:UnsignedProperties/>"
+		<< "</xades:QualifyingProperties></ds:Object>"
+		<< "</ds:Signature>";
+	return x.str();
+}
+
+/*
+ * The SignedProperties digest goes into SignedInfo and the signature
+ * value after it, neither changes what was digested or signed before.
+ * */
+static std::string signVote(const bdoc::GrammarPool *grammar,
+		const VoteTemplate& v, EVP_PKEY *key)
+{
+	std::string xades = v.xades111 ? XADES111_NS : XADES132_NS;
+
+	std::string xml = renderVote(v, "", "");
+	std::string props = base64(digest(digestUri(v),
+			canonicalize(grammar, xml, xades.c_str(),
+				"SignedProperties")));
+
+	xml = renderVote(v, props, "");
+	std::string value = base64(sign(key,
+			v.xades111 ? EVP_sha1() : EVP_sha256(),
+			canonicalize(grammar, xml, DSIG_NS, "SignedInfo")));
+
+	return renderVote(v, props, value);
+}
+
+static std::string xsdNow(int offset)
+{
+	time_t t = time(NULL) - offset;
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	char buf[32];
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	return buf;
+}
+
+void bdoc::BenchCorpus::generate(const std::string& dir,
+		const std::string& schema_dir, int votes, int signers)
+{
+	const GrammarPool *grammar = GrammarPool::get(schema_dir);
+
+	makeDir(dir);
+	makeDir(dir + "/signers");
+	makeDir(dir + "/votes");
+	makeDir(dir + "/challenges");
+
+	EVP_PKEY *rootKey = generateKey(BENCH_KEY_BITS);
+	X509 *root = issueCA(rootKey, BENCH_ROOT_CN, 1, NULL, NULL);
+
+	EVP_PKEY *caKey = generateKey(BENCH_KEY_BITS);
+	X509 *ca = issueCA(caKey, BENCH_ISSUER_CN, 2, root, rootKey);
+
+	// Issued by the root, as the SK responder
+	EVP_PKEY *ocspKey = generateKey(BENCH_KEY_BITS);
+	X509 *ocsp;
+	{
+		X509_NAME *name = X509_NAME_new();
+		addEntry(name, "C", "EE");
+		addEntry(name, "O", "AS Sertifitseerimiskeskus");
+		addEntry(name, "OU", "OCSP");
+		addEntry(name, "CN", BENCH_OCSP_CN);
+		ocsp = issue(ocspKey, name, 3, root, rootKey, "CA:FALSE",
+				"critical,digitalSignature", "OCSPSigning");
+		X509_NAME_free(name);
+	}
+
+	writeCert(dir + "/root.pem", root);
+	writeCert(dir + "/esteid.pem", ca);
+	writeCert(dir + "/ocsp.pem", ocsp);
+	writeKey(dir + "/ocsp-key.pem", ocspKey);
+
+	std::ostringstream conf;
+	conf << "# bdoc_bench corpus, " << votes << " votes of "
+		<< signers << " voters\n"
+		<< "cert\troot.pem\n"
+		<< "cert\testeid.pem\n"
+		<< "ocsp\t" << BENCH_ISSUER_CN << "\tocsp.pem\tocsp-key.pem\n";
+
+	std::vector<Signer> voters;
+	for (int i = 0; i < signers; i++) {
+		voters.push_back(issueSigner(i, ca, caKey));
+		char name[32];
+		snprintf(name, sizeof(name), "signers/%04d.der", i);
+		writeFile(dir + "/" + name, voters.back().der);
+	}
+
+	std::string uri = std::string(BENCH_ELECTION) + ".evote";
+	for (int i = 0; i < votes; i++) {
+		const Signer& s = voters[i % signers];
+		X509Cert cert(s.cert);
+
+		VoteTemplate v;
+		v.xades111 = i % 2 == 0;
+		v.signingTime = xsdNow(votes - i);
+		v.cert = base64(s.der);
+		v.certDigest = base64(digest(digestUri(v), s.der));
+		v.issuerName = TMSignatureWriter::escape(cert.getIssuerName());
+		v.serial = cert.getSerial();
+		v.uri = uri;
+
+		std::string ballot = randomBytes(BENCH_BALLOT_LEN);
+		v.docDigest = base64(digest(digestUri(v), ballot));
+
+		char base[32];
+		snprintf(base, sizeof(base), "votes/%06d", i);
+		writeFile(dir + "/" + base + ".xml", signVote(grammar, v, s.key));
+		writeFile(dir + "/" + base + ".evote", ballot);
+		conf << "signature\t" << base << ".xml\t" << uri << "="
+			<< base << ".evote\n";
+
+		std::string challenge = randomBytes(BENCH_CHALLENGE_LEN);
+		snprintf(base, sizeof(base), "challenges/%06d", i);
+		writeFile(dir + "/" + base + ".bin", challenge);
+		writeFile(dir + "/" + base + ".sig",
+				signChallenge(s.key, challenge));
+
+		char signer[32];
+		snprintf(signer, sizeof(signer), "signers/%04d.der",
+				i % signers);
+		conf << "challenge\t" << signer << "\t" << base << ".bin\t"
+			<< base << ".sig\n";
+	}
+
+	writeFile(dir + "/corpus.conf", conf.str());
+
+	for (size_t i = 0; i < voters.size(); i++) {
+		X509_free(voters[i].cert);
+		EVP_PKEY_free(voters[i].key);
+	}
+	X509_free(ocsp);
+	EVP_PKEY_free(ocspKey);
+	X509_free(ca);
+	EVP_PKEY_free(caKey);
+	X509_free(root);
+	EVP_PKEY_free(rootKey);
+}
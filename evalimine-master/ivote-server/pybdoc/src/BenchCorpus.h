@@ -0,0 +1,79 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace bdoc {
+
+/*
+ * Signatures, documents and challenges bdoc_bench verifies. A corpus is
+ * a directory with corpus.conf, which lists the files relative to the
+ * directory, one entry per line, the fields separated by tabs:
+ *
+ *   cert <certificate PEM>                   trusted CA certificate
+ *   ocsp <issuer CN> <responder PEM> <key PEM>
+ *                                            responder for the issuer,
+ *                                            the stub signs with the key
+ *   signature <XML> <URI>=<file> ...         signature and its documents
+ *   challenge <certificate DER> <challenge> <signature>
+ *
+ * generate() writes a corpus of its own: a test PKI, vote signatures
+ * alternating between XAdES 1.1.1 (RSA-SHA1) and XAdES 1.3.2
+ * (RSA-SHA256) over one encrypted ballot each, and a Mobile-ID
+ * challenge per vote.
+ * */
+class BenchCorpus {
+
+	public:
+
+		struct Document {
+			std::string uri;
+			std::string data;
+		};
+
+		struct SignatureFile {
+			std::string name;
+			std::string xml;
+			std::vector<Document> documents;
+		};
+
+		struct Challenge {
+			std::string certificate;
+			std::string challenge;
+			std::string signature;
+		};
+
+		struct Responder {
+			std::string issuer;
+			std::string cert;
+			std::string key;
+		};
+
+		BenchCorpus();
+
+		void load(const std::string& dir);
+
+		static void generate(const std::string& dir,
+				const std::string& schema_dir,
+				int votes, int signers);
+
+		// Paths with the directory
+		std::vector<std::string> certs;
+		std::vector<Responder> responders;
+
+		std::vector<SignatureFile> signatures;
+		std::vector<Challenge> challenges;
+};
+
+}
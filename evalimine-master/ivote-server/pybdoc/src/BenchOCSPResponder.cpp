@@ -0,0 +1,405 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "BenchOCSPResponder.h"
+#include "StackException.h"
+#include "crypto/X509Cert.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+
+#include <sstream>
+
+// Requests larger than this are not OCSP requests
+#define BENCH_OCSP_MAX_REQUEST (64 * 1024)
+
+bdoc::BenchOCSPResponder::BenchOCSPResponder(const std::string& cert,
+		const std::string& key, int latency_ms) :
+	_cert(NULL),
+	_key(NULL),
+	_latency(latency_ms),
+	_listen(-1),
+	_port(0),
+	_started(false),
+	_stopping(false),
+	_thread(),
+	_mutex(),
+	_connections(),
+	_requests(0)
+{
+	pthread_mutex_init(&_mutex, NULL);
+
+	_cert = X509Cert::loadX509(cert);
+	if (_cert == NULL) {
+		THROW_STACK_EXCEPTION("Failed to load OCSP responder "
+			"certificate '%s'", cert.c_str());
+	}
+
+	FILE *f = fopen(key.c_str(), "r");
+	if (f == NULL) {
+		THROW_STACK_EXCEPTION("Failed to open OCSP responder key "
+			"'%s': %s", key.c_str(), strerror(errno));
+	}
+	_key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	if (_key == NULL) {
+		THROW_STACK_EXCEPTION("Failed to load OCSP responder key "
+			"'%s'", key.c_str());
+	}
+}
+
+bdoc::BenchOCSPResponder::~BenchOCSPResponder()
+{
+	stop();
+	EVP_PKEY_free(_key);
+	X509_free(_cert);
+	pthread_mutex_destroy(&_mutex);
+}
+
+void bdoc::BenchOCSPResponder::start()
+{
+	_listen = socket(AF_INET, SOCK_STREAM, 0);
+	if (_listen == -1) {
+		THROW_STACK_EXCEPTION("socket() failed: %s", strerror(errno));
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	socklen_t len = sizeof(addr);
+	if (bind(_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(_listen, 64) != 0 ||
+			getsockname(_listen, (struct sockaddr *)&addr, &len) != 0) {
+		int err = errno;
+		close(_listen);
+		_listen = -1;
+		THROW_STACK_EXCEPTION("Failed to listen on 127.0.0.1: %s",
+			strerror(err));
+	}
+	_port = ntohs(addr.sin_port);
+
+	_stopping = false;
+	int rc = pthread_create(&_thread, NULL, acceptMain, this);
+	if (rc != 0) {
+		close(_listen);
+		_listen = -1;
+		THROW_STACK_EXCEPTION("pthread_create() failed: %s",
+			strerror(rc));
+	}
+	_started = true;
+}
+
+void bdoc::BenchOCSPResponder::stop()
+{
+	if (!_started) {
+		return;
+	}
+
+	pthread_mutex_lock(&_mutex);
+	_stopping = true;
+	pthread_mutex_unlock(&_mutex);
+
+	// Wakes up accept() and the connections waiting for a request
+	shutdown(_listen, SHUT_RDWR);
+	pthread_join(_thread, NULL);
+	close(_listen);
+	_listen = -1;
+
+	pthread_mutex_lock(&_mutex);
+	for (std::list<Connection*>::iterator it = _connections.begin();
+			it != _connections.end(); it++) {
+		shutdown((*it)->fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&_mutex);
+	reap(true);
+
+	_started = false;
+}
+
+std::string bdoc::BenchOCSPResponder::url() const
+{
+	std::ostringstream oss;
+	oss << "http://127.0.0.1:" << _port << "/";
+	return oss.str();
+}
+
+unsigned long bdoc::BenchOCSPResponder::requests() const
+{
+	pthread_mutex_lock(&_mutex);
+	unsigned long n = _requests;
+	pthread_mutex_unlock(&_mutex);
+	return n;
+}
+
+void* bdoc::BenchOCSPResponder::acceptMain(void *arg)
+{
+	((BenchOCSPResponder *)arg)->acceptLoop();
+	return NULL;
+}
+
+void bdoc::BenchOCSPResponder::acceptLoop()
+{
+	while (true) {
+		int fd = accept(_listen, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		// Connections closed by the pool meanwhile
+		reap(false);
+
+		Connection *c = new Connection();
+		c->owner = this;
+		c->fd = fd;
+		c->done = false;
+
+		pthread_mutex_lock(&_mutex);
+		if (_stopping) {
+			pthread_mutex_unlock(&_mutex);
+			close(fd);
+			delete c;
+			break;
+		}
+		if (pthread_create(&c->thread, NULL, connectionMain, c) != 0) {
+			pthread_mutex_unlock(&_mutex);
+			close(fd);
+			delete c;
+			continue;
+		}
+		_connections.push_back(c);
+		pthread_mutex_unlock(&_mutex);
+	}
+}
+
+/*
+ * Joins the connection threads that are done, or all of them. The
+ * socket is closed here, after the thread, so that stop() never shuts
+ * down a descriptor that is already reused.
+ * */
+void bdoc::BenchOCSPResponder::reap(bool all)
+{
+	std::list<Connection*> finished;
+
+	pthread_mutex_lock(&_mutex);
+	std::list<Connection*>::iterator it = _connections.begin();
+	while (it != _connections.end()) {
+		if (all || (*it)->done) {
+			finished.push_back(*it);
+			it = _connections.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+	pthread_mutex_unlock(&_mutex);
+
+	for (it = finished.begin(); it != finished.end(); it++) {
+		pthread_join((*it)->thread, NULL);
+		close((*it)->fd);
+		delete *it;
+	}
+}
+
+void* bdoc::BenchOCSPResponder::connectionMain(void *arg)
+{
+	Connection *c = (Connection *)arg;
+	c->owner->serve(c);
+	return NULL;
+}
+
+static bool writeAll(int fd, const char *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+void bdoc::BenchOCSPResponder::serve(Connection *c)
+{
+	std::string in;
+	std::vector<unsigned char> body;
+
+	while (readRequest(c->fd, in, body)) {
+		std::vector<unsigned char> der = respond(body);
+		if (der.empty()) {
+			break;
+		}
+
+		if (_latency > 0) {
+			usleep(_latency * 1000);
+		}
+
+		std::ostringstream head;
+		head << "HTTP/1.1 200 OK\r\n"
+			<< "Content-Type: application/ocsp-response\r\n"
+			<< "Content-Length: " << der.size() << "\r\n"
+			<< "Connection: keep-alive\r\n\r\n";
+		std::string out = head.str();
+		out.append((const char *)&der[0], der.size());
+		if (!writeAll(c->fd, out.data(), out.size())) {
+			break;
+		}
+
+		pthread_mutex_lock(&_mutex);
+		_requests++;
+		pthread_mutex_unlock(&_mutex);
+	}
+
+	pthread_mutex_lock(&_mutex);
+	c->done = true;
+	pthread_mutex_unlock(&_mutex);
+}
+
+/*
+ * Reads the next request of the connection into body. Bytes read past
+ * it stay in in for the next call. False when the peer is gone or the
+ * request is not a POST with a Content-Length.
+ * */
+bool bdoc::BenchOCSPResponder::readRequest(int fd, std::string& in,
+		std::vector<unsigned char>& body) const
+{
+	char buf[4096];
+	size_t end;
+	while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+		if (in.size() > BENCH_OCSP_MAX_REQUEST) {
+			return false;
+		}
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		in.append(buf, n);
+	}
+
+	if (in.compare(0, 5, "POST ") != 0) {
+		return false;
+	}
+
+	long length = -1;
+	size_t pos = in.find("\r\n") + 2;
+	while (pos < end) {
+		size_t eol = in.find("\r\n", pos);
+		std::string line = in.substr(pos, eol - pos);
+		size_t colon = line.find(':');
+		if (colon != std::string::npos &&
+				strcasecmp(line.substr(0, colon).c_str(),
+					"Content-Length") == 0) {
+			length = strtol(line.c_str() + colon + 1, NULL, 10);
+		}
+		pos = eol + 2;
+	}
+	if (length < 0 || length > BENCH_OCSP_MAX_REQUEST) {
+		return false;
+	}
+
+	size_t start = end + 4;
+	while (in.size() < start + length) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		in.append(buf, n);
+	}
+
+	body.assign(in.begin() + start, in.begin() + start + length);
+	in.erase(0, start + length);
+	return true;
+}
+
+/*
+ * The DER of the response to the DER of a request: GOOD for every
+ * certificate id, produced and updated now, the nonce copied.
+ * */
+std::vector<unsigned char> bdoc::BenchOCSPResponder::respond(
+		const std::vector<unsigned char>& request) const
+{
+	OCSP_RESPONSE *resp = NULL;
+
+	const unsigned char *p = request.empty() ? NULL : &request[0];
+	OCSP_REQUEST *req = p == NULL ? NULL :
+		d2i_OCSP_REQUEST(NULL, &p, request.size());
+
+	if (req == NULL) {
+		resp = OCSP_response_create(
+			OCSP_RESPONSE_STATUS_MALFORMEDREQUEST, NULL);
+	}
+	else {
+		OCSP_BASICRESP *basic = OCSP_BASICRESP_new();
+		ASN1_TIME *now = X509_gmtime_adj(NULL, 0);
+
+		bool ok = basic != NULL && now != NULL;
+		int count = OCSP_request_onereq_count(req);
+		for (int i = 0; ok && i < count; i++) {
+			OCSP_ONEREQ *one = OCSP_request_onereq_get0(req, i);
+			OCSP_CERTID *id = OCSP_onereq_get0_id(one);
+			ok = OCSP_basic_add1_status(basic, id,
+					V_OCSP_CERTSTATUS_GOOD, 0, NULL,
+					now, NULL) != NULL;
+		}
+		ok = ok && OCSP_copy_nonce(basic, req) > 0 &&
+			OCSP_basic_sign(basic, _cert, _key, EVP_sha1(),
+					NULL, 0) > 0;
+
+		resp = OCSP_response_create(ok ?
+				OCSP_RESPONSE_STATUS_SUCCESSFUL :
+				OCSP_RESPONSE_STATUS_INTERNALERROR,
+				ok ? basic : NULL);
+
+		ASN1_TIME_free(now);
+		OCSP_BASICRESP_free(basic);
+		OCSP_REQUEST_free(req);
+	}
+
+	std::vector<unsigned char> der;
+	int len = resp == NULL ? 0 : i2d_OCSP_RESPONSE(resp, NULL);
+	if (len > 0) {
+		der.resize(len);
+		unsigned char *q = &der[0];
+		i2d_OCSP_RESPONSE(resp, &q);
+	}
+	OCSP_RESPONSE_free(resp);
+	return der;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <pthread.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+namespace bdoc {
+
+/*
+ * OCSP responder of bdoc_bench on 127.0.0.1, answering GOOD for every
+ * certificate asked about, with the nonce of the request, signed by
+ * the given responder key. Speaks kept-alive HTTP/1.1 as the
+ * OCSPConnectionPool does, a thread per connection. A latency emulates
+ * the round trip to a real responder.
+ * */
+class BenchOCSPResponder {
+
+	public:
+
+		BenchOCSPResponder(const std::string& cert,
+				const std::string& key, int latency_ms);
+		~BenchOCSPResponder();
+
+		// Listens on a free port
+		void start();
+		void stop();
+
+		// http://127.0.0.1:<port>/
+		std::string url() const;
+		unsigned long requests() const;
+
+	private:
+
+		BenchOCSPResponder(const BenchOCSPResponder&);
+		BenchOCSPResponder& operator=(const BenchOCSPResponder&);
+
+		struct Connection {
+			BenchOCSPResponder *owner;
+			int fd;
+			pthread_t thread;
+			bool done;
+		};
+
+		static void* acceptMain(void *arg);
+		void acceptLoop();
+		void reap(bool all);
+
+		static void* connectionMain(void *arg);
+		void serve(Connection *c);
+		bool readRequest(int fd, std::string& in,
+				std::vector<unsigned char>& body) const;
+		std::vector<unsigned char> respond(
+				const std::vector<unsigned char>& request) const;
+
+		X509 *_cert;
+		EVP_PKEY *_key;
+		int _latency;
+
+		int _listen;
+		int _port;
+		bool _started;
+		bool _stopping;
+		pthread_t _thread;
+
+		mutable pthread_mutex_t _mutex;
+		std::list<Connection*> _connections;
+		unsigned long _requests;
+};
+
+}
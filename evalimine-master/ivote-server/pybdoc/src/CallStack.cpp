@@ -16,12 +16,49 @@
 
 namespace bdoc {
 
-CallStack::CallStack (const size_t num_discard /*= 0*/) {
+static volatile bool capture_enabled = true;
 
-	void * trace[MAX_DEPTH];
-	int stack_depth = backtrace(trace, MAX_DEPTH);
+void CallStack::setEnabled (bool enabled) {
+	capture_enabled = enabled;
+}
+
+bool CallStack::isEnabled () {
+#ifdef BDOC_WITHOUT_BACKTRACE
+	return false;
+#else
+	return capture_enabled;
+#endif
+}
+
+CallStack::CallStack (const size_t num_discard /*= 0*/, bool capture /*= true*/) :
+	trace(), stack(), resolved(false) {
+
+	if (!capture || !isEnabled()) {
+		return;
+	}
+
+#ifndef BDOC_WITHOUT_BACKTRACE
+	void * addrs[MAX_DEPTH];
+	int stack_depth = backtrace(addrs, MAX_DEPTH);
 
 	for (int i = num_discard+1; i < stack_depth; i++) {
+		trace.push_back(addrs[i]);
+	}
+#else
+	(void)num_discard;
+#endif
+}
+
+CallStack::~CallStack () throw() {
+}
+
+void CallStack::resolve () const {
+	if (resolved) {
+		return;
+	}
+	resolved = true;
+
+	for (size_t i = 0; i < trace.size(); i++) {
 		Dl_info dlinfo;
 		if (!dladdr(trace[i], &dlinfo)) {
 			break;
@@ -40,8 +77,9 @@ CallStack::CallStack (const size_t num_discard /*= 0*/) {
 			e.file = dlinfo.dli_fname;
 			e.function = symname;
 			stack.push_back(e);
-		} 
+		}
 		else {
+			free(demangled);
 			break; // skip last entries below main
 		}
 
@@ -51,7 +89,18 @@ CallStack::CallStack (const size_t num_discard /*= 0*/) {
 	}
 }
 
-CallStack::~CallStack () throw() {
+const std::vector<CallStackEntry>& CallStack::entries () const {
+	resolve();
+	return stack;
+}
+
+std::string CallStack::to_string (const std::string& pre) const {
+	resolve();
+	std::ostringstream os;
+	for (size_t i = 0; i < stack.size(); i++) {
+		os << pre << "\t" << stack[i].to_string() << std::endl;
+	}
+	return os.str();
 }
 
 } // namespace stacktrace
@@ -34,23 +34,35 @@ struct CallStackEntry {
 
 };
 
+/*
+ * Return addresses of the callers, symbols are looked up only when the
+ * stack is printed. Nothing is captured when built with
+ * -DBDOC_WITHOUT_BACKTRACE or after setEnabled(false).
+ * */
 class CallStack {
 
 	public:
 
-		CallStack (const size_t num_discard = 0);
+		CallStack (const size_t num_discard = 0, bool capture = true);
 
 		virtual ~CallStack () throw();
 
-		std::string to_string (const std::string& pre) const {
-			std::ostringstream os;
-			for (size_t i = 0; i < stack.size(); i++) {
-				os << pre << "\t" << stack[i].to_string() << std::endl;
-			}
-			return os.str();
-		}
+		std::string to_string (const std::string& pre) const;
+
+		const std::vector<CallStackEntry>& entries () const;
+
+		// For the whole process, e.g. when only the messages of the
+		// errors are used
+		static void setEnabled (bool enabled);
+		static bool isEnabled ();
+
+	private:
+
+		void resolve () const;
 
-		std::vector<CallStackEntry> stack;
+		std::vector<void *> trace;
+		mutable std::vector<CallStackEntry> stack;
+		mutable bool resolved;
 };
 
 }
@@ -12,15 +12,85 @@
  * */
 
 #include <string.h>
+#include <pthread.h>
 #include <openssl/pem.h>
 
+#include <list>
+#include <map>
+
 #include "ChallengeVerifierImpl.h"
+#include "crypto/DigestEngine.h"
 
 #define ASN_DIGEST_INFO_LEN	15
 #define CHALLENGE_LEN		20
+// Public keys of the most recently used certificates
+#define KEY_CACHE_SIZE		64
+// Up to 8192 bit keys are decrypted without allocating
+#define RSA_OUT_MAX		1024
+
+/*
+ * Decoded public keys by the SHA-1 of the certificate, the same few
+ * certificates are checked over and over during a Mobile-ID session.
+ * */
+struct CachedKey {
+	std::string hash;
+	RSA *rsa;
+};
+
+typedef std::list<CachedKey> KeyList;
+
+static KeyList key_lru;
+static std::map<std::string, KeyList::iterator> key_index;
+static pthread_mutex_t key_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static RSA* cache_find(const std::string& hash)
+{
+	RSA *rsa = NULL;
+	pthread_mutex_lock(&key_mutex);
+	std::map<std::string, KeyList::iterator>::iterator it =
+						key_index.find(hash);
+	if (it != key_index.end()) {
+		key_lru.splice(key_lru.begin(), key_lru, it->second);
+		rsa = it->second->rsa;
+		RSA_up_ref(rsa);
+	}
+	pthread_mutex_unlock(&key_mutex);
+	return rsa;
+}
+
+static void cache_add(const std::string& hash, RSA *rsa)
+{
+	pthread_mutex_lock(&key_mutex);
+	if (key_index.find(hash) == key_index.end()) {
+		CachedKey ck;
+		ck.hash = hash;
+		ck.rsa = rsa;
+		RSA_up_ref(rsa);
+		key_lru.push_front(ck);
+		key_index[hash] = key_lru.begin();
+
+		if (key_lru.size() > KEY_CACHE_SIZE) {
+			key_index.erase(key_lru.back().hash);
+			RSA_free(key_lru.back().rsa);
+			key_lru.pop_back();
+		}
+	}
+	pthread_mutex_unlock(&key_mutex);
+}
+
+void ChallengeVerifierImpl::releaseKeys()
+{
+	pthread_mutex_lock(&key_mutex);
+	for (KeyList::iterator it = key_lru.begin(); it != key_lru.end(); it++) {
+		RSA_free(it->rsa);
+	}
+	key_lru.clear();
+	key_index.clear();
+	pthread_mutex_unlock(&key_mutex);
+}
 
 ChallengeVerifierImpl::ChallengeVerifierImpl()
-	: certificate(), challenge(), signature(), error()
+	: certificate(), challenge(), signature(), error(), challenges()
 {
 }
 
@@ -28,83 +98,139 @@ ChallengeVerifierImpl::~ChallengeVerifierImpl()
 {
 }
 
-bool ChallengeVerifierImpl::isChallengeOk()
+RSA* ChallengeVerifierImpl::getKey(std::string& err)
 {
-	// PKCS#1 DigestInfo ASN1, in case of obj-id sha1
-	unsigned char asn1[ASN_DIGEST_INFO_LEN] = {
-		0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e,
-		0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14
-	};
+	typedef bdoc::DigestEngine<NID_sha1> SHA1Engine;
+	unsigned char md[SHA1Engine::SIZE];
+	SHA1Engine::hash(certificate.peek(), certificate.len(), md);
+	std::string hash((const char *)md, SHA1Engine::SIZE);
+
+	RSA *rsa = cache_find(hash);
+	if (rsa != NULL) {
+		return rsa;
+	}
 
-	bool ret = false;
 	EVP_PKEY *pkey = NULL;
-	RSA *rsa = NULL;
-	unsigned char *rsa_out = NULL;
-	int rsa_outlen = 0;
-	int keysize = 0;
-		X509 *x = NULL;
+	X509 *x = NULL;
 
 	const unsigned char *buf = certificate.peek();
 	x = d2i_X509(NULL, &buf, certificate.len());
 	if (x == NULL) {
-		error = "Error decoding certificate";
+		err = "Error decoding certificate";
 		goto end;
-		}
+	}
 
 	pkey = X509_get_pubkey(x);
 	if (pkey == NULL) {
-		error = "Error decoding public key";
+		err = "Error decoding public key";
 		goto end;
 	}
 
 	rsa = EVP_PKEY_get1_RSA(pkey);
 	if (rsa == NULL) {
-		error = "Error extracting RSA from public key";
+		err = "Error extracting RSA from public key";
 		goto end;
 	}
 
-	keysize = RSA_size(rsa);
-	rsa_out = (unsigned char*)OPENSSL_malloc(keysize);
-	if (rsa_out == NULL) {
-		error = "Out of memory";
-		goto end;
+	cache_add(hash, rsa);
+
+	end:
+	if (x) X509_free(x);
+	if (pkey) EVP_PKEY_free(pkey);
+	return rsa;
+}
+
+bool ChallengeVerifierImpl::verify(RSA *rsa,
+		const unsigned char *chal, size_t chal_len,
+		const unsigned char *sig, size_t sig_len,
+		std::string& err)
+{
+	// PKCS#1 DigestInfo ASN1, in case of obj-id sha1
+	static const unsigned char asn1[ASN_DIGEST_INFO_LEN] = {
+		0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e,
+		0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14
+	};
+
+	bool ret = false;
+	unsigned char out[RSA_OUT_MAX];
+	unsigned char *rsa_out = out;
+	int rsa_outlen = 0;
+	int keysize = RSA_size(rsa);
+
+	if (keysize > RSA_OUT_MAX) {
+		rsa_out = (unsigned char*)OPENSSL_malloc(keysize);
+		if (rsa_out == NULL) {
+			err = "Out of memory";
+			return false;
+		}
 	}
 
-	rsa_outlen  = RSA_public_decrypt(signature.len(), \
-						signature.peek(), rsa_out, \
+	rsa_outlen  = RSA_public_decrypt(sig_len, sig, rsa_out, \
 						rsa, RSA_PKCS1_PADDING);
 	if (rsa_outlen <= 0) {
-		error = "Error in decryption";
+		err = "Error in decryption";
 		goto end;
 	}
 
 	if (rsa_outlen != (ASN_DIGEST_INFO_LEN + CHALLENGE_LEN)) {
-		error = "Result length not correct";
+		err = "Result length not correct";
 		goto end;
 	}
 
 	if (memcmp(rsa_out, asn1, ASN_DIGEST_INFO_LEN)) {
-		error = "Result ASN not correct";
+		err = "Result ASN not correct";
 		goto end;
 	}
 
-	if (challenge.len() != CHALLENGE_LEN) {
-		error = "Invalid input challenge";
+	if (chal_len != CHALLENGE_LEN) {
+		err = "Invalid input challenge";
 		goto end;
 	}
 
-	if (memcmp(rsa_out + ASN_DIGEST_INFO_LEN, \
-					challenge.peek(), CHALLENGE_LEN)) {
-		error = "Invalid challenge verification result";
+	if (memcmp(rsa_out + ASN_DIGEST_INFO_LEN, chal, CHALLENGE_LEN)) {
+		err = "Invalid challenge verification result";
 		goto end;
 	}
 
 	ret = true;
 	end:
-	if (x) X509_free(x);
-	if (rsa) RSA_free(rsa);
-	if (rsa_out) OPENSSL_free(rsa_out);
-	if (pkey) EVP_PKEY_free(pkey);
+	if (rsa_out != out) OPENSSL_free(rsa_out);
+	return ret;
+}
+
+bool ChallengeVerifierImpl::isChallengeOk()
+{
+	RSA *rsa = getKey(error);
+	if (rsa == NULL) {
+		return false;
+	}
+
+	bool ret = verify(rsa, challenge.peek(), challenge.len(),
+				signature.peek(), signature.len(), error);
+	RSA_free(rsa);
 	return ret;
 }
 
+std::list<std::string> ChallengeVerifierImpl::verifyAll()
+{
+	std::list<std::string> errors;
+	std::string keyError;
+
+	RSA *rsa = getKey(keyError);
+	for (size_t i = 0; i < challenges.size(); i++) {
+		std::string err;
+		if (rsa == NULL) {
+			err = keyError;
+		}
+		else {
+			const std::string& c = challenges[i].first;
+			const std::string& s = challenges[i].second;
+			verify(rsa, (const unsigned char *)c.data(), c.size(),
+				(const unsigned char *)s.data(), s.size(), err);
+		}
+		errors.push_back(err);
+	}
+
+	if (rsa) RSA_free(rsa);
+	return errors;
+}
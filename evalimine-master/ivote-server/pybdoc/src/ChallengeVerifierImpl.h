@@ -14,7 +14,10 @@
 #pragma once
 
 #include "BDoc.h"
+#include <openssl/rsa.h>
 #include <string>
+#include <utility>
+#include <vector>
 
 class ChallengeVerifierImpl {
 
@@ -25,9 +28,27 @@ class ChallengeVerifierImpl {
 
 		bool isChallengeOk();
 
+		// Checks the queued challenges, one error per challenge,
+		// empty if the challenge is correct
+		std::list<std::string> verifyAll();
+
+		// Frees the cached public keys, in terminate()
+		static void releaseKeys();
+
 		bdoc::Buffer certificate;
 		bdoc::Buffer challenge;
 		bdoc::Buffer signature;
 		std::string error;
-};
 
+		// Challenges and their signatures for verifyAll()
+		std::vector<std::pair<std::string, std::string> > challenges;
+
+	private:
+
+		RSA* getKey(std::string& err);
+
+		static bool verify(RSA *rsa,
+				const unsigned char *chal, size_t chal_len,
+				const unsigned char *sig, size_t sig_len,
+				std::string& err);
+};
@@ -0,0 +1,412 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "ConfigurationSnapshot.h"
+#include "BDoc.h"
+#include "GrammarPool.h"
+#include "StackException.h"
+#include "crypto/X509Cert.h"
+#include "crypto/X509CertStore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "BDOCSNAP"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_VERSION 2
+
+// Records: tag and length as 32-bit little-endian, then the data
+#define SNAPSHOT_END 0
+#define SNAPSHOT_SCHEMA_DIR 1
+#define SNAPSHOT_DIGEST_URI 2
+#define SNAPSHOT_FLAGS 3
+#define SNAPSHOT_CERT 4
+#define SNAPSHOT_OCSP 5
+#define SNAPSHOT_GRAMMARS 6
+#define SNAPSHOT_SOURCE 7
+
+#define SNAPSHOT_FLAG_TM_SPLICING 0x01
+#define SNAPSHOT_FLAG_KEEP_SIGNATURE 0x02
+
+static void putLE(std::string& out, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++) {
+		out += (char)((v >> (8 * i)) & 0xff);
+	}
+}
+
+static uint64_t getLE(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < bytes; i++) {
+		v |= (uint64_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+static void putRecord(std::string& out, uint32_t tag, const std::string& data)
+{
+	if (data.size() > 0xffffffffUL) {
+		THROW_STACK_EXCEPTION("Snapshot record %u too large", tag);
+	}
+	putLE(out, tag, 4);
+	putLE(out, data.size(), 4);
+	out += data;
+}
+
+static void putField(std::string& out, const std::string& data)
+{
+	putLE(out, data.size(), 4);
+	out += data;
+}
+
+/*
+ * Reads the fields of a record, everything is checked against the
+ * end so that a short or damaged file fails instead of overreading.
+ * */
+class SnapshotReader {
+
+	public:
+
+		SnapshotReader(const unsigned char *data, size_t len) :
+			_p(data),
+			_end(data + len)
+		{
+		}
+
+		bool atEnd() const
+		{
+			return _p == _end;
+		}
+
+		uint64_t number(int bytes)
+		{
+			need(bytes);
+			uint64_t v = getLE(_p, bytes);
+			_p += bytes;
+			return v;
+		}
+
+		const unsigned char* bytes(size_t len)
+		{
+			need(len);
+			const unsigned char *ret = _p;
+			_p += len;
+			return ret;
+		}
+
+		std::string field()
+		{
+			size_t len = number(4);
+			return std::string((const char *)bytes(len), len);
+		}
+
+		size_t left() const
+		{
+			return _end - _p;
+		}
+
+	private:
+
+		void need(size_t len) const
+		{
+			if ((size_t)(_end - _p) < len) {
+				THROW_STACK_EXCEPTION("Invalid configuration snapshot: truncated");
+			}
+		}
+
+		const unsigned char *_p;
+		const unsigned char *_end;
+};
+
+// What tells that a source file has changed: size, mtime and inode
+static void putSourceStat(std::string& out, const std::string& path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		THROW_STACK_EXCEPTION("Failed to stat '%s': %s", path.c_str(), strerror(errno));
+	}
+	putLE(out, st.st_size, 8);
+	putLE(out, st.st_mtim.tv_sec, 8);
+	putLE(out, st.st_mtim.tv_nsec, 4);
+	putLE(out, st.st_ino, 8);
+}
+
+void bdoc::ConfigurationSnapshot::save(const Configuration& conf, const char *path,
+		const std::list<std::string>& sources)
+{
+	std::string out(SNAPSHOT_MAGIC);
+	putLE(out, SNAPSHOT_VERSION, 4);
+
+	// First, so that a stale snapshot is refused before anything else
+	// is read
+	for (std::list<std::string>::const_iterator it = sources.begin();
+			it != sources.end(); it++) {
+		std::string rec;
+		putField(rec, *it);
+		putSourceStat(rec, *it);
+		putRecord(out, SNAPSHOT_SOURCE, rec);
+	}
+
+	putRecord(out, SNAPSHOT_SCHEMA_DIR, conf.schema_dir);
+	putRecord(out, SNAPSHOT_DIGEST_URI, conf.digest);
+
+	std::string flags;
+	putLE(flags, (conf.tm_splicing ? SNAPSHOT_FLAG_TM_SPLICING : 0) |
+		(conf.keep_signature ? SNAPSHOT_FLAG_KEEP_SIGNATURE : 0), 4);
+	putRecord(out, SNAPSHOT_FLAGS, flags);
+
+	const std::vector<X509*>& certs = conf.store->certificates();
+	for (size_t i = 0; i < certs.size(); i++) {
+		std::vector<unsigned char> der = X509Cert(certs[i]).encodeDER();
+		putRecord(out, SNAPSHOT_CERT,
+			std::string(der.begin(), der.end()));
+	}
+
+	for (std::map<std::string, OCSPConf>::const_iterator it = conf.ocsp.begin();
+			it != conf.ocsp.end(); it++) {
+		const OCSPConf& oc = it->second;
+		std::vector<unsigned char> der = oc.der;
+		if (der.empty()) {
+			STACK_OF(X509)* stack = X509Cert::loadX509Stack(oc.cert);
+			try {
+				der = X509Cert::encodeDERStack(stack);
+			}
+			catch (...) {
+				sk_X509_pop_free(stack, X509_free);
+				throw;
+			}
+			sk_X509_pop_free(stack, X509_free);
+		}
+
+		std::string rec;
+		putField(rec, it->first);
+		putField(rec, oc.url);
+		putField(rec, oc.cert);
+		putLE(rec, (uint64_t)(int64_t)oc.skew, 8);
+		putLE(rec, (uint64_t)(int64_t)oc.maxAge, 8);
+		rec.append(der.begin(), der.end());
+		putRecord(out, SNAPSHOT_OCSP, rec);
+	}
+
+	if (conf.grammar != NULL) {
+		putRecord(out, SNAPSHOT_GRAMMARS, conf.grammar->serialize());
+	}
+
+	putRecord(out, SNAPSHOT_END, "");
+
+	// Written aside and renamed, a reader sees the old file or the
+	// whole new one
+	std::string tmp = std::string(path) + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660);
+	// The mode BDocConfig.save() gives the rest of the directory
+	if (fd < 0 || fchmod(fd, 0660) != 0) {
+		int err = errno;
+		if (fd >= 0) {
+			::close(fd);
+			unlink(tmp.c_str());
+		}
+		THROW_STACK_EXCEPTION("Failed to create snapshot '%s': %s", tmp.c_str(), strerror(err));
+	}
+
+	size_t done = 0;
+	while (done < out.size()) {
+		ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			int err = errno;
+			::close(fd);
+			unlink(tmp.c_str());
+			THROW_STACK_EXCEPTION("Failed to write snapshot '%s': %s", tmp.c_str(), strerror(err));
+		}
+		done += n;
+	}
+
+	if (fsync(fd) != 0 || ::close(fd) != 0) {
+		int err = errno;
+		unlink(tmp.c_str());
+		THROW_STACK_EXCEPTION("Failed to write snapshot '%s': %s", tmp.c_str(), strerror(err));
+	}
+
+	if (rename(tmp.c_str(), path) != 0) {
+		int err = errno;
+		unlink(tmp.c_str());
+		THROW_STACK_EXCEPTION("Failed to write snapshot '%s': %s", path, strerror(err));
+	}
+}
+
+void bdoc::ConfigurationSnapshot::load(Configuration& conf, const char *path)
+{
+	if (!conf.ocsp.empty() || !conf.store->certificates().empty()) {
+		THROW_STACK_EXCEPTION("Snapshot '%s' loaded into a configuration in use", path);
+	}
+
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		THROW_STACK_EXCEPTION("Failed to open snapshot '%s': %s", path, strerror(errno));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		::close(fd);
+		THROW_STACK_EXCEPTION("Failed to open snapshot '%s': %s", path, strerror(err));
+	}
+
+	if (st.st_size < SNAPSHOT_MAGIC_LEN + 4) {
+		::close(fd);
+		THROW_STACK_EXCEPTION("Invalid configuration snapshot '%s'", path);
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	// The mapping keeps the file
+	::close(fd);
+	if (data == MAP_FAILED) {
+		THROW_STACK_EXCEPTION("Failed to map snapshot '%s': %s", path, strerror(err));
+	}
+
+	try {
+		parse(conf, (const unsigned char *)data, st.st_size);
+	}
+	catch (...) {
+		munmap(data, st.st_size);
+		throw;
+	}
+	munmap(data, st.st_size);
+}
+
+void bdoc::ConfigurationSnapshot::parse(Configuration& conf,
+		const unsigned char *data, size_t len)
+{
+	SnapshotReader file(data, len);
+	if (memcmp(file.bytes(SNAPSHOT_MAGIC_LEN), SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+		THROW_STACK_EXCEPTION("Invalid configuration snapshot: bad magic");
+	}
+	uint32_t version = file.number(4);
+	if (version != SNAPSHOT_VERSION) {
+		THROW_STACK_EXCEPTION("Unsupported configuration snapshot version %u", version);
+	}
+
+	// Everything is read before the configuration is touched
+	std::string schemaDir;
+	std::string digest;
+	uint32_t flags = 0;
+	std::vector<X509*> certs;
+	std::map<std::string, OCSPConf> ocsp;
+	const unsigned char *grammars = NULL;
+	size_t grammarsLen = 0;
+	GrammarPool *grammar = NULL;
+
+	try {
+		bool end = false;
+		while (!end) {
+			uint32_t tag = file.number(4);
+			size_t recLen = file.number(4);
+			const unsigned char *rec = file.bytes(recLen);
+
+			switch (tag) {
+				case SNAPSHOT_END:
+					end = true;
+					break;
+				case SNAPSHOT_SCHEMA_DIR:
+					schemaDir.assign((const char *)rec, recLen);
+					break;
+				case SNAPSHOT_DIGEST_URI:
+					digest.assign((const char *)rec, recLen);
+					break;
+				case SNAPSHOT_FLAGS: {
+					SnapshotReader r(rec, recLen);
+					flags = r.number(4);
+					break;
+				}
+				case SNAPSHOT_CERT: {
+					const unsigned char *p = rec;
+					X509 *cert = d2i_X509(NULL, &p, recLen);
+					if (cert == NULL || p != rec + recLen) {
+						X509_free(cert);
+						THROW_STACK_EXCEPTION("Invalid configuration snapshot: bad certificate");
+					}
+					certs.push_back(cert);
+					break;
+				}
+				case SNAPSHOT_OCSP: {
+					SnapshotReader r(rec, recLen);
+					std::string issuer = r.field();
+					OCSPConf oc;
+					oc.url = r.field();
+					oc.cert = r.field();
+					oc.skew = (long)(int64_t)r.number(8);
+					oc.maxAge = (long)(int64_t)r.number(8);
+					const unsigned char *der = r.bytes(r.left());
+					oc.der.assign(der, der + (rec + recLen - der));
+					ocsp[issuer] = oc;
+					break;
+				}
+				case SNAPSHOT_GRAMMARS:
+					grammars = rec;
+					grammarsLen = recLen;
+					break;
+				case SNAPSHOT_SOURCE: {
+					SnapshotReader r(rec, recLen);
+					std::string source = r.field();
+					std::string now;
+					try {
+						putSourceStat(now, source);
+					}
+					catch (bdoc::StackExceptionBase&) {
+						THROW_STACK_EXCEPTION("Configuration snapshot is out of date: '%s' is gone", source.c_str());
+					}
+					if (r.left() != now.size() ||
+							memcmp(r.bytes(now.size()), now.data(), now.size()) != 0) {
+						THROW_STACK_EXCEPTION("Configuration snapshot is out of date: '%s' has changed", source.c_str());
+					}
+					break;
+				}
+				default:
+					THROW_STACK_EXCEPTION("Invalid configuration snapshot: unknown record %u", tag);
+			}
+		}
+		if (!file.atEnd()) {
+			THROW_STACK_EXCEPTION("Invalid configuration snapshot: data after the end");
+		}
+
+		// Compiled again if the snapshot has none
+		if (!schemaDir.empty()) {
+			grammar = GrammarPool::get(schemaDir, grammars, grammarsLen);
+		}
+	}
+	catch (...) {
+		for (size_t i = 0; i < certs.size(); i++) {
+			X509_free(certs[i]);
+		}
+		throw;
+	}
+
+	for (size_t i = 0; i < certs.size(); i++) {
+		conf.store->addCert(certs[i]);
+	}
+	conf.ocsp.swap(ocsp);
+	conf.schema_dir = schemaDir;
+	conf.grammar = grammar;
+	conf.digest = digest;
+	conf.tm_splicing = (flags & SNAPSHOT_FLAG_TM_SPLICING) != 0;
+	conf.keep_signature = (flags & SNAPSHOT_FLAG_KEEP_SIGNATURE) != 0;
+	conf.dropResponders();
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <list>
+#include <string>
+
+namespace bdoc {
+
+class Configuration;
+
+/*
+ * A built Configuration in one file: the trusted certificates and the
+ * OCSP responder certificates as DER, the OCSP settings and the
+ * compiled schemas. Loading it maps the file and needs no PEM parsing
+ * or schema compilation, for processes that live for one request.
+ *
+ * The files it was made from are recorded with their size, mtime and
+ * inode, the snapshot does not load once one of them has changed. The
+ * schemas only load with the Xerces version that saved them.
+ * */
+class ConfigurationSnapshot {
+
+	public:
+
+		static void save(const Configuration& conf, const char *path,
+				const std::list<std::string>& sources);
+
+		// Into a configuration with no certificates or OCSP settings,
+		// which is left as it was if the file is not usable
+		static void load(Configuration& conf, const char *path);
+
+	private:
+
+		ConfigurationSnapshot();
+
+		static void parse(Configuration& conf,
+				const unsigned char *data, size_t len);
+};
+
+}
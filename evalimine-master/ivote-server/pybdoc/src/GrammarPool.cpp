@@ -0,0 +1,255 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "GrammarPool.h"
+#include "StackException.h"
+#include <map>
+#include <pthread.h>
+#include <xercesc/util/PlatformUtils.hpp>
+#include <xercesc/util/XMLUniDefs.hpp>
+#include <xercesc/util/XMLUni.hpp>
+#include <xercesc/framework/MemBufInputSource.hpp>
+#include <xercesc/framework/Wrapper4InputSource.hpp>
+#include <xercesc/framework/XMLGrammarPoolImpl.hpp>
+#include <xercesc/internal/BinMemOutputStream.hpp>
+#include <xercesc/util/BinMemInputStream.hpp>
+#include <xercesc/validators/common/Grammar.hpp>
+#include <xsd/cxx/tree/exceptions.hxx>
+#include <xsd/cxx/tree/error-handler.hxx>
+#include <xsd/cxx/xml/dom/bits/error-handler-proxy.hxx>
+
+typedef std::map<std::string, bdoc::GrammarPool*> GrammarPoolMap;
+
+static GrammarPoolMap pools;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Imports XAdES111.xsd and XAdES.xsd, which import it back, so loading
+// it brings all three signature schemas into the pool.
+static const char *ROOT_SCHEMA = "/xmldsig-core-schema.xsd";
+
+static std::string exceptionMessage(const xercesc::XMLException& e)
+{
+	char* tmp = xercesc::XMLString::transcode(e.getMessage());
+	std::string msg(tmp);
+	xercesc::XMLString::release(&tmp);
+	return msg;
+}
+
+bdoc::GrammarPool* bdoc::GrammarPool::get(const std::string& schema_dir)
+{
+	return get(schema_dir, NULL, 0);
+}
+
+bdoc::GrammarPool* bdoc::GrammarPool::get(const std::string& schema_dir,
+		const unsigned char *data, size_t len)
+{
+	pthread_mutex_lock(&pools_mutex);
+	GrammarPool *gp = NULL;
+	try {
+		GrammarPoolMap::const_iterator it = pools.find(schema_dir);
+		if (it != pools.end()) {
+			gp = it->second;
+		}
+		else {
+			gp = (data == NULL) ? new GrammarPool(schema_dir) :
+				new GrammarPool(schema_dir, data, len);
+			pools[schema_dir] = gp;
+		}
+	}
+	catch (...) {
+		pthread_mutex_unlock(&pools_mutex);
+		throw;
+	}
+	pthread_mutex_unlock(&pools_mutex);
+	return gp;
+}
+
+void bdoc::GrammarPool::release()
+{
+	pthread_mutex_lock(&pools_mutex);
+	for (GrammarPoolMap::iterator it = pools.begin();
+						it != pools.end(); it++) {
+		delete it->second;
+	}
+	pools.clear();
+	pthread_mutex_unlock(&pools_mutex);
+}
+
+bdoc::GrammarPool::GrammarPool(const std::string& schema_dir) :
+	_schema_dir(schema_dir),
+	_pool(NULL)
+{
+	_pool = new xercesc::XMLGrammarPoolImpl(
+				xercesc::XMLPlatformUtils::fgMemoryManager);
+
+	xsd::cxx::tree::error_handler<char> eh;
+	xsd::cxx::xml::dom::bits::error_handler_proxy<char> ehp(eh);
+	xercesc::Grammar *grammar = NULL;
+	std::string path = schema_dir + ROOT_SCHEMA;
+
+	try {
+		xercesc::DOMLSParser *parser = createParser();
+		parser->getDomConfig()->setParameter(
+				xercesc::XMLUni::fgDOMErrorHandler, &ehp);
+		try {
+			grammar = parser->loadGrammar(path.c_str(),
+				xercesc::Grammar::SchemaGrammarType, true);
+		}
+		catch (...) {
+			parser->release();
+			throw;
+		}
+		parser->release();
+
+		eh.throw_if_failed<xsd::cxx::tree::parsing<char> >();
+	}
+	catch (const xsd::cxx::tree::parsing<char>& e) {
+		delete _pool;
+		std::ostringstream oss;
+		oss << e;
+		THROW_STACK_EXCEPTION(
+			"Failed to load schema %s: %s",
+			path.c_str(), oss.str().c_str());
+	}
+	catch (const xercesc::XMLException& e) {
+		delete _pool;
+		char* tmp = xercesc::XMLString::transcode(e.getMessage());
+		std::string msg(tmp);
+		xercesc::XMLString::release(&tmp);
+		THROW_STACK_EXCEPTION(
+			"Failed to load schema %s: %s",
+			path.c_str(), msg.c_str());
+	}
+
+	if (grammar == NULL) {
+		delete _pool;
+		THROW_STACK_EXCEPTION("Failed to load schema %s", path.c_str());
+	}
+
+	// Read-only from now on, safe to share between parsers and threads
+	_pool->lockPool();
+}
+
+bdoc::GrammarPool::GrammarPool(const std::string& schema_dir,
+		const unsigned char *data, size_t len) :
+	_schema_dir(schema_dir),
+	_pool(NULL)
+{
+	_pool = new xercesc::XMLGrammarPoolImpl(
+				xercesc::XMLPlatformUtils::fgMemoryManager);
+
+	try {
+		xercesc::BinMemInputStream in((const XMLByte*)data, len,
+				xercesc::BinMemInputStream::BufOpt_Reference);
+		_pool->deserializeGrammars(&in);
+	}
+	catch (const xercesc::XMLException& e) {
+		delete _pool;
+		THROW_STACK_EXCEPTION(
+			"Failed to restore schemas of %s: %s",
+			schema_dir.c_str(), exceptionMessage(e).c_str());
+	}
+
+	_pool->lockPool();
+}
+
+bdoc::GrammarPool::~GrammarPool()
+{
+	delete _pool;
+}
+
+std::string bdoc::GrammarPool::serialize() const
+{
+	xercesc::BinMemOutputStream out;
+	try {
+		_pool->serializeGrammars(&out);
+	}
+	catch (const xercesc::XMLException& e) {
+		THROW_STACK_EXCEPTION(
+			"Failed to serialize schemas of %s: %s",
+			_schema_dir.c_str(), exceptionMessage(e).c_str());
+	}
+	return std::string((const char *)out.getRawBuffer(),
+			(size_t)out.getSize());
+}
+
+const std::string& bdoc::GrammarPool::schemaDir() const
+{
+	return _schema_dir;
+}
+
+xercesc::DOMLSParser* bdoc::GrammarPool::createParser() const
+{
+	const XMLCh ls_id[] = {
+		xercesc::chLatin_L, xercesc::chLatin_S, xercesc::chNull};
+
+	xercesc::DOMImplementation *impl =
+		xercesc::DOMImplementationRegistry::getDOMImplementation(ls_id);
+
+	xercesc::DOMLSParser *parser = impl->createLSParser(
+			xercesc::DOMImplementationLS::MODE_SYNCHRONOUS, 0,
+			xercesc::XMLPlatformUtils::fgMemoryManager, _pool);
+
+	xercesc::DOMConfiguration *conf = parser->getDomConfig();
+
+	// The document is canonicalized for digests, so keep it exactly
+	// as it was written: white space, comments and attribute values.
+	conf->setParameter(xercesc::XMLUni::fgDOMComments, true);
+	conf->setParameter(xercesc::XMLUni::fgDOMDatatypeNormalization, false);
+	conf->setParameter(xercesc::XMLUni::fgDOMElementContentWhitespace, true);
+	conf->setParameter(xercesc::XMLUni::fgDOMEntities, false);
+	conf->setParameter(xercesc::XMLUni::fgDOMNamespaces, true);
+
+	conf->setParameter(xercesc::XMLUni::fgDOMValidate, true);
+	conf->setParameter(xercesc::XMLUni::fgXercesSchema, true);
+	conf->setParameter(xercesc::XMLUni::fgXercesSchemaFullChecking, false);
+	conf->setParameter(xercesc::XMLUni::fgXercesHandleMultipleImports, true);
+
+	// Validate against the cached grammars only, never load the
+	// schemas named by the document itself.
+	conf->setParameter(xercesc::XMLUni::fgXercesUseCachedGrammarInParse, true);
+	conf->setParameter(xercesc::XMLUni::fgXercesLoadSchema, false);
+
+	conf->setParameter(xercesc::XMLUni::fgXercesUserAdoptsDOMDocument, true);
+
+	return parser;
+}
+
+std::auto_ptr<xercesc::DOMDocument> bdoc::GrammarPool::parse(
+			const char *xml_buf, size_t buf_len) const
+{
+	xsd::cxx::tree::error_handler<char> eh;
+	xsd::cxx::xml::dom::bits::error_handler_proxy<char> ehp(eh);
+
+	xercesc::MemBufInputSource is(
+		(const XMLByte*)xml_buf, buf_len, "signature", false);
+	xercesc::Wrapper4InputSource wis(&is, false);
+
+	std::auto_ptr<xercesc::DOMDocument> doc;
+	xercesc::DOMLSParser *parser = createParser();
+	parser->getDomConfig()->setParameter(
+			xercesc::XMLUni::fgDOMErrorHandler, &ehp);
+	try {
+		doc.reset(parser->parse(&wis));
+	}
+	catch (...) {
+		parser->release();
+		throw;
+	}
+	parser->release();
+
+	eh.throw_if_failed<xsd::cxx::tree::parsing<char> >();
+
+	if (doc.get() == NULL) {
+		THROW_STACK_EXCEPTION("Failed to parse signature XML.");
+	}
+	return doc;
+}
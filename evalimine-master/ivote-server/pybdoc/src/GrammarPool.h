@@ -0,0 +1,62 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <xercesc/dom/DOM.hpp>
+#include <xercesc/framework/XMLGrammarPool.hpp>
+
+namespace bdoc {
+
+/*
+ * Pre-compiled signature schemas (XAdES 1.1.1, XAdES 1.3.2 and
+ * XML-DSIG). One pool per schema directory is loaded on first use,
+ * locked, and shared by all parsers of the process until release().
+ * */
+class GrammarPool {
+
+	public:
+
+		static GrammarPool* get(const std::string& schema_dir);
+		// As get(), but a pool not there yet is restored from
+		// serialize() output instead of compiling the schemas
+		static GrammarPool* get(const std::string& schema_dir,
+				const unsigned char *data, size_t len);
+		static void release();
+
+		// The compiled grammars, only readable by the same Xerces
+		// version
+		std::string serialize() const;
+
+		std::auto_ptr<xercesc::DOMDocument>
+			parse(const char *xml_buf, size_t buf_len) const;
+
+		const std::string& schemaDir() const;
+
+	private:
+
+		GrammarPool(const std::string& schema_dir);
+		GrammarPool(const std::string& schema_dir,
+				const unsigned char *data, size_t len);
+		~GrammarPool();
+
+		GrammarPool(const GrammarPool&);
+		GrammarPool& operator=(const GrammarPool&);
+
+		xercesc::DOMLSParser* createParser() const;
+
+		std::string _schema_dir;
+		xercesc::XMLGrammarPool *_pool;
+};
+
+}
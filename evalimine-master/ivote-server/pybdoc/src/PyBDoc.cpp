@@ -14,54 +14,163 @@
 #include "PyBDoc.h"
 #include "BDoc.h"
 #include "Signature.h"
+#include "GrammarPool.h"
 #include "StackException.h"
+#include "Timing.h"
 #include "ChallengeVerifierImpl.h"
+#include "ConfigurationSnapshot.h"
+#include "ValidationError.h"
+#include "ZipContainer.h"
 #include <xsec/utils/XSECPlatformUtils.hpp>
 #include "crypto/OpenSSLHelpers.h"
+#include "crypto/OCSPConnectionPool.h"
+#include "crypto/OCSPRequestQueue.h"
+#include "crypto/OCSPResponseCache.h"
 #include "crypto/X509Cert.h"
 #include <openssl/err.h>
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <map>
 
 void __composeNewSignature(BDocVerifierResult *res, const std::string& sig)
 {
 	res->signature = sig;
 }
 
-void __composeResultInfo(BDocVerifierResult *res, bdoc::Signature *sig,
-			const char* xml, size_t xml_len)
+void __composeResultInfo(BDocVerifierResult *res, bdoc::Configuration *conf,
+			bdoc::Signature *sig, const char* xml, size_t xml_len)
 {
 	res->subject = sig->getSubject();
 	res->ocsp_time = sig->getProducedAt();
-	res->signature = std::string(xml, xml_len);
+	if (conf->getKeepSignature()) {
+		res->signature.assign(xml, xml_len);
+	}
 }
 
 void __composeResultErrorInfo(BDocVerifierResult *res, const char *exc)
 {
 	res->result = false;
+	res->error_code = bdoc::VALIDATION_EXCEPTION;
 	res->error = exc;
 }
 
+void __composeResultErrorInfo(BDocVerifierResult *res, bdoc::ValidationError code)
+{
+	res->result = false;
+	res->error_code = code;
+	res->error = bdoc::validationErrorMessage(code);
+}
+
 void __composeResultErrorInfo(
 	BDocVerifierResult *res, bdoc::StackExceptionBase& exc)
 {
 	res->result = false;
+	res->error_code = bdoc::VALIDATION_EXCEPTION;
 	res->error = exc.what();
 }
 
 void __composeResultErrorInfo(BDocVerifierResult *res, std::exception& exc)
 {
 	res->result = false;
+	res->error_code = bdoc::VALIDATION_EXCEPTION;
 	res->error = exc.what();
 }
 
 void __composeResultErrorInfo(BDocVerifierResult *res)
 {
 	res->result = false;
+	res->error_code = bdoc::VALIDATION_EXCEPTION;
 	res->error = "Unknown (...) error";
 }
 
+void __composeOnlineResult(BDocVerifierResult *res,
+		bdoc::SignatureValidator& sv, bdoc::OCSP::CertStatus status)
+{
+	res->ocsp_is_good = false;
+	switch (status) {
+
+		case bdoc::OCSP::GOOD:
+			__composeNewSignature(res, sv.getTMSignature());
+
+			res->ocsp_time = sv.getProducedAt();
+			res->ocsp_is_good = true;
+			break;
+
+		case bdoc::OCSP::REVOKED:
+			__composeResultErrorInfo(res, bdoc::VALIDATION_CERT_REVOKED);
+			break;
+
+		case bdoc::OCSP::UNKNOWN:
+			__composeResultErrorInfo(res, bdoc::VALIDATION_CERT_UNKNOWN);
+			break;
+
+		default:
+			__composeResultErrorInfo(res, bdoc::VALIDATION_CERT_STATUS);
+			break;
+	}
+}
+
 //
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL before 1.1 relies on the application for locking, which it
+// needs as soon as verifications run in several threads.
+static pthread_mutex_t *ssl_locks = NULL;
+
+static void ssl_locking_callback(int mode, int n, const char *, int)
+{
+	if (mode & CRYPTO_LOCK) {
+		pthread_mutex_lock(&ssl_locks[n]);
+	}
+	else {
+		pthread_mutex_unlock(&ssl_locks[n]);
+	}
+}
+
+static unsigned long ssl_id_callback()
+{
+	return (unsigned long)pthread_self();
+}
+
+static void ssl_init_locks()
+{
+	if (ssl_locks != NULL || CRYPTO_get_locking_callback() != NULL) {
+		return;
+	}
+	ssl_locks = new pthread_mutex_t[CRYPTO_num_locks()];
+	for (int i = 0; i < CRYPTO_num_locks(); i++) {
+		pthread_mutex_init(&ssl_locks[i], NULL);
+	}
+	CRYPTO_set_id_callback(ssl_id_callback);
+	CRYPTO_set_locking_callback(ssl_locking_callback);
+}
+
+static void ssl_cleanup_locks()
+{
+	if (ssl_locks == NULL) {
+		return;
+	}
+	CRYPTO_set_locking_callback(NULL);
+	CRYPTO_set_id_callback(NULL);
+	for (int i = 0; i < CRYPTO_num_locks(); i++) {
+		pthread_mutex_destroy(&ssl_locks[i]);
+	}
+	delete[] ssl_locks;
+	ssl_locks = NULL;
+}
+#else
+static void ssl_init_locks()
+{
+}
+
+static void ssl_cleanup_locks()
+{
+}
+#endif
+
 void initialize() {
+	ssl_init_locks();
 	SSL_load_error_strings();
 	SSL_library_init();
 	OPENSSL_config(NULL);
@@ -69,9 +178,54 @@ void initialize() {
 	XSECPlatformUtils::Initialise();
 }
 
+void set_backtraces(bool enabled)
+{
+	bdoc::CallStack::setEnabled(enabled);
+}
+
+void set_timings(bool enabled)
+{
+	bdoc::timing::setEnabled(enabled);
+}
+
+std::list<std::string> timing_stages()
+{
+	std::list<std::string> ret;
+	for (int i = 0; i < bdoc::TIMING_STAGES; i++) {
+		ret.push_back(bdoc::timing::stageName(i));
+	}
+	return ret;
+}
+
+std::vector<TimingSummary> timing_summaries()
+{
+	std::vector<TimingSummary> ret;
+	for (int i = 0; i < bdoc::TIMING_STAGES; i++) {
+		bdoc::timing::Summary s = bdoc::timing::summary(i);
+		TimingSummary ts;
+		ts.stage = bdoc::timing::stageName(i);
+		ts.count = s.count;
+		ts.total = s.total;
+		ts.p50 = s.p50;
+		ts.p99 = s.p99;
+		ret.push_back(ts);
+	}
+	return ret;
+}
+
+void reset_timings()
+{
+	bdoc::timing::reset();
+}
+
 void terminate() {
+	bdoc::OCSPConnectionPool::release();
+	bdoc::OCSPResponseCache::release();
+	ChallengeVerifierImpl::releaseKeys();
+	bdoc::GrammarPool::release();
 	XSECPlatformUtils::Terminate();
 	xercesc::XMLPlatformUtils::Terminate();
+	ssl_cleanup_locks();
 }
 
 std::list<std::string> list_policies(const unsigned char *buf, size_t len)
@@ -84,6 +238,15 @@ std::list<std::string> list_policies(const unsigned char *buf, size_t len)
 //
 //
 
+TimingSummary::TimingSummary() :
+	stage(), count(0), total(0.0), p50(0.0), p99(0.0)
+{
+}
+
+//
+//
+//
+
 CertificateData::CertificateData() :
 	subject_name(), issuer_name(), serial_number(), modulus(), exponent()
 {
@@ -130,9 +293,11 @@ BDocVerifierResult::BDocVerifierResult() :
 	subject(),
 	ocsp_time(),
 	error(),
+	error_code(bdoc::VALIDATION_OK),
 	signature(),
 	cert_is_valid(true),
-	ocsp_is_good(true)
+	ocsp_is_good(true),
+	timings()
 {
 }
 
@@ -141,9 +306,11 @@ BDocVerifierResult::BDocVerifierResult(const BDocVerifierResult& bvr) :
 	subject(bvr.subject),
 	ocsp_time(bvr.ocsp_time),
 	error(bvr.error),
+	error_code(bvr.error_code),
 	signature(bvr.signature),
 	cert_is_valid(bvr.cert_is_valid),
-	ocsp_is_good(bvr.ocsp_is_good)
+	ocsp_is_good(bvr.ocsp_is_good),
+	timings(bvr.timings)
 {
 }
 
@@ -155,9 +322,11 @@ BDocVerifierResult&
 		subject = bvr.subject;
 		ocsp_time = bvr.ocsp_time;
 		error = bvr.error;
+		error_code = bvr.error_code;
 		signature = bvr.signature;
 		cert_is_valid = bvr.cert_is_valid;
 		ocsp_is_good = bvr.ocsp_is_good;
+		timings = bvr.timings;
 	}
 	return *this;
 }
@@ -170,27 +339,352 @@ BDocVerifierResult::~BDocVerifierResult()
 //
 //
 
+BDocVerifierResult __verifyBESOffline(bdoc::Configuration *conf,
+			bdoc::ContainerInfo *bdoc, const char* xml, size_t xml_len)
+{
+	BDocVerifierResult res;
+	bdoc::TimingScope timing(res.timings);
+	try {
+		std::auto_ptr<bdoc::Signature> sig(bdoc::Signature::parse(conf->getGrammarPool(),
+				xml, xml_len, bdoc, false));
+		__composeResultInfo(&res, conf, sig.get(), xml, xml_len);
+		bdoc::ValidationError err = sig->checkOffline(conf->getCertStore());
+		if (err != bdoc::VALIDATION_OK) {
+			__composeResultErrorInfo(&res, err);
+			return res;
+		}
+
+		const bdoc::X509Cert& x509 = sig->getSigningCertificate();
+		if (!x509.isValid()) {
+			__composeResultErrorInfo(&res, bdoc::VALIDATION_CERT_EXPIRED);
+			res.cert_is_valid = false;
+		}
+	}
+	catch (bdoc::StackExceptionBase& exc) {
+		__composeResultErrorInfo(&res, exc);
+	}
+	catch (std::exception& exc) {
+		__composeResultErrorInfo(&res, exc);
+	}
+	catch (...) {
+		__composeResultErrorInfo(&res);
+	}
+	return res;
+}
+
+BDocVerifierResult __verifyTMOffline(bdoc::Configuration *conf,
+			bdoc::ContainerInfo *bdoc, const char* xml, size_t xml_len)
+{
+	BDocVerifierResult res;
+	bdoc::TimingScope timing(res.timings);
+	try {
+		std::auto_ptr<bdoc::Signature> sig(bdoc::Signature::parse(conf->getGrammarPool(),
+				xml, xml_len, bdoc, false));
+		__composeResultInfo(&res, conf, sig.get(), xml, xml_len);
+		bdoc::ValidationError err = sig->checkOffline(conf->getCertStore());
+		if (err != bdoc::VALIDATION_OK) {
+			__composeResultErrorInfo(&res, err);
+			return res;
+		}
+
+		bdoc::SignatureValidator sv(sig.get(), conf);
+		res.ocsp_is_good = false;
+		err = sv.checkTMOffline();
+		if (err != bdoc::VALIDATION_OK) {
+			__composeResultErrorInfo(&res, err);
+			return res;
+		}
+		res.ocsp_is_good = true;
+	}
+	catch (bdoc::StackExceptionBase& exc) {
+		__composeResultErrorInfo(&res, exc);
+	}
+	catch (std::exception& exc) {
+		__composeResultErrorInfo(&res, exc);
+	}
+	catch (...) {
+		__composeResultErrorInfo(&res);
+	}
+	return res;
+}
+
+BDocVerifierResult __verifyBESOnline(bdoc::Configuration *conf,
+			bdoc::ContainerInfo *bdoc, const char* xml, size_t xml_len)
+{
+	BDocVerifierResult res;
+	bdoc::TimingScope timing(res.timings);
+	try {
+		std::auto_ptr<bdoc::Signature> sig(bdoc::Signature::parse(conf->getGrammarPool(),
+				xml, xml_len, bdoc, conf->getTMSplicing()));
+		__composeResultInfo(&res, conf, sig.get(), xml, xml_len);
+		bdoc::ValidationError err = sig->checkOffline(conf->getCertStore());
+		if (err != bdoc::VALIDATION_OK) {
+			__composeResultErrorInfo(&res, err);
+			return res;
+		}
+
+		bdoc::SignatureValidator sv(sig.get(), conf);
+		__composeOnlineResult(&res, sv, sv.validateBESOnline());
+	}
+	catch (bdoc::StackExceptionBase& exc) {
+		__composeResultErrorInfo(&res, exc);
+	}
+	catch (std::exception& exc) {
+		__composeResultErrorInfo(&res, exc);
+	}
+	catch (...) {
+		__composeResultErrorInfo(&res);
+	}
+	return res;
+}
+
+static bool __isContainerSignature(const std::string& name)
+{
+	return name.compare(0, 9, "META-INF/") == 0 &&
+		name.find("signature") != std::string::npos;
+}
+
+static bool __isContainerDocument(const std::string& name)
+{
+	return name != "mimetype" && name != "META-INF/manifest.xml" &&
+		(name.empty() || name[name.size() - 1] != '/') &&
+		!__isContainerSignature(name);
+}
+
+typedef BDocVerifierResult (*__verifyFunction)(bdoc::Configuration *conf,
+			bdoc::ContainerInfo *bdoc, const char* xml, size_t xml_len);
+
+std::vector<BDocVerifierResult> __verifyContainer(bdoc::Configuration *conf,
+			const bdoc::ZipContainer& zip, __verifyFunction verify)
+{
+	if (zip.count() == 0) {
+		THROW_STACK_EXCEPTION("Container is not loaded");
+	}
+
+	// The documents are shared by the signatures, each one is hashed
+	// once per algorithm
+	bdoc::ContainerInfo bdoc;
+	for (size_t i = 0; i < zip.count(); i++) {
+		const std::string& name = zip.entry(i).name;
+		if (__isContainerDocument(name)) {
+			bdoc.zipDocument(name, &zip, i);
+		}
+	}
+
+	std::vector<BDocVerifierResult> ret;
+	for (size_t i = 0; i < zip.count(); i++) {
+		const bdoc::ZipContainer::Entry& ent = zip.entry(i);
+		if (!__isContainerSignature(ent.name)) {
+			continue;
+		}
+
+		// Stored signatures are parsed in place
+		const unsigned char *view = zip.view(i);
+		if (view != NULL) {
+			ret.push_back(verify(conf, &bdoc,
+				(const char *)view, ent.size));
+			continue;
+		}
+
+		std::string xml;
+		try {
+			xml = zip.read(i);
+		}
+		catch (bdoc::StackExceptionBase& exc) {
+			BDocVerifierResult res;
+			__composeResultErrorInfo(&res, exc);
+			ret.push_back(res);
+			continue;
+		}
+		ret.push_back(verify(conf, &bdoc, xml.data(), xml.size()));
+	}
+	return ret;
+}
+
+//
+//
+//
+
+BDocContainerFile::BDocContainerFile() :
+	zip(new bdoc::ZipContainer())
+{
+}
+
+BDocContainerFile::~BDocContainerFile()
+{
+	delete zip;
+}
+
+void BDocContainerFile::open(const char *path)
+{
+	zip->open(path);
+}
+
+void BDocContainerFile::borrow(const unsigned char *buf, size_t len)
+{
+	zip->borrow(buf, len);
+}
+
+void BDocContainerFile::close()
+{
+	zip->close();
+}
+
+std::list<std::string> BDocContainerFile::namelist() const
+{
+	std::list<std::string> ret;
+	for (size_t i = 0; i < zip->count(); i++) {
+		ret.push_back(zip->entry(i).name);
+	}
+	return ret;
+}
+
+std::string BDocContainerFile::read(const char *name) const
+{
+	int i = zip->find(name);
+	if (i < 0) {
+		THROW_STACK_EXCEPTION("There is no item named '%s' in the container", name);
+	}
+	return zip->read(i);
+}
+
+//
+//
+//
+
+VerifierConfig::VerifierConfig() :
+	conf(NULL),
+	frozen(false)
+{
+	conf = new bdoc::Configuration();
+}
+
+VerifierConfig::~VerifierConfig()
+{
+	delete conf;
+}
+
+void VerifierConfig::checkMutable() const
+{
+	if (frozen) {
+		THROW_STACK_EXCEPTION(
+			"Verifier configuration is frozen and can not be changed");
+	}
+}
+
+void VerifierConfig::setSchemaDir(const char *path)
+{
+	checkMutable();
+	conf->setSchemaDir(path);
+}
+
+void VerifierConfig::addCertToStore(const char *path)
+{
+	checkMutable();
+	conf->addCertToStore(path);
+}
+
+void VerifierConfig::addOCSPConf(
+	const char *issuer, const char *url,
+	const char *cert, long skew, long maxAge)
+{
+	checkMutable();
+	conf->addOCSPConf(issuer, url, cert, skew, maxAge);
+}
+
+void VerifierConfig::setDigestURI(const char *uri)
+{
+	checkMutable();
+	conf->setDigestURI(uri);
+}
+
+void VerifierConfig::setTMSplicing(bool splice)
+{
+	checkMutable();
+	conf->setTMSplicing(splice);
+}
+
+void VerifierConfig::setKeepSignature(bool keep)
+{
+	checkMutable();
+	conf->setKeepSignature(keep);
+}
+
+void VerifierConfig::saveSnapshot(const char *path,
+		const std::list<std::string>& sources) const
+{
+	bdoc::ConfigurationSnapshot::save(*conf, path, sources);
+}
+
+void VerifierConfig::loadSnapshot(const char *path)
+{
+	checkMutable();
+	bdoc::ConfigurationSnapshot::load(*conf, path);
+}
+
+void VerifierConfig::freeze()
+{
+	frozen = true;
+}
+
+bool VerifierConfig::isFrozen() const
+{
+	return frozen;
+}
+
+//
+//
+//
+
 BDocVerifier::BDocVerifier() :
 	bdoc(NULL),
-	conf(NULL)
+	conf(NULL),
+	shared(false),
+	online(NULL)
 {
 	bdoc = new bdoc::ContainerInfo();
 	conf = new bdoc::Configuration();
 }
 
+BDocVerifier::BDocVerifier(VerifierConfig& vc) :
+	bdoc(NULL),
+	conf(vc.conf),
+	shared(true),
+	online(NULL)
+{
+	// Once shared, the configuration must not change under the
+	// verifiers reading it
+	vc.freeze();
+	bdoc = new bdoc::ContainerInfo();
+}
+
 BDocVerifier::~BDocVerifier()
 {
+	delete online;
 	delete bdoc;
-	delete conf;
+	if (!shared) {
+		delete conf;
+	}
+}
+
+void BDocVerifier::checkOwnConfig() const
+{
+	if (shared) {
+		THROW_STACK_EXCEPTION(
+			"Verifier uses a shared configuration, "
+			"change the VerifierConfig instead");
+	}
 }
 
 void BDocVerifier::setSchemaDir(const char *path)
 {
+	checkOwnConfig();
 	conf->setSchemaDir(path);
 }
 
 void BDocVerifier::addCertToStore(const char *path)
 {
+	checkOwnConfig();
 	conf->addCertToStore(path);
 }
 
@@ -200,120 +694,366 @@ void BDocVerifier::setDocument(
 	bdoc->setDocument(uri, buf, len);
 }
 
+void BDocVerifier::borrowDocument(
+	const unsigned char *buf, size_t len, const char* uri)
+{
+	bdoc->borrowDocument(uri, buf, len);
+}
+
 void BDocVerifier::addOCSPConf(
 	const char *issuer, const char *url,
 	const char *cert, long skew, long maxAge)
 {
+	checkOwnConfig();
 	conf->addOCSPConf(issuer, url, cert, skew, maxAge);
 }
 
 void BDocVerifier::setDigestURI(const char *uri)
 {
+	checkOwnConfig();
 	conf->setDigestURI(uri);
 }
 
+void BDocVerifier::setTMSplicing(bool splice)
+{
+	checkOwnConfig();
+	conf->setTMSplicing(splice);
+}
+
+void BDocVerifier::setKeepSignature(bool keep)
+{
+	checkOwnConfig();
+	conf->setKeepSignature(keep);
+}
+
 const BDocVerifierResult BDocVerifier::verifyBESOffline(
 					const char* xml, size_t xml_len)
 {
-	BDocVerifierResult res;
-	try {
-		std::auto_ptr<bdoc::Signature> sig(bdoc::Signature::parse(conf->getSchemaDir(), xml, xml_len, bdoc));
-		__composeResultInfo(&res, sig.get(), xml, xml_len);
-		sig->validateOffline(conf->getCertStore());
+	return __verifyBESOffline(conf, bdoc, xml, xml_len);
+}
 
-		bdoc::X509Cert x509 = sig->getSigningCertificate();
-		if (!x509.isValid()) {
-			__composeResultErrorInfo(&res, "Certificate is expired");
-			res.cert_is_valid = false;
+const BDocVerifierResult BDocVerifier::verifyBESOnline(
+					const char* xml, size_t xml_len)
+{
+	return __verifyBESOnline(conf, bdoc, xml, xml_len);
+}
+
+std::vector<BDocVerifierResult> BDocVerifier::verifyContainerBESOffline(
+		const BDocContainerFile& container)
+{
+	return __verifyContainer(conf, *container.zip, __verifyBESOffline);
+}
+
+std::vector<BDocVerifierResult> BDocVerifier::verifyContainerBESOnline(
+		const BDocContainerFile& container)
+{
+	return __verifyContainer(conf, *container.zip, __verifyBESOnline);
+}
+
+std::vector<BDocVerifierResult> BDocVerifier::verifyContainerTMOffline(
+		const BDocContainerFile& container)
+{
+	return __verifyContainer(conf, *container.zip, __verifyTMOffline);
+}
+
+//
+//
+//
+
+class BDocVerifier::OnlineQueue {
+
+	public:
+
+		struct Pending {
+			int ticket;
+			bdoc::ContainerInfo *bdoc;
+			bdoc::Signature *sig;
+			bdoc::SignatureValidator *sv;
+			BDocVerifierResult res;
+		};
+
+		OnlineQueue() :
+			nextTicket(1), requests(), pending(), ready(), done()
+		{
+		}
+
+		~OnlineQueue()
+		{
+			std::map<int, Pending>::iterator it;
+			for (it = pending.begin(); it != pending.end(); it++) {
+				release(it->second);
+			}
+		}
+
+		static void release(Pending& p)
+		{
+			delete p.sv;
+			delete p.sig;
+			delete p.bdoc;
+		}
+
+		int nextTicket;
+		bdoc::OCSPRequestQueue requests;
+		// By the OCSP request id
+		std::map<int, Pending> pending;
+		// Tickets finished but not yet returned by poll
+		std::vector<int> ready;
+		std::map<int, BDocVerifierResult> done;
+};
+
+int BDocVerifier::submitBESOnline(const char* xml, size_t xml_len)
+{
+	if (online == NULL) {
+		online = new OnlineQueue();
+	}
+
+	OnlineQueue::Pending p;
+	p.ticket = online->nextTicket++;
+	p.bdoc = bdoc;
+	p.sig = NULL;
+	p.sv = NULL;
+
+	// The documents go with the signature
+	bdoc = new bdoc::ContainerInfo();
+
+	bdoc::TimingScope timing(p.res.timings);
+	try {
+		p.sig = bdoc::Signature::parse(conf->getGrammarPool(),
+				xml, xml_len, p.bdoc, conf->getTMSplicing());
+		__composeResultInfo(&p.res, conf, p.sig, xml, xml_len);
+		bdoc::ValidationError err = p.sig->checkOffline(conf->getCertStore());
+		if (err != bdoc::VALIDATION_OK) {
+			__composeResultErrorInfo(&p.res, err);
+		}
+		else {
+			p.sv = new bdoc::SignatureValidator(p.sig, conf);
+			std::vector<unsigned char> der = p.sv->createBESOnlineRequest();
+			const bdoc::OCSP *ocsp = p.sv->getOCSP();
+			int id = online->requests.submit(ocsp->connectionPool(),
+							ocsp->getPath(), der);
+			online->pending[id] = p;
+			return p.ticket;
 		}
 	}
 	catch (bdoc::StackExceptionBase& exc) {
-		__composeResultErrorInfo(&res, exc);
+		__composeResultErrorInfo(&p.res, exc);
 	}
 	catch (std::exception& exc) {
-		__composeResultErrorInfo(&res, exc);
+		__composeResultErrorInfo(&p.res, exc);
 	}
 	catch (...) {
-		__composeResultErrorInfo(&res);
+		__composeResultErrorInfo(&p.res);
 	}
-	return res;
+
+	online->done[p.ticket] = p.res;
+	online->ready.push_back(p.ticket);
+	OnlineQueue::release(p);
+	return p.ticket;
 }
 
-const BDocVerifierResult BDocVerifier::verifyBESOnline(
-					const char* xml, size_t xml_len)
+std::vector<int> BDocVerifier::pollBESOnline(int timeout)
 {
-	BDocVerifierResult res;
-	try {
-		std::auto_ptr<bdoc::Signature> sig(bdoc::Signature::parse(conf->getSchemaDir(), xml, xml_len, bdoc));
-		__composeResultInfo(&res, sig.get(), xml, xml_len);
-		sig->validateOffline(conf->getCertStore());
+	std::vector<int> tickets;
+	if (online == NULL) {
+		return tickets;
+	}
 
-		bdoc::SignatureValidator sv(sig.get(), conf);
-		bdoc::OCSP::CertStatus status = sv.validateBESOnline();
+	tickets.swap(online->ready);
+	std::vector<int> ids =
+		online->requests.poll(tickets.empty() ? timeout : 0);
 
-		res.ocsp_is_good = false;
-		switch (status) {
-
-			case bdoc::OCSP::GOOD:
-				__composeNewSignature(&res,
-							sv.getTMSignature());
-
-				res.ocsp_time = sv.getProducedAt();
-				res.ocsp_is_good = true;
-				break;
-
-			case bdoc::OCSP::REVOKED:
-				__composeResultErrorInfo(&res,
-						"Certificate status revoked");
-				break;
-
-			case bdoc::OCSP::UNKNOWN:
-				__composeResultErrorInfo(&res,
-						"Certificate status unknown");
-				break;
-
-			default:
-				__composeResultErrorInfo(&res,
-						"Certificate status invalid");
-				break;
+	for (size_t i = 0; i < ids.size(); i++) {
+		std::map<int, OnlineQueue::Pending>::iterator it =
+					online->pending.find(ids[i]);
+		if (it == online->pending.end()) {
+			continue;
 		}
+		OnlineQueue::Pending p = it->second;
+		online->pending.erase(it);
+
+		bdoc::TimingScope timing(p.res.timings);
+		try {
+			std::vector<unsigned char> body;
+			std::string error;
+			if (online->requests.take(ids[i], body, error)) {
+				__composeOnlineResult(&p.res, *p.sv,
+					p.sv->checkBESOnlineResponse(body));
+			}
+			else {
+				__composeResultErrorInfo(&p.res, error.c_str());
+			}
+		}
+		catch (bdoc::StackExceptionBase& exc) {
+			__composeResultErrorInfo(&p.res, exc);
+		}
+		catch (std::exception& exc) {
+			__composeResultErrorInfo(&p.res, exc);
+		}
+		catch (...) {
+			__composeResultErrorInfo(&p.res);
+		}
+
+		online->done[p.ticket] = p.res;
+		tickets.push_back(p.ticket);
+		OnlineQueue::release(p);
 	}
-	catch (bdoc::StackExceptionBase& exc) {
-		__composeResultErrorInfo(&res, exc);
-	}
-	catch (std::exception& exc) {
-		__composeResultErrorInfo(&res, exc);
-	}
-	catch (...) {
-		__composeResultErrorInfo(&res);
+	return tickets;
+}
+
+BDocVerifierResult BDocVerifier::takeBESOnline(int ticket)
+{
+	std::map<int, BDocVerifierResult>::iterator it;
+	if (online == NULL ||
+			(it = online->done.find(ticket)) == online->done.end()) {
+		THROW_STACK_EXCEPTION("No finished verification %d.", ticket);
 	}
+	BDocVerifierResult res = it->second;
+	online->done.erase(it);
 	return res;
 }
 
+size_t BDocVerifier::pendingBESOnline() const
+{
+	if (online == NULL) {
+		return 0;
+	}
+	return online->pending.size() + online->ready.size();
+}
+
 const BDocVerifierResult BDocVerifier::verifyTMOffline(
 					const char* xml, size_t xml_len)
 {
-	BDocVerifierResult res;
-	try {
-		std::auto_ptr<bdoc::Signature> sig(bdoc::Signature::parse(conf->getSchemaDir(), xml, xml_len, bdoc));
-		__composeResultInfo(&res, sig.get(), xml, xml_len);
-		sig->validateOffline(conf->getCertStore());
+	return __verifyTMOffline(conf, bdoc, xml, xml_len);
+}
 
-		bdoc::SignatureValidator sv(sig.get(), conf);
-		res.ocsp_is_good = false;
-		sv.validateTMOffline();
-		res.ocsp_is_good = true;
+//
+// Batch verification
+//
+
+BDocVerifierBatch::BDocVerifierBatch() : entries()
+{
+}
+
+BDocVerifierBatch::~BDocVerifierBatch()
+{
+	clear();
+}
+
+void BDocVerifierBatch::add(const char* xml, size_t xml_len)
+{
+	Entry e;
+	e.xml.assign(xml, xml_len);
+	e.bdoc = NULL;
+	entries.push_back(e);
+	entries.back().bdoc = new bdoc::ContainerInfo();
+}
+
+void BDocVerifierBatch::addDocument(
+	const unsigned char *buf, size_t len, const char* uri)
+{
+	if (entries.empty()) {
+		THROW_STACK_EXCEPTION(
+			"Batch is empty, add a signature before its documents");
 	}
-	catch (bdoc::StackExceptionBase& exc) {
-		__composeResultErrorInfo(&res, exc);
+	entries.back().bdoc->setDocument(uri, buf, len);
+}
+
+size_t BDocVerifierBatch::size() const
+{
+	return entries.size();
+}
+
+void BDocVerifierBatch::clear()
+{
+	for (size_t i = 0; i < entries.size(); i++) {
+		delete entries[i].bdoc;
 	}
-	catch (std::exception& exc) {
-		__composeResultErrorInfo(&res, exc);
+	entries.clear();
+}
+
+struct BatchWork {
+	bdoc::Configuration *conf;
+	const BDocVerifierBatch *batch;
+	BDocVerifierResult *results;
+	bool tm;
+	volatile size_t next;
+};
+
+void* BDocVerifier::batchWorker(void *arg)
+{
+	BatchWork *work = static_cast<BatchWork*>(arg);
+	const std::vector<BDocVerifierBatch::Entry>& entries =
+						work->batch->entries;
+	size_t i;
+	while ((i = __sync_fetch_and_add(&work->next, 1)) < entries.size()) {
+		const BDocVerifierBatch::Entry& e = entries[i];
+		// Document checks of an entry start from a clean slate if
+		// the batch is verified again
+		e.bdoc->errors.clear();
+		if (work->tm) {
+			work->results[i] = __verifyTMOffline(work->conf,
+				e.bdoc, e.xml.data(), e.xml.size());
+		}
+		else {
+			work->results[i] = __verifyBESOffline(work->conf,
+				e.bdoc, e.xml.data(), e.xml.size());
+		}
 	}
-	catch (...) {
-		__composeResultErrorInfo(&res);
+	return NULL;
+}
+
+std::vector<BDocVerifierResult> BDocVerifier::verifyBatch(
+	const BDocVerifierBatch& batch, int threads, bool tm)
+{
+	std::vector<BDocVerifierResult> results(batch.entries.size());
+	if (results.empty()) {
+		return results;
 	}
-	return res;
+
+	if (threads < 1) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (int)cpus : 1;
+	}
+	if ((size_t)threads > results.size()) {
+		threads = results.size();
+	}
+
+	BatchWork work;
+	work.conf = conf;
+	work.batch = &batch;
+	work.results = &results[0];
+	work.tm = tm;
+	work.next = 0;
+
+	// The calling thread is one of the workers. If a thread can not
+	// be started, the ones that could share its part.
+	std::vector<pthread_t> tids;
+	for (int t = 1; t < threads; t++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, batchWorker, &work) != 0) {
+			break;
+		}
+		tids.push_back(tid);
+	}
+
+	batchWorker(&work);
+
+	for (size_t t = 0; t < tids.size(); t++) {
+		pthread_join(tids[t], NULL);
+	}
+	return results;
+}
+
+std::vector<BDocVerifierResult> BDocVerifier::verifyBESOfflineBatch(
+	const BDocVerifierBatch& batch, int threads)
+{
+	return verifyBatch(batch, threads, false);
+}
+
+std::vector<BDocVerifierResult> BDocVerifier::verifyTMOfflineBatch(
+	const BDocVerifierBatch& batch, int threads)
+{
+	return verifyBatch(batch, threads, true);
 }
 
 /*
@@ -363,3 +1103,21 @@ void ChallengeVerifier::setSignature(const unsigned char *buf, size_t len)
 	impl->signature.set(buf, len);
 }
 
+void ChallengeVerifier::addChallenge(const unsigned char *buf, size_t len,
+				const unsigned char *sig, size_t sig_len)
+{
+	impl->challenges.push_back(std::make_pair(
+		std::string((const char *)buf, len),
+		std::string((const char *)sig, sig_len)));
+}
+
+void ChallengeVerifier::clearChallenges()
+{
+	impl->challenges.clear();
+}
+
+std::list<std::string> ChallengeVerifier::verifyAll()
+{
+	return impl->verifyAll();
+}
+
@@ -15,17 +15,46 @@
 
 #include <string>
 #include <list>
+#include <vector>
 
 namespace bdoc {
 	class ContainerInfo;
 	class Configuration;
+	class ZipContainer;
 }
 
 void initialize();
 void terminate();
 
+// Errors are built without a stack trace when off, for floods of
+// invalid input whose errors only go to the result
+void set_backtraces(bool enabled);
+
+class TimingSummary;
+
+// When on, BDocVerifierResult.timings has the seconds spent in each
+// stage, in the order of timing_stages(), and process-wide histograms
+// of the stages are kept
+void set_timings(bool enabled);
+std::list<std::string> timing_stages();
+std::vector<TimingSummary> timing_summaries();
+void reset_timings();
+
 std::list<std::string> list_policies(const unsigned char *buf, size_t len);
 
+class TimingSummary {
+
+	public:
+		TimingSummary();
+
+		std::string stage;
+		unsigned long count;
+		// Seconds
+		double total;
+		double p50;
+		double p99;
+};
+
 class CertificateData {
 
 	public:
@@ -57,16 +86,138 @@ class BDocVerifierResult {
 		std::string subject;
 		std::string ocsp_time;
 		std::string error;
+		// bdoc::ValidationError, the error above is static for all
+		// but VALIDATION_EXCEPTION
+		int error_code;
 		std::string signature;
 		bool cert_is_valid;
 		bool ocsp_is_good;
+		// Empty unless set_timings(true)
+		std::vector<double> timings;
 };
 
+/*
+ * Verification configuration shared by many verifiers. Filled once,
+ * then frozen: a frozen configuration is only read, so verifiers built
+ * on it can run in parallel threads.
+ * */
+class VerifierConfig {
+
+	public:
+
+		VerifierConfig();
+		~VerifierConfig();
+
+		void setSchemaDir(const char *path);
+		void addCertToStore(const char *path);
+
+		void addOCSPConf(
+			const char *issuer, const char *url,
+			const char *cert, long skew, long maxAge);
+
+		void setDigestURI(const char *uri);
+		void setTMSplicing(bool splice);
+		void setKeepSignature(bool keep);
+
+		// The whole configuration in one file, loaded in one call
+		// instead of the calls above. The snapshot is refused when one
+		// of the sources it was made from has changed.
+		void saveSnapshot(const char *path,
+				const std::list<std::string>& sources) const;
+		void loadSnapshot(const char *path);
+
+		void freeze();
+		bool isFrozen() const;
+
+	private:
+
+		VerifierConfig(const VerifierConfig&);
+		VerifierConfig& operator=(const VerifierConfig&);
+
+		void checkMutable() const;
+
+		friend class BDocVerifier;
+
+		bdoc::Configuration *conf;
+		bool frozen;
+};
+
+/*
+ * Signatures to verify in one go, each with the documents of its own
+ * container. add() starts a new entry, addDocument() attaches a
+ * document to the entry added last. The data is copied.
+ * */
+class BDocVerifierBatch {
+
+	public:
+
+		BDocVerifierBatch();
+		~BDocVerifierBatch();
+
+		void add(const char* xml, size_t xml_len);
+
+		void addDocument(
+			const unsigned char *buf, size_t len, const char* uri);
+
+		size_t size() const;
+		void clear();
+
+	private:
+
+		BDocVerifierBatch(const BDocVerifierBatch&);
+		BDocVerifierBatch& operator=(const BDocVerifierBatch&);
+
+		friend class BDocVerifier;
+
+		struct Entry {
+			std::string xml;
+			bdoc::ContainerInfo *bdoc;
+		};
+
+		std::vector<Entry> entries;
+};
+
+/*
+ * A BDoc container read natively. A file is mmapped, bytes given to
+ * borrow() must live as long as the container (the Python wrapper keeps
+ * them). namelist() and read() are for checking the mimetype and the
+ * manifest, the verifier takes the documents and signatures straight
+ * from the container.
+ * */
+class BDocContainerFile {
+
+	public:
+
+		BDocContainerFile();
+		~BDocContainerFile();
+
+		void open(const char *path);
+		void borrow(const unsigned char *buf, size_t len);
+		void close();
+
+		std::list<std::string> namelist() const;
+		std::string read(const char *name) const;
+
+	private:
+
+		BDocContainerFile(const BDocContainerFile&);
+		BDocContainerFile& operator=(const BDocContainerFile&);
+
+		friend class BDocVerifier;
+
+		bdoc::ZipContainer *zip;
+};
+
+/*
+ * A verifier owns the documents of one container. Built on a shared
+ * VerifierConfig it is cheap, so use one per container and thread.
+ * */
 class BDocVerifier {
 
 	public:
 
 		BDocVerifier();
+		BDocVerifier(VerifierConfig& vc);
 		~BDocVerifier();
 
 		void setSchemaDir(const char *path);
@@ -77,10 +228,17 @@ class BDocVerifier {
 			const char *cert, long skew, long maxAge);
 
 		void setDigestURI(const char *uri);
+		void setTMSplicing(bool splice);
+		void setKeepSignature(bool keep);
 
 		void setDocument(
 			const unsigned char *buf, size_t len, const char* uri);
 
+		// As setDocument() without copying, the buffer must live as
+		// long as the verifier (the Python wrapper keeps it).
+		void borrowDocument(
+			const unsigned char *buf, size_t len, const char* uri);
+
 		const BDocVerifierResult verifyBESOffline(
 					const char* xml, size_t xml_len);
 
@@ -90,10 +248,59 @@ class BDocVerifier {
 			const BDocVerifierResult verifyTMOffline(
 					const char* xml, size_t xml_len);
 
+		// Verify every entry of the batch on a pool of native threads
+		// (number of CPUs if threads < 1). Results are in the
+		// order of the entries. The verifier's own documents are not
+		// used.
+		std::vector<BDocVerifierResult> verifyBESOfflineBatch(
+				const BDocVerifierBatch& batch, int threads);
+
+		std::vector<BDocVerifierResult> verifyTMOfflineBatch(
+				const BDocVerifierBatch& batch, int threads);
+
+		// Verify every signature of the container (META-INF/ members
+		// named *signature*) against its other members, except the
+		// mimetype and the manifest. Results are in the order of the
+		// signatures. The verifier's own documents are not used.
+		std::vector<BDocVerifierResult> verifyContainerBESOffline(
+				const BDocContainerFile& container);
+
+		std::vector<BDocVerifierResult> verifyContainerBESOnline(
+				const BDocContainerFile& container);
+
+		std::vector<BDocVerifierResult> verifyContainerTMOffline(
+				const BDocContainerFile& container);
+
+		// verifyBESOnline without waiting for the OCSP responder.
+		// submitBESOnline() does the offline part, queues the request
+		// and takes over the documents set so far, so that the next
+		// container can be set right away. pollBESOnline() waits at
+		// most timeout milliseconds (forever if negative) and returns
+		// the tickets finished meanwhile, takeBESOnline() hands out
+		// the result of one of them.
+		int submitBESOnline(const char* xml, size_t xml_len);
+		std::vector<int> pollBESOnline(int timeout);
+		BDocVerifierResult takeBESOnline(int ticket);
+		size_t pendingBESOnline() const;
+
 	private:
 
+		BDocVerifier(const BDocVerifier&);
+		BDocVerifier& operator=(const BDocVerifier&);
+
+		void checkOwnConfig() const;
+
+		std::vector<BDocVerifierResult> verifyBatch(
+				const BDocVerifierBatch& batch, int threads,
+				bool tm);
+		static void* batchWorker(void *arg);
+
+		class OnlineQueue;
+
 		bdoc::ContainerInfo *bdoc;
 		bdoc::Configuration *conf;
+		bool shared;
+		OnlineQueue *online;
 
 };
 
@@ -112,6 +319,14 @@ class ChallengeVerifier {
 		void setChallenge(const unsigned char *buf, size_t len);
 		void setSignature(const unsigned char *buf, size_t len);
 
+		// Several challenges signed with the same certificate:
+		// addChallenge() them with their signatures, verifyAll()
+		// returns an error per challenge, empty if it is correct.
+		void addChallenge(const unsigned char *buf, size_t len,
+				const unsigned char *sig, size_t sig_len);
+		void clearChallenges();
+		std::list<std::string> verifyAll();
+
 		std::string error;
 
 	private:
@@ -20,14 +20,15 @@
 #include "xml/XAdES.hxx"
 #include <xercesc/dom/DOM.hpp>
 #include <xsec/canon/XSECC14n20010315.hpp>
-#include <xercesc/parsers/XercesDOMParser.hpp>
-#include <xercesc/framework/MemBufInputSource.hpp>
 #include <xercesc/framework/StdOutFormatTarget.hpp>
 #include <xercesc/util/XMLString.hpp>
 #include <xsec/dsig/DSIGConstants.hpp>
 #include <xsec/utils/XSECSafeBuffer.hpp>
 #include "BDoc.h"
+#include "GrammarPool.h"
 #include "StackException.h"
+#include "TMSignatureWriter.h"
+#include "Timing.h"
 #include "XMLHelper.h"
 
 const std::string bdoc::XAdES111Signature::XADES111_NAMESPACE =
@@ -40,22 +41,21 @@ const std::string bdoc::Signature::DSIG_NAMESPACE =
 					"http://www.w3.org/2000/09/xmldsig#";
 
 
-std::string serializeDOM(xercesc::DOMNode* node) {
+// Canonicalized output is pulled from XSEC in chunks of this size and
+// passed on as is, to the digest or to the output string.
+#define C14N_CHUNK_SIZE (64 * 1024)
+
+void serializeDOM(xercesc::DOMNode* node, std::string& out) {
 
-	std::string c14n;
 	XSECC14n20010315 canonicalizer(node->getOwnerDocument(), node);
 	canonicalizer.setCommentsProcessing(false);
 	canonicalizer.setUseNamespaceStack(true);
 
-	unsigned char buffer[1024];
+	unsigned char buffer[C14N_CHUNK_SIZE];
 	int bytes = 0;
-	while ((bytes = canonicalizer.outputBuffer(buffer, 1024)) > 0) {
-		for (int i = 0; i < bytes; i++) {
-			c14n += (char)buffer[i];
-		}
+	while ((bytes = canonicalizer.outputBuffer(buffer, C14N_CHUNK_SIZE)) > 0) {
+		out.append((const char *)buffer, bytes);
 	}
-
-	return c14n;
 }
 
 /*
@@ -68,9 +68,11 @@ bdoc::SignatureValidator::SignatureValidator(bdoc::Signature *sig,
 						bdoc::Configuration *cf) :
 	_sig(sig),
 	_conf(cf),
-	_signingCert(),
-	_ocspCerts(NULL),
+	_signingCert(NULL),
+	_responder(NULL),
 	_issuerX509(NULL),
+	_ocsp(NULL),
+	_nonce(),
 	_ocspResponse(),
 	_producedAt()
 {
@@ -78,12 +80,9 @@ bdoc::SignatureValidator::SignatureValidator(bdoc::Signature *sig,
 
 bdoc::SignatureValidator::~SignatureValidator()
 {
-	if (_ocspCerts) {
-		sk_X509_pop_free(_ocspCerts, X509_free);
-	}
-	if (_issuerX509) {
-		X509_free(_issuerX509);
-	}
+	// _responder is owned by the configuration, _issuerX509 is
+	// borrowed from the certificate store
+	delete _ocsp;
 }
 
 std::string bdoc::SignatureValidator::getProducedAt() const
@@ -94,30 +93,20 @@ std::string bdoc::SignatureValidator::getProducedAt() const
 
 bdoc::OCSP* bdoc::SignatureValidator::prepare()
 {
-	_signingCert = _sig->getSigningCertificate();
-
-	std::string issuer = _signingCert.getIssuerName();
-	int pos = issuer.find("CN=", 0) + 3;
-	std::string issure_cn =
-			issuer.substr(pos, issuer.find(",", pos) - pos);
-	if (!_conf->hasOCSPConf(issure_cn)) {
-		THROW_STACK_EXCEPTION("Failed to find ocsp responder.");
-	}
+	_signingCert = &_sig->getSigningCertificate();
 
-	OCSPConf ocspConf = _conf->getOCSPConf(issure_cn);
+	_responder = _conf->getOCSPResponder(_signingCert->getIssuerName());
 
 	_issuerX509 = _conf->getCertStore()->
-			getCert(*(_signingCert.getIssuerNameAsn1()));
+			findCert(*(_signingCert->getIssuerNameAsn1()));
 	if (_issuerX509 == NULL) {
 		THROW_STACK_EXCEPTION("Failed to load issuer certificate.");
 	}
 
-	_ocspCerts = X509Cert::loadX509Stack(ocspConf.cert);
-
-	OCSP *ocsp = new OCSP(ocspConf.url);
-	ocsp->setSkew(ocspConf.skew);
-	ocsp->setMaxAge(ocspConf.maxAge);
-	ocsp->setOCSPCerts(_ocspCerts);
+	OCSP *ocsp = new OCSP(_responder->conf.url);
+	ocsp->setSkew(_responder->conf.skew);
+	ocsp->setMaxAge(_responder->conf.maxAge);
+	ocsp->setOCSPCerts(_responder->certs);
 
 	return ocsp;
 }
@@ -128,18 +117,55 @@ bdoc::OCSP::CertStatus bdoc::SignatureValidator::validateBESOnline()
 	std::auto_ptr<Digest> sigCalc = Digest::create(_conf->getDigestURI());
 	sigCalc->update(_sig->getSignatureValue());
 
-	return ocsp->checkCert(_signingCert.getX509(),
+	X509* cert = _signingCert->getX509();
+	X509_scope certScope(&cert);
+	return ocsp->checkCert(cert,
 				_issuerX509,
 				sigCalc->getDigest(),
 				_ocspResponse,
 				_producedAt);
 }
 
+std::vector<unsigned char> bdoc::SignatureValidator::createBESOnlineRequest()
+{
+	if (_ocsp != NULL) {
+		THROW_STACK_EXCEPTION("OCSP request already created.");
+	}
+	_ocsp = prepare();
+
+	std::auto_ptr<Digest> sigCalc = Digest::create(_conf->getDigestURI());
+	sigCalc->update(_sig->getSignatureValue());
+	_nonce = sigCalc->getDigest();
+
+	X509* cert = _signingCert->getX509();
+	X509_scope certScope(&cert);
+	return _ocsp->createRequestDER(cert, _issuerX509, _nonce);
+}
+
+const bdoc::OCSP* bdoc::SignatureValidator::getOCSP() const
+{
+	return _ocsp;
+}
+
+bdoc::OCSP::CertStatus bdoc::SignatureValidator::checkBESOnlineResponse(
+		const std::vector<unsigned char>& body)
+{
+	if (_ocsp == NULL) {
+		THROW_STACK_EXCEPTION("OCSP request not created.");
+	}
+
+	X509* cert = _signingCert->getX509();
+	X509_scope certScope(&cert);
+	return _ocsp->checkResponse(cert, _issuerX509, _nonce, body,
+				_ocspResponse, _producedAt);
+}
+
 std::string bdoc::SignatureValidator::getTMSignature()
 {
+	StageTimer timer(TIMING_TM_ASSEMBLY);
 	std::string ret;
 
-	X509Cert ocspCert(sk_X509_value(_ocspCerts, 0));
+	X509Cert ocspCert(sk_X509_value(_responder->certs, 0));
 
 	std::auto_ptr<Digest> ocspResponseCalc =
 					Digest::create(_conf->getDigestURI());
@@ -148,17 +174,24 @@ std::string bdoc::SignatureValidator::getTMSignature()
 	std::vector<unsigned char>
 			ocspResponseHash = ocspResponseCalc->getDigest();
 
+	// The XML is kept by Signature::parse() only for splicing
+	if (_conf->getTMSplicing() && !_sig->getXML().empty()) {
+		TMSignatureWriter writer(_sig->getXML());
+		if (writer.usable()) {
+			return writer.write(renderTMProperties(writer.prefix(),
+					ocspCert, ocspResponseHash,
+					ocspResponseCalc->getUri()));
+		}
+	}
+
 	std::auto_ptr<xercesc::DOMDocument> doc = _sig->createDom();
 	xercesc::DOMNodeList *nl =
 		doc->getElementsByTagNameNS(
-			xercesc::XMLString::transcode("*"),
-			xercesc::XMLString::transcode("UnsignedProperties"));
+			XMLStr("*"), XMLStr("UnsignedProperties"));
 
 	xercesc::DOMNode *unsignedprops = nl->item(0);
 	xercesc::DOMNode *unsignedsignatureprops =
-		doc->createElement(
-			xercesc::XMLString::transcode(
-					"UnsignedSignatureProperties"));
+		doc->createElement(XMLStr("UnsignedSignatureProperties"));
 
 	unsignedprops->appendChild(unsignedsignatureprops);
 
@@ -176,24 +209,22 @@ std::string bdoc::SignatureValidator::getTMSignature()
 	}
 
 	{
-		X509* ocspIssuerCert =
-			_conf->getCertStore()->getCert(
-					*(ocspCert.getIssuerNameAsn1()));
-
-		X509_scope ocspIssuerCertScope(&ocspIssuerCert);
-		if (ocspIssuerCert == NULL) {
+		if (_responder->issuer == NULL) {
 			THROW_STACK_EXCEPTION(
 				"Failed to load issuer certificate.");
 		}
 
-		X509Cert oic(ocspIssuerCert);
-		std::vector<unsigned char> der = oic.encodeDER();
+		X509Cert oic(_responder->issuer);
 		std::string oicmeth(_conf->getDigestURI());
-		std::auto_ptr<bdoc::Digest> oicCalc =
-					bdoc::Digest::create(oicmeth);
-		oicCalc->update(der);
-		xml_schema::Base64Binary oicDig(&oicCalc->getDigest()[0],
-						oicCalc->getSize());
+		std::vector<unsigned char> oicDigest = _responder->issuerDigest;
+		if (oicDigest.empty() || _responder->digestUri != oicmeth) {
+			std::auto_ptr<bdoc::Digest> oicCalc =
+						bdoc::Digest::create(oicmeth);
+			oicCalc->update(oic.encodeDER());
+			oicDigest = oicCalc->getDigest();
+		}
+		xml_schema::Base64Binary oicDig(&oicDigest[0],
+						oicDigest.size());
 
 		addXMLCompleteCertificateRefs(doc.get(),
 						unsignedsignatureprops,
@@ -214,11 +245,116 @@ std::string bdoc::SignatureValidator::getTMSignature()
 
 	xercesc::DOMElement* root (doc->getDocumentElement ());
 	ret = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-	ret += serializeDOM(root);
+	serializeDOM(root, ret);
 	return ret;
 }
 
+std::string bdoc::SignatureValidator::renderTMProperties(
+				const std::string& prefix,
+				const X509Cert& ocspCert,
+				const std::vector<unsigned char>& ocspResponseHash,
+				const std::string& ocspResponseHashUri) const
+{
+	// Same elements in the same order as the DOM above
+	std::string certValues;
+	{
+		std::string ocspValue = _responder->responderCertValue;
+		if (ocspValue.empty()) {
+			ocspValue = renderXMLBase64(ocspCert.encodeDER());
+		}
+		X509Cert issuerCert(_issuerX509);
+
+		certValues = TMSignatureWriter::element(prefix,
+				"EncapsulatedX509Certificate", ocspValue,
+				"Id=\"S0-RESPONDER_CERT\"") +
+			TMSignatureWriter::element(prefix,
+				"EncapsulatedX509Certificate",
+				renderXMLBase64(issuerCert.encodeDER()),
+				"Id=\"S0-CA_CERT\"");
+	}
+
+	std::string revocationValues =
+		TMSignatureWriter::element(prefix, "OCSPValues",
+			TMSignatureWriter::element(prefix,
+				"EncapsulatedOCSPValue",
+				renderXMLBase64(_ocspResponse), "Id=\"N0\""));
+
+	std::string certRefs;
+	{
+		if (_responder->issuer == NULL) {
+			THROW_STACK_EXCEPTION(
+				"Failed to load issuer certificate.");
+		}
+
+		std::string oicmeth(_conf->getDigestURI());
+		std::string certDigest = _responder->issuerCertDigest;
+		std::string issuerSerial = _responder->issuerSerial;
+		if (certDigest.empty() || _responder->digestUri != oicmeth ||
+				issuerSerial.empty()) {
+			X509Cert oic(_responder->issuer);
+			std::auto_ptr<bdoc::Digest> oicCalc =
+						bdoc::Digest::create(oicmeth);
+			oicCalc->update(oic.encodeDER());
+			certDigest = renderXMLDigestMethodAndValue(
+					oicCalc->getDigest(), oicmeth);
+			issuerSerial = renderXMLIssuerSerial(oic);
+		}
+
+		certRefs = TMSignatureWriter::element(prefix, "CertRefs",
+			TMSignatureWriter::element(prefix, "Cert",
+				TMSignatureWriter::element(prefix, "CertDigest",
+					certDigest) +
+				TMSignatureWriter::element(prefix, "IssuerSerial",
+					issuerSerial)));
+	}
+
+	std::string revocationRefs;
+	{
+		std::string byName = _responder->responderName;
+		if (byName.empty()) {
+			byName = TMSignatureWriter::escape(ocspCert.getSubject());
+		}
+		std::string producedAt = bdoc::util::date::xsd2string(
+				bdoc::util::date::makeDateTime(_producedAt));
+
+		std::string ocspId = TMSignatureWriter::element(prefix,
+				"OCSPIdentifier",
+				TMSignatureWriter::element(prefix, "ResponderID",
+					TMSignatureWriter::element(prefix, "ByName",
+						byName)) +
+				TMSignatureWriter::element(prefix, "ProducedAt",
+					TMSignatureWriter::escape(producedAt)),
+				"URI=\"#N0\"");
+
+		revocationRefs = TMSignatureWriter::element(prefix, "OCSPRefs",
+			TMSignatureWriter::element(prefix, "OCSPRef",
+				ocspId +
+				TMSignatureWriter::element(prefix,
+					"DigestAlgAndValue",
+					renderXMLDigestMethodAndValue(
+						ocspResponseHash,
+						ocspResponseHashUri))));
+	}
+
+	return TMSignatureWriter::element(prefix, "CertificateValues",
+			certValues) +
+		TMSignatureWriter::element(prefix, "RevocationValues",
+			revocationValues) +
+		TMSignatureWriter::element(prefix, "CompleteCertificateRefs",
+			certRefs) +
+		TMSignatureWriter::element(prefix, "CompleteRevocationRefs",
+			revocationRefs);
+}
+
 void bdoc::SignatureValidator::validateTMOffline()
+{
+	ValidationError err = checkTMOffline();
+	if (err != VALIDATION_OK) {
+		THROW_STACK_EXCEPTION("%s", validationErrorMessage(err));
+	}
+}
+
+bdoc::ValidationError bdoc::SignatureValidator::checkTMOffline()
 {
 
 //	   1. Check OCSP response (RevocationValues) was signed by OCSP server
@@ -230,39 +366,47 @@ void bdoc::SignatureValidator::validateTMOffline()
 	std::auto_ptr<OCSP> ocsp(prepare());
 
 	_sig->getOCSPResponseValue(_ocspResponse);
-	ocsp->verifyResponse(_ocspResponse);
 
-	std::vector<unsigned char> respNonce = ocsp->getNonce(_ocspResponse);
+	std::vector<unsigned char> respNonce;
+	ocsp->verifyResponse(_ocspResponse, respNonce);
 
 	xml_schema::Uri method = _sig->ocspDigestAlgorithm();
 
-	std::auto_ptr<Digest> calc = Digest::create(std::string(method));
-	calc->update(_sig->getSignatureValue());
-	std::vector<unsigned char> nonce = calc->getDigest();
-
-	if (nonce != respNonce) {
-		THROW_STACK_EXCEPTION(
-			"Calculated signature hash doesn't match to OCSP "
-			"responder nonce field");
-	}
-
 	std::vector<unsigned char> revocationOCSPRefValue(0);
 	std::string ocspResponseHashUri;
 	_sig->getRevocationOCSPRef(revocationOCSPRefValue,
 					ocspResponseHashUri);
 
-	std::auto_ptr<Digest> ocspResponseCalc =
-					Digest::create(ocspResponseHashUri);
+	int nonceMethod = Digest::toMethod(std::string(method));
+	int ocspResponseMethod = Digest::toMethod(ocspResponseHashUri);
 
-	ocspResponseCalc->update(_ocspResponse);
-	std::vector<unsigned char> ocspResponseHash =
-					ocspResponseCalc->getDigest();
+	// The signature value and the OCSP response
+	std::vector<unsigned char> signatureValue = _sig->getSignatureValue();
+	DigestInput in[2];
+	in[0].data = signatureValue.empty() ? NULL : &signatureValue[0];
+	in[0].len = signatureValue.size();
+	in[1].data = _ocspResponse.empty() ? NULL : &_ocspResponse[0];
+	in[1].len = _ocspResponse.size();
 
-	if (ocspResponseHash != revocationOCSPRefValue) {
-		THROW_STACK_EXCEPTION(
-			"OCSPRef value doesn't match with hash of OCSP "
-			"response");
+	std::vector<std::vector<unsigned char> > hashes;
+	if (nonceMethod == ocspResponseMethod) {
+		Digest::hashMany(nonceMethod, in, 2, hashes);
+	}
+	else {
+		std::vector<std::vector<unsigned char> > h;
+		Digest::hashMany(nonceMethod, &in[0], 1, hashes);
+		Digest::hashMany(ocspResponseMethod, &in[1], 1, h);
+		hashes.push_back(h[0]);
+	}
+
+	if (hashes[0] != respNonce) {
+		return VALIDATION_OCSP_NONCE;
+	}
+
+	if (hashes[1] != revocationOCSPRefValue) {
+		return VALIDATION_OCSP_REF;
 	}
+	return VALIDATION_OK;
 }
 
 
@@ -272,17 +416,26 @@ void bdoc::SignatureValidator::validateTMOffline()
  *
  * */
 
-bdoc::Signature* bdoc::Signature::parse(const std::string& schema_dir,
-					const char *xml_buf, size_t buf_len, ContainerInfo *ci)
+bdoc::Signature* bdoc::Signature::parse(const GrammarPool *grammar,
+					const char *xml_buf, size_t buf_len, ContainerInfo *ci,
+					bool keep_xml)
 {
+	if (grammar == NULL) {
+		THROW_STACK_EXCEPTION("Schema directory is not set.");
+	}
+
 	try {
-		xml_schema::Properties properties;
-		properties.schema_location(bdoc::XAdES111Signature::XADES111_NAMESPACE, schema_dir + "/XAdES111.xsd");
-		properties.schema_location(bdoc::XAdES132Signature::XADES132_NAMESPACE, schema_dir + "/XAdES.xsd");
-		properties.schema_location(DSIG_NAMESPACE, schema_dir + "/xmldsig-core-schema.xsd");
-		std::istringstream input(std::string(xml_buf, buf_len));
-		xml_schema::Flags flags = xml_schema::Flags::dont_initialize;
-		std::auto_ptr<dsig::SignatureType> sig(dsig::signature(input, flags, properties).release());
+		// Validated against the pre-compiled schemas of the pool
+		std::auto_ptr<xercesc::DOMDocument> doc;
+		{
+			StageTimer timer(TIMING_PARSE);
+			doc = grammar->parse(xml_buf, buf_len);
+		}
+		std::auto_ptr<dsig::SignatureType> sig;
+		{
+			StageTimer timer(TIMING_DOM);
+			sig.reset(dsig::signature(*doc).release());
+		}
 
 		dsig::SignatureType::ObjectSequence& os = sig->object();
 		if (os.empty()) {
@@ -308,7 +461,11 @@ bdoc::Signature* bdoc::Signature::parse(const std::string& schema_dir,
 					"Signature block 'Object' contains more than one "
 					"'QualifyingProperties' block.");
 			}
-			return new XAdES111Signature(sig.release(), xml_buf, buf_len, ci);
+			Signature *ret = new XAdES111Signature(sig.release(), doc.release(), ci);
+			if (keep_xml) {
+				ret->_xml.assign(xml_buf, buf_len);
+			}
+			return ret;
 		}
 
 		if ((!qpSeq.empty()) && qp1Seq.empty()) {
@@ -317,7 +474,11 @@ bdoc::Signature* bdoc::Signature::parse(const std::string& schema_dir,
 					"Signature block 'Object' contains more than one "
 					"'QualifyingProperties' block.");
 			}
-			return new XAdES132Signature(sig.release(), xml_buf, buf_len, ci);
+			Signature *ret = new XAdES132Signature(sig.release(), doc.release(), ci);
+			if (keep_xml) {
+				ret->_xml.assign(xml_buf, buf_len);
+			}
+			return ret;
 		}
 
 		THROW_STACK_EXCEPTION("Signature block 'Object' contains more than one 'QualifyingProperties' block.");
@@ -333,24 +494,50 @@ bdoc::Signature* bdoc::Signature::parse(const std::string& schema_dir,
 		THROW_STACK_EXCEPTION(
 			"Failed to parse signature XML: %s", e.what());
 	}
+	catch (const xercesc::XMLException& e) {
+		char* tmp = xercesc::XMLString::transcode(e.getMessage());
+		std::string msg(tmp);
+		xercesc::XMLString::release(&tmp);
+		THROW_STACK_EXCEPTION(
+			"Failed to parse signature XML: %s", msg.c_str());
+	}
 }
 
 
 
 
-bdoc::Signature::Signature(dsig::SignatureType* signature, const char *xml, size_t xml_len, ContainerInfo *ci)
-	: _sign(signature), _xml(xml), _xml_len(xml_len), _bdoc(ci)
+bdoc::Signature::Signature(dsig::SignatureType* signature,
+				xercesc::DOMDocument *dom, ContainerInfo *ci)
+	: _sign(signature), _dom(dom), _bdoc(ci), _xml(), _signingCert(NULL)
 {
 }
 
+const std::string& bdoc::Signature::getXML() const
+{
+	return _xml;
+}
+
 bdoc::Signature::~Signature()
 {
+	delete _signingCert;
 	delete _sign;
+	delete _dom;
 }
 
 void bdoc::Signature::validateOffline(bdoc::X509CertStore *store)
+{
+	ValidationError err = checkOffline(store);
+	if (err != VALIDATION_OK) {
+		DECLARE_STACK_EXCEPTION("Signature is invalid");
+		exc.add(std::runtime_error(validationErrorMessage(err)));
+		throw exc;
+	}
+}
+
+bdoc::ValidationError bdoc::Signature::checkOffline(bdoc::X509CertStore *store)
 {
 	DECLARE_STACK_EXCEPTION("Signature is invalid");
+	ValidationError ret = VALIDATION_OK;
 
 	try {
 		checkQualifyingProperties();
@@ -361,9 +548,15 @@ void bdoc::Signature::validateOffline(bdoc::X509CertStore *store)
 
 	try {
 		checkSignatureMethod();
-		checkReferences();
-		checkKeyInfo();
-		checkSignatureValue();
+		if (!checkReferences()) {
+			ret = VALIDATION_DOCUMENT_REFERENCES;
+		}
+		else {
+			checkKeyInfo();
+			if (!checkSignatureValue()) {
+				ret = VALIDATION_SIGNATURE_VALUE;
+			}
+		}
 	}
 	catch (StackExceptionBase& e) {
 		exc.add(e);
@@ -379,6 +572,7 @@ void bdoc::Signature::validateOffline(bdoc::X509CertStore *store)
 	if (exc.hasCauses()) {
 		throw exc;
 	}
+	return ret;
 }
 
 std::string bdoc::Signature::getSubject() const
@@ -404,22 +598,22 @@ std::vector<unsigned char> bdoc::Signature::calcDigestOnNode(
 		Digest* calc, const std::string& ns,
 		const std::string& tagName)
 {
-	// Parse Xerces DOM from file, to preserve the white spaces "as is"
-	// and get the same digest value on XML node.
+	StageTimer timer(TIMING_DIGEST);
+
 	// Canonical XML 1.0 specification
 	// (http://www.w3.org/TR/2001/REC-xml-c14n-20010315)
 	// needs all the white spaces from XML file "as is", otherwise the
-	// digests won't match. Therefore we have to use Xerces to parse the
-	// XML file each time a digest needs to be calculated on a XML node.
+	// digests won't match. The DOM the signature was parsed from keeps
+	// them, and canonicalization only reads it, so every digest of this
+	// signature is calculated on the same document.
 	// If you are parsing XML files with a parser that doesn't preserve
 	// the white spaces you are DOOMED!
-	std::auto_ptr<xercesc::DOMDocument> dom = createDom();
 
 	// Select node, on which the digest is calculated.
 	XMLCh* tagNs(xercesc::XMLString::transcode(ns.c_str()));
 	XMLCh* tag(xercesc::XMLString::transcode(tagName.c_str()));
 	xercesc::DOMNodeList* nodeList =
-		dom->getElementsByTagNameNS(tagNs, tag);
+		_dom->getElementsByTagNameNS(tagNs, tag);
 
 	xercesc::XMLString::release(&tagNs);
 	xercesc::XMLString::release(&tag);
@@ -438,7 +632,7 @@ std::vector<unsigned char> bdoc::Signature::calcDigestOnNode(
 	}
 
 	// Canocalize XML using one of the three methods supported by XML-DSIG
-	XSECC14n20010315 canonicalizer(dom.get(), nodeList->item(0));
+	XSECC14n20010315 canonicalizer(_dom, nodeList->item(0));
 	canonicalizer.setCommentsProcessing(false);
 	canonicalizer.setUseNamespaceStack(true);
 
@@ -477,35 +671,22 @@ std::vector<unsigned char> bdoc::Signature::calcDigestOnNode(
 			algorithmType.c_str());
 	}
 
-//	std::string out;
-
-	unsigned char buffer[1024];
+	unsigned char buffer[C14N_CHUNK_SIZE];
 	int bytes = 0;
-	while ((bytes = canonicalizer.outputBuffer(buffer, 1024)) > 0) {
-//		out += std::string((char *)buffer, bytes);
+	while ((bytes = canonicalizer.outputBuffer(buffer, C14N_CHUNK_SIZE)) > 0) {
 		calc->update(buffer, bytes);
 	}
-//	std::cout << out << std::endl;
 
 	return calc->getDigest();
 }
 
 std::auto_ptr<xercesc::DOMDocument> bdoc::Signature::createDom() const
 {
+	StageTimer timer(TIMING_DOM);
 
 	try {
-		std::auto_ptr<xercesc::XercesDOMParser>
-			parser(new xercesc::XercesDOMParser());
-
-		parser->setValidationScheme(
-			xercesc::XercesDOMParser::Val_Always);
-
-		parser->setDoNamespaces(true);
-
-		xercesc::MemBufInputSource memIS((const XMLByte*)_xml, _xml_len, "test", false);
-
-		parser->parse(memIS);
-		xercesc::DOMNode* dom = parser->getDocument()->cloneNode(true);
+		// Callers modify the copy, the parsed document stays as is
+		xercesc::DOMNode* dom = _dom->cloneNode(true);
 
 		return std::auto_ptr<xercesc::DOMDocument>
 				(static_cast<xercesc::DOMDocument*>(dom));
@@ -530,13 +711,16 @@ std::auto_ptr<xercesc::DOMDocument> bdoc::Signature::createDom() const
 	return std::auto_ptr<xercesc::DOMDocument>(NULL);
 }
 
-bdoc::X509Cert bdoc::Signature::getSigningCertificate() const
+const bdoc::X509Cert& bdoc::Signature::getSigningCertificate() const
 {
-	const dsig::X509DataType::X509CertificateType&
-		certBlock = getSigningX509CertificateType();
+	if (_signingCert == NULL) {
+		const dsig::X509DataType::X509CertificateType&
+			certBlock = getSigningX509CertificateType();
 
-	return X509Cert(
-		(const unsigned char*)certBlock.data(), certBlock.size());
+		_signingCert = new X509Cert(
+			(const unsigned char*)certBlock.data(), certBlock.size());
+	}
+	return *_signingCert;
 }
 
 bdoc::dsig::X509DataType::X509CertificateType&
@@ -626,7 +810,7 @@ void bdoc::Signature::checkSignatureMethod() const
 	}
 }
 
-void bdoc::Signature::checkReferences()
+bool bdoc::Signature::checkReferences()
 {
 	dsig::SignedInfoType& signedInfo = _sign->signedInfo();
 	dsig::SignedInfoType::ReferenceSequence&
@@ -665,25 +849,21 @@ void bdoc::Signature::checkReferences()
 			"SignedProperties");
 	}
 
-	checkReferencesToDocs(refSeq);
+	return checkReferencesToDocs(refSeq);
 }
 
 void bdoc::Signature::checkSigningCertificate(bdoc::X509CertStore *store) const
 {
-	X509Cert signingCert = getSigningCertificate();
+	StageTimer timer(TIMING_CHAIN);
+	const X509Cert& signingCert = getSigningCertificate();
 
 	if (store == NULL) {
 		THROW_STACK_EXCEPTION(
 			"Unable to verify signing certificate %s",
 			signingCert.getSubject().c_str());
 	}
-	X509_STORE *st = NULL;
-	st = store->getCertStore();
-
-	int res = signingCert.verify(st);
-
-	X509_STORE_free(st);
-	st = NULL;
+	// Chains verified before are looked up by fingerprint
+	int res = store->verify(signingCert);
 
 	if (!res) {
 		THROW_STACK_EXCEPTION(
@@ -762,7 +942,7 @@ void bdoc::Signature::checkReferenceToSigProps(
 	}
 }
 
-void bdoc::Signature::checkReferencesToDocs(
+bool bdoc::Signature::checkReferencesToDocs(
 	dsig::SignedInfoType::ReferenceSequence& refSeq) const
 {
 	_bdoc->checkDocumentsBegin();
@@ -801,14 +981,12 @@ void bdoc::Signature::checkReferencesToDocs(
 		}
 	}
 
-	if (!_bdoc->checkDocumentsResult()) {
-		THROW_STACK_EXCEPTION("Document references didn't match");
-	}
+	return _bdoc->checkDocumentsResult();
 }
 
-void bdoc::Signature::checkSignatureValue()
+bool bdoc::Signature::checkSignatureValue()
 {
-	X509Cert cert(getSigningCertificate());
+	const X509Cert& cert = getSigningCertificate();
 
 	const dsig::SignatureMethodType::AlgorithmType&
 		algorithmType = getSignatureMethodAlgorithmType();
@@ -818,7 +996,7 @@ void bdoc::Signature::checkSignatureValue()
 	signatureMethod sm;
 	hashMethod hm;
 	safeBuffer hashMethodUri;
-	if (!XSECmapURIToSignatureMethods(XMLString::transcode(algorithmUri), sm, hm)
+	if (!XSECmapURIToSignatureMethods(XMLStr(algorithmUri), sm, hm)
 			|| !hashMethod2URI(hashMethodUri, hm)) {
 		THROW_STACK_EXCEPTION("Couldn't extract hash method from "
 			"signature method URI '%s'.", algorithmUri);
@@ -830,10 +1008,8 @@ void bdoc::Signature::checkSignatureValue()
 
 	std::vector<unsigned char> signatureValue = getSignatureValue();
 
-	if (!cert.verifySignature(calc->getMethod(), calc->getSize(), digest,
-														signatureValue)) {
-		THROW_STACK_EXCEPTION("Signature is not valid.");
-	}
+	return cert.verifySignature(calc->getMethod(), calc->getSize(), digest,
+														signatureValue);
 }
 
 
@@ -846,8 +1022,8 @@ void bdoc::Signature::checkSignatureValue()
 
 bdoc::XAdES111Signature::XAdES111Signature(
 					dsig::SignatureType* signature,
-					const char *xml, size_t xml_len,
-					bdoc::ContainerInfo *bdoc) : bdoc::Signature(signature, xml, xml_len, bdoc)
+					xercesc::DOMDocument *dom,
+					bdoc::ContainerInfo *bdoc) : bdoc::Signature(signature, dom, bdoc)
 {
 }
 
@@ -957,7 +1133,7 @@ void bdoc::XAdES111Signature::getRevocationOCSPRef(
 
 void bdoc::XAdES111Signature::checkKeyInfo() const
 {
-	X509Cert x509 = getSigningCertificate();
+	const X509Cert& x509 = getSigningCertificate();
 
 	dsig::SignatureType::ObjectSequence const& objs = _sign->object();
 
@@ -1124,8 +1300,8 @@ void bdoc::XAdES111Signature::checkQualifyingProperties() const
 
 bdoc::XAdES132Signature::XAdES132Signature(
 					dsig::SignatureType* signature,
-					const char *xml, size_t xml_len,
-					bdoc::ContainerInfo *bdoc) : bdoc::Signature(signature, xml, xml_len, bdoc)
+					xercesc::DOMDocument *dom,
+					bdoc::ContainerInfo *bdoc) : bdoc::Signature(signature, dom, bdoc)
 {
 }
 
@@ -1235,7 +1411,7 @@ void bdoc::XAdES132Signature::getRevocationOCSPRef(
 
 void bdoc::XAdES132Signature::checkKeyInfo() const
 {
-	X509Cert x509 = getSigningCertificate();
+	const X509Cert& x509 = getSigningCertificate();
 
 	dsig::SignatureType::ObjectSequence const& objs = _sign->object();
 
@@ -17,6 +17,7 @@
 #include "crypto/X509Cert.h"
 #include "crypto/X509CertStore.h"
 #include "crypto/Digest.h"
+#include "ValidationError.h"
 #include "xml/xmldsig-core-schema.hxx"
 #include "xml/XAdES.hxx"
 
@@ -25,6 +26,8 @@ namespace bdoc
 {
 	class ContainerInfo;
 	class Configuration;
+	class OCSPResponder;
+	class GrammarPool;
 
 	class Signature {
 
@@ -33,10 +36,15 @@ namespace bdoc
 
 			virtual ~Signature();
 
-			static Signature* parse(const std::string& schema_dir,
-					const char *xml_buf, size_t buf_len, ContainerInfo *ci);
+			// With keep_xml a copy of the XML is kept for getXML()
+			static Signature* parse(const GrammarPool *grammar,
+					const char *xml_buf, size_t buf_len, ContainerInfo *ci,
+					bool keep_xml);
 
 			virtual void validateOffline(X509CertStore *store);
+			// As validateOffline, but a document digest or signature
+			// value that does not match is returned, not thrown
+			ValidationError checkOffline(X509CertStore *store);
 			virtual void getOCSPResponseValue(std::vector<unsigned char>& data) const = 0;
 
 			virtual std::string getProducedAt() const = 0;
@@ -48,11 +56,15 @@ namespace bdoc
 					std::string& digestMethodUri) const = 0;
 
 			std::string getSubject() const;
-			X509Cert getSigningCertificate() const;
+			// Decoded on first use, lives as long as the signature
+			const X509Cert& getSigningCertificate() const;
 			std::vector<unsigned char> getSignatureValue() const;
 
 			std::auto_ptr<xercesc::DOMDocument> createDom() const;
 
+			// The XML the signature was parsed from, empty unless kept
+			const std::string& getXML() const;
+
 		protected:
 
 			virtual const std::string& xadesnamespace() = 0;
@@ -61,7 +73,8 @@ namespace bdoc
 			virtual void checkSignedSignatureProperties() const = 0;
 			virtual void checkQualifyingProperties() const = 0;
 
-			Signature(dsig::SignatureType* signature, const char *xml, size_t xml_len, bdoc::ContainerInfo *ci);
+			Signature(dsig::SignatureType* signature,
+					xercesc::DOMDocument *dom, bdoc::ContainerInfo *ci);
 
 			bdoc::dsig::KeyInfoType& keyInfo() const;
 
@@ -93,21 +106,25 @@ namespace bdoc
 			// offline checks
 			void checkSignature();
 			void checkSignatureMethod() const;
-			void checkReferences();
-			void checkSignatureValue();
+			bool checkReferences();
+			bool checkSignatureValue();
 			void checkSigningCertificate(
 					bdoc::X509CertStore *store) const;
 
 
 			bool isReferenceToSigProps(const bdoc::dsig::ReferenceType& refType) const;
 			void checkReferenceToSigProps(const bdoc::dsig::ReferenceType& refType);
-			void checkReferencesToDocs(dsig::SignedInfoType::ReferenceSequence& refSeq) const;
+			bool checkReferencesToDocs(dsig::SignedInfoType::ReferenceSequence& refSeq) const;
 			void checkDocumentRefDigest(const std::string& documentFileName, const dsig::ReferenceType& refType) const;
 
 
-			const char *_xml;
-			size_t _xml_len;
+			// Parsed once, white space preserved. The typed tree _sign
+			// was built from it and digests are calculated on it.
+			xercesc::DOMDocument *_dom;
 			bdoc::ContainerInfo *_bdoc;
+			std::string _xml;
+
+			mutable X509Cert *_signingCert;
 	};
 
 
@@ -133,8 +150,7 @@ namespace bdoc
 
 			XAdES111Signature(
 					dsig::SignatureType* signature,
-					const char *signature_xml,
-					size_t signature_xml_len,
+					xercesc::DOMDocument *dom,
 					bdoc::ContainerInfo *bdoc);
 
 			void checkKeyInfo() const;
@@ -168,8 +184,7 @@ namespace bdoc
 
 			XAdES132Signature(
 					dsig::SignatureType* signature,
-					const char *signature_xml,
-					size_t signature_xml_len,
+					xercesc::DOMDocument *dom,
 					bdoc::ContainerInfo *bdoc);
 
 			void checkKeyInfo() const;
@@ -190,8 +205,19 @@ namespace bdoc
 
 			std::string getProducedAt() const;
 			OCSP::CertStatus validateBESOnline();
+
+			// validateBESOnline() split around the HTTP exchange for
+			// callers sending the request themselves.
+			std::vector<unsigned char> createBESOnlineRequest();
+			const OCSP* getOCSP() const;
+			OCSP::CertStatus checkBESOnlineResponse(
+					const std::vector<unsigned char>& body);
+
 			std::string getTMSignature();
 			void validateTMOffline();
+			// As validateTMOffline, but a nonce or OCSPRef that does
+			// not match is returned, not thrown
+			ValidationError checkTMOffline();
 
 		protected:
 
@@ -199,12 +225,20 @@ namespace bdoc
 
 		private:
 
+			std::string renderTMProperties(const std::string& prefix,
+					const X509Cert& ocspCert,
+					const std::vector<unsigned char>& ocspResponseHash,
+					const std::string& ocspResponseHashUri) const;
+
 			bdoc::Signature *_sig;
 			bdoc::Configuration *_conf;
 
-			X509Cert _signingCert;
-			STACK_OF(X509)* _ocspCerts;
+			// Owned by the signature
+			const X509Cert* _signingCert;
+			const OCSPResponder* _responder;
 			X509* _issuerX509;
+			OCSP* _ocsp;
+			std::vector<unsigned char> _nonce;
 			std::vector<unsigned char> _ocspResponse;
 			struct tm _producedAt;
 	};
@@ -43,7 +43,7 @@ class StackExceptionBase : public CallStack {
 
 	public:
 		StackExceptionBase (bool ss = true) :
-			CallStack(2), show_stack(ss), causes() {
+			CallStack(2, ss), show_stack(ss), causes() {
 		}
 
 		virtual ~StackExceptionBase () throw() {}
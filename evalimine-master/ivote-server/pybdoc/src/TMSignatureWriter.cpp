@@ -0,0 +1,256 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "TMSignatureWriter.h"
+
+#include <string.h>
+#include <strings.h>
+
+#define TM_XML_DECLARATION "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+#define TM_UNSIGNED_PROPERTIES "UnsignedProperties"
+#define TM_UNSIGNED_SIGNATURE_PROPERTIES "UnsignedSignatureProperties"
+
+static bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool startsWith(const std::string& s, size_t pos, const char *prefix)
+{
+	return s.compare(pos, strlen(prefix), prefix) == 0;
+}
+
+bdoc::TMSignatureWriter::TMSignatureWriter(const std::string& xml) :
+	_xml(xml),
+	_usable(false),
+	_root(0),
+	_prefix(),
+	_open(0),
+	_openEnd(0),
+	_empty(false),
+	_close(0)
+{
+	_usable = locate();
+}
+
+bool bdoc::TMSignatureWriter::usable() const
+{
+	return _usable;
+}
+
+const std::string& bdoc::TMSignatureWriter::prefix() const
+{
+	return _prefix;
+}
+
+bool bdoc::TMSignatureWriter::skipMarkup(size_t& pos) const
+{
+	const char *end = NULL;
+	if (startsWith(_xml, pos, "<!--")) {
+		end = "-->";
+	}
+	else if (startsWith(_xml, pos, "<![CDATA[")) {
+		end = "]]>";
+	}
+	else if (startsWith(_xml, pos, "<?")) {
+		end = "?>";
+	}
+	else {
+		// DOCTYPE and the like, entities could change the text
+		return false;
+	}
+
+	size_t e = _xml.find(end, pos + 2);
+	if (e == std::string::npos) {
+		return false;
+	}
+	pos = e + strlen(end);
+	return true;
+}
+
+bool bdoc::TMSignatureWriter::tagEnd(size_t pos, size_t& end) const
+{
+	// Attribute values may contain '>'
+	char quote = 0;
+	for (size_t i = pos + 1; i < _xml.size(); i++) {
+		char c = _xml[i];
+		if (quote) {
+			if (c == quote) {
+				quote = 0;
+			}
+		}
+		else if (c == '"' || c == '\'') {
+			quote = c;
+		}
+		else if (c == '>') {
+			end = i + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool bdoc::TMSignatureWriter::locate()
+{
+	size_t pos = 0;
+	if (startsWith(_xml, 0, "\xEF\xBB\xBF")) {
+		pos = 3;
+	}
+
+	// Prolog
+	while (true) {
+		while (pos < _xml.size() && isSpace(_xml[pos])) {
+			pos++;
+		}
+		if (pos >= _xml.size() || _xml[pos] != '<') {
+			return false;
+		}
+		if (startsWith(_xml, pos, "<?xml") &&
+				pos + 5 < _xml.size() && isSpace(_xml[pos + 5])) {
+			size_t e = _xml.find("?>", pos);
+			if (e == std::string::npos) {
+				return false;
+			}
+			// Written out as UTF-8
+			std::string decl = _xml.substr(pos, e - pos);
+			size_t enc = decl.find("encoding");
+			if (enc != std::string::npos) {
+				size_t q = decl.find_first_of("\"'", enc);
+				if (q == std::string::npos || q + 6 >= decl.size() ||
+						strncasecmp(decl.c_str() + q + 1, "UTF-8", 5) != 0 ||
+						decl[q + 6] != decl[q]) {
+					return false;
+				}
+			}
+			pos = e + 2;
+			continue;
+		}
+		if (_xml[pos + 1] == '?' || _xml[pos + 1] == '!') {
+			if (!skipMarkup(pos)) {
+				return false;
+			}
+			continue;
+		}
+		break;
+	}
+	_root = pos;
+
+	std::string qname;
+	bool found = false;
+	while ((pos = _xml.find('<', pos)) != std::string::npos) {
+		if (pos + 1 >= _xml.size()) {
+			return false;
+		}
+
+		char c = _xml[pos + 1];
+		if (c == '!' || c == '?') {
+			if (!skipMarkup(pos)) {
+				return false;
+			}
+			continue;
+		}
+
+		size_t nameStart = (c == '/') ? pos + 2 : pos + 1;
+		size_t nameEnd = nameStart;
+		while (nameEnd < _xml.size() && !isSpace(_xml[nameEnd]) &&
+				_xml[nameEnd] != '/' && _xml[nameEnd] != '>') {
+			nameEnd++;
+		}
+		std::string name = _xml.substr(nameStart, nameEnd - nameStart);
+
+		size_t end = 0;
+		if (!tagEnd(pos, end)) {
+			return false;
+		}
+
+		if (c == '/') {
+			if (found && name == qname) {
+				_close = pos;
+				return true;
+			}
+			pos = end;
+			continue;
+		}
+
+		size_t colon = name.find(':');
+		std::string local = (colon == std::string::npos) ?
+			name : name.substr(colon + 1);
+		if (!found && local == TM_UNSIGNED_PROPERTIES) {
+			_prefix = (colon == std::string::npos) ?
+				"" : name.substr(0, colon + 1);
+			_open = pos;
+			_openEnd = end;
+			if (_xml[end - 2] == '/') {
+				_empty = true;
+				return true;
+			}
+			found = true;
+			qname = name;
+		}
+		pos = end;
+	}
+	return false;
+}
+
+std::string bdoc::TMSignatureWriter::write(const std::string& properties) const
+{
+	std::string usp;
+	usp.reserve(properties.size() + 64);
+	usp += "<" + _prefix + TM_UNSIGNED_SIGNATURE_PROPERTIES + ">";
+	usp += properties;
+	usp += "</" + _prefix + TM_UNSIGNED_SIGNATURE_PROPERTIES + ">";
+
+	std::string ret(TM_XML_DECLARATION);
+	ret.reserve(ret.size() + _xml.size() - _root + usp.size() + 64);
+	if (_empty) {
+		// <UnsignedProperties .../> gets content
+		ret.append(_xml, _root, _openEnd - 2 - _root);
+		ret += ">";
+		ret += usp;
+		ret += "</" + _prefix + TM_UNSIGNED_PROPERTIES + ">";
+		ret.append(_xml, _openEnd, std::string::npos);
+	}
+	else {
+		ret.append(_xml, _root, _close - _root);
+		ret += usp;
+		ret.append(_xml, _close, std::string::npos);
+	}
+	return ret;
+}
+
+std::string bdoc::TMSignatureWriter::escape(const std::string& text)
+{
+	std::string ret;
+	ret.reserve(text.size());
+	for (size_t i = 0; i < text.size(); i++) {
+		switch (text[i]) {
+			case '&': ret += "&amp;"; break;
+			case '<': ret += "&lt;"; break;
+			case '>': ret += "&gt;"; break;
+			case '"': ret += "&quot;"; break;
+			case '\r': ret += "&#xD;"; break;
+			default: ret += text[i]; break;
+		}
+	}
+	return ret;
+}
+
+std::string bdoc::TMSignatureWriter::element(const std::string& prefix,
+		const char *name, const std::string& content,
+		const std::string& attributes)
+{
+	std::string ret("<" + prefix + name);
+	if (!attributes.empty()) {
+		ret += " " + attributes;
+	}
+	ret += ">" + content + "</" + prefix + name + ">";
+	return ret;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+namespace bdoc {
+
+/*
+ * Adds UnsignedSignatureProperties to a signature by splicing text into
+ * the original XML instead of rebuilding it through a DOM. The
+ * insertion point is the end of the first UnsignedProperties element,
+ * where the DOM would append it. Signatures the scanner is not sure
+ * about (DOCTYPE, non-UTF-8 encoding, no UnsignedProperties) are left
+ * to the DOM: usable() is false.
+ * */
+class TMSignatureWriter {
+
+	public:
+
+		TMSignatureWriter(const std::string& xml);
+
+		bool usable() const;
+
+		// Prefix of the XAdES elements, with the colon, or empty
+		const std::string& prefix() const;
+
+		// The signature with the properties (the content of
+		// UnsignedSignatureProperties) in place
+		std::string write(const std::string& properties) const;
+
+		// Text or attribute value escaped for XML
+		static std::string escape(const std::string& text);
+
+		// <prefix:name attributes>content</prefix:name>, the content
+		// is already XML
+		static std::string element(const std::string& prefix,
+				const char *name, const std::string& content,
+				const std::string& attributes = "");
+
+	private:
+
+		bool locate();
+		bool skipMarkup(size_t& pos) const;
+		bool tagEnd(size_t pos, size_t& end) const;
+
+		const std::string& _xml;
+		bool _usable;
+
+		// Start of the root element, the prolog is not written
+		size_t _root;
+		std::string _prefix;
+		// Start and end of the UnsignedProperties start tag
+		size_t _open;
+		size_t _openEnd;
+		bool _empty;
+		// Start of the UnsignedProperties end tag
+		size_t _close;
+};
+
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "Timing.h"
+
+#include <math.h>
+#include <string.h>
+
+// Bucket 0 is below a microsecond, bucket b > 0 ends at 2^(b/4) us
+#define TIMING_BUCKETS 128
+#define TIMING_BUCKETS_PER_OCTAVE 4
+
+struct StageHistogram {
+	unsigned long count;
+	unsigned long long totalNs;
+	unsigned long buckets[TIMING_BUCKETS];
+};
+
+static volatile bool timing_enabled = false;
+static StageHistogram histograms[bdoc::TIMING_STAGES];
+
+// Timings of the verification running in this thread
+static __thread double *current = NULL;
+
+static const char *stage_names[bdoc::TIMING_STAGES] = {
+	"parse",
+	"dom",
+	"digest",
+	"chain",
+	"ocsp_connect",
+	"ocsp_roundtrip",
+	"tm_assembly"
+};
+
+static int bucketOf(unsigned long long ns)
+{
+	double us = ns / 1000.0;
+	if (us < 1.0) {
+		return 0;
+	}
+	int b = 1 + (int)(TIMING_BUCKETS_PER_OCTAVE * log2(us));
+	return b < TIMING_BUCKETS ? b : TIMING_BUCKETS - 1;
+}
+
+static double bucketEnd(int b)
+{
+	return pow(2.0, (double)b / TIMING_BUCKETS_PER_OCTAVE) / 1e6;
+}
+
+static double percentile(const unsigned long *buckets, unsigned long count,
+		double q)
+{
+	if (count == 0) {
+		return 0.0;
+	}
+	unsigned long want = (unsigned long)ceil(q * count);
+	unsigned long seen = 0;
+	for (int b = 0; b < TIMING_BUCKETS; b++) {
+		seen += buckets[b];
+		if (seen >= want) {
+			return bucketEnd(b);
+		}
+	}
+	return bucketEnd(TIMING_BUCKETS - 1);
+}
+
+void bdoc::timing::setEnabled(bool enabled)
+{
+	timing_enabled = enabled;
+}
+
+bool bdoc::timing::isEnabled()
+{
+	return timing_enabled;
+}
+
+const char* bdoc::timing::stageName(int stage)
+{
+	if (stage < 0 || stage >= TIMING_STAGES) {
+		return "unknown";
+	}
+	return stage_names[stage];
+}
+
+bdoc::timing::Summary bdoc::timing::summary(int stage)
+{
+	Summary ret;
+	memset(&ret, 0, sizeof(ret));
+	if (stage < 0 || stage >= TIMING_STAGES) {
+		return ret;
+	}
+
+	// A snapshot, other threads may be adding
+	StageHistogram h;
+	memcpy(&h, (const void *)&histograms[stage], sizeof(h));
+
+	ret.count = h.count;
+	ret.total = h.totalNs / 1e9;
+	ret.p50 = percentile(h.buckets, h.count, 0.50);
+	ret.p99 = percentile(h.buckets, h.count, 0.99);
+	return ret;
+}
+
+void bdoc::timing::reset()
+{
+	memset(histograms, 0, sizeof(histograms));
+}
+
+bdoc::TimingScope::TimingScope(std::vector<double>& out) :
+	_previous(current)
+{
+	if (!timing_enabled) {
+		return;
+	}
+	if (out.size() != TIMING_STAGES) {
+		out.assign(TIMING_STAGES, 0.0);
+	}
+	current = &out[0];
+}
+
+bdoc::TimingScope::~TimingScope()
+{
+	current = _previous;
+}
+
+bdoc::StageTimer::StageTimer(TimingStage stage) :
+	_stage(stage),
+	_on(timing_enabled)
+{
+	if (_on) {
+		clock_gettime(CLOCK_MONOTONIC, &_start);
+	}
+}
+
+bdoc::StageTimer::~StageTimer()
+{
+	if (!_on) {
+		return;
+	}
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long long ns = (end.tv_sec - _start.tv_sec) * 1000000000LL +
+		(end.tv_nsec - _start.tv_nsec);
+	if (ns < 0) {
+		ns = 0;
+	}
+
+	StageHistogram& h = histograms[_stage];
+	__sync_fetch_and_add(&h.count, 1UL);
+	__sync_fetch_and_add(&h.totalNs, (unsigned long long)ns);
+	__sync_fetch_and_add(&h.buckets[bucketOf(ns)], 1UL);
+
+	if (current != NULL) {
+		current[_stage] += ns / 1e9;
+	}
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <time.h>
+#include <vector>
+
+namespace bdoc {
+
+// Stages of a verification. TM assembly includes the DOM it builds.
+enum TimingStage {
+	TIMING_PARSE = 0,
+	TIMING_DOM,
+	TIMING_DIGEST,
+	TIMING_CHAIN,
+	TIMING_OCSP_CONNECT,
+	TIMING_OCSP_ROUNDTRIP,
+	TIMING_TM_ASSEMBLY,
+	TIMING_STAGES
+};
+
+/*
+ * Time spent in the stages, off by default. When on, every StageTimer
+ * adds to the process-wide histogram of its stage and to the timings
+ * of the TimingScope of its thread, if there is one.
+ * */
+namespace timing {
+
+	struct Summary {
+		unsigned long count;
+		// Seconds, the percentiles are upper bounds of histogram
+		// buckets a quarter of an octave wide
+		double total;
+		double p50;
+		double p99;
+	};
+
+	void setEnabled(bool enabled);
+	bool isEnabled();
+
+	const char* stageName(int stage);
+	Summary summary(int stage);
+	void reset();
+}
+
+class TimingScope {
+
+	public:
+
+		// Stages timed in the scope add seconds to out, which gets
+		// TIMING_STAGES entries if timing is on
+		TimingScope(std::vector<double>& out);
+		~TimingScope();
+
+	private:
+
+		TimingScope(const TimingScope&);
+		TimingScope& operator=(const TimingScope&);
+
+		double *_previous;
+};
+
+class StageTimer {
+
+	public:
+
+		StageTimer(TimingStage stage);
+		~StageTimer();
+
+	private:
+
+		StageTimer(const StageTimer&);
+		StageTimer& operator=(const StageTimer&);
+
+		TimingStage _stage;
+		bool _on;
+		struct timespec _start;
+};
+
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "ValidationError.h"
+
+const char* bdoc::validationErrorMessage(int code)
+{
+	switch (code) {
+		case VALIDATION_OK:
+			return "";
+		case VALIDATION_EXCEPTION:
+			return "Verification failed";
+		case VALIDATION_DOCUMENT_REFERENCES:
+			return "Document references didn't match";
+		case VALIDATION_SIGNATURE_VALUE:
+			return "Signature is not valid.";
+		case VALIDATION_CERT_EXPIRED:
+			return "Certificate is expired";
+		case VALIDATION_CERT_REVOKED:
+			return "Certificate status revoked";
+		case VALIDATION_CERT_UNKNOWN:
+			return "Certificate status unknown";
+		case VALIDATION_CERT_STATUS:
+			return "Certificate status invalid";
+		case VALIDATION_OCSP_NONCE:
+			return "Calculated signature hash doesn't match to OCSP "
+				"responder nonce field";
+		case VALIDATION_OCSP_REF:
+			return "OCSPRef value doesn't match with hash of OCSP "
+				"response";
+		default:
+			return "Unknown error";
+	}
+}
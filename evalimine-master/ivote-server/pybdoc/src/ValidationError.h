@@ -0,0 +1,37 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+namespace bdoc {
+
+/*
+ * Outcome of a verification. Failures expected from bad input are
+ * reported with their own code and a static message, without an
+ * exception. VALIDATION_EXCEPTION stands for everything else, the
+ * message is the one of the exception.
+ * */
+enum ValidationError {
+	VALIDATION_OK = 0,
+	VALIDATION_EXCEPTION,
+	VALIDATION_DOCUMENT_REFERENCES,
+	VALIDATION_SIGNATURE_VALUE,
+	VALIDATION_CERT_EXPIRED,
+	VALIDATION_CERT_REVOKED,
+	VALIDATION_CERT_UNKNOWN,
+	VALIDATION_CERT_STATUS,
+	VALIDATION_OCSP_NONCE,
+	VALIDATION_OCSP_REF
+};
+
+const char* validationErrorMessage(int code);
+
+}
@@ -14,6 +14,7 @@
 
 #include "Signature.h"
 #include "XMLHelper.h"
+#include "TMSignatureWriter.h"
 
 void addXMLEncapsulatedX509Certificate(xercesc::DOMDocument *doc,
 					xercesc::DOMNode *root,
@@ -22,18 +23,18 @@ void addXMLEncapsulatedX509Certificate(xercesc::DOMDocument *doc,
 {
 	xercesc::DOMElement *x509val =
 		doc->createElement(
-			xercesc::XMLString::transcode(
+			XMLStr(
 					"EncapsulatedX509Certificate"));
 
 	std::vector<unsigned char> der = x509.encodeDER();
 	xml_schema::Base64Binary b64(&der[0], der.size());
 
 	x509val->setTextContent(
-			xercesc::XMLString::transcode(b64.encode().c_str()));
+			XMLStr(b64.encode().c_str()));
 
 	x509val->setAttribute(
-			xercesc::XMLString::transcode("Id"),
-			xercesc::XMLString::transcode(id));
+			XMLStr("Id"),
+			XMLStr(id));
 
 	root->appendChild(x509val);
 }
@@ -45,7 +46,7 @@ void addXMLCertificateValues(xercesc::DOMDocument *doc,
 {
 	xercesc::DOMNode *certificatevalues =
 		doc->createElement(
-			xercesc::XMLString::transcode("CertificateValues"));
+			XMLStr("CertificateValues"));
 
 	addXMLEncapsulatedX509Certificate(doc, certificatevalues,
 						ocspCert, "S0-RESPONDER_CERT");
@@ -62,23 +63,23 @@ void addXMLRevocationValues(xercesc::DOMDocument *doc,
 {
 	xercesc::DOMNode *revocationvalues =
 		doc->createElement(
-			xercesc::XMLString::transcode("RevocationValues"));
+			XMLStr("RevocationValues"));
 
 	xercesc::DOMNode *ocspvalues =
 		doc->createElement(
-			xercesc::XMLString::transcode("OCSPValues"));
+			XMLStr("OCSPValues"));
 
 	xercesc::DOMElement *encapsulatedocsp =
 		doc->createElement(
-			xercesc::XMLString::transcode(
+			XMLStr(
 						"EncapsulatedOCSPValue"));
 
 	encapsulatedocsp->setAttribute(
-					xercesc::XMLString::transcode("Id"),
-					xercesc::XMLString::transcode("N0"));
+					XMLStr("Id"),
+					XMLStr("N0"));
 
 	encapsulatedocsp->setTextContent(
-				xercesc::XMLString::transcode(
+				XMLStr(
 						resp.encode().c_str()));
 
 	ocspvalues->appendChild(encapsulatedocsp);
@@ -93,27 +94,27 @@ void addXMLDigestMethodAndAlgorithm(xercesc::DOMDocument *doc,
 {
 	xercesc::DOMElement *digestmethod =
 		doc->createElement(
-			xercesc::XMLString::transcode("DigestMethod"));
+			XMLStr("DigestMethod"));
 
 	digestmethod->setAttribute(
-			xercesc::XMLString::transcode("Algorithm"),
-			xercesc::XMLString::transcode(methuri.c_str()));
+			XMLStr("Algorithm"),
+			XMLStr(methuri.c_str()));
 
 	digestmethod->setAttribute(
-		xercesc::XMLString::transcode("xmlns"),
-		xercesc::XMLString::transcode(
+		XMLStr("xmlns"),
+		XMLStr(
 			bdoc::Signature::DSIG_NAMESPACE.c_str()));
 
 	xercesc::DOMElement *digestvalue =
 		doc->createElement(
-			xercesc::XMLString::transcode("DigestValue"));
+			XMLStr("DigestValue"));
 
 	digestvalue->setTextContent(
-		xercesc::XMLString::transcode(dig.encode().c_str()));
+		XMLStr(dig.encode().c_str()));
 
 	digestvalue->setAttribute(
-			xercesc::XMLString::transcode("xmlns"),
-			xercesc::XMLString::transcode(
+			XMLStr("xmlns"),
+			XMLStr(
 				bdoc::Signature::DSIG_NAMESPACE.c_str()));
 
 	root->appendChild(digestmethod);
@@ -129,50 +130,50 @@ void addXMLCompleteCertificateRefs(xercesc::DOMDocument *doc,
 
 	xercesc::DOMNode *completecertrefs =
 		doc->createElement(
-			xercesc::XMLString::transcode(
+			XMLStr(
 						"CompleteCertificateRefs"));
 
 	xercesc::DOMNode *certrefs =
-		doc->createElement(xercesc::XMLString::transcode("CertRefs"));
+		doc->createElement(XMLStr("CertRefs"));
 
 	xercesc::DOMNode *cert =
-		doc->createElement(xercesc::XMLString::transcode("Cert"));
+		doc->createElement(XMLStr("Cert"));
 
 	xercesc::DOMNode *certdigest =
 		doc->createElement(
-			xercesc::XMLString::transcode("CertDigest"));
+			XMLStr("CertDigest"));
 
 	addXMLDigestMethodAndAlgorithm(doc, certdigest, dig, methuri);
 
 	xercesc::DOMElement *x509name = doc->createElement(
-			xercesc::XMLString::transcode("X509IssuerName"));
+			XMLStr("X509IssuerName"));
 
 	x509name->setTextContent(
-				xercesc::XMLString::transcode(
+				XMLStr(
 					incert.getIssuerName().c_str()));
 
 	x509name->setAttribute(
-			xercesc::XMLString::transcode("xmlns"),
-			xercesc::XMLString::transcode(
+			XMLStr("xmlns"),
+			XMLStr(
 				bdoc::Signature::DSIG_NAMESPACE.c_str()));
 
 	xercesc::DOMElement *x509number =
 		doc->createElement(
-			xercesc::XMLString::transcode("X509SerialNumber"));
+			XMLStr("X509SerialNumber"));
 
 	std::ostringstream oss;
 	oss << incert.getSerial();
 	x509number->setTextContent(
-			xercesc::XMLString::transcode(oss.str().c_str()));
+			XMLStr(oss.str().c_str()));
 
 	x509number->setAttribute(
-			xercesc::XMLString::transcode("xmlns"),
-			xercesc::XMLString::transcode(
+			XMLStr("xmlns"),
+			XMLStr(
 				bdoc::Signature::DSIG_NAMESPACE.c_str()));
 
 	xercesc::DOMNode *issuerserial =
 			doc->createElement(
-				xercesc::XMLString::transcode("IssuerSerial"));
+				XMLStr("IssuerSerial"));
 
 	cert->appendChild(certdigest);
 	issuerserial->appendChild(x509name);
@@ -193,45 +194,45 @@ void addXMLCompleteRevocationRefs(xercesc::DOMDocument *doc,
 {
 	xercesc::DOMNode *dav =
 		doc->createElement(
-			xercesc::XMLString::transcode("DigestAlgAndValue"));
+			XMLStr("DigestAlgAndValue"));
 
 	addXMLDigestMethodAndAlgorithm(doc, dav, dig, methuri);
 
 	xercesc::DOMElement *rid =
 		doc->createElement(
-			xercesc::XMLString::transcode("ResponderID"));
+			XMLStr("ResponderID"));
 
 	xercesc::DOMElement *bn =
 			doc->createElement(
-				xercesc::XMLString::transcode("ByName"));
+				XMLStr("ByName"));
 
 	bn->setTextContent(
-			xercesc::XMLString::transcode(
+			XMLStr(
 				cert.getSubject().c_str()));
 
 	xercesc::DOMElement *dt =
 		doc->createElement(
-			xercesc::XMLString::transcode("ProducedAt"));
+			XMLStr("ProducedAt"));
 
-	dt->setTextContent(xercesc::XMLString::transcode(producedAt.c_str()));
+	dt->setTextContent(XMLStr(producedAt.c_str()));
 
 	xercesc::DOMElement *ocspid =
 		doc->createElement(
-			xercesc::XMLString::transcode("OCSPIdentifier"));
+			XMLStr("OCSPIdentifier"));
 
 	ocspid->setAttribute(
-		xercesc::XMLString::transcode("URI"),
-		xercesc::XMLString::transcode("#N0"));
+		XMLStr("URI"),
+		XMLStr("#N0"));
 
 	xercesc::DOMNode *ocspref =
-		doc->createElement(xercesc::XMLString::transcode("OCSPRef"));
+		doc->createElement(XMLStr("OCSPRef"));
 
 	xercesc::DOMNode *ocsprefs =
-		doc->createElement(xercesc::XMLString::transcode("OCSPRefs"));
+		doc->createElement(XMLStr("OCSPRefs"));
 
 	xercesc::DOMElement *revrefs =
 		doc->createElement(
-			xercesc::XMLString::transcode(
+			XMLStr(
 					"CompleteRevocationRefs"));
 
 	rid->appendChild(bn);
@@ -244,3 +245,37 @@ void addXMLCompleteRevocationRefs(xercesc::DOMDocument *doc,
 	root->appendChild(revrefs);
 }
 
+std::string renderXMLBase64(const std::vector<unsigned char>& data)
+{
+	if (data.empty()) {
+		return "";
+	}
+	xml_schema::Base64Binary b64(&data[0], data.size());
+	return b64.encode();
+}
+
+std::string renderXMLDigestMethodAndValue(
+					const std::vector<unsigned char>& dig,
+					const std::string& methuri)
+{
+	std::string xmlns = "xmlns=\"" + bdoc::Signature::DSIG_NAMESPACE + "\"";
+
+	return bdoc::TMSignatureWriter::element("", "DigestMethod", "",
+			xmlns + " Algorithm=\"" +
+			bdoc::TMSignatureWriter::escape(methuri) + "\"") +
+		bdoc::TMSignatureWriter::element("", "DigestValue",
+			renderXMLBase64(dig), xmlns);
+}
+
+std::string renderXMLIssuerSerial(const bdoc::X509Cert& cert)
+{
+	std::string xmlns = "xmlns=\"" + bdoc::Signature::DSIG_NAMESPACE + "\"";
+
+	return bdoc::TMSignatureWriter::element("", "X509IssuerName",
+			bdoc::TMSignatureWriter::escape(cert.getIssuerName()),
+			xmlns) +
+		bdoc::TMSignatureWriter::element("", "X509SerialNumber",
+			bdoc::TMSignatureWriter::escape(cert.getSerial()),
+			xmlns);
+}
+
@@ -18,6 +18,30 @@
 #include "xml/XAdES.hxx"
 #include "crypto/X509Cert.h"
 
+/*
+ * Xerces string transcoded from a C string, released at the end of the
+ * scope. Temporaries live until the end of the full expression, which
+ * is long enough for the DOM calls that copy their arguments.
+ * */
+class XMLStr {
+
+	public:
+
+		XMLStr(const char *s) : _s(xercesc::XMLString::transcode(s)) {}
+		XMLStr(const std::string& s) :
+			_s(xercesc::XMLString::transcode(s.c_str())) {}
+		~XMLStr() { xercesc::XMLString::release(&_s); }
+
+		operator const XMLCh*() const { return _s; }
+
+	private:
+
+		XMLStr(const XMLStr&);
+		XMLStr& operator=(const XMLStr&);
+
+		XMLCh *_s;
+};
+
 void addXMLEncapsulatedX509Certificate(xercesc::DOMDocument *doc,
 					xercesc::DOMNode *root,
 					bdoc::X509Cert& x509,
@@ -50,3 +74,13 @@ void addXMLCompleteRevocationRefs(xercesc::DOMDocument *doc,
 					const std::string& methuri,
 					const std::string& producedAt);
 
+/*
+ * The same blocks as text, for splicing into the signature XML.
+ * */
+std::string renderXMLBase64(const std::vector<unsigned char>& data);
+
+std::string renderXMLDigestMethodAndValue(
+					const std::vector<unsigned char>& dig,
+					const std::string& methuri);
+
+std::string renderXMLIssuerSerial(const bdoc::X509Cert& cert);
@@ -0,0 +1,346 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "ZipContainer.h"
+#include "crypto/Digest.h"
+#include "StackException.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <set>
+
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP_END_SIG 0x06054b50
+
+#define ZIP_LOCAL_HEADER_LEN 30
+#define ZIP_CENTRAL_HEADER_LEN 46
+#define ZIP_END_LEN 22
+#define ZIP_MAX_COMMENT_LEN 0xffff
+
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+#define ZIP_FLAG_ENCRYPTED 0x0001
+
+#define ZIP_INFLATE_CHUNK (64 * 1024)
+
+static uint16_t le16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bdoc::ZipContainer::ZipContainer() :
+	_data(NULL),
+	_len(0),
+	_mapped(false),
+	_entries()
+{
+}
+
+bdoc::ZipContainer::~ZipContainer()
+{
+	close();
+}
+
+void bdoc::ZipContainer::close()
+{
+	if (_mapped && _data != NULL) {
+		munmap(const_cast<unsigned char *>(_data), _len);
+	}
+	_data = NULL;
+	_len = 0;
+	_mapped = false;
+	_entries.clear();
+}
+
+void bdoc::ZipContainer::open(const char *path)
+{
+	close();
+
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		THROW_STACK_EXCEPTION("Failed to open container '%s': %s", path, strerror(errno));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		::close(fd);
+		THROW_STACK_EXCEPTION("Failed to open container '%s': %s", path, strerror(err));
+	}
+
+	if (st.st_size < ZIP_END_LEN) {
+		::close(fd);
+		THROW_STACK_EXCEPTION("Invalid zipfile '%s'", path);
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	// The mapping keeps the file
+	::close(fd);
+	if (data == MAP_FAILED) {
+		THROW_STACK_EXCEPTION("Failed to map container '%s': %s", path, strerror(err));
+	}
+
+	_data = (const unsigned char *)data;
+	_len = st.st_size;
+	_mapped = true;
+
+	try {
+		parse();
+	}
+	catch (...) {
+		close();
+		throw;
+	}
+}
+
+void bdoc::ZipContainer::borrow(const unsigned char *buf, size_t len)
+{
+	close();
+	_data = buf;
+	_len = len;
+
+	try {
+		parse();
+	}
+	catch (...) {
+		close();
+		throw;
+	}
+}
+
+void bdoc::ZipContainer::parse()
+{
+	if (_data == NULL || _len < ZIP_END_LEN) {
+		THROW_STACK_EXCEPTION("Invalid zipfile");
+	}
+
+	// The end record is followed only by the archive comment
+	size_t end = _len - ZIP_END_LEN;
+	size_t stop = (_len - ZIP_END_LEN > ZIP_MAX_COMMENT_LEN) ?
+		_len - ZIP_END_LEN - ZIP_MAX_COMMENT_LEN : 0;
+	while (true) {
+		if (le32(_data + end) == ZIP_END_SIG &&
+				end + ZIP_END_LEN + le16(_data + end + 20) == _len) {
+			break;
+		}
+		if (end == stop) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: no central directory");
+		}
+		end--;
+	}
+
+	const unsigned char *e = _data + end;
+	size_t entries = le16(e + 10);
+	size_t dirSize = le32(e + 12);
+	size_t dirOffset = le32(e + 16);
+
+	if (le16(e + 4) != 0 || le16(e + 6) != 0 || le16(e + 8) != entries) {
+		THROW_STACK_EXCEPTION("Invalid zipfile: multi-disk archives are not supported");
+	}
+	if (dirOffset > end || dirSize > end - dirOffset) {
+		THROW_STACK_EXCEPTION("Invalid zipfile: bad central directory");
+	}
+
+	std::set<std::string> names;
+	size_t pos = dirOffset;
+	for (size_t i = 0; i < entries; i++) {
+		if (dirOffset + dirSize - pos < ZIP_CENTRAL_HEADER_LEN) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: truncated central directory");
+		}
+		const unsigned char *c = _data + pos;
+		if (le32(c) != ZIP_CENTRAL_HEADER_SIG) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: bad central directory entry");
+		}
+
+		size_t nameLen = le16(c + 28);
+		size_t headerLen = ZIP_CENTRAL_HEADER_LEN + nameLen +
+			le16(c + 30) + le16(c + 32);
+		if (dirOffset + dirSize - pos < headerLen) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: truncated central directory");
+		}
+
+		Entry ent;
+		ent.name.assign((const char *)c + ZIP_CENTRAL_HEADER_LEN, nameLen);
+		ent.method = le16(c + 10);
+		ent.crc = le32(c + 16);
+		ent.compressedSize = le32(c + 20);
+		ent.size = le32(c + 24);
+		size_t local = le32(c + 42);
+
+		if (le16(c + 8) & ZIP_FLAG_ENCRYPTED) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: '%s' is encrypted", ent.name.c_str());
+		}
+		if (ent.method != ZIP_METHOD_STORED && ent.method != ZIP_METHOD_DEFLATED) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: '%s' uses unsupported compression %d",
+					ent.name.c_str(), ent.method);
+		}
+		if (ent.method == ZIP_METHOD_STORED && ent.compressedSize != ent.size) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: bad size of '%s'", ent.name.c_str());
+		}
+		if (!names.insert(ent.name).second) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: '%s' appears more than once", ent.name.c_str());
+		}
+
+		// The local header must agree with the central directory
+		if (local > dirOffset || dirOffset - local < ZIP_LOCAL_HEADER_LEN) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: bad offset of '%s'", ent.name.c_str());
+		}
+		const unsigned char *l = _data + local;
+		size_t localNameLen = le16(l + 26);
+		size_t dataOffset = local + ZIP_LOCAL_HEADER_LEN +
+			localNameLen + le16(l + 28);
+		if (le32(l) != ZIP_LOCAL_HEADER_SIG || localNameLen != nameLen ||
+				dataOffset > dirOffset ||
+				memcmp(l + ZIP_LOCAL_HEADER_LEN, ent.name.data(), nameLen) != 0) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: bad local header of '%s'", ent.name.c_str());
+		}
+		if (ent.compressedSize > dirOffset - dataOffset) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: truncated '%s'", ent.name.c_str());
+		}
+		ent.offset = dataOffset;
+
+		// Stored members are handed out in place, so they are checked
+		// once here
+		if (ent.method == ZIP_METHOD_STORED &&
+				crc32(crc32(0L, Z_NULL, 0), _data + dataOffset, ent.size) != ent.crc) {
+			THROW_STACK_EXCEPTION("Invalid zipfile: bad CRC of '%s'", ent.name.c_str());
+		}
+
+		_entries.push_back(ent);
+		pos += headerLen;
+	}
+}
+
+size_t bdoc::ZipContainer::count() const
+{
+	return _entries.size();
+}
+
+const bdoc::ZipContainer::Entry& bdoc::ZipContainer::entry(size_t i) const
+{
+	if (i >= _entries.size()) {
+		THROW_STACK_EXCEPTION("No zip entry %lu", (unsigned long)i);
+	}
+	return _entries[i];
+}
+
+int bdoc::ZipContainer::find(const std::string& name) const
+{
+	for (size_t i = 0; i < _entries.size(); i++) {
+		if (_entries[i].name == name) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const unsigned char* bdoc::ZipContainer::view(size_t i) const
+{
+	const Entry& ent = entry(i);
+	if (ent.method != ZIP_METHOD_STORED) {
+		return NULL;
+	}
+	return _data + ent.offset;
+}
+
+std::string bdoc::ZipContainer::read(size_t i) const
+{
+	std::string ret;
+	inflate(i, NULL, &ret);
+	return ret;
+}
+
+void bdoc::ZipContainer::digest(size_t i, Digest& calc) const
+{
+	inflate(i, &calc, NULL);
+}
+
+void bdoc::ZipContainer::inflate(size_t i, Digest *calc, std::string *out) const
+{
+	const Entry& ent = entry(i);
+	const unsigned char *src = _data + ent.offset;
+	uLong crc = crc32(0L, Z_NULL, 0);
+
+	// The CRC of a stored member was checked by parse()
+	if (ent.method == ZIP_METHOD_STORED) {
+		if (calc != NULL) {
+			calc->update(src, ent.size);
+		}
+		if (out != NULL) {
+			out->assign((const char *)src, ent.size);
+		}
+		return;
+	}
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	// Raw deflate data, no zlib header
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		THROW_STACK_EXCEPTION("Failed to inflate '%s'", ent.name.c_str());
+	}
+	zs.next_in = const_cast<Bytef *>(src);
+	zs.avail_in = ent.compressedSize;
+
+	if (out != NULL) {
+		out->clear();
+		out->reserve(ent.size);
+	}
+
+	unsigned char buf[ZIP_INFLATE_CHUNK];
+	size_t total = 0;
+	int ret = Z_OK;
+	while (ret != Z_STREAM_END) {
+		zs.next_out = buf;
+		zs.avail_out = sizeof(buf);
+		ret = ::inflate(&zs, Z_NO_FLUSH);
+		size_t n = sizeof(buf) - zs.avail_out;
+
+		if ((ret != Z_OK && ret != Z_STREAM_END) ||
+				(ret == Z_OK && n == 0) || n > ent.size - total) {
+			inflateEnd(&zs);
+			THROW_STACK_EXCEPTION("Invalid zipfile: failed to inflate '%s'", ent.name.c_str());
+		}
+
+		crc = crc32(crc, buf, n);
+		total += n;
+		try {
+			if (calc != NULL) {
+				calc->update(buf, n);
+			}
+			if (out != NULL) {
+				out->append((const char *)buf, n);
+			}
+		}
+		catch (...) {
+			inflateEnd(&zs);
+			throw;
+		}
+	}
+	inflateEnd(&zs);
+
+	if (total != ent.size || crc != ent.crc) {
+		THROW_STACK_EXCEPTION("Invalid zipfile: bad CRC of '%s'", ent.name.c_str());
+	}
+}
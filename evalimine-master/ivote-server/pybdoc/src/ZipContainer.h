@@ -0,0 +1,83 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace bdoc {
+
+class Digest;
+
+/*
+ * Read-only view of a BDoc ZIP container. A file is mmapped, a memory
+ * buffer is borrowed and must outlive the container. Only the central
+ * directory is parsed up front: stored members are used in place and
+ * their CRC is checked then, deflated ones are inflated on demand, into
+ * a digest without keeping the data when only the hash is needed.
+ * */
+class ZipContainer {
+
+	public:
+
+		struct Entry {
+			std::string name;
+			uint16_t method;
+			uint32_t crc;
+			size_t compressedSize;
+			size_t size;
+			// Offset of the member data in the container
+			size_t offset;
+		};
+
+		ZipContainer();
+		~ZipContainer();
+
+		void open(const char *path);
+		void borrow(const unsigned char *buf, size_t len);
+		void close();
+
+		size_t count() const;
+		const Entry& entry(size_t i) const;
+
+		// Index of the member or -1
+		int find(const std::string& name) const;
+
+		// Data of a stored member in place, CRC checked, NULL if it is
+		// compressed
+		const unsigned char* view(size_t i) const;
+
+		// Uncompressed data of the member, CRC checked
+		std::string read(size_t i) const;
+
+		// Feeds the uncompressed data of the member to the digest,
+		// CRC checked
+		void digest(size_t i, Digest& calc) const;
+
+	private:
+
+		ZipContainer(const ZipContainer&);
+		ZipContainer& operator=(const ZipContainer&);
+
+		void parse();
+		void inflate(size_t i, Digest *calc, std::string *out) const;
+
+		const unsigned char *_data;
+		size_t _len;
+		bool _mapped;
+		std::vector<Entry> _entries;
+};
+
+}
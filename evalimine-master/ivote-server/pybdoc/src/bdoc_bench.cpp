@@ -0,0 +1,451 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+/*
+ * Throughput and latency of the verifications of a vote: BES offline,
+ * BES online with the TM signature assembled (getTMSignature() against
+ * a stub OCSP responder), TM offline of the signatures assembled and
+ * the Mobile-ID challenge, on 1..N threads. Besides the latency of a
+ * call, the stages timed by the library (set_timings()) are reported
+ * for each run.
+ *
+ * Caches of the library (grammars, verified chains, OCSP responses,
+ * connections, keys) live through the whole process, so a run sees
+ * the caches the runs before it filled, as a long running server does.
+ * */
+
+#include "PyBDoc.h"
+#include "BenchCorpus.h"
+#include "BenchOCSPResponder.h"
+#include "StackException.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <sstream>
+
+#define BENCH_VOTES 1000
+#define BENCH_SIGNERS 16
+#define BENCH_SCHEMA_DIR "../etc/schema"
+#define BENCH_DIGEST_URI "http://www.w3.org/2001/04/xmlenc#sha256"
+#define BENCH_OCSP_SKEW 300
+#define BENCH_OCSP_MAX_AGE 300
+
+enum Operation {
+	OP_BES_OFFLINE = 0,
+	OP_BES_ONLINE,
+	OP_TM_OFFLINE,
+	OP_CHALLENGE,
+	OPERATIONS
+};
+
+static const char *operationNames[OPERATIONS] = {
+	"verifyBESOffline",
+	"getTMSignature",
+	"verifyTMOffline",
+	"isChallengeOk"
+};
+
+/*
+ * One operation on a number of threads. The threads take the next item
+ * of the corpus until rounds times the corpus is done.
+ * */
+struct Run {
+	Operation op;
+	const bdoc::BenchCorpus *corpus;
+	VerifierConfig *config;
+	// TM signatures by BES online, by the index of the signature
+	std::vector<std::string> *tm;
+
+	size_t items;
+	size_t total;
+	size_t next;
+	pthread_mutex_t mutex;
+};
+
+struct Worker {
+	Run *run;
+	pthread_t thread;
+	std::vector<double> latencies;
+	unsigned long errors;
+	std::string error;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool verifySignature(Run *run, size_t k, std::string& error)
+{
+	size_t i = k % run->items;
+	const bdoc::BenchCorpus::SignatureFile& s = run->corpus->signatures[i];
+	const std::string *xml = &s.xml;
+	if (run->op == OP_TM_OFFLINE) {
+		xml = &(*run->tm)[i];
+		if (xml->empty()) {
+			error = s.name + ": no TM signature";
+			return false;
+		}
+	}
+
+	// A verifier per container, on the shared configuration
+	BDocVerifier verifier(*run->config);
+	for (size_t j = 0; j < s.documents.size(); j++) {
+		const bdoc::BenchCorpus::Document& d = s.documents[j];
+		verifier.borrowDocument((const unsigned char *)d.data.data(),
+				d.data.size(), d.uri.c_str());
+	}
+
+	BDocVerifierResult res;
+	switch (run->op) {
+		case OP_BES_OFFLINE:
+			res = verifier.verifyBESOffline(xml->data(), xml->size());
+			break;
+		case OP_BES_ONLINE:
+			res = verifier.verifyBESOnline(xml->data(), xml->size());
+			break;
+		default:
+			res = verifier.verifyTMOffline(xml->data(), xml->size());
+			break;
+	}
+
+	if (!res.result) {
+		error = s.name + ": " + res.error;
+		return false;
+	}
+	// The first round keeps the TM signatures, each of its items is
+	// done by one thread only
+	if (run->op == OP_BES_ONLINE && k < run->items) {
+		(*run->tm)[i] = res.signature;
+	}
+	return true;
+}
+
+static bool verifyChallenge(Run *run, ChallengeVerifier& cv, size_t i,
+		std::string& error)
+{
+	const bdoc::BenchCorpus::Challenge& c = run->corpus->challenges[i];
+	cv.setCertificate((const unsigned char *)c.certificate.data(),
+			c.certificate.size());
+	cv.setChallenge((const unsigned char *)c.challenge.data(),
+			c.challenge.size());
+	cv.setSignature((const unsigned char *)c.signature.data(),
+			c.signature.size());
+	if (!cv.isChallengeOk()) {
+		error = cv.error;
+		return false;
+	}
+	return true;
+}
+
+static void* workerMain(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	Run *run = w->run;
+	ChallengeVerifier cv;
+
+	while (true) {
+		pthread_mutex_lock(&run->mutex);
+		size_t k = run->next;
+		if (k < run->total) {
+			run->next++;
+		}
+		pthread_mutex_unlock(&run->mutex);
+		if (k >= run->total) {
+			break;
+		}
+
+		std::string error;
+		bool ok = false;
+
+		double start = now();
+		try {
+			if (run->op == OP_CHALLENGE) {
+				ok = verifyChallenge(run, cv, k % run->items,
+						error);
+			}
+			else {
+				ok = verifySignature(run, k, error);
+			}
+		}
+		catch (bdoc::StackExceptionBase& e) {
+			error = e.what();
+		}
+		catch (std::exception& e) {
+			error = e.what();
+		}
+		w->latencies.push_back(now() - start);
+
+		if (!ok) {
+			if (w->errors == 0) {
+				w->error = error;
+			}
+			w->errors++;
+		}
+	}
+	return NULL;
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+static void runOperation(Operation op, int threads, int rounds,
+		const bdoc::BenchCorpus& corpus, VerifierConfig& config,
+		std::vector<std::string>& tm)
+{
+	Run run;
+	run.op = op;
+	run.corpus = &corpus;
+	run.config = &config;
+	run.tm = &tm;
+	run.items = op == OP_CHALLENGE ?
+		corpus.challenges.size() : corpus.signatures.size();
+	run.total = run.items * rounds;
+	run.next = 0;
+	pthread_mutex_init(&run.mutex, NULL);
+
+	if (run.items == 0) {
+		pthread_mutex_destroy(&run.mutex);
+		return;
+	}
+
+	std::vector<Worker> workers(threads);
+	reset_timings();
+	double start = now();
+	int started = 0;
+	for (int t = 0; t < threads; t++) {
+		workers[t].run = &run;
+		workers[t].errors = 0;
+		if (pthread_create(&workers[t].thread, NULL, workerMain,
+					&workers[t]) != 0) {
+			fprintf(stderr, "pthread_create() failed\n");
+			break;
+		}
+		started++;
+	}
+	for (int t = 0; t < started; t++) {
+		pthread_join(workers[t].thread, NULL);
+	}
+	double elapsed = now() - start;
+
+	std::vector<double> all;
+	unsigned long errors = 0;
+	for (int t = 0; t < started; t++) {
+		all.insert(all.end(), workers[t].latencies.begin(),
+				workers[t].latencies.end());
+		if (workers[t].errors > 0 && errors == 0) {
+			fprintf(stderr, "%s: %s\n", operationNames[op],
+					workers[t].error.c_str());
+		}
+		errors += workers[t].errors;
+	}
+	std::sort(all.begin(), all.end());
+
+	printf("%-18s %7d %10.1f %10.3f %10.3f %8lu\n",
+		operationNames[op], threads,
+		elapsed > 0 ? all.size() / elapsed : 0,
+		percentile(all, 0.50) * 1000, percentile(all, 0.99) * 1000,
+		errors);
+
+	std::vector<TimingSummary> stages = timing_summaries();
+	for (size_t k = 0; k < stages.size(); k++) {
+		if (stages[k].count == 0) {
+			continue;
+		}
+		printf("  %-16s %7lu %10s %10.3f %10.3f\n",
+			stages[k].stage.c_str(), stages[k].count, "",
+			stages[k].p50 * 1000, stages[k].p99 * 1000);
+	}
+	fflush(stdout);
+
+	pthread_mutex_destroy(&run.mutex);
+}
+
+static bool parseThreads(const char *arg, std::vector<int>& out)
+{
+	std::istringstream in(arg);
+	std::string item;
+	out.clear();
+	while (std::getline(in, item, ',')) {
+		int n = atoi(item.c_str());
+		if (n < 1) {
+			return false;
+		}
+		out.push_back(n);
+	}
+	return !out.empty();
+}
+
+static void usage(const char *self)
+{
+	printf("Usage:\n");
+	printf("    %s --generate [--votes N] [--signers N] [--schema DIR] "
+		"<corpus>\n", self);
+	printf("    %s [--threads N,N...] [--rounds N] [--ocsp-latency MS] "
+		"[--digest URI] [--splice] [--schema DIR] <corpus>\n", self);
+	printf("\n    --generate      write a corpus of %d votes of %d "
+		"voters by default\n", BENCH_VOTES, BENCH_SIGNERS);
+	printf("    --threads       numbers of threads to run on, "
+		"default 1,2,4,8\n");
+	printf("    --rounds        times every item of the corpus is "
+		"done in a run, default 1\n");
+	printf("    --ocsp-latency  milliseconds the stub OCSP responder "
+		"waits before answering\n");
+	printf("    --digest        digest of the nonce and of the OCSP "
+		"response, default\n                    %s\n",
+		BENCH_DIGEST_URI);
+	printf("    --splice        assemble TM signatures by splicing the "
+		"XML\n");
+	printf("    --schema        schema directory, default %s\n",
+		BENCH_SCHEMA_DIR);
+}
+
+int main(int argc, char **argv)
+{
+	bool generate = false;
+	int votes = BENCH_VOTES;
+	int signers = BENCH_SIGNERS;
+	int rounds = 1;
+	int latency = 0;
+	bool splice = false;
+	std::string schema = BENCH_SCHEMA_DIR;
+	std::string digest = BENCH_DIGEST_URI;
+	std::vector<int> threads;
+	parseThreads("1,2,4,8", threads);
+
+	static struct option options[] = {
+		{ "generate", no_argument, NULL, 'g' },
+		{ "votes", required_argument, NULL, 'v' },
+		{ "signers", required_argument, NULL, 'n' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "rounds", required_argument, NULL, 'r' },
+		{ "ocsp-latency", required_argument, NULL, 'l' },
+		{ "digest", required_argument, NULL, 'd' },
+		{ "splice", no_argument, NULL, 'p' },
+		{ "schema", required_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (c) {
+			case 'g': generate = true; break;
+			case 'v': votes = atoi(optarg); break;
+			case 'n': signers = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'l': latency = atoi(optarg); break;
+			case 'd': digest = optarg; break;
+			case 'p': splice = true; break;
+			case 's': schema = optarg; break;
+			case 't':
+				if (!parseThreads(optarg, threads)) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1 || votes < 1 || signers < 1 || rounds < 1 ||
+			latency < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	std::string dir = argv[optind];
+
+	initialize();
+	int ret = 0;
+	try {
+		if (generate) {
+			bdoc::BenchCorpus::generate(dir, schema, votes, signers);
+			printf("Corpus of %d votes written to %s\n", votes,
+					dir.c_str());
+			terminate();
+			return 0;
+		}
+
+		bdoc::BenchCorpus corpus;
+		corpus.load(dir);
+		if (corpus.responders.empty()) {
+			fprintf(stderr, "%s: no OCSP responder\n", dir.c_str());
+			terminate();
+			return 1;
+		}
+
+		// One stub answers for every issuer, with the key of the
+		// first responder, the others trust it as their own
+		const bdoc::BenchCorpus::Responder& r = corpus.responders[0];
+		bdoc::BenchOCSPResponder responder(r.cert, r.key, latency);
+		responder.start();
+
+		VerifierConfig config;
+		config.setSchemaDir(schema.c_str());
+		for (size_t i = 0; i < corpus.certs.size(); i++) {
+			config.addCertToStore(corpus.certs[i].c_str());
+		}
+		for (size_t i = 0; i < corpus.responders.size(); i++) {
+			config.addOCSPConf(corpus.responders[i].issuer.c_str(),
+					responder.url().c_str(), r.cert.c_str(),
+					BENCH_OCSP_SKEW, BENCH_OCSP_MAX_AGE);
+		}
+		config.setDigestURI(digest.c_str());
+		config.setTMSplicing(splice);
+		config.freeze();
+
+		set_backtraces(false);
+		set_timings(true);
+
+		printf("%lu signatures, %lu challenges, OCSP responder %s\n\n",
+			(unsigned long)corpus.signatures.size(),
+			(unsigned long)corpus.challenges.size(),
+			responder.url().c_str());
+		printf("%-18s %7s %10s %10s %10s %8s\n", "operation",
+			"threads", "ops/s", "p50 ms", "p99 ms", "errors");
+
+		std::vector<std::string> tm(corpus.signatures.size());
+		for (int op = 0; op < OPERATIONS; op++) {
+			for (size_t t = 0; t < threads.size(); t++) {
+				runOperation((Operation)op, threads[t], rounds,
+						corpus, config, tm);
+			}
+		}
+
+		printf("\n%lu OCSP requests answered\n", responder.requests());
+		responder.stop();
+	}
+	catch (bdoc::StackExceptionBase& e) {
+		fprintf(stderr, "%s\n", e.what());
+		ret = 1;
+	}
+	catch (std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		ret = 1;
+	}
+	terminate();
+	return ret;
+}
@@ -52,147 +52,27 @@ bool bdoc::Digest::isSupported(const std::string& methodUri)
 	return false;
 }
 
-void bdoc::Digest::update(std::vector<unsigned char> data)
+std::string bdoc::Digest::toUri(int method)
 {
-	update(&data[0], data.size());
-}
-
-///
-
-bdoc::SHA1Digest::SHA1Digest()
-{
-	if (SHA1_Init(&ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to initialize SHA1 digest calculator: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-}
-
-void bdoc::SHA1Digest::update(const unsigned char* data, unsigned long length)
-{
-	if (data == NULL) {
-		THROW_STACK_EXCEPTION("Can not update digest value from NULL pointer.");
-	}
-
-	if (!digest.empty()) {
-		THROW_STACK_EXCEPTION("Digest is already finalized, can not update it.");
-	}
-
-	if (SHA1_Update(&ctx, static_cast<const void*>(data), length) != 1) {
-		THROW_STACK_EXCEPTION("Failed to update SHA1 digest value: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-}
-
-std::vector<unsigned char> bdoc::SHA1Digest::getDigest()
-{
-	if (!digest.empty()) {
-		return digest;
-	}
-
-	unsigned char buf[SHA_DIGEST_LENGTH];
-	if (SHA1_Final(buf, &ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to create SHA1 digest: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-
-	for (unsigned int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-		digest.push_back(buf[i]);
-	}
-
-	return digest;
-}
-
-///
-
-bdoc::SHA224Digest::SHA224Digest()
-{
-	if (SHA224_Init(&ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to initialize SHA224 digest calculator: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-}
-
-void bdoc::SHA224Digest::update(const unsigned char* data, unsigned long length)
-{
-	if (data == NULL) {
-		THROW_STACK_EXCEPTION("Can not update digest value from NULL pointer.");
-	}
-
-	if (!digest.empty()) {
-		THROW_STACK_EXCEPTION("Digest is already finalized, can not update it.");
-	}
-
-	if (SHA224_Update(&ctx, static_cast<const void*>(data), length) != 1) {
-		THROW_STACK_EXCEPTION("Failed to update SHA224 digest value: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-}
-
-std::vector<unsigned char> bdoc::SHA224Digest::getDigest()
-{
-	if (!digest.empty()) {
-		return digest;
-	}
-
-	unsigned char buf[SHA224_DIGEST_LENGTH];
-	if (SHA224_Final(buf, &ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to create SHA224 digest: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-
-	for (unsigned int i = 0; i < SHA224_DIGEST_LENGTH; i++) {
-		digest.push_back(buf[i]);
-	}
-
-	return digest;
-}
-
-///
-
-bdoc::SHA256Digest::SHA256Digest()
-{
-	if (SHA256_Init(&ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to initialize SHA256 digest calculator: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-}
-
-void bdoc::SHA256Digest::update(const unsigned char* data, unsigned long length)
-{
-	if (data == NULL) {
-		THROW_STACK_EXCEPTION("Can not update digest value from NULL pointer.");
-	}
-
-	if (!digest.empty()) {
-		THROW_STACK_EXCEPTION("Digest is already finalized, can not update it.");
-	}
-
-	if (SHA256_Update(&ctx, static_cast<const void*>(data), length) != 1) {
-		THROW_STACK_EXCEPTION("Failed to update SHA256 digest value: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-}
-
-std::vector<unsigned char> bdoc::SHA256Digest::getDigest()
-{
-	if (!digest.empty()) {
-		return digest;
-	}
-
-	unsigned char buf[SHA256_DIGEST_LENGTH];
-	if (SHA256_Final(buf, &ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to create SHA256 digest: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-
-	for (unsigned int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-		digest.push_back(buf[i]);
+	switch(method) {
+	case NID_sha1: return URI_SHA1;
+	case NID_sha224: return URI_SHA224;
+	case NID_sha256: return URI_SHA256;
+	case NID_sha384: return URI_SHA384;
+	case NID_sha512: return URI_SHA512;
 	}
-
-	return digest;
+	return "";
 }
 
-///
-
-bdoc::SHA384Digest::SHA384Digest()
+void bdoc::Digest::update(const std::vector<unsigned char>& data)
 {
-	if (SHA384_Init(&ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to initialize SHA384 digest calculator: %s", ERR_reason_error_string(ERR_get_error()));
+	if (data.empty()) {
+		return;
 	}
+	update(&data[0], data.size());
 }
 
-void bdoc::SHA384Digest::update(const unsigned char* data, unsigned long length)
+void bdoc::Digest::checkUpdate(const unsigned char* data) const
 {
 	if (data == NULL) {
 		THROW_STACK_EXCEPTION("Can not update digest value from NULL pointer.");
@@ -201,69 +81,34 @@ void bdoc::SHA384Digest::update(const unsigned char* data, unsigned long length)
 	if (!digest.empty()) {
 		THROW_STACK_EXCEPTION("Digest is already finalized, can not update it.");
 	}
-
-	if (SHA384_Update(&ctx, static_cast<const void*>(data), length) != 1) {
-		THROW_STACK_EXCEPTION("Failed to update SHA384 digest value: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-}
-
-std::vector<unsigned char> bdoc::SHA384Digest::getDigest()
-{
-	if (!digest.empty()) {
-		return digest;
-	}
-
-	unsigned char buf[SHA384_DIGEST_LENGTH];
-	if (SHA384_Final(buf, &ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to create SHA384 digest: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-
-	for (unsigned int i = 0; i < SHA384_DIGEST_LENGTH; i++) {
-		digest.push_back(buf[i]);
-	}
-
-	return digest;
 }
 
-///
-
-bdoc::SHA512Digest::SHA512Digest()
+template <int NID>
+static void hashManyInto(const bdoc::DigestInput *in, size_t count,
+		std::vector<std::vector<unsigned char> >& out)
 {
-	if (SHA512_Init(&ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to initialize SHA512 digest calculator: %s", ERR_reason_error_string(ERR_get_error()));
+	typedef typename bdoc::DigestEngine<NID>::Value Value;
+	std::vector<Value> values(count);
+	if (count > 0) {
+		bdoc::DigestEngine<NID>::hashMany(in, count, &values[0]);
 	}
-}
 
-void bdoc::SHA512Digest::update(const unsigned char* data, unsigned long length)
-{
-	if (data == NULL) {
-		THROW_STACK_EXCEPTION("Can not update digest value from NULL pointer.");
-	}
-
-	if (!digest.empty()) {
-		THROW_STACK_EXCEPTION("Digest is already finalized, can not update it.");
-	}
-
-	if (SHA512_Update(&ctx, static_cast<const void*>(data), length) != 1) {
-		THROW_STACK_EXCEPTION("Failed to update SHA512 digest value: %s", ERR_reason_error_string(ERR_get_error()));
+	out.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		out[i].assign(values[i].data, values[i].data + sizeof(values[i].data));
 	}
 }
 
-std::vector<unsigned char> bdoc::SHA512Digest::getDigest()
+void bdoc::Digest::hashMany(int method, const DigestInput *in, size_t count,
+		std::vector<std::vector<unsigned char> >& out)
 {
-	if (!digest.empty()) {
-		return digest;
-	}
-
-	unsigned char buf[SHA512_DIGEST_LENGTH];
-	if (SHA512_Final(buf, &ctx) != 1) {
-		THROW_STACK_EXCEPTION("Failed to create SHA512 digest: %s", ERR_reason_error_string(ERR_get_error()));
-	}
-
-	for (unsigned int i = 0; i < SHA512_DIGEST_LENGTH; i++) {
-		digest.push_back(buf[i]);
+	switch(method) {
+	default:
+		THROW_STACK_EXCEPTION("Digest method '%s' is not supported.", OBJ_nid2sn(method));
+	case NID_sha1: hashManyInto<NID_sha1>(in, count, out); break;
+	case NID_sha224: hashManyInto<NID_sha224>(in, count, out); break;
+	case NID_sha256: hashManyInto<NID_sha256>(in, count, out); break;
+	case NID_sha384: hashManyInto<NID_sha384>(in, count, out); break;
+	case NID_sha512: hashManyInto<NID_sha512>(in, count, out); break;
 	}
-
-	return digest;
 }
-
@@ -15,8 +15,12 @@
 
 #include <openssl/objects.h>
 #include <memory>
+#include <string>
+#include <vector>
 #include <openssl/sha.h>
 
+#include "DigestEngine.h"
+
 #define URI_SHA1 "http://www.w3.org/2000/09/xmldsig#sha1"
 #define URI_SHA224 "http://www.w3.org/2001/04/xmldsig-more#sha224"
 #define URI_SHA256 "http://www.w3.org/2001/04/xmlenc#sha256"
@@ -33,7 +37,7 @@ namespace bdoc
 		virtual void update(const unsigned char* data,
 					unsigned long length) = 0;
 
-		void update(std::vector<unsigned char> data);
+		void update(const std::vector<unsigned char>& data);
 
 		virtual std::vector<unsigned char> getDigest() = 0;
 
@@ -44,131 +48,65 @@ namespace bdoc
 		static std::auto_ptr<Digest> create(int method);
 		static std::auto_ptr<Digest> create(const std::string& methodUri);
 		static int toMethod(const std::string& methodUri);
+		static std::string toUri(int method);
 		static bool isSupported(const std::string& methodUri);
 
+		// Digests of several inputs with one algorithm, for the
+		// small ones hashed together (nonces, OCSP responses)
+		static void hashMany(int method, const DigestInput *in,
+				size_t count,
+				std::vector<std::vector<unsigned char> >& out);
+
 	protected:
 		Digest() {}
+		void checkUpdate(const unsigned char* data) const;
 		std::vector<unsigned char> digest;
 	};
 
-	class SHA1Digest : public Digest {
+	/*
+	 * Digest on the compile-time DigestEngine, for algorithms chosen
+	 * by URI at run time.
+	 * */
+	template <int NID> class EVPDigest : public Digest {
 
 	public:
-		SHA1Digest();
-		virtual ~SHA1Digest() {}
-		void update(const unsigned char* data, unsigned long length);
-		std::vector<unsigned char> getDigest();
-
-		virtual unsigned int getSize() const {
-			return SHA_DIGEST_LENGTH;
-		}
+		EVPDigest() : engine() {}
+		virtual ~EVPDigest() {}
 
-		virtual int getMethod() const {
-			return NID_sha1;
+		void update(const unsigned char* data, unsigned long length) {
+			checkUpdate(data);
+			engine.update(data, length);
 		}
 
-		virtual std::string getUri() const {
-			return URI_SHA1;
+		std::vector<unsigned char> getDigest() {
+			if (digest.empty()) {
+				unsigned char buf[DigestEngine<NID>::SIZE];
+				engine.final(buf);
+				digest.assign(buf, buf + sizeof(buf));
+			}
+			return digest;
 		}
 
-	private:
-		SHA_CTX ctx;
-	};
-
-	class SHA224Digest : public Digest {
-
-	public:
-		SHA224Digest();
-		virtual ~SHA224Digest() {}
-		void update(const unsigned char* data, unsigned long length);
-		std::vector<unsigned char> getDigest();
-
 		virtual unsigned int getSize() const {
-			return SHA224_DIGEST_LENGTH;
+			return DigestEngine<NID>::SIZE;
 		}
 
 		virtual int getMethod() const {
-			return NID_sha224;
+			return NID;
 		}
 
 		virtual std::string getUri() const {
-			return URI_SHA224;
+			return toUri(NID);
 		}
 
 	private:
-		SHA256_CTX ctx;
+		DigestEngine<NID> engine;
 	};
 
-	class SHA256Digest : public Digest {
-
-	public:
-		SHA256Digest();
-		virtual ~SHA256Digest() {}
-		void update(const unsigned char* data, unsigned long length);
-		std::vector<unsigned char> getDigest();
-
-		virtual unsigned int getSize() const {
-			return SHA256_DIGEST_LENGTH;
-		}
-
-		virtual int getMethod() const {
-			return NID_sha256;
-		}
-
-		virtual std::string getUri() const {
-			return URI_SHA256;
-		}
-
-	private:
-		SHA256_CTX ctx;
-	};
-
-	class SHA384Digest : public Digest {
-
-	public:
-		SHA384Digest();
-		virtual ~SHA384Digest() {}
-		void update(const unsigned char* data, unsigned long length);
-		std::vector<unsigned char> getDigest();
-
-		virtual unsigned int getSize() const {
-			return SHA384_DIGEST_LENGTH;
-		}
-
-		virtual int getMethod() const {
-			return NID_sha384;
-		}
-
-		virtual std::string getUri() const {
-			return URI_SHA384;
-		}
-
-	private:
-		SHA512_CTX ctx;
-	};
-
-	class SHA512Digest : public Digest {
-
-	public:
-		SHA512Digest();
-		virtual ~SHA512Digest() {}
-		void update(const unsigned char* data, unsigned long length);
-		std::vector<unsigned char> getDigest();
-
-		virtual unsigned int getSize() const {
-			return SHA512_DIGEST_LENGTH;
-		}
-
-		virtual int getMethod() const {
-			return NID_sha512;
-		}
-
-		virtual std::string getUri() const {
-			return URI_SHA512;
-		}
-
-	private:
-		SHA512_CTX ctx;
-	};
+	typedef EVPDigest<NID_sha1> SHA1Digest;
+	typedef EVPDigest<NID_sha224> SHA224Digest;
+	typedef EVPDigest<NID_sha256> SHA256Digest;
+	typedef EVPDigest<NID_sha384> SHA384Digest;
+	typedef EVPDigest<NID_sha512> SHA512Digest;
 }
 
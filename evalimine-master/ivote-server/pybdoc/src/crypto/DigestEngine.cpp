@@ -0,0 +1,84 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include <openssl/err.h>
+#include "../StackException.h"
+#include "DigestEngine.h"
+
+EVP_MD_CTX* bdoc::evp::createContext(const EVP_MD *md)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+	if (ctx == NULL || EVP_DigestInit_ex(ctx, md, NULL) != 1) {
+		destroyContext(ctx);
+		THROW_STACK_EXCEPTION("Failed to initialize %s digest calculator: %s", OBJ_nid2sn(EVP_MD_type(md)), ERR_reason_error_string(ERR_get_error()));
+	}
+	return ctx;
+}
+
+void bdoc::evp::destroyContext(EVP_MD_CTX *ctx)
+{
+	if (ctx != NULL) {
+		EVP_MD_CTX_destroy(ctx);
+	}
+}
+
+void bdoc::evp::update(EVP_MD_CTX *ctx, const unsigned char *data, size_t len)
+{
+	if (data == NULL && len > 0) {
+		THROW_STACK_EXCEPTION("Can not update digest value from NULL pointer.");
+	}
+
+	if (EVP_DigestUpdate(ctx, data, len) != 1) {
+		THROW_STACK_EXCEPTION("Failed to update digest value: %s", ERR_reason_error_string(ERR_get_error()));
+	}
+}
+
+void bdoc::evp::final(EVP_MD_CTX *ctx, const EVP_MD *md, unsigned char *out)
+{
+	if (EVP_DigestFinal_ex(ctx, out, NULL) != 1 ||
+			EVP_DigestInit_ex(ctx, md, NULL) != 1) {
+		THROW_STACK_EXCEPTION("Failed to create %s digest: %s", OBJ_nid2sn(EVP_MD_type(md)), ERR_reason_error_string(ERR_get_error()));
+	}
+}
+
+void bdoc::evp::hash(const EVP_MD *md, const unsigned char *data,
+		size_t len, unsigned char *out)
+{
+	if (data == NULL && len > 0) {
+		THROW_STACK_EXCEPTION("Can not update digest value from NULL pointer.");
+	}
+
+	if (EVP_Digest(data, len, out, NULL, md, NULL) != 1) {
+		THROW_STACK_EXCEPTION("Failed to create %s digest: %s", OBJ_nid2sn(EVP_MD_type(md)), ERR_reason_error_string(ERR_get_error()));
+	}
+}
+
+void bdoc::evp::hashMany(const EVP_MD *md, const DigestInput *in,
+		size_t count, unsigned char *out, size_t size)
+{
+	if (count == 0) {
+		return;
+	}
+
+	// One context for all of them, only its state is reset in between
+	EVP_MD_CTX *ctx = createContext(md);
+	try {
+		for (size_t i = 0; i < count; i++) {
+			update(ctx, in[i].data, in[i].len);
+			final(ctx, md, out + i * size);
+		}
+	}
+	catch (...) {
+		destroyContext(ctx);
+		throw;
+	}
+	destroyContext(ctx);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/sha.h>
+
+#include <stddef.h>
+
+namespace bdoc
+{
+	// One input of a multi-buffer hash
+	struct DigestInput {
+		const unsigned char *data;
+		size_t len;
+	};
+
+	/*
+	 * Non-template part of DigestEngine, on EVP so that OpenSSL picks
+	 * the fastest implementation of the CPU.
+	 * */
+	namespace evp
+	{
+		EVP_MD_CTX* createContext(const EVP_MD *md);
+		void destroyContext(EVP_MD_CTX *ctx);
+		void update(EVP_MD_CTX *ctx, const unsigned char *data, size_t len);
+		// Finalizes into out and starts over with the same algorithm
+		void final(EVP_MD_CTX *ctx, const EVP_MD *md, unsigned char *out);
+
+		void hash(const EVP_MD *md, const unsigned char *data,
+				size_t len, unsigned char *out);
+		// out holds count digests of size bytes back to back
+		void hashMany(const EVP_MD *md, const DigestInput *in,
+				size_t count, unsigned char *out, size_t size);
+	}
+
+	template <int NID> struct DigestTraits;
+
+	template <> struct DigestTraits<NID_sha1> {
+		enum { SIZE = SHA_DIGEST_LENGTH };
+		static const EVP_MD* md() { return EVP_sha1(); }
+	};
+
+	template <> struct DigestTraits<NID_sha224> {
+		enum { SIZE = SHA224_DIGEST_LENGTH };
+		static const EVP_MD* md() { return EVP_sha224(); }
+	};
+
+	template <> struct DigestTraits<NID_sha256> {
+		enum { SIZE = SHA256_DIGEST_LENGTH };
+		static const EVP_MD* md() { return EVP_sha256(); }
+	};
+
+	template <> struct DigestTraits<NID_sha384> {
+		enum { SIZE = SHA384_DIGEST_LENGTH };
+		static const EVP_MD* md() { return EVP_sha384(); }
+	};
+
+	template <> struct DigestTraits<NID_sha512> {
+		enum { SIZE = SHA512_DIGEST_LENGTH };
+		static const EVP_MD* md() { return EVP_sha512(); }
+	};
+
+	/*
+	 * Digest with the algorithm fixed at compile time, results go to
+	 * fixed-size arrays. An engine is reused after final(), hash() and
+	 * hashMany() need none.
+	 * */
+	template <int NID> class DigestEngine {
+
+	public:
+		enum { SIZE = DigestTraits<NID>::SIZE };
+
+		struct Value {
+			unsigned char data[SIZE];
+		};
+
+		DigestEngine() : ctx(evp::createContext(DigestTraits<NID>::md())) {}
+		~DigestEngine() { evp::destroyContext(ctx); }
+
+		void update(const unsigned char *data, size_t len) {
+			evp::update(ctx, data, len);
+		}
+
+		void final(unsigned char out[SIZE]) {
+			evp::final(ctx, DigestTraits<NID>::md(), out);
+		}
+
+		static void hash(const unsigned char *data, size_t len,
+				unsigned char out[SIZE]) {
+			evp::hash(DigestTraits<NID>::md(), data, len, out);
+		}
+
+		static void hashMany(const DigestInput *in, size_t count,
+				Value *out) {
+			evp::hashMany(DigestTraits<NID>::md(), in, count,
+					out[0].data, SIZE);
+		}
+
+	private:
+		DigestEngine(const DigestEngine&);
+		DigestEngine& operator=(const DigestEngine&);
+
+		EVP_MD_CTX *ctx;
+	};
+}
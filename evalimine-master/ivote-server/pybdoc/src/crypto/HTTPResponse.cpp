@@ -0,0 +1,322 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "HTTPResponse.h"
+#include "../StackException.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sstream>
+
+// OCSP responses are a few kilobytes, anything far beyond is garbage
+#define HTTP_MAX_HEADER_BYTES (64 * 1024)
+#define HTTP_MAX_BODY_BYTES (1024 * 1024)
+
+static std::string trim(const std::string& s)
+{
+	size_t b = s.find_first_not_of(" \t");
+	if (b == std::string::npos) {
+		return "";
+	}
+	size_t e = s.find_last_not_of(" \t");
+	return s.substr(b, e - b + 1);
+}
+
+static bool hasToken(const std::string& value, const char *token)
+{
+	size_t pos = 0;
+	while (pos <= value.size()) {
+		size_t end = value.find(',', pos);
+		if (end == std::string::npos) {
+			end = value.size();
+		}
+		if (strcasecmp(trim(value.substr(pos, end - pos)).c_str(), token) == 0) {
+			return true;
+		}
+		pos = end + 1;
+	}
+	return false;
+}
+
+std::string bdoc::HTTPResponse::postRequest(const std::string& host,
+		const std::string& port, const std::string& path,
+		const std::string& contentType,
+		const std::vector<unsigned char>& body)
+{
+	std::ostringstream req;
+	req << "POST " << path << " HTTP/1.1\r\n";
+	req << "Host: " << host;
+	if (!port.empty() && port != "80" && port != "443") {
+		req << ":" << port;
+	}
+	req << "\r\n";
+	req << "Content-Type: " << contentType << "\r\n";
+	req << "Content-Length: " << body.size() << "\r\n";
+	req << "Connection: keep-alive\r\n";
+	req << "\r\n";
+
+	std::string ret = req.str();
+	if (!body.empty()) {
+		ret.append((const char *)&body[0], body.size());
+	}
+	return ret;
+}
+
+bdoc::HTTPResponse::HTTPResponse()
+{
+	reset();
+}
+
+bdoc::HTTPResponse::~HTTPResponse()
+{
+}
+
+void bdoc::HTTPResponse::reset()
+{
+	state = STATUS_LINE;
+	line.clear();
+	headerBytes = 0;
+	remaining = 0;
+	started_ = false;
+	keepAlive_ = true;
+	chunked = false;
+	haveLength = false;
+	status_ = 0;
+	body_.clear();
+}
+
+bool bdoc::HTTPResponse::started() const
+{
+	return started_;
+}
+
+bool bdoc::HTTPResponse::complete() const
+{
+	return state == DONE;
+}
+
+bool bdoc::HTTPResponse::keepAlive() const
+{
+	return keepAlive_;
+}
+
+int bdoc::HTTPResponse::status() const
+{
+	return status_;
+}
+
+const std::vector<unsigned char>& bdoc::HTTPResponse::body() const
+{
+	return body_;
+}
+
+size_t bdoc::HTTPResponse::feed(const char *data, size_t len)
+{
+	size_t pos = 0;
+	if (len > 0) {
+		started_ = true;
+	}
+
+	while (pos < len && state != DONE) {
+		switch (state) {
+			case STATUS_LINE:
+				if (readLine(data, len, pos)) {
+					parseStatusLine();
+				}
+				break;
+
+			case HEADERS:
+				if (readLine(data, len, pos)) {
+					if (line.empty()) {
+						endOfHeaders();
+					}
+					else {
+						parseHeader();
+					}
+				}
+				break;
+
+			case CHUNK_SIZE:
+				if (readLine(data, len, pos)) {
+					parseChunkSize();
+				}
+				break;
+
+			case CHUNK_DATA_END:
+				if (readLine(data, len, pos)) {
+					if (!line.empty()) {
+						THROW_STACK_EXCEPTION("Malformed chunked HTTP response.");
+					}
+					state = CHUNK_SIZE;
+				}
+				break;
+
+			case TRAILERS:
+				if (readLine(data, len, pos)) {
+					if (line.empty()) {
+						state = DONE;
+					}
+					line.clear();
+				}
+				break;
+
+			case BODY_LENGTH:
+			case CHUNK_DATA:
+				{
+					size_t n = len - pos;
+					if (n > remaining) {
+						n = remaining;
+					}
+					body_.insert(body_.end(), data + pos, data + pos + n);
+					pos += n;
+					remaining -= n;
+					if (remaining == 0) {
+						state = (state == CHUNK_DATA) ?
+							CHUNK_DATA_END : DONE;
+					}
+				}
+				break;
+
+			case BODY_CLOSE:
+				if (body_.size() + (len - pos) > HTTP_MAX_BODY_BYTES) {
+					THROW_STACK_EXCEPTION("HTTP response body too large.");
+				}
+				body_.insert(body_.end(), data + pos, data + len);
+				pos = len;
+				break;
+
+			case DONE:
+				break;
+		}
+	}
+
+	return pos;
+}
+
+bool bdoc::HTTPResponse::finish()
+{
+	// End of connection delimits the body only if nothing else did
+	if (state == BODY_CLOSE) {
+		state = DONE;
+		keepAlive_ = false;
+	}
+	return state == DONE;
+}
+
+bool bdoc::HTTPResponse::readLine(const char *data, size_t len, size_t& pos)
+{
+	while (pos < len) {
+		char c = data[pos++];
+		if (++headerBytes > HTTP_MAX_HEADER_BYTES) {
+			THROW_STACK_EXCEPTION("HTTP response header too large.");
+		}
+		if (c == '\n') {
+			if (!line.empty() && line[line.size() - 1] == '\r') {
+				line.erase(line.size() - 1);
+			}
+			return true;
+		}
+		line += c;
+	}
+	return false;
+}
+
+void bdoc::HTTPResponse::parseStatusLine()
+{
+	// HTTP/1.1 200 OK
+	if (line.compare(0, 5, "HTTP/") != 0 || line.size() < 12) {
+		THROW_STACK_EXCEPTION("Malformed HTTP status line.");
+	}
+	if (line.compare(5, 3, "1.0") == 0) {
+		keepAlive_ = false;
+	}
+	status_ = atoi(line.c_str() + 9);
+	line.clear();
+	state = HEADERS;
+}
+
+void bdoc::HTTPResponse::parseHeader()
+{
+	size_t colon = line.find(':');
+	if (colon == std::string::npos) {
+		THROW_STACK_EXCEPTION("Malformed HTTP header.");
+	}
+	std::string name = trim(line.substr(0, colon));
+	std::string value = trim(line.substr(colon + 1));
+	line.clear();
+
+	if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+		char *end = NULL;
+		errno = 0;
+		unsigned long n = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || errno == ERANGE ||
+				n > HTTP_MAX_BODY_BYTES) {
+			THROW_STACK_EXCEPTION("Invalid HTTP Content-Length: %s", value.c_str());
+		}
+		remaining = n;
+		haveLength = true;
+	}
+	else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+		chunked = hasToken(value, "chunked");
+	}
+	else if (strcasecmp(name.c_str(), "Connection") == 0) {
+		if (hasToken(value, "close")) {
+			keepAlive_ = false;
+		}
+		else if (hasToken(value, "keep-alive")) {
+			keepAlive_ = true;
+		}
+	}
+}
+
+void bdoc::HTTPResponse::endOfHeaders()
+{
+	line.clear();
+	if (status_ >= 100 && status_ < 200) {
+		// Interim response, the real one follows
+		status_ = 0;
+		state = STATUS_LINE;
+		return;
+	}
+
+	if (status_ == 204 || status_ == 304) {
+		state = DONE;
+	}
+	else if (chunked) {
+		state = CHUNK_SIZE;
+	}
+	else if (haveLength) {
+		state = remaining > 0 ? BODY_LENGTH : DONE;
+	}
+	else {
+		state = BODY_CLOSE;
+		keepAlive_ = false;
+	}
+}
+
+void bdoc::HTTPResponse::parseChunkSize()
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long n = strtoul(line.c_str(), &end, 16);
+	if (line.empty() || errno == ERANGE ||
+			(*end != '\0' && *end != ';' && *end != ' ')) {
+		THROW_STACK_EXCEPTION("Malformed chunked HTTP response.");
+	}
+	// Not as a sum, which a huge chunk size would wrap
+	if (n > HTTP_MAX_BODY_BYTES - body_.size()) {
+		THROW_STACK_EXCEPTION("HTTP response body too large.");
+	}
+	line.clear();
+	remaining = n;
+	state = (n == 0) ? TRAILERS : CHUNK_DATA;
+}
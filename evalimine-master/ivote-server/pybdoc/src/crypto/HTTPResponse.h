@@ -0,0 +1,79 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace bdoc
+{
+	/*
+	 * Incremental HTTP/1.x response parser for talking to OCSP
+	 * responders over kept-alive connections. Bytes are fed as they
+	 * arrive, blocking or not; the body is delimited by Content-Length,
+	 * chunked transfer coding or the end of the connection.
+	 * */
+	class HTTPResponse
+	{
+		public:
+
+			HTTPResponse();
+			~HTTPResponse();
+
+			static std::string postRequest(const std::string& host,
+					const std::string& port, const std::string& path,
+					const std::string& contentType,
+					const std::vector<unsigned char>& body);
+
+			void reset();
+
+			size_t feed(const char *data, size_t len);
+			bool finish();
+
+			bool started() const;
+			bool complete() const;
+			bool keepAlive() const;
+			int status() const;
+			const std::vector<unsigned char>& body() const;
+
+		private:
+
+			enum State {
+				STATUS_LINE,
+				HEADERS,
+				BODY_LENGTH,
+				BODY_CLOSE,
+				CHUNK_SIZE,
+				CHUNK_DATA,
+				CHUNK_DATA_END,
+				TRAILERS,
+				DONE
+			};
+
+			bool readLine(const char *data, size_t len, size_t& pos);
+			void parseStatusLine();
+			void parseHeader();
+			void endOfHeaders();
+			void parseChunkSize();
+
+			State state;
+			std::string line;
+			size_t headerBytes;
+			size_t remaining;
+			bool started_;
+			bool keepAlive_;
+			bool chunked;
+			bool haveLength;
+			int status_;
+			std::vector<unsigned char> body_;
+	};
+}
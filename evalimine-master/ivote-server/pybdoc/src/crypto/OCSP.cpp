@@ -12,6 +12,8 @@
  * */
 
 #include "OCSP.h"
+#include "OCSPConnectionPool.h"
+#include "OCSPResponseCache.h"
 #include <openssl/err.h>
 #include "../StackException.h"
 
@@ -23,15 +25,13 @@ DECLARE_OPENSSL_RELEASE_STRUCT(X509_EXTENSION)
 
 bdoc::OCSP::OCSP(const std::string& url) :
 	ssl(false), skew(0), maxAge(0),
-	connection(NULL), ctx(NULL), ocspCerts(NULL)
+	ocspCerts(NULL)
 {
 	setUrl(url);
 }
 
 bdoc::OCSP::~OCSP()
 {
-	BIO_free_all(connection);
-	SSL_CTX_free(ctx);
 }
 
 void bdoc::OCSP::setUrl(const std::string& _url)
@@ -85,25 +85,64 @@ bdoc::OCSP::CertStatus bdoc::OCSP::checkCert(
 		X509* cert, X509* issuer,
 		const std::vector<unsigned char>& nonce)
 {
-	OCSP_REQUEST* req = NULL;
-	OCSP_REQUEST_scope reqScope(&req);
-
-	OCSP_RESPONSE* resp = NULL;
-	OCSP_RESPONSE_scope respScope(&resp);
-	return checkCert(cert, issuer, nonce, &req, &resp);
+	std::vector<unsigned char> ocspResponseDER;
+	tm producedAt;
+	return checkCert(cert, issuer, nonce, ocspResponseDER, producedAt);
 }
 
 bdoc::OCSP::CertStatus bdoc::OCSP::checkCert(X509* cert, X509* issuer,
 		const std::vector<unsigned char>& nonce,
 		std::vector<unsigned char>& ocspResponseDER, tm& producedAt)
 {
-	OCSP_REQUEST* req = NULL;
+	std::vector<unsigned char> body = connectionPool()->post(
+			path, "application/ocsp-request",
+			createRequestDER(cert, issuer, nonce));
+
+	return checkResponse(cert, issuer, nonce, body,
+			ocspResponseDER, producedAt);
+}
+
+std::vector<unsigned char> bdoc::OCSP::createRequestDER(X509* cert,
+		X509* issuer, const std::vector<unsigned char>& nonce)
+{
+	if (cert == NULL) {
+		THROW_STACK_EXCEPTION("Can not check X.509 certificate, certificate is NULL pointer.");
+	}
+
+	if (issuer == NULL) {
+		THROW_STACK_EXCEPTION("Can not check X.509 certificate, issuer certificate is NULL pointer.");
+	}
+
+	OCSP_REQUEST* req = createRequest(cert, issuer, nonce);
 	OCSP_REQUEST_scope reqScope(&req);
 
+	int len = i2d_OCSP_REQUEST(req, NULL);
+	if (len <= 0) {
+		THROW_STACK_EXCEPTION("Failed to send OCSP request.");
+	}
+	std::vector<unsigned char> der(len);
+	unsigned char *p = &der[0];
+	i2d_OCSP_REQUEST(req, &p);
+	return der;
+}
+
+bdoc::OCSP::CertStatus bdoc::OCSP::checkResponse(X509* cert, X509* issuer,
+		const std::vector<unsigned char>& nonce,
+		const std::vector<unsigned char>& body,
+		std::vector<unsigned char>& ocspResponseDER, tm& producedAt)
+{
+	const unsigned char *q = body.empty() ? NULL : &body[0];
 	OCSP_RESPONSE* resp = NULL;
 	OCSP_RESPONSE_scope respScope(&resp);
+	if (q == NULL || !(resp = d2i_OCSP_RESPONSE(NULL, &q, body.size()))) {
+		THROW_STACK_EXCEPTION("Failed to send OCSP request.");
+	}
 
-	CertStatus certStatus = checkCert(cert, issuer, nonce, &req, &resp);
+	// The nonce is checked against the request it was sent in
+	OCSP_REQUEST* req = createRequest(cert, issuer, nonce);
+	OCSP_REQUEST_scope reqScope(&req);
+
+	CertStatus certStatus = validateResponse(req, resp, cert, issuer);
 
 	int bufSize = i2d_OCSP_RESPONSE(resp, NULL);
 	if (bufSize < 0) {
@@ -125,62 +164,14 @@ bdoc::OCSP::CertStatus bdoc::OCSP::checkCert(X509* cert, X509* issuer,
 	return certStatus;
 }
 
-bdoc::OCSP::CertStatus bdoc::OCSP::checkCert(X509* cert, X509* issuer,
-		const std::vector<unsigned char>& nonce,
-		OCSP_REQUEST** req, OCSP_RESPONSE** resp)
+bdoc::OCSPConnectionPool* bdoc::OCSP::connectionPool() const
 {
-	if (cert == NULL) {
-		THROW_STACK_EXCEPTION("Can not check X.509 certificate, certificate is NULL pointer.");
-	}
-
-	if (issuer == NULL) {
-		THROW_STACK_EXCEPTION("Can not check X.509 certificate, issuer certificate is NULL pointer.");
-	}
-
-	connect();
-
-	*req = createRequest(cert, issuer, nonce);
-	*resp = sendRequest(*req);
-	return validateResponse(*req, *resp, cert, issuer);
+	return OCSPConnectionPool::get(host, port, ssl);
 }
 
-void bdoc::OCSP::connect()
+const std::string& bdoc::OCSP::getPath() const
 {
-	BIO_free_all(connection);
-	SSL_CTX_free(ctx);
-	connection = NULL;
-	ctx = NULL;
-
-	connection = BIO_new_connect(const_cast<char*>(host.c_str()));
-	if (connection == NULL) {
-		THROW_STACK_EXCEPTION("Failed to create connection with host: '%s'", host.c_str());
-	}
-
-	if (!BIO_set_conn_port(connection, const_cast<char*>(port.c_str()))) {
-		THROW_STACK_EXCEPTION("Failed to set port of the connection: %s", port.c_str());
-	}
-
-	if (ssl) {
-		connectSSL();
-	}
-
-	if (!BIO_do_connect(connection)) {
-		THROW_STACK_EXCEPTION("Failed to connect to host: '%s'", host.c_str());
-	}
-}
-
-void bdoc::OCSP::connectSSL()
-{
-	ctx = SSL_CTX_new(SSLv23_client_method());
-	if (!ctx) {
-		THROW_STACK_EXCEPTION("Failed to create connection with host: '%s'", host.c_str());
-	}
-	SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
-	BIO *sconnection = BIO_new_ssl(ctx, 1);
-	if (!sconnection) {
-		THROW_STACK_EXCEPTION("Failed to create ssl connection with host: '%s'", host.c_str());
-	}
-	connection = BIO_push(sconnection, connection);
+	return path;
 }
 
 OCSP_REQUEST* bdoc::OCSP::createRequest(X509* cert, X509* issuer, const std::vector<unsigned char>& nonce)
@@ -209,16 +200,6 @@ OCSP_REQUEST* bdoc::OCSP::createRequest(X509* cert, X509* issuer, const std::vec
 	return req;
 }
 
-OCSP_RESPONSE* bdoc::OCSP::sendRequest(OCSP_REQUEST* req)
-{
-	OCSP_RESPONSE* resp = 0;
-
-	if (!(resp = OCSP_sendreq_bio(connection, const_cast<char*>(path.c_str()), req)))
-			THROW_STACK_EXCEPTION("Failed to send OCSP request.");
-
-	return resp;
-}
-
 bdoc::OCSP::CertStatus bdoc::OCSP::validateResponse(OCSP_REQUEST* req, OCSP_RESPONSE* resp, X509* cert, X509* issuer)
 {
 	// Check OCSP response status code.
@@ -279,39 +260,67 @@ bdoc::OCSP::CertStatus bdoc::OCSP::validateResponse(OCSP_REQUEST* req, OCSP_RESP
 	}
 }
 
-void bdoc::OCSP::verifyResponse(const std::vector<unsigned char>& ocspResponseDER) const
+void bdoc::OCSP::verifyResponse(const std::vector<unsigned char>& ocspResponseDER,
+		std::vector<unsigned char>& nonce) const
 {
-	BIO * bio = BIO_new_mem_buf(const_cast<unsigned char*>(&ocspResponseDER[0]), ocspResponseDER.size());
-	BIO_scope bioScope(&bio);
+	if (ocspCerts == NULL) {
+		THROW_STACK_EXCEPTION("OCSP responder certificate not configured.");
+	}
 
-	OCSP_RESPONSE * resp = d2i_OCSP_RESPONSE_bio(bio, NULL);
+	std::string key = OCSPResponseCache::key(ocspCerts, ocspResponseDER);
+	if (OCSPResponseCache::lookup(key, nonce)) {
+		return;
+	}
+
+	OCSP_RESPONSE * resp = decodeResponse(ocspResponseDER);
 	OCSP_RESPONSE_scope respScope(&resp);
 
 	OCSP_BASICRESP* basic = OCSP_response_get1_basic(resp);
 	OCSP_BASICRESP_scope basicScope(&basic);
-
-	if (ocspCerts == NULL) {
-		THROW_STACK_EXCEPTION("OCSP responder certificate not configured.");
+	if (basic == NULL) {
+		THROW_STACK_EXCEPTION("Incorrect OCSP response.");
 	}
+
 	int res = OCSP_basic_verify(basic, ocspCerts, NULL, OCSP_TRUSTOTHER | OCSP_NOINTERN);
 	if (res <= 0) {
 		THROW_STACK_EXCEPTION("OCSP responder certificate not found or not valid.");
 	}
+
+	nonce = extractNonce(basic);
+	OCSPResponseCache::insert(key, nonce);
 }
 
 std::vector<unsigned char> bdoc::OCSP::getNonce(const std::vector<unsigned char>& ocspResponseDER) const
 {
-	BIO * bio = BIO_new_mem_buf(const_cast<unsigned char*>(&ocspResponseDER[0]), ocspResponseDER.size());
-	BIO_scope bioScope(&bio);
-
-	OCSP_RESPONSE * resp = d2i_OCSP_RESPONSE_bio(bio, NULL);
+	OCSP_RESPONSE * resp = decodeResponse(ocspResponseDER);
 	OCSP_RESPONSE_scope respScope(&resp);
 
 	OCSP_BASICRESP* basic = OCSP_response_get1_basic(resp);
 	OCSP_BASICRESP_scope basicScope(&basic);
+	if (basic == NULL) {
+		THROW_STACK_EXCEPTION("Incorrect OCSP response.");
+	}
 
+	return extractNonce(basic);
+}
+
+OCSP_RESPONSE* bdoc::OCSP::decodeResponse(const std::vector<unsigned char>& ocspResponseDER)
+{
+	const unsigned char *p = ocspResponseDER.empty() ? NULL : &ocspResponseDER[0];
+	OCSP_RESPONSE* resp = NULL;
+	if (p == NULL || !(resp = d2i_OCSP_RESPONSE(NULL, &p, ocspResponseDER.size()))) {
+		THROW_STACK_EXCEPTION("Failed to decode OCSP response.");
+	}
+	return resp;
+}
+
+std::vector<unsigned char> bdoc::OCSP::extractNonce(OCSP_BASICRESP* basic)
+{
 	int resp_idx = OCSP_BASICRESP_get_ext_by_NID(basic, NID_id_pkix_OCSP_Nonce, -1);
-	X509_EXTENSION* resp_ext = OCSP_BASICRESP_get_ext(basic, resp_idx);// X509_EXTENSION_scope x509ExtScope(&resp_ext);
+	X509_EXTENSION* resp_ext = OCSP_BASICRESP_get_ext(basic, resp_idx);
+	if (resp_ext == NULL) {
+		THROW_STACK_EXCEPTION("OCSP response has no NONCE field.");
+	}
 
 	int r = i2d_ASN1_OCTET_STRING(resp_ext->value, NULL);
 
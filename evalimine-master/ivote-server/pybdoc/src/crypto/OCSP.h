@@ -23,6 +23,8 @@
 
 namespace bdoc
 {
+	class OCSPConnectionPool;
+
 	class OCSP
 	{
 	public:
@@ -37,19 +39,32 @@ namespace bdoc
 		CertStatus checkCert(X509* cert, X509* issuer, const std::vector<unsigned char>& nonce);
 		CertStatus checkCert(X509* cert, X509* issuer, const std::vector<unsigned char>& nonce,
 				std::vector<unsigned char>& ocspResponseDER, tm& producedAt);
-		void verifyResponse(const std::vector<unsigned char>& ocspResponseDER) const;
+		// Checks the responder signature and extracts the nonce from
+		// one decoding of the response. Verified responses are cached.
+		void verifyResponse(const std::vector<unsigned char>& ocspResponseDER,
+				std::vector<unsigned char>& nonce) const;
+
+		// The steps of checkCert for callers doing the HTTP exchange
+		// themselves: POST the request to getPath() on a connection
+		// of connectionPool() and check the response body.
+		std::vector<unsigned char> createRequestDER(X509* cert, X509* issuer,
+				const std::vector<unsigned char>& nonce);
+		CertStatus checkResponse(X509* cert, X509* issuer,
+				const std::vector<unsigned char>& nonce,
+				const std::vector<unsigned char>& body,
+				std::vector<unsigned char>& ocspResponseDER, tm& producedAt);
+		OCSPConnectionPool* connectionPool() const;
+		const std::string& getPath() const;
 		std::vector<unsigned char> getNonce(const std::vector<unsigned char>& ocspResponseDER) const;
 
 	private:
 		void setUrl(const std::string& url);
-		CertStatus checkCert(X509* cert, X509* issuer, const std::vector<unsigned char>& nonce,
-				OCSP_REQUEST** req, OCSP_RESPONSE** resp);
-		void connect();
-		void connectSSL();
 		OCSP_REQUEST* createRequest(X509* cert, X509* issuer, const std::vector<unsigned char>& nonce);
-		OCSP_RESPONSE* sendRequest(OCSP_REQUEST* req);
 		CertStatus validateResponse(OCSP_REQUEST* req, OCSP_RESPONSE* resp, X509* cert, X509* issuer);
 
+		static OCSP_RESPONSE* decodeResponse(const std::vector<unsigned char>& ocspResponseDER);
+		static std::vector<unsigned char> extractNonce(OCSP_BASICRESP* basic);
+
 		static tm convert(ASN1_GENERALIZEDTIME* time);
 
 		std::string url, host, port, path;
@@ -58,8 +73,6 @@ namespace bdoc
 		long skew;
 		long maxAge;
 
-		BIO *connection;
-		SSL_CTX *ctx;
 		X509* ocspCert;
 		STACK_OF(X509)* ocspCerts;
 	};
@@ -0,0 +1,373 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "OCSPConnectionPool.h"
+#include "HTTPResponse.h"
+#include "../StackException.h"
+#include "../Timing.h"
+
+#include <fcntl.h>
+#include <map>
+
+#define OCSP_POOL_MAX_CONNECTIONS 8
+#define OCSP_POOL_IDLE_TIMEOUT 10
+#define OCSP_POOL_READ_SIZE 4096
+
+typedef std::map<std::string, bdoc::OCSPConnectionPool*> OCSPPoolMap;
+
+static OCSPPoolMap pools;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+bdoc::OCSPConnectionPool* bdoc::OCSPConnectionPool::get(
+		const std::string& host, const std::string& port, bool ssl)
+{
+	std::string key = (ssl ? "https://" : "http://") + host + ":" + port;
+
+	pthread_mutex_lock(&pools_mutex);
+	OCSPConnectionPool *pool = NULL;
+	try {
+		OCSPPoolMap::const_iterator it = pools.find(key);
+		if (it != pools.end()) {
+			pool = it->second;
+		}
+		else {
+			pool = new OCSPConnectionPool(host, port, ssl);
+			pools[key] = pool;
+		}
+	}
+	catch (...) {
+		pthread_mutex_unlock(&pools_mutex);
+		throw;
+	}
+	pthread_mutex_unlock(&pools_mutex);
+	return pool;
+}
+
+void bdoc::OCSPConnectionPool::release()
+{
+	pthread_mutex_lock(&pools_mutex);
+	for (OCSPPoolMap::iterator it = pools.begin(); it != pools.end(); it++) {
+		delete it->second;
+	}
+	pools.clear();
+	pthread_mutex_unlock(&pools_mutex);
+}
+
+bdoc::OCSPConnectionPool::OCSPConnectionPool(const std::string& host,
+		const std::string& port, bool ssl) :
+	_host(host), _port(port), _ssl(ssl),
+	_ctx(NULL), _session(NULL), _idle(), _open(0)
+{
+	if (_ssl) {
+		_ctx = SSL_CTX_new(SSLv23_client_method());
+		if (!_ctx) {
+			THROW_STACK_EXCEPTION("Failed to create connection with host: '%s'", host.c_str());
+		}
+		SSL_CTX_set_mode(_ctx, SSL_MODE_AUTO_RETRY);
+	}
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_cond_init(&_cond, NULL);
+}
+
+bdoc::OCSPConnectionPool::~OCSPConnectionPool()
+{
+	for (std::list<Idle>::iterator it = _idle.begin(); it != _idle.end(); it++) {
+		BIO_free_all(it->connection);
+	}
+	if (_session) {
+		SSL_SESSION_free(_session);
+	}
+	SSL_CTX_free(_ctx);
+	pthread_cond_destroy(&_cond);
+	pthread_mutex_destroy(&_mutex);
+}
+
+const std::string& bdoc::OCSPConnectionPool::host() const
+{
+	return _host;
+}
+
+const std::string& bdoc::OCSPConnectionPool::port() const
+{
+	return _port;
+}
+
+void bdoc::OCSPConnectionPool::expireIdle(time_t now)
+{
+	// Oldest first, the most recently used connection is at the back
+	while (!_idle.empty() && now - _idle.front().since > OCSP_POOL_IDLE_TIMEOUT) {
+		BIO_free_all(_idle.front().connection);
+		_idle.pop_front();
+		_open--;
+	}
+}
+
+void bdoc::OCSPConnectionPool::dropIdle()
+{
+	pthread_mutex_lock(&_mutex);
+	while (!_idle.empty()) {
+		BIO_free_all(_idle.front().connection);
+		_idle.pop_front();
+		_open--;
+	}
+	pthread_cond_broadcast(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+BIO* bdoc::OCSPConnectionPool::checkout(bool fresh, bool& reused)
+{
+	return acquire(fresh, reused, true);
+}
+
+BIO* bdoc::OCSPConnectionPool::tryCheckout(bool fresh, bool& reused)
+{
+	return acquire(fresh, reused, false);
+}
+
+BIO* bdoc::OCSPConnectionPool::acquire(bool fresh, bool& reused, bool blocking)
+{
+	reused = false;
+
+	pthread_mutex_lock(&_mutex);
+	while (true) {
+		expireIdle(time(NULL));
+
+		if (!fresh && !_idle.empty()) {
+			BIO *connection = _idle.back().connection;
+			_idle.pop_back();
+			pthread_mutex_unlock(&_mutex);
+			reused = true;
+			if (!blocking) {
+				setBlocking(connection, false);
+			}
+			return connection;
+		}
+
+		if (fresh && !_idle.empty() && _open >= OCSP_POOL_MAX_CONNECTIONS) {
+			// Make room for the new connection
+			BIO_free_all(_idle.front().connection);
+			_idle.pop_front();
+			_open--;
+		}
+
+		if (_open < OCSP_POOL_MAX_CONNECTIONS) {
+			break;
+		}
+
+		if (!blocking) {
+			pthread_mutex_unlock(&_mutex);
+			return NULL;
+		}
+
+		pthread_cond_wait(&_cond, &_mutex);
+	}
+	_open++;
+	pthread_mutex_unlock(&_mutex);
+
+	BIO *connection = NULL;
+	try {
+		StageTimer timer(TIMING_OCSP_CONNECT);
+		connection = open(blocking);
+		if (blocking) {
+			connected(connection);
+		}
+	}
+	catch (...) {
+		checkin(connection, false);
+		throw;
+	}
+	return connection;
+}
+
+void bdoc::OCSPConnectionPool::checkin(BIO *connection, bool reusable)
+{
+	pthread_mutex_lock(&_mutex);
+	if (reusable && connection != NULL) {
+		setBlocking(connection, true);
+		Idle idle;
+		idle.connection = connection;
+		idle.since = time(NULL);
+		_idle.push_back(idle);
+	}
+	else {
+		if (connection != NULL) {
+			BIO_free_all(connection);
+		}
+		_open--;
+	}
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+BIO* bdoc::OCSPConnectionPool::open(bool blocking)
+{
+	BIO *connection = BIO_new_connect(const_cast<char*>(_host.c_str()));
+	if (connection == NULL) {
+		THROW_STACK_EXCEPTION("Failed to create connection with host: '%s'", _host.c_str());
+	}
+
+	if (!BIO_set_conn_port(connection, const_cast<char*>(_port.c_str()))) {
+		BIO_free_all(connection);
+		THROW_STACK_EXCEPTION("Failed to set port of the connection: %s", _port.c_str());
+	}
+
+	if (!blocking) {
+		BIO_set_nbio(connection, 1);
+	}
+
+	if (_ssl) {
+		BIO *sconnection = BIO_new_ssl(_ctx, 1);
+		if (!sconnection) {
+			BIO_free_all(connection);
+			THROW_STACK_EXCEPTION("Failed to create ssl connection with host: '%s'", _host.c_str());
+		}
+		connection = BIO_push(sconnection, connection);
+
+		SSL *ssl = NULL;
+		BIO_get_ssl(sconnection, &ssl);
+		SSL_set_tlsext_host_name(ssl, const_cast<char*>(_host.c_str()));
+
+		pthread_mutex_lock(&_mutex);
+		if (_session) {
+			SSL_set_session(ssl, _session);
+		}
+		pthread_mutex_unlock(&_mutex);
+	}
+
+	if (blocking && BIO_do_connect(connection) <= 0) {
+		BIO_free_all(connection);
+		THROW_STACK_EXCEPTION("Failed to connect to host: '%s'", _host.c_str());
+	}
+
+	return connection;
+}
+
+void bdoc::OCSPConnectionPool::connected(BIO *connection)
+{
+	if (!_ssl) {
+		return;
+	}
+
+	// Resumed by the next connection to skip the full handshake
+	SSL *ssl = NULL;
+	BIO_get_ssl(connection, &ssl);
+	SSL_SESSION *session = ssl ? SSL_get1_session(ssl) : NULL;
+	if (session == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&_mutex);
+	if (_session) {
+		SSL_SESSION_free(_session);
+	}
+	_session = session;
+	pthread_mutex_unlock(&_mutex);
+}
+
+void bdoc::OCSPConnectionPool::setBlocking(BIO *connection, bool blocking)
+{
+	int fd = -1;
+	if (BIO_get_fd(connection, &fd) < 0 || fd < 0) {
+		return;
+	}
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) {
+		return;
+	}
+	flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+	(void)fcntl(fd, F_SETFL, flags);
+}
+
+bool bdoc::OCSPConnectionPool::exchange(BIO *connection,
+		const std::string& request, HTTPResponse& response)
+{
+	size_t written = 0;
+	while (written < request.size()) {
+		int n = BIO_write(connection, request.data() + written,
+					request.size() - written);
+		if (n <= 0) {
+			if (BIO_should_retry(connection)) {
+				continue;
+			}
+			// Closed by the responder while idle
+			return false;
+		}
+		written += n;
+	}
+	(void)BIO_flush(connection);
+
+	char buf[OCSP_POOL_READ_SIZE];
+	while (!response.complete()) {
+		int n = BIO_read(connection, buf, sizeof(buf));
+		if (n > 0) {
+			size_t used = response.feed(buf, n);
+			if (used < (size_t)n) {
+				THROW_STACK_EXCEPTION("Unexpected data after OCSP response.");
+			}
+			continue;
+		}
+		if (n < 0 && BIO_should_retry(connection)) {
+			continue;
+		}
+		if (response.finish()) {
+			break;
+		}
+		if (!response.started()) {
+			return false;
+		}
+		THROW_STACK_EXCEPTION("Failed to read OCSP response.");
+	}
+	return true;
+}
+
+std::vector<unsigned char> bdoc::OCSPConnectionPool::post(
+		const std::string& path, const std::string& contentType,
+		const std::vector<unsigned char>& body)
+{
+	std::string request =
+		HTTPResponse::postRequest(_host, _port, path, contentType, body);
+
+	bool fresh = false;
+	while (true) {
+		bool reused = false;
+		BIO *connection = checkout(fresh, reused);
+
+		HTTPResponse response;
+		bool done = false;
+		try {
+			StageTimer timer(TIMING_OCSP_ROUNDTRIP);
+			done = exchange(connection, request, response);
+		}
+		catch (...) {
+			checkin(connection, false);
+			throw;
+		}
+
+		if (!done) {
+			checkin(connection, false);
+			if (reused) {
+				// The other idle connections are likely as stale
+				dropIdle();
+				fresh = true;
+				continue;
+			}
+			THROW_STACK_EXCEPTION("Failed to send OCSP request.");
+		}
+
+		checkin(connection, response.keepAlive());
+
+		if (response.status() != 200) {
+			THROW_STACK_EXCEPTION(
+				"OCSP responder returned HTTP status %d",
+				response.status());
+		}
+		return response.body();
+	}
+}
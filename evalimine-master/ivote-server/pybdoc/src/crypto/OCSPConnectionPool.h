@@ -0,0 +1,102 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+namespace bdoc
+{
+	class HTTPResponse;
+
+	/*
+	 * Kept-alive HTTP/1.1 connections to one OCSP responder, shared by
+	 * all verifications of the process. At most OCSP_POOL_MAX_CONNECTIONS
+	 * are open at a time, idle ones are closed after
+	 * OCSP_POOL_IDLE_TIMEOUT seconds. TLS connections share one SSL_CTX
+	 * and resume the last session.
+	 * */
+	class OCSPConnectionPool
+	{
+		public:
+
+			static OCSPConnectionPool* get(const std::string& host,
+					const std::string& port, bool ssl);
+			static void release();
+
+			// POST body to path, returns the response body. A request
+			// failing on a reused connection is retried once on a new
+			// one.
+			std::vector<unsigned char> post(const std::string& path,
+					const std::string& contentType,
+					const std::vector<unsigned char>& body);
+
+			// Connection handling for callers driving the exchange
+			// themselves. checkin() with reusable == false closes it.
+			BIO* checkout(bool fresh, bool& reused);
+			void checkin(BIO *connection, bool reusable);
+			void dropIdle();
+
+			// As checkout() but returns NULL instead of waiting when
+			// all connections are in use. The connection is
+			// non-blocking and a new one is not connected yet: drive
+			// BIO_do_connect() and call connected() when it is done.
+			BIO* tryCheckout(bool fresh, bool& reused);
+			void connected(BIO *connection);
+
+			static void setBlocking(BIO *connection, bool blocking);
+
+			const std::string& host() const;
+			const std::string& port() const;
+
+		private:
+
+			OCSPConnectionPool(const std::string& host,
+					const std::string& port, bool ssl);
+			~OCSPConnectionPool();
+
+			OCSPConnectionPool(const OCSPConnectionPool&);
+			OCSPConnectionPool& operator=(const OCSPConnectionPool&);
+
+			struct Idle {
+				BIO *connection;
+				time_t since;
+			};
+
+			BIO* acquire(bool fresh, bool& reused, bool blocking);
+			BIO* open(bool blocking);
+			void expireIdle(time_t now);
+
+			static bool exchange(BIO *connection,
+					const std::string& request,
+					HTTPResponse& response);
+
+			std::string _host;
+			std::string _port;
+			bool _ssl;
+
+			SSL_CTX *_ctx;
+			SSL_SESSION *_session;
+
+			std::list<Idle> _idle;
+			unsigned int _open;
+
+			pthread_mutex_t _mutex;
+			pthread_cond_t _cond;
+	};
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "OCSPRequestQueue.h"
+#include "OCSPConnectionPool.h"
+#include "../StackException.h"
+
+#include <poll.h>
+
+#define OCSP_QUEUE_TIMEOUT 30
+#define OCSP_QUEUE_READ_SIZE 4096
+// How often requests waiting for a free connection look again
+#define OCSP_QUEUE_RETRY_MS 20
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bdoc::OCSPRequestQueue::OCSPRequestQueue() :
+	nextId(1), active(), finished()
+{
+}
+
+bdoc::OCSPRequestQueue::~OCSPRequestQueue()
+{
+	for (std::list<Request>::iterator it = active.begin(); it != active.end(); it++) {
+		abandon(*it);
+	}
+}
+
+int bdoc::OCSPRequestQueue::submit(OCSPConnectionPool *pool,
+		const std::string& path, const std::vector<unsigned char>& der)
+{
+	Request r;
+	r.id = nextId++;
+	r.pool = pool;
+	r.request = HTTPResponse::postRequest(pool->host(), pool->port(),
+				path, "application/ocsp-request", der);
+	r.deadline = time(NULL) + OCSP_QUEUE_TIMEOUT;
+	r.state = WAITING;
+	r.connection = NULL;
+	r.fresh = false;
+	r.reused = false;
+	r.written = 0;
+	r.events = 0;
+	active.push_back(r);
+	return r.id;
+}
+
+size_t bdoc::OCSPRequestQueue::pending() const
+{
+	return active.size();
+}
+
+bool bdoc::OCSPRequestQueue::take(int id, std::vector<unsigned char>& body,
+		std::string& error)
+{
+	std::map<int, Outcome>::iterator it = finished.find(id);
+	if (it == finished.end()) {
+		THROW_STACK_EXCEPTION("OCSP request %d is not finished.", id);
+	}
+	body.swap(it->second.body);
+	error = it->second.error;
+	finished.erase(it);
+	return error.empty();
+}
+
+std::vector<int> bdoc::OCSPRequestQueue::poll(int timeout)
+{
+	std::vector<int> done;
+	long long start = now_ms();
+
+	while (true) {
+		bool waiting = false;
+		std::vector<struct pollfd> fds;
+
+		std::list<Request>::iterator it = active.begin();
+		while (it != active.end()) {
+			bool over = false;
+			try {
+				over = step(*it);
+				if (!over && time(NULL) > it->deadline) {
+					THROW_STACK_EXCEPTION("OCSP request timed out.");
+				}
+			}
+			catch (bdoc::StackExceptionBase& exc) {
+				fail(*it, exc.what());
+				over = true;
+			}
+			catch (std::exception& exc) {
+				fail(*it, exc.what());
+				over = true;
+			}
+
+			if (over) {
+				done.push_back(it->id);
+				it = active.erase(it);
+				continue;
+			}
+
+			int fd = -1;
+			if (it->connection == NULL || it->events == 0 ||
+					BIO_get_fd(it->connection, &fd) < 0 || fd < 0) {
+				waiting = true;
+			}
+			else {
+				struct pollfd p;
+				p.fd = fd;
+				p.events = it->events;
+				p.revents = 0;
+				fds.push_back(p);
+			}
+			it++;
+		}
+
+		if (!done.empty() || active.empty()) {
+			break;
+		}
+
+		long long elapsed = now_ms() - start;
+		if (timeout >= 0 && elapsed >= timeout) {
+			break;
+		}
+
+		// Wake up at least once a second to enforce the deadlines
+		int wait = 1000;
+		if (timeout >= 0 && timeout - elapsed < wait) {
+			wait = timeout - elapsed;
+		}
+		if (waiting && wait > OCSP_QUEUE_RETRY_MS) {
+			wait = OCSP_QUEUE_RETRY_MS;
+		}
+
+		(void)::poll(fds.empty() ? NULL : &fds[0], fds.size(), wait);
+	}
+
+	return done;
+}
+
+bool bdoc::OCSPRequestQueue::step(Request& r)
+{
+	char buf[OCSP_QUEUE_READ_SIZE];
+
+	while (true) {
+		switch (r.state) {
+			case WAITING:
+				r.connection = r.pool->tryCheckout(r.fresh, r.reused);
+				if (r.connection == NULL) {
+					r.events = 0;
+					return false;
+				}
+				r.state = r.reused ? WRITING : CONNECTING;
+				break;
+
+			case CONNECTING:
+				if (BIO_do_connect(r.connection) <= 0) {
+					if (BIO_should_retry(r.connection)) {
+						r.events = BIO_should_read(r.connection) ?
+							POLLIN : POLLOUT;
+						return false;
+					}
+					THROW_STACK_EXCEPTION("Failed to connect to host: '%s'", r.pool->host().c_str());
+				}
+				r.pool->connected(r.connection);
+				r.state = WRITING;
+				break;
+
+			case WRITING:
+				{
+					int n = BIO_write(r.connection,
+						r.request.data() + r.written,
+						r.request.size() - r.written);
+					if (n <= 0) {
+						if (BIO_should_retry(r.connection)) {
+							r.events = BIO_should_read(r.connection) ?
+								POLLIN : POLLOUT;
+							return false;
+						}
+						if (stale(r)) {
+							break;
+						}
+						THROW_STACK_EXCEPTION("Failed to send OCSP request.");
+					}
+					r.written += n;
+					if (r.written == r.request.size()) {
+						r.state = READING;
+					}
+				}
+				break;
+
+			case READING:
+				{
+					int n = BIO_read(r.connection, buf, sizeof(buf));
+					if (n > 0) {
+						size_t used = r.response.feed(buf, n);
+						if (used < (size_t)n) {
+							THROW_STACK_EXCEPTION("Unexpected data after OCSP response.");
+						}
+						if (r.response.complete()) {
+							finish(r);
+							return true;
+						}
+						break;
+					}
+					if (n < 0 && BIO_should_retry(r.connection)) {
+						r.events = BIO_should_write(r.connection) ?
+							POLLOUT : POLLIN;
+						return false;
+					}
+					if (r.response.finish()) {
+						finish(r);
+						return true;
+					}
+					if (!r.response.started() && stale(r)) {
+						break;
+					}
+					THROW_STACK_EXCEPTION("Failed to read OCSP response.");
+				}
+		}
+	}
+}
+
+bool bdoc::OCSPRequestQueue::stale(Request& r)
+{
+	bool retry = r.reused;
+	abandon(r);
+	if (!retry) {
+		return false;
+	}
+
+	// Closed by the responder while idle, as are likely the others
+	r.pool->dropIdle();
+	r.state = WAITING;
+	r.fresh = true;
+	r.reused = false;
+	r.written = 0;
+	r.response.reset();
+	return true;
+}
+
+void bdoc::OCSPRequestQueue::finish(Request& r)
+{
+	r.pool->checkin(r.connection, r.response.keepAlive());
+	r.connection = NULL;
+
+	if (r.response.status() != 200) {
+		THROW_STACK_EXCEPTION(
+			"OCSP responder returned HTTP status %d",
+			r.response.status());
+	}
+	finished[r.id].body = r.response.body();
+}
+
+void bdoc::OCSPRequestQueue::fail(Request& r, const std::string& error)
+{
+	abandon(r);
+	finished[r.id].error = error;
+}
+
+void bdoc::OCSPRequestQueue::abandon(Request& r)
+{
+	if (r.connection != NULL) {
+		r.pool->checkin(r.connection, false);
+		r.connection = NULL;
+	}
+}
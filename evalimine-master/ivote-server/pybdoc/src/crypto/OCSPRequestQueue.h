@@ -0,0 +1,99 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include "HTTPResponse.h"
+
+#include <openssl/bio.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace bdoc
+{
+	class OCSPConnectionPool;
+
+	/*
+	 * Outstanding OCSP requests multiplexed over non-blocking pooled
+	 * connections by one thread. submit() queues a request, poll()
+	 * moves all of them forward until at least one is finished or the
+	 * timeout passes, take() hands out the outcome of a finished one.
+	 * Requests wait for a free connection when the pool of their
+	 * responder is exhausted.
+	 * */
+	class OCSPRequestQueue
+	{
+		public:
+
+			OCSPRequestQueue();
+			~OCSPRequestQueue();
+
+			int submit(OCSPConnectionPool *pool, const std::string& path,
+					const std::vector<unsigned char>& der);
+
+			// Ids of the requests finished during the call, timeout in
+			// milliseconds, negative waits until one finishes.
+			std::vector<int> poll(int timeout);
+
+			// Response body of a finished request or false and the
+			// error. The request is forgotten.
+			bool take(int id, std::vector<unsigned char>& body,
+					std::string& error);
+
+			size_t pending() const;
+
+		private:
+
+			OCSPRequestQueue(const OCSPRequestQueue&);
+			OCSPRequestQueue& operator=(const OCSPRequestQueue&);
+
+			enum State {
+				WAITING,
+				CONNECTING,
+				WRITING,
+				READING
+			};
+
+			struct Request {
+				int id;
+				OCSPConnectionPool *pool;
+				std::string request;
+				time_t deadline;
+
+				State state;
+				BIO *connection;
+				bool fresh;
+				bool reused;
+				size_t written;
+				short events;
+				HTTPResponse response;
+			};
+
+			struct Outcome {
+				std::vector<unsigned char> body;
+				std::string error;
+			};
+
+			bool step(Request& r);
+			bool stale(Request& r);
+			void finish(Request& r);
+			void fail(Request& r, const std::string& error);
+			void abandon(Request& r);
+
+			int nextId;
+			std::list<Request> active;
+			std::map<int, Outcome> finished;
+	};
+}
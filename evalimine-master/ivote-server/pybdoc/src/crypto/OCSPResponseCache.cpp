@@ -0,0 +1,85 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#include "OCSPResponseCache.h"
+#include "DigestEngine.h"
+#include "../StackException.h"
+
+#include <pthread.h>
+#include <map>
+
+#define OCSP_CACHE_MAX_ENTRIES 65536
+
+typedef std::map<std::string, std::vector<unsigned char> > OCSPCacheMap;
+
+static OCSPCacheMap responses;
+static pthread_mutex_t responses_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+std::string bdoc::OCSPResponseCache::key(STACK_OF(X509) *certs,
+		const std::vector<unsigned char>& ocspResponseDER)
+{
+	typedef DigestEngine<NID_sha256> Engine;
+
+	// Fingerprints of the responder certificates, then the response
+	Engine calc;
+	for (int i = 0; i < sk_X509_num(certs); i++) {
+		unsigned char fp[EVP_MAX_MD_SIZE];
+		unsigned int len = 0;
+		if (X509_digest(sk_X509_value(certs, i), EVP_sha256(), fp, &len) != 1) {
+			THROW_STACK_EXCEPTION("Failed to calculate OCSP responder certificate fingerprint.");
+		}
+		calc.update(fp, len);
+	}
+
+	unsigned char out[2 * Engine::SIZE];
+	calc.final(out);
+	Engine::hash(ocspResponseDER.empty() ? NULL : &ocspResponseDER[0],
+			ocspResponseDER.size(), out + Engine::SIZE);
+	return std::string((const char *)out, sizeof(out));
+}
+
+bool bdoc::OCSPResponseCache::lookup(const std::string& key,
+		std::vector<unsigned char>& nonce)
+{
+	bool found = false;
+	pthread_mutex_lock(&responses_mutex);
+	OCSPCacheMap::const_iterator it = responses.find(key);
+	if (it != responses.end()) {
+		nonce = it->second;
+		found = true;
+	}
+	pthread_mutex_unlock(&responses_mutex);
+	return found;
+}
+
+void bdoc::OCSPResponseCache::insert(const std::string& key,
+		const std::vector<unsigned char>& nonce)
+{
+	pthread_mutex_lock(&responses_mutex);
+	try {
+		if (responses.size() >= OCSP_CACHE_MAX_ENTRIES) {
+			responses.clear();
+		}
+		responses[key] = nonce;
+	}
+	catch (...) {
+		pthread_mutex_unlock(&responses_mutex);
+		throw;
+	}
+	pthread_mutex_unlock(&responses_mutex);
+}
+
+void bdoc::OCSPResponseCache::release()
+{
+	pthread_mutex_lock(&responses_mutex);
+	responses.clear();
+	pthread_mutex_unlock(&responses_mutex);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright: Eesti Vabariigi Valimiskomisjon
+ * (Estonian National Electoral Committee), www.vvk.ee
+ * Written in 2011-2013 by Cybernetica AS, www.cyber.ee
+ *
+ * This work is licensed under the Creative Commons
+ * Attribution-NonCommercial-NoDerivs 3.0 Unported License.
+ * To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-nd/3.0/.
+ * */
+
+#pragma once
+
+#include <openssl/x509.h>
+
+#include <string>
+#include <vector>
+
+namespace bdoc
+{
+	/*
+	 * Nonces of OCSP responses whose signature already verified, shared
+	 * by all verifications of the process. An entry is keyed by the
+	 * responder certificates the response was checked against and the
+	 * hash of the response, so a response is trusted again only by the
+	 * same responder configuration. At most OCSP_CACHE_MAX_ENTRIES are
+	 * kept, the cache starts over when it is full.
+	 * */
+	class OCSPResponseCache
+	{
+		public:
+
+			static std::string key(STACK_OF(X509) *certs,
+					const std::vector<unsigned char>& ocspResponseDER);
+
+			static bool lookup(const std::string& key,
+					std::vector<unsigned char>& nonce);
+			static void insert(const std::string& key,
+					const std::vector<unsigned char>& nonce);
+
+			static void release();
+
+		private:
+
+			OCSPResponseCache();
+	};
+}
@@ -134,6 +134,38 @@ STACK_OF(X509)* bdoc::X509Cert::loadX509Stack(const std::string& path)
 	return stack;
 }
 
+std::vector<unsigned char> bdoc::X509Cert::encodeDERStack(STACK_OF(X509)* stack)
+{
+	std::vector<unsigned char> der;
+	for (int i = 0; i < sk_X509_num(stack); i++) {
+		std::vector<unsigned char> one = X509Cert(sk_X509_value(stack, i)).encodeDER();
+		der.insert(der.end(), one.begin(), one.end());
+	}
+	return der;
+}
+
+STACK_OF(X509)* bdoc::X509Cert::decodeX509Stack(const unsigned char* der, size_t len)
+{
+	STACK_OF(X509)* stack = sk_X509_new_null();
+	if (stack == NULL) {
+		THROW_STACK_EXCEPTION("Failed to create X.509 certificate stack.");
+	}
+
+	const unsigned char *p = der;
+	const unsigned char *end = der + len;
+	while (p < end) {
+		X509 *cert = d2i_X509(NULL, &p, end - p);
+		if (cert == NULL) {
+			sk_X509_pop_free(stack, X509_free);
+			THROW_STACK_EXCEPTION("Failed to parse X509 certificate from bytes given: %s",
+					ERR_reason_error_string(ERR_get_error()));
+		}
+		sk_X509_push(stack, cert);
+	}
+
+	return stack;
+}
+
 std::vector<unsigned char> bdoc::X509Cert::encodeDER() const
 {
 	int bufSize = i2d_X509(cert, NULL);
@@ -152,6 +184,16 @@ std::vector<unsigned char> bdoc::X509Cert::encodeDER() const
 	return derEncodedX509;
 }
 
+std::string bdoc::X509Cert::fingerprint() const
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	if (!X509_digest(cert, EVP_sha256(), md, &len)) {
+		THROW_STACK_EXCEPTION("Failed to calculate X.509 certificate fingerprint: %s", ERR_reason_error_string(ERR_get_error()));
+	}
+	return std::string((const char *)md, len);
+}
+
 std::string bdoc::X509Cert::getSerial() const
 {
 	std::string serial;
@@ -460,7 +502,7 @@ int my_rsa_verify(int dtype, int dsize,
 	return ret;
 }
 
-bool bdoc::X509Cert::verifySignature(int digestMethod, int digestSize, std::vector<unsigned char> digest, std::vector<unsigned char> signature)
+bool bdoc::X509Cert::verifySignature(int digestMethod, int digestSize, std::vector<unsigned char> digest, std::vector<unsigned char> signature) const
 {
 	EVP_PKEY* key = getPublicKey();
 	if (EVP_PKEY_type(key->type) != EVP_PKEY_RSA) {
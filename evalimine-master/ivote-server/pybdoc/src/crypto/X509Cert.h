@@ -30,6 +30,10 @@ namespace bdoc
 
 		static STACK_OF(X509)* loadX509Stack(const std::string& path);
 
+		// Certificates DER-encoded back to back
+		static std::vector<unsigned char> encodeDERStack(STACK_OF(X509)* stack);
+		static STACK_OF(X509)* decodeX509Stack(const unsigned char* der, size_t len);
+
 		X509Cert();
 		X509Cert(X509* cert);
 		X509Cert(const unsigned char* bytes, size_t len);
@@ -39,6 +43,8 @@ namespace bdoc
 		X509* getX509() const;
 
 		std::vector<unsigned char> encodeDER() const;
+		// SHA-256 of the DER encoding
+		std::string fingerprint() const;
 		std::string getSerial() const;
 		X509_NAME* getIssuerNameAsn1() const;
 		std::string getIssuerName() const;
@@ -48,7 +54,7 @@ namespace bdoc
 
 		bool verifySignature(int digestMethod, int digestSize,
 			std::vector<unsigned char> digest,
-			std::vector<unsigned char> signature);
+			std::vector<unsigned char> signature) const;
 
 		bool isValid() const;
 		std::list<std::string> policies();
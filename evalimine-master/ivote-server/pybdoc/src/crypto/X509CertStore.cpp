@@ -13,16 +13,45 @@
 
 #include <openssl/pem.h>
 #include <openssl/err.h>
+#include <openssl/x509v3.h>
 
 #include "X509CertStore.h"
 #include "../StackException.h"
 
-bdoc::X509CertStore::X509CertStore()
+// Trusted certificates do not change while the store lives, a
+// certificate is verified again when this passes or it expires
+#define VERIFIED_CACHE_TTL 3600
+#define VERIFIED_CACHE_SIZE 8192
+
+static std::string keyIdString(const ASN1_OCTET_STRING& keyId)
+{
+	return std::string((const char *)ASN1_STRING_data(
+			const_cast<ASN1_OCTET_STRING*>(&keyId)),
+			ASN1_STRING_length(&keyId));
+}
+
+bdoc::X509CertStore::X509CertStore() :
+	certs(),
+	store(NULL),
+	bySubject(),
+	byKeyId(),
+	verified()
 {
+	pthread_mutex_init(&verifiedMutex, NULL);
+	store = X509_STORE_new();
+
+	if (store == NULL) {
+		THROW_STACK_EXCEPTION("Failed to create X509_STORE");
+	}
 }
 
 bdoc::X509CertStore::~X509CertStore()
 {
+	for (VerifiedCache::iterator it = verified.begin(); it != verified.end(); it++) {
+		X509_free(it->second.cert);
+	}
+	pthread_mutex_destroy(&verifiedMutex);
+	X509_STORE_free(store);
 	for (std::vector<X509*>::const_iterator iter = certs.begin(); iter != certs.end(); iter++) {
 		X509_free(*iter);
 	}
@@ -30,37 +59,150 @@ bdoc::X509CertStore::~X509CertStore()
 
 void bdoc::X509CertStore::addCert(const std::string& path)
 {
-	X509 *cert = bdoc::X509Cert::loadX509(path);
+	addCert(bdoc::X509Cert::loadX509(path));
+}
 
+void bdoc::X509CertStore::addCert(X509* cert)
+{
 	if (cert) {
 		certs.push_back(cert);
+
+		X509_STORE_add_cert(store, cert);
+		// It is correct not to check retval
+
+		bySubject.insert(SubjectIndex::value_type(
+				X509_subject_name_hash(cert), cert));
+
+		ASN1_OCTET_STRING *ski = (ASN1_OCTET_STRING *)X509_get_ext_d2i(
+				cert, NID_subject_key_identifier, NULL, NULL);
+		if (ski) {
+			std::string key = keyIdString(*ski);
+			if (byKeyId.find(key) == byKeyId.end()) {
+				byKeyId[key] = cert;
+			}
+			ASN1_OCTET_STRING_free(ski);
+		}
 	}
 }
 
+const std::vector<X509*>& bdoc::X509CertStore::certificates() const
+{
+	return certs;
+}
+
 X509_STORE* bdoc::X509CertStore::getCertStore() const
 {
-	X509_STORE* cert_store = X509_STORE_new();
+	return store;
+}
 
-	if (cert_store == NULL) {
-		THROW_STACK_EXCEPTION("Failed to create X509_STORE");
+X509* bdoc::X509CertStore::findCert(const X509_NAME& subject) const
+{
+	X509_NAME *name = const_cast<X509_NAME*>(&subject);
+	std::pair<SubjectIndex::const_iterator, SubjectIndex::const_iterator>
+		range = bySubject.equal_range(X509_NAME_hash(name));
+
+	for (SubjectIndex::const_iterator iter = range.first; iter != range.second; iter++) {
+		if (X509_NAME_cmp(X509_get_subject_name(iter->second), name) == 0) {
+			return iter->second;
+		}
 	}
 
-	for(std::vector<X509*>::const_iterator iter = certs.begin(); iter != certs.end(); iter++) {
-		X509_STORE_add_cert(cert_store, *iter);
-		// It is correct not to check retval
+	return NULL;
+}
+
+X509* bdoc::X509CertStore::findCertByKeyId(const ASN1_OCTET_STRING& keyId) const
+{
+	KeyIdIndex::const_iterator iter = byKeyId.find(keyIdString(keyId));
+	if (iter == byKeyId.end()) {
+		return NULL;
 	}
+	return iter->second;
+}
 
-	return cert_store;
+X509* bdoc::X509CertStore::findIssuer(X509* cert) const
+{
+	X509 *issuer = NULL;
+	AUTHORITY_KEYID *akid = (AUTHORITY_KEYID *)X509_get_ext_d2i(
+			cert, NID_authority_key_identifier, NULL, NULL);
+	if (akid) {
+		if (akid->keyid) {
+			issuer = findCertByKeyId(*akid->keyid);
+		}
+		AUTHORITY_KEYID_free(akid);
+	}
+
+	// The key identifier must belong to a certificate with the
+	// issuer's name, otherwise fall back to the name
+	X509_NAME *name = X509_get_issuer_name(cert);
+	if (issuer != NULL && X509_NAME_cmp(X509_get_subject_name(issuer), name) == 0) {
+		return issuer;
+	}
+	return findCert(*name);
 }
 
 X509* bdoc::X509CertStore::getCert(const X509_NAME& subject) const
 {
-	for(std::vector<X509*>::const_iterator iter = certs.begin(); iter != certs.end(); iter++) {
-		if (X509_NAME_cmp(X509_get_subject_name(*iter), &subject) == 0) {
-			return X509Cert::copyX509(*iter);
-		}
+	X509 *cert = findCert(subject);
+	if (cert == NULL) {
+		return NULL;
 	}
+	return X509Cert::copyX509(cert);
+}
 
-	return NULL;
+int bdoc::X509CertStore::verify(const X509Cert& cert) const
+{
+	std::string fingerprint = cert.fingerprint();
+	if (isVerified(fingerprint)) {
+		return 1;
+	}
+
+	int ok = cert.verify(store);
+	if (ok) {
+		addVerified(fingerprint, cert);
+	}
+	return ok;
 }
 
+bool bdoc::X509CertStore::isVerified(const std::string& fingerprint) const
+{
+	bool ok = false;
+	pthread_mutex_lock(&verifiedMutex);
+	VerifiedCache::iterator it = verified.find(fingerprint);
+	if (it != verified.end()) {
+		ok = time(NULL) < it->second.until &&
+			X509_cmp_current_time(X509_get_notAfter(it->second.cert)) > 0;
+		if (!ok) {
+			X509_free(it->second.cert);
+			verified.erase(it);
+		}
+	}
+	pthread_mutex_unlock(&verifiedMutex);
+	return ok;
+}
+
+void bdoc::X509CertStore::addVerified(const std::string& fingerprint,
+		const X509Cert& cert) const
+{
+	Verified v;
+	v.cert = cert.getX509();
+	v.until = time(NULL) + VERIFIED_CACHE_TTL;
+	if (v.cert == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&verifiedMutex);
+	if (verified.size() >= VERIFIED_CACHE_SIZE) {
+		// Bounded by dropping everything, entries are cheap to redo
+		for (VerifiedCache::iterator it = verified.begin(); it != verified.end(); it++) {
+			X509_free(it->second.cert);
+		}
+		verified.clear();
+	}
+	std::pair<VerifiedCache::iterator, bool> ins =
+		verified.insert(VerifiedCache::value_type(fingerprint, v));
+	pthread_mutex_unlock(&verifiedMutex);
+
+	if (!ins.second) {
+		X509_free(v.cert);
+	}
+}
@@ -14,11 +14,22 @@
 #pragma once
 
 #include "X509Cert.h"
+#include <pthread.h>
+#include <time.h>
+#include <map>
 #include <string>
 #include <vector>
 
 namespace bdoc
 {
+	/*
+	 * Trusted certificates. The X509_STORE is built as certificates are
+	 * added and lives as long as the store, lookups go through indexes
+	 * by subject name hash and by subject key identifier.
+	 *
+	 * Certificates returned by getCertStore(), findCert() and
+	 * findIssuer() are borrowed, the caller must not free them.
+	 * */
 	class X509CertStore
 	{
 		public:
@@ -26,12 +37,50 @@ namespace bdoc
 			~X509CertStore();
 
 			void addCert(const std::string& path);
+			// Takes ownership of the certificate
+			void addCert(X509* cert);
+
+			// In the order added
+			const std::vector<X509*>& certificates() const;
 
 			X509_STORE* getCertStore() const;
+
+			X509* findCert(const X509_NAME& subject) const;
+			X509* findCertByKeyId(const ASN1_OCTET_STRING& keyId) const;
+			X509* findIssuer(X509* cert) const;
+
+			// Copy of findCert(), to be freed by the caller
 			X509* getCert(const X509_NAME& subject) const;
 
+			// cert.verify() against the store. Success is remembered by
+			// the fingerprint of the certificate until it expires, for
+			// at most VERIFIED_CACHE_TTL seconds.
+			int verify(const X509Cert& cert) const;
+
 		private:
+
+			X509CertStore(const X509CertStore&);
+			X509CertStore& operator=(const X509CertStore&);
+
+			typedef std::multimap<unsigned long, X509*> SubjectIndex;
+			typedef std::map<std::string, X509*> KeyIdIndex;
+
+			struct Verified {
+				X509 *cert;
+				time_t until;
+			};
+			typedef std::map<std::string, Verified> VerifiedCache;
+
+			bool isVerified(const std::string& fingerprint) const;
+			void addVerified(const std::string& fingerprint,
+					const X509Cert& cert) const;
+
 			std::vector<X509*> certs;
+			X509_STORE *store;
+			SubjectIndex bySubject;
+			KeyIdIndex byKeyId;
+
+			mutable VerifiedCache verified;
+			mutable pthread_mutex_t verifiedMutex;
 	};
 }
-